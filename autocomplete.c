@@ -108,6 +108,8 @@ static const char * const opts_nosuggest[] =
     "--crop-rect",
     "--deadzone-inter",
     "--deadzone-intra",
+    "--estimate",
+    "--estimate-sample",
     "--fps",
     "--frames",
     "--input-depth",
@@ -145,6 +147,8 @@ static const char * const opts_nosuggest[] =
     "--slice-max-mbs",
     "--slice-min-mbs",
     "--sps-id",
+    "--stats-range",
+    "--stats-window",
     "--sync-lookahead",
     "--threads",
     "--timebase",
@@ -160,6 +164,7 @@ static const char * const opts_nosuggest[] =
 static const char * const opts_filename[] =
 {
     "--cqmfile",
+    "--dump-et",
     "--dump-yuv",
     "--index",
     "--opencl-clbin",
@@ -182,6 +187,7 @@ static const char * const opts_standalone[] =
     "--constrained-intra",
     "--cpu-independent",
     "--dts-compress",
+    "--et-model",
     "--fake-interlaced",
     "--fast-pskip",
     "--filler",
@@ -208,7 +214,9 @@ static const char * const opts_standalone[] =
     "--psnr",
     "--quiet",
     "--sliced-threads",
+    "--stage-timing",
     "--slow-firstpass",
+    "--stats-binary",
     "--ssim",
     "--stitchable",
     "--tff",
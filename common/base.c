@@ -62,7 +62,8 @@ void name( type *n, type *d )\
 REDUCE_FRACTION( x264_reduce_fraction  , uint32_t )
 REDUCE_FRACTION( x264_reduce_fraction64, uint64_t )
 
-extern const char * const x264_log_level_names[];
+/* The CLI has its own x264_log_level_names, which the library can't rely on. */
+static const char * const log_level_names[] = { "none", "error", "warning", "info", "debug", 0 };
 
 /****************************************************************************
  * x264_log:
@@ -960,8 +961,16 @@ REALIGN_STACK int x264_param_parse( x264_param_t *p, const char *name, const cha
     }
     OPT("threads")
     {
+        int i_frame_threads, i_slice_threads;
         if( !strcasecmp(value, "auto") )
             p->i_threads = X264_THREADS_AUTO;
+        /* frames x slices: frame threads that each encode with sliced threads */
+        else if( 2 == sscanf( value, "%dx%d", &i_frame_threads, &i_slice_threads ) )
+        {
+            p->i_threads = i_frame_threads * i_slice_threads;
+            p->i_slice_threads = i_slice_threads;
+            p->b_sliced_threads = 1;
+        }
         else
             p->i_threads = atoi(value);
     }
@@ -974,6 +983,21 @@ REALIGN_STACK int x264_param_parse( x264_param_t *p, const char *name, const cha
     }
     OPT("sliced-threads")
         p->b_sliced_threads = atobool(value);
+    OPT("slice-threads")
+    {
+        p->i_slice_threads = atoi(value);
+        p->b_sliced_threads = p->i_slice_threads > 0;
+    }
+    OPT("wavefront")
+        p->b_wavefront = atobool(value);
+    OPT("numa")
+        p->b_numa = atobool(value);
+    OPT("frame-arena")
+        p->b_frame_arena = atobool(value);
+    OPT("low-memory")
+        p->b_low_memory = atobool(value);
+    OPT("lazy-hpel")
+        p->b_lazy_hpel = atobool(value);
     OPT("sync-lookahead")
     {
         if( !strcasecmp(value, "auto") )
@@ -1247,12 +1271,14 @@ REALIGN_STACK int x264_param_parse( x264_param_t *p, const char *name, const cha
     OPT("log-file")
         p->psz_log_file = strdup(value);
     OPT("log-file-level")
-        if( !parse_enum( value, x264_log_level_names, &p->i_log_file_level ) )
+        if( !parse_enum( value, log_level_names, &p->i_log_file_level ) )
             p->i_log_file_level += X264_LOG_NONE;
         else
             p->i_log_file_level = atoi(value);
     OPT("dump-yuv")
         CHECKED_ERROR_PARAM_STRDUP( p->psz_dump_yuv, p, value );
+    OPT("dump-et")
+        CHECKED_ERROR_PARAM_STRDUP( p->psz_dump_et, p, value );
     OPT2("analyse", "partitions")
     {
         p->analyse.inter = 0;
@@ -1311,6 +1337,8 @@ REALIGN_STACK int x264_param_parse( x264_param_t *p, const char *name, const cha
         p->analyse.i_trellis = atoi(value);
     OPT("fast-pskip")
         p->analyse.b_fast_pskip = atobool(value);
+    OPT("et-model")
+        p->analyse.b_et_model = atobool(value);
     OPT("dct-decimate")
         p->analyse.b_dct_decimate = atobool(value);
     OPT("deadzone-inter")
@@ -1336,6 +1364,8 @@ REALIGN_STACK int x264_param_parse( x264_param_t *p, const char *name, const cha
     }
     OPT("crf-max")
         p->rc.f_rf_constant_max = atof(value);
+    OPT("estimate")
+        p->rc.b_estimate = atobool(value);
     OPT("rc-lookahead")
         p->rc.i_lookahead = atoi(value);
     OPT2("qpmin", "qp-min")
@@ -1373,6 +1403,21 @@ REALIGN_STACK int x264_param_parse( x264_param_t *p, const char *name, const cha
         CHECKED_ERROR_PARAM_STRDUP( p->rc.psz_stat_in, p, value );
         CHECKED_ERROR_PARAM_STRDUP( p->rc.psz_stat_out, p, value );
     }
+    OPT("stats-binary")
+        p->rc.b_stat_binary = atobool(value);
+    OPT("stats-window")
+        p->rc.i_stats_window = atoi(value);
+    OPT("stats-range")
+    {
+        int start, end;
+        if( sscanf( value, "%d,%d", &start, &end ) == 2 && start >= 0 && end >= start )
+        {
+            p->rc.i_stats_range_start = start;
+            p->rc.i_stats_range_frames = end - start + 1;
+        }
+        else
+            b_error = 1;
+    }
     OPT("qcomp")
         p->rc.f_qcompress = atof(value);
     OPT("mbtree")
@@ -1450,6 +1495,8 @@ REALIGN_STACK int x264_param_parse( x264_param_t *p, const char *name, const cha
         CHECKED_ERROR_PARAM_STRDUP( p->psz_clbin_file, p, value );
     OPT("opencl-device")
         p->i_opencl_device = atoi( value );
+    OPT("lookahead-batch")
+        p->b_lookahead_batch = atobool(value);
     else
     {
         b_error = 1;
@@ -1491,6 +1538,8 @@ char *x264_param2string( x264_param_t *p, int b_res )
 
     if( p->b_opencl )
         s += sprintf( s, "opencl=%d ", p->b_opencl );
+    if( p->b_lookahead_batch )
+        s += sprintf( s, "lookahead_batch=%d ", p->b_lookahead_batch );
     s += sprintf( s, "cabac=%d", p->b_cabac );
     s += sprintf( s, " ref=%d", p->i_frame_reference );
     s += sprintf( s, " deblock=%d:%d:%d", p->b_deblocking_filter,
@@ -1512,10 +1561,18 @@ char *x264_param2string( x264_param_t *p, int b_res )
     s += sprintf( s, " cqm=%d", p->i_cqm_preset );
     s += sprintf( s, " deadzone=%d,%d", p->analyse.i_luma_deadzone[0], p->analyse.i_luma_deadzone[1] );
     s += sprintf( s, " fast_pskip=%d", p->analyse.b_fast_pskip );
+    if( p->analyse.b_et_model )
+        s += sprintf( s, " et_model=1" );
     s += sprintf( s, " chroma_qp_offset=%d", p->analyse.i_chroma_qp_offset );
     s += sprintf( s, " threads=%d", p->i_threads );
     s += sprintf( s, " lookahead_threads=%d", p->i_lookahead_threads );
     s += sprintf( s, " sliced_threads=%d", p->b_sliced_threads );
+    if( p->b_sliced_threads && p->i_slice_threads && p->i_slice_threads < p->i_threads )
+        s += sprintf( s, " slice_threads=%d", p->i_slice_threads );
+    if( p->b_wavefront )
+        s += sprintf( s, " wavefront=%d", p->b_wavefront );
+    if( p->b_numa )
+        s += sprintf( s, " numa=%d", p->b_numa );
     if( p->i_slice_count )
         s += sprintf( s, " slices=%d", p->i_slice_count );
     if( p->i_slice_count_max )
@@ -329,11 +329,16 @@ do {\
     prealloc_size += ALIGN((int64_t)(size), NATIVE_ALIGN);\
 } while( 0 )
 
-#define PREALLOC_END( ptr )\
+#define PREALLOC_RELOCATE( ptr )\
 do {\
-    CHECKED_MALLOC( ptr, prealloc_size );\
     while( prealloc_idx-- )\
         *preallocs[prealloc_idx] = (uint8_t*)((intptr_t)(*preallocs[prealloc_idx]) + (intptr_t)ptr);\
 } while( 0 )
 
+#define PREALLOC_END( ptr )\
+do {\
+    CHECKED_MALLOC( ptr, prealloc_size );\
+    PREALLOC_RELOCATE( ptr );\
+} while( 0 )
+
 #endif
@@ -43,8 +43,10 @@
 #define x264_encoder_close x264_template(encoder_close)
 #define x264_encoder_delayed_frames x264_template(encoder_delayed_frames)
 #define x264_encoder_maximum_delayed_frames x264_template(encoder_maximum_delayed_frames)
+#define x264_encoder_resident_memory x264_template(encoder_resident_memory)
 #define x264_encoder_intra_refresh x264_template(encoder_intra_refresh)
 #define x264_encoder_invalidate_reference x264_template(encoder_invalidate_reference)
+#define x264_encoder_estimate x264_template(encoder_estimate)
 
 /* This undef allows to rename the external symbol and force link failure in case
  * of incompatible libraries. Then the define enables templating as above. */
@@ -67,6 +69,9 @@
 #define FILLER_OVERHEAD (NALU_OVERHEAD+1)
 #define SEI_OVERHEAD (NALU_OVERHEAD - (h->param.b_annexb && !h->param.i_avcintra_class && (h->out.i_nal-1)))
 
+/* esa and tesa search the integral image; pyr comes after them but doesn't */
+#define ME_EXHAUSTIVE(method) ((method) == X264_ME_ESA || (method) == X264_ME_TESA)
+
 #if HAVE_INTERLACED
 #   define MB_INTERLACED h->mb.b_interlaced
 #   define SLICE_MBAFF h->sh.b_mbaff
@@ -217,18 +222,31 @@ typedef struct
 typedef struct x264_lookahead_t
 {
     volatile uint8_t              b_exit_thread;
-    uint8_t                       b_thread_active;
     uint8_t                       b_analyse_keyframe;
+    uint8_t                       b_ladder_leader;   /* publish decisions to param.ladder */
+    uint8_t                       b_ladder_follower; /* take decisions from param.ladder */
+    volatile uint8_t              b_ladder_cancel;   /* stop waiting for the ladder leader */
+    int                           i_ladder_gop;      /* next minigop to take from the ladder */
     int                           i_last_keyframe;
     int                           i_slicetype_length;
+    uint8_t                       b_estimate_costs;  /* estimate intra and P costs as frames come in */
+    uint8_t                       b_lowres_stage;    /* threaded: lowres planes are built by a thread of their own */
+    uint8_t                       b_cost_stage;      /* threaded: b_estimate_costs is done by a thread of its own */
     x264_frame_t                  *last_nonb;
     x264_pthread_t                thread_handle;
-    x264_sync_frame_list_t        ifbuf;
-    x264_sync_frame_list_t        next;
-    x264_sync_frame_list_t        ofbuf;
+    x264_pthread_t                lowres_handle;
+    x264_pthread_t                cost_handle;
+    x264_t                        *cost_h;           /* context of the cost stage */
+    int                           i_frames;          /* frames anywhere in the lookahead; only touched by the caller's thread */
+    x264_sync_frame_list_t        ifbuf;             /* caller -> first stage */
+    x264_sync_frame_list_t        lowresbuf;         /* lowres stage -> next stage */
+    x264_sync_frame_list_t        costbuf;           /* cost stage -> slicetype decision */
+    x264_frame_list_t             next;              /* slicetype decision only */
+    x264_sync_frame_list_t        ofbuf;             /* slicetype decision -> caller */
 } x264_lookahead_t;
 
 typedef struct x264_ratecontrol_t   x264_ratecontrol_t;
+typedef struct x264_wavefront_t     x264_wavefront_t;
 
 typedef struct x264_left_table_t
 {
@@ -276,6 +294,7 @@ struct x264_t
 
     x264_t          *thread[X264_THREAD_MAX+1];
     x264_t          *lookahead_thread[X264_LOOKAHEAD_THREAD_MAX];
+    x264_t          *slice_thread[X264_THREAD_MAX]; /* contexts encoding the slices (or wavefront rows) of this frame, [0] owns the frame */
     int             b_thread_active;
     int             i_thread_phase; /* which thread to use for the next frame */
     int             i_thread_idx;   /* which thread this is */
@@ -284,6 +303,22 @@ struct x264_t
     int             i_threadslice_pass; /* which pass of encoding we are on */
     x264_threadpool_t *threadpool;
     x264_threadpool_t *lookaheadpool;
+    x264_threadpool_t **numa_pool; /* --numa without a shared pool: a pool per node, threadpool is its node's */
+    int             i_numa_pools;
+    x264_wavefront_t *wavefront; /* rows in flight when the slice_thread contexts analyse the frame as a wavefront */
+    int             i_numa_node;    /* node this context's frame thread runs on */
+    /* reference frames used by this context: [0] all, [1] on another node, and the bytes of the latter */
+    int64_t         i_numa_refs[2];
+    int64_t         i_numa_remote_bytes;
+    /* lazy hpel: tiles filtered by this context, and tiles of the reference frames it reconstructed */
+    int64_t         i_hpel_tiles[2];
+    /* lowres cost cache lookups made with this context: [0] frame costs, [1] MB-tree reweighting */
+    int64_t         i_cost_cache_hits[2];
+    int64_t         i_cost_cache_misses[2];
+    /* --dump-et: P-mb count, sub-16x16 partition wins and intra wins, per feature cell */
+    uint32_t      (*et_stats)[3];
+    /* param.stage_timing: microseconds this context spent in each X264_STAGE_* on its current frame */
+    int64_t         i_stage_time[X264_STAGE_MAX];
     x264_pthread_mutex_t mutex;
     x264_pthread_cond_t cv;
 
@@ -311,7 +346,7 @@ struct x264_t
     int             i_frame_num;
 
     int             i_thread_frames; /* Number of different frames being encoded by threads;
-                                      * 1 when sliced-threads is on. */
+                                      * 1 when sliced-threads is on without frame threads. */
     int             i_nal_type;
     int             i_nal_ref_idc;
 
@@ -376,12 +411,15 @@ struct x264_t
     {
         /* Frames to be encoded (whose types have been decided) */
         x264_frame_t **current;
-        /* Unused frames: 0 = fenc, 1 = fdec */
-        x264_frame_t **unused[2];
+        /* Unused frames: 0 = fenc, 1 = fdec, 2 = fdec without hpel (low-memory mode) */
+        x264_frame_t **unused[3];
 
         /* Unused blank frames (for duplicates) */
         x264_frame_t **blank_unused;
 
+        /* Memory of the frames above, shared by all threads */
+        x264_frame_arena_t *arena;
+
         /* frames used for reference + sentinels */
         x264_frame_t *reference[X264_REF_MAX+2];
 
@@ -731,6 +769,20 @@ struct x264_t
     /* Buffers that are allocated per-thread even in sliced threads. */
     void *scratch_buffer; /* for any temporary storage that doesn't want repeated malloc */
     void *scratch_buffer2; /* if the first one's already in use */
+    pixel *hpel_scratch;   /* lazy hpel: the three hpel planes of a tile, in rows of the frame's stride */
+    int16_t *hpel_scratch_buf; /* and the hpel filter's row buffer */
+    uint16_t *mbtree_propagate_acc[2]; /* lookahead slice threads: MB-tree costs propagated to each reference, merged afterwards */
+    struct
+    {
+        /* lookahead-batch: fenc and ref downscaled by 1<<scale with LOOKAHEAD_BATCH_PAD of border.
+         * [0] is unused, scale 0 being the lowres planes themselves. */
+        pixel *plane[2][4];
+        int i_stride[4];
+        int16_t *mv[2][2];  /* mv field by component, ping-ponged between iterations */
+        int16_t *mvp[2];    /* the mvp each mb was last searched around */
+        pixel *buffer;
+        int16_t *mv_buffer;
+    } batch;
     pixel *intra_border_backup[5][3]; /* bottom pixels of the previous mb row, used for intra prediction after the framebuffer has been deblocked */
     /* Deblock strength values are stored for each 4x4 partition. In MBAFF
      * there are four extra values that need to be stored, located in [4][i]. */
@@ -804,6 +856,25 @@ static ALWAYS_INLINE int x264_predictor_clip( int16_t (*dst)[2], int16_t (*mvc)[
     return cnt;
 }
 
+/* Stage timing for param.stage_timing; compiles to nothing without --enable-stage-timing.
+ * x264_stage_start returns 0 when nothing is being timed. */
+static ALWAYS_INLINE int64_t x264_stage_start( x264_t *h )
+{
+#if HAVE_STAGE_TIMING
+    if( h->param.stage_timing )
+        return x264_mdate();
+#endif
+    return 0;
+}
+
+static ALWAYS_INLINE void x264_stage_end( x264_t *h, int stage, int64_t start )
+{
+#if HAVE_STAGE_TIMING
+    if( start )
+        h->i_stage_time[stage] += x264_mdate() - start;
+#endif
+}
+
 #if ARCH_X86 || ARCH_X86_64
 #include "x86/util.h"
 #endif
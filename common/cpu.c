@@ -47,6 +47,10 @@
 #if SYS_OPENBSD
 #include <machine/cpu.h>
 #endif
+#if HAVE_NUMA
+#include <numa.h>
+#include <numaif.h>
+#endif
 
 const x264_cpu_name_t x264_cpu_names[] =
 {
@@ -478,3 +482,35 @@ int x264_cpu_num_processors( void )
     return 1;
 #endif
 }
+
+int x264_numa_num_nodes( void )
+{
+#if HAVE_NUMA
+    if( numa_available() >= 0 )
+        /* x264_numa_bind's node mask is a single word. */
+        return X264_MIN( numa_max_node() + 1, (int)sizeof(unsigned long) * 8 );
+#endif
+    return 0;
+}
+
+int x264_numa_run_on_node( int node )
+{
+#if HAVE_NUMA
+    return numa_run_on_node( node );
+#else
+    return -1;
+#endif
+}
+
+void x264_numa_bind( void *p, int64_t size, int node )
+{
+#if HAVE_NUMA
+    /* Only the pages entirely inside the buffer, the others may be shared with its neighbours. */
+    uintptr_t page = numa_pagesize();
+    uintptr_t start = ((uintptr_t)p + page - 1) & ~(page - 1);
+    uintptr_t end = ((uintptr_t)p + size) & ~(page - 1);
+    unsigned long mask = 1UL << node;
+    if( end > start )
+        mbind( (void*)start, end - start, MPOL_PREFERRED, &mask, sizeof(mask) * 8, MPOL_MF_MOVE );
+#endif
+}
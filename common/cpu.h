@@ -28,6 +28,10 @@
 
 X264_API uint32_t x264_cpu_detect( void );
 X264_API int      x264_cpu_num_processors( void );
+/* NUMA: 0 nodes if unsupported. Binding moves the pages that are already there. */
+int      x264_numa_num_nodes( void );
+int      x264_numa_run_on_node( int node );
+void     x264_numa_bind( void *p, int64_t size, int node );
 void     x264_cpu_emms( void );
 void     x264_cpu_sfence( void );
 #if HAVE_MMX
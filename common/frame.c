@@ -27,6 +27,12 @@
 
 #include "common.h"
 
+#if ARCH_PPC
+#define DISALIGN ((1<<9) / SIZEOF_PIXEL)
+#else
+#define DISALIGN ((1<<10) / SIZEOF_PIXEL)
+#endif
+
 static int align_stride( int x, int align, int disalign )
 {
     x = ALIGN( x, align );
@@ -56,7 +62,15 @@ static int frame_internal_csp( int external_csp )
     return X264_CSP_NONE;
 }
 
-static x264_frame_t *frame_new( x264_t *h, int b_fdec )
+/* With base_size, nothing is allocated: only the size of the frame's buffers is returned. */
+static void frame_lowres_planes( x264_frame_t *frame )
+{
+    int64_t luma_plane_size = align_plane_size( frame->i_stride_lowres * (frame->i_lines[0]/2 + 2*PADV), DISALIGN );
+    for( int i = 0; i < 4; i++ )
+        frame->lowres[i] = frame->buffer_lowres + frame->i_stride_lowres * PADV + PADH_ALIGN + i * luma_plane_size;
+}
+
+static x264_frame_t *frame_new( x264_t *h, int b_fdec, int64_t *base_size )
 {
     x264_frame_t *frame;
     int i_csp = frame_internal_csp( h->param.i_csp );
@@ -72,11 +86,7 @@ static x264_frame_t *frame_new( x264_t *h, int b_fdec )
     else
         align = 16 / SIZEOF_PIXEL;
 #endif
-#if ARCH_PPC
-    int disalign = (1<<9) / SIZEOF_PIXEL;
-#else
-    int disalign = (1<<10) / SIZEOF_PIXEL;
-#endif
+    int disalign = DISALIGN;
 
     CHECKED_MALLOCZERO( frame, sizeof(x264_frame_t) );
     PREALLOC_INIT
@@ -162,7 +172,7 @@ static x264_frame_t *frame_new( x264_t *h, int b_fdec )
     for( int p = 0; p < luma_plane_count; p++ )
     {
         int64_t luma_plane_size = align_plane_size( frame->i_stride[p] * (frame->i_lines[p] + 2*i_padv), disalign );
-        if( h->param.analyse.i_subpel_refine && b_fdec )
+        if( h->param.analyse.i_subpel_refine && b_fdec == 1 )
             luma_plane_size *= 4;
 
         /* FIXME: Don't allocate both buffers in non-adaptive MBAFF. */
@@ -193,8 +203,16 @@ static x264_frame_t *frame_new( x264_t *h, int b_fdec )
         PREALLOC( frame->i_row_bits, i_lines/16 * sizeof(int) );
         PREALLOC( frame->f_row_qp, i_lines/16 * sizeof(float) );
         PREALLOC( frame->f_row_qscale, i_lines/16 * sizeof(float) );
-        if( h->param.analyse.i_me_method >= X264_ME_ESA )
+        if( h->param.b_lazy_hpel && h->param.analyse.i_subpel_refine && b_fdec == 1 )
+            PREALLOC( frame->hpel_tiles, i_mb_count * sizeof(uint8_t) );
+        if( ME_EXHAUSTIVE( h->param.analyse.i_me_method ) && b_fdec == 1 )
             PREALLOC( frame->buffer[3], frame->i_stride[0] * (frame->i_lines[0] + 2*i_padv) * sizeof(uint16_t) << h->frames.b_have_sub8x8_esa );
+        if( h->param.analyse.i_me_method == X264_ME_PYR && b_fdec == 1 )
+            for( int i = 0; i < 2; i++ )
+            {
+                frame->i_stride_pyramid[i] = align_stride( (i_width >> (i+1)) + PADH2, align, disalign<<(i+1) );
+                PREALLOC( frame->pyramid[i], frame->i_stride_pyramid[i] * ((i_lines >> (i+1)) + 2*PADV) * SIZEOF_PIXEL );
+            }
         if( PARAM_INTERLACED )
             PREALLOC( frame->field, i_mb_count * sizeof(uint8_t) );
         if( h->param.analyse.b_mb_info )
@@ -206,25 +224,34 @@ static x264_frame_t *frame_new( x264_t *h, int b_fdec )
         {
             int64_t luma_plane_size = align_plane_size( frame->i_stride_lowres * (frame->i_lines[0]/2 + 2*PADV), disalign );
 
-            PREALLOC( frame->buffer_lowres, 4 * luma_plane_size * SIZEOF_PIXEL );
+            if( h->param.b_low_memory )
+                h->frames.arena->i_lowres_size = 4 * luma_plane_size * SIZEOF_PIXEL;
+            else
+                PREALLOC( frame->buffer_lowres, 4 * luma_plane_size * SIZEOF_PIXEL );
 
+            /* The per-mb arrays that MB-tree streams through for every frame it propagates go
+             * first and next to each other, the rest after them. */
+            PREALLOC( frame->i_propagate_cost, i_mb_count * sizeof(uint16_t) );
+            PREALLOC( frame->lowres_costs[0][0], i_mb_count * sizeof(uint16_t) );
+            if( h->param.rc.i_aq_mode )
+                PREALLOC( frame->i_inv_qscale_factor, i_mb_count * sizeof(uint16_t) );
+            /* Costs are only estimated with p0 and p1 at most bframes+1 apart, so don't allocate
+             * the other half of the table. */
+            for( int j = 0; j <= h->param.i_bframe+1; j++ )
+                for( int i = 0; i <= h->param.i_bframe+1; i++ )
+                    if( (i|j) && i+j <= h->param.i_bframe+1 )
+                        PREALLOC( frame->lowres_costs[j][i], i_mb_count * sizeof(uint16_t) );
             for( int j = 0; j <= !!h->param.i_bframe; j++ )
                 for( int i = 0; i <= h->param.i_bframe; i++ )
                 {
                     PREALLOC( frame->lowres_mvs[j][i], 2*i_mb_count*sizeof(int16_t) );
                     PREALLOC( frame->lowres_mv_costs[j][i], i_mb_count*sizeof(int) );
                 }
-            PREALLOC( frame->i_propagate_cost, i_mb_count * sizeof(uint16_t) );
-            for( int j = 0; j <= h->param.i_bframe+1; j++ )
-                for( int i = 0; i <= h->param.i_bframe+1; i++ )
-                    PREALLOC( frame->lowres_costs[j][i], i_mb_count * sizeof(uint16_t) );
         }
         if( h->param.rc.i_aq_mode )
         {
             PREALLOC( frame->f_qp_offset, i_mb_count * sizeof(float) );
             PREALLOC( frame->f_qp_offset_aq, i_mb_count * sizeof(float) );
-            if( h->frames.b_have_lowres )
-                PREALLOC( frame->i_inv_qscale_factor, i_mb_count * sizeof(uint16_t) );
         }
 
         /* mbtree asm can overread the input buffers, make sure we don't read outside of allocated memory. */
@@ -232,7 +259,28 @@ static x264_frame_t *frame_new( x264_t *h, int b_fdec )
             prealloc_size += NATIVE_ALIGN;
     }
 
-    PREALLOC_END( frame->base );
+    if( base_size )
+    {
+        *base_size = prealloc_size;
+        x264_free( frame );
+        return NULL;
+    }
+
+    x264_frame_arena_t *arena = h->frames.arena;
+    if( arena->base && arena->i_used + prealloc_size <= arena->i_size )
+    {
+        frame->base = arena->base + arena->i_used;
+        frame->b_arena = 1;
+        arena->i_used += prealloc_size;
+        PREALLOC_RELOCATE( frame->base );
+    }
+    else
+    {
+        PREALLOC_END( frame->base );
+        arena->i_heap_size += prealloc_size;
+    }
+    frame->i_base_size = prealloc_size;
+    frame->i_numa_node = -1;
 
     if( i_csp == X264_CSP_NV12 || i_csp == X264_CSP_NV16 )
     {
@@ -245,7 +293,7 @@ static x264_frame_t *frame_new( x264_t *h, int b_fdec )
     for( int p = 0; p < luma_plane_count; p++ )
     {
         int64_t luma_plane_size = align_plane_size( frame->i_stride[p] * (frame->i_lines[p] + 2*i_padv), disalign );
-        if( h->param.analyse.i_subpel_refine && b_fdec )
+        if( h->param.analyse.i_subpel_refine && b_fdec == 1 )
         {
             for( int i = 0; i < 4; i++ )
             {
@@ -269,16 +317,18 @@ static x264_frame_t *frame_new( x264_t *h, int b_fdec )
         M32( frame->mv16x16[0] ) = 0;
         frame->mv16x16++;
 
-        if( h->param.analyse.i_me_method >= X264_ME_ESA )
+        if( ME_EXHAUSTIVE( h->param.analyse.i_me_method ) && b_fdec == 1 )
             frame->integral = (uint16_t*)frame->buffer[3] + frame->i_stride[0] * i_padv + PADH_ALIGN;
+        if( frame->pyramid[0] )
+            for( int i = 0; i < 2; i++ )
+                frame->pyramid[i] += frame->i_stride_pyramid[i] * PADV + PADH_ALIGN;
     }
     else
     {
         if( h->frames.b_have_lowres )
         {
-            int64_t luma_plane_size = align_plane_size( frame->i_stride_lowres * (frame->i_lines[0]/2 + 2*PADV), disalign );
-            for( int i = 0; i < 4; i++ )
-                frame->lowres[i] = frame->buffer_lowres + frame->i_stride_lowres * PADV + PADH_ALIGN + i * luma_plane_size;
+            if( frame->buffer_lowres )
+                frame_lowres_planes( frame );
 
             for( int j = 0; j <= !!h->param.i_bframe; j++ )
                 for( int i = 0; i <= h->param.i_bframe; i++ )
@@ -297,6 +347,8 @@ static x264_frame_t *frame_new( x264_t *h, int b_fdec )
         goto fail;
     if( x264_pthread_cond_init( &frame->cv, NULL ) )
         goto fail;
+    if( x264_pthread_mutex_init( &frame->hpel_mutex, NULL ) )
+        goto fail;
 
 #if HAVE_OPENCL
     frame->opencl.ocl = h->opencl.ocl;
@@ -315,7 +367,10 @@ void x264_frame_delete( x264_frame_t *frame )
      * so freeing those pointers would cause a double free later. */
     if( !frame->b_duplicate )
     {
-        x264_free( frame->base );
+        if( !frame->b_arena )
+            x264_free( frame->base );
+        if( frame->b_lowres_pooled == 1 )
+            x264_free( frame->buffer_lowres );
 
         if( frame->param && frame->param->param_free )
         {
@@ -332,6 +387,7 @@ void x264_frame_delete( x264_frame_t *frame )
         }
         x264_pthread_mutex_destroy( &frame->mutex );
         x264_pthread_cond_destroy( &frame->cv );
+        x264_pthread_mutex_destroy( &frame->hpel_mutex );
 #if HAVE_OPENCL
         x264_opencl_frame_delete( frame );
 #endif
@@ -339,6 +395,103 @@ void x264_frame_delete( x264_frame_t *frame )
     x264_free( frame );
 }
 
+static int arena_owns( x264_frame_arena_t *arena, pixel *p )
+{
+    return arena->base && (uint8_t*)p >= arena->base && (uint8_t*)p < arena->base + arena->i_size;
+}
+
+int x264_frame_arena_init( x264_t *h )
+{
+    x264_frame_arena_t *arena;
+    CHECKED_MALLOCZERO( arena, sizeof(x264_frame_arena_t) );
+    h->frames.arena = arena;
+    if( x264_pthread_mutex_init( &arena->mutex, NULL ) )
+        goto fail;
+    if( h->param.b_low_memory )
+        CHECKED_MALLOCZERO( arena->lowres_unused, (h->frames.i_delay + 3) * sizeof(pixel*) );
+    if( !h->param.b_frame_arena )
+        return 0;
+
+    /* The pool settles at every delayed input frame plus the one being copied in and the lookahead's
+     * last non-B, and at a full DPB plus the frame being reconstructed by each frame thread. */
+    int count[2] = { h->frames.i_delay + 2, h->frames.i_max_dpb + h->i_thread_frames };
+    int i_lowres = 0;
+    if( h->param.b_low_memory )
+    {
+        /* A non-reference B-frame takes a spare frame with hpel planes rather than making one
+         * without (see x264_frame_pop_unused), which only ever costs one more of those. */
+        count[1] += !!h->param.i_bframe;
+        /* Lowres planes: only the frames still in the lookahead have them, not those delayed by the
+         * frame threads. */
+        if( h->frames.b_have_lowres )
+            i_lowres = h->frames.i_delay - (h->i_thread_frames - 1) + 3;
+    }
+    int64_t size[2];
+    for( int i = 0; i < 2; i++ )
+    {
+        frame_new( h, i, &size[i] );
+        arena->i_size += count[i] * size[i];
+    }
+    int64_t lowres_size = ALIGN( arena->i_lowres_size, NATIVE_ALIGN );
+    arena->i_size += i_lowres * lowres_size;
+    /* Large enough to get transparent huge pages from x264_malloc. */
+    CHECKED_MALLOC( arena->base, arena->i_size );
+    /* Fault everything in now instead of on the first keyint of the encode. */
+    for( int64_t i = 0; i < arena->i_size; i += 4096 )
+        arena->base[i] = 0;
+    for( ; arena->i_lowres_unused < i_lowres; arena->i_used += lowres_size )
+        arena->lowres_unused[arena->i_lowres_unused++] = (pixel*)(arena->base + arena->i_used);
+    x264_log( h, X264_LOG_DEBUG, "frame arena: %d input + %d reconstructed frames, %d sets of lowres planes, %.1f MB\n",
+              count[0], count[1], i_lowres, arena->i_size / 1048576. );
+    return 0;
+fail:
+    return -1;
+}
+
+void x264_frame_arena_delete( x264_frame_arena_t *arena )
+{
+    if( !arena )
+        return;
+    for( int i = 0; i < arena->i_lowres_unused; i++ )
+        if( !arena_owns( arena, arena->lowres_unused[i] ) )
+            x264_free( arena->lowres_unused[i] );
+    x264_free( arena->lowres_unused );
+    x264_free( arena->base );
+    x264_pthread_mutex_destroy( &arena->mutex );
+    x264_free( arena );
+}
+
+static int frame_lowres_acquire( x264_t *h, x264_frame_t *frame )
+{
+    x264_frame_arena_t *arena = h->frames.arena;
+    x264_pthread_mutex_lock( &arena->mutex );
+    if( arena->i_lowres_unused )
+        frame->buffer_lowres = arena->lowres_unused[--arena->i_lowres_unused];
+    else if( (frame->buffer_lowres = x264_malloc( arena->i_lowres_size )) )
+        arena->i_heap_size += arena->i_lowres_size;
+    x264_pthread_mutex_unlock( &arena->mutex );
+    if( !frame->buffer_lowres )
+        return -1;
+    frame->b_lowres_pooled = arena_owns( arena, frame->buffer_lowres ) ? 2 : 1;
+    frame_lowres_planes( frame );
+    return 0;
+}
+
+/* Called by the lookahead once it's done with the frame's lowres planes. */
+void x264_frame_lowres_release( x264_t *h, x264_frame_t *frame )
+{
+    x264_frame_arena_t *arena = h->frames.arena;
+    if( !frame->b_lowres_pooled )
+        return;
+    x264_pthread_mutex_lock( &arena->mutex );
+    arena->lowres_unused[arena->i_lowres_unused++] = frame->buffer_lowres;
+    x264_pthread_mutex_unlock( &arena->mutex );
+    frame->buffer_lowres = NULL;
+    for( int i = 0; i < 4; i++ )
+        frame->lowres[i] = NULL;
+    frame->b_lowres_pooled = 0;
+}
+
 static int get_plane_ptr( x264_t *h, x264_picture_t *src, uint8_t **pix, int *stride, int plane, int xshift, int yshift )
 {
     int width = h->param.i_width >> xshift;
@@ -624,6 +777,108 @@ void x264_frame_expand_border_filtered( x264_t *h, x264_frame_t *frame, int mb_y
         }
 }
 
+/* Filter one tile of the hpel planes, and the part of the frame border it owns, into exactly what
+ * x264_frame_filter and x264_frame_expand_border_filtered would have left there: the filtered
+ * value at (clip(x,-4,width+3), clip(y,-8,height+7)). */
+static void frame_filter_tile( x264_t *h, x264_frame_t *frame, int tx, int ty )
+{
+    int width  = 16*h->mb.i_mb_width;
+    int height = 16*h->mb.i_mb_height;
+    int x0 = tx ? 16*tx : -PADH;
+    int x1 = tx < h->mb.i_mb_width-1 ? 16*tx+16 : width+PADH;
+    int y0 = ty ? 16*ty : -PADV;
+    int y1 = ty < h->mb.i_mb_height-1 ? 16*ty+16 : height+PADV;
+    int fx0 = X264_MAX( x0, -4 ), fx1 = X264_MIN( x1, width+4 );
+    int fy0 = X264_MAX( y0, -8 ), fy1 = X264_MIN( y1, height+8 );
+    /* As in x264_frame_filter, filter 8 extra pixels on each side of an aligned span, since the
+     * simd may get the outermost ones wrong. */
+    int sx = (fx0 & ~15) - 8;
+    int sw = ((fx1 + 15) & ~15) + 8 - sx;
+    for( int p = 0; p < (CHROMA444 ? 3 : 1); p++ )
+    {
+        int stride = frame->i_stride[p];
+        intptr_t offs = fy0*stride + sx;
+        /* keep the frame's alignment in the scratch */
+        int align = ((intptr_t)(frame->filtered[p][1] + offs) & 63) / SIZEOF_PIXEL;
+        pixel *dst[4];
+        for( int i = 1; i < 4; i++ )
+            dst[i] = h->hpel_scratch + (i-1)*HPEL_SCRATCH_PLANE( stride ) + 64/SIZEOF_PIXEL + align;
+        h->mc.hpel_filter( dst[1], dst[2], dst[3], frame->plane[p] + offs, stride, sw, fy1 - fy0, h->hpel_scratch_buf );
+
+        for( int i = 1; i < 4; i++ )
+            for( int y = y0; y < y1; y++ )
+            {
+                pixel *src = dst[i] + (x264_clip3( y, fy0, fy1-1 ) - fy0)*stride - sx;
+                pixel *pix = frame->filtered[p][i] + y*stride;
+                memcpy( pix + fx0, src + fx0, (fx1 - fx0) * SIZEOF_PIXEL );
+                if( x0 < fx0 )
+                    pixel_memset( pix + x0, src + fx0, fx0 - x0, SIZEOF_PIXEL );
+                if( x1 > fx1 )
+                    pixel_memset( pix + fx1, src + fx1-1, x1 - fx1, SIZEOF_PIXEL );
+            }
+    }
+}
+
+void x264_frame_hpel_ensure( x264_t *h, x264_frame_t *frame, int x0, int y0, int x1, int y1 )
+{
+    frame = frame->orig;
+    if( !frame->hpel_tiles )
+        return;
+    int tx0 = x264_clip3( x0 >> 4, 0, h->mb.i_mb_width-1 );
+    int tx1 = x264_clip3( (x1-1) >> 4, 0, h->mb.i_mb_width-1 );
+    int ty0 = x264_clip3( y0 >> 4, 0, h->mb.i_mb_height-1 );
+    int ty1 = x264_clip3( (y1-1) >> 4, 0, h->mb.i_mb_height-1 );
+    for( int ty = ty0; ty <= ty1; ty++ )
+        for( int tx = tx0; tx <= tx1; tx++ )
+        {
+            uint8_t *done = &frame->hpel_tiles[ty*h->mb.i_mb_width + tx];
+            if( x264_pthread_load_acquire( done, &frame->hpel_mutex ) )
+                continue;
+            /* The frame may still be being reconstructed by another frame thread: wait until the
+             * rows the tile reads are final, or the whole frame for the tiles owning the border. */
+            if( h->i_thread_frames > 1 )
+                x264_frame_cond_wait( h, frame, ty < h->mb.i_mb_height-1 ? 16*ty+16 : 16*h->mb.i_mb_height+16 );
+            /* Not frame->mutex, which would stall the threads waiting on other rows of the frame. */
+            x264_pthread_mutex_lock( &frame->hpel_mutex );
+            if( !*done )
+            {
+                frame_filter_tile( h, frame, tx, ty );
+                h->i_hpel_tiles[0]++;
+                x264_pthread_store_release( done, 1 );
+            }
+            x264_pthread_mutex_unlock( &frame->hpel_mutex );
+        }
+}
+
+void x264_frame_pyramid_scale( pixel *dst, intptr_t i_dst, pixel *src, intptr_t i_src, int i_width, int i_height )
+{
+    for( int y = 0; y < i_height; y++, dst += i_dst, src += 2*i_src )
+        for( int x = 0; x < i_width; x++ )
+            dst[x] = (src[2*x] + src[2*x+1] + src[2*x+i_src] + src[2*x+i_src+1] + 2) >> 2;
+}
+
+/* Build mb row mb_y of both pyramid levels, each from the level above, once that row of the
+ * reconstruction is final. */
+void x264_frame_filter_pyramid( x264_t *h, x264_frame_t *frame, int mb_y )
+{
+    int width = 16*h->mb.i_mb_width;
+    int pad_top = mb_y == 0;
+    int pad_bot = mb_y == h->mb.i_mb_height - 1;
+    intptr_t i_src = frame->i_stride[0];
+    pixel *src = frame->plane[0] + 16*mb_y*i_src;
+    for( int i = 0; i < 2; i++ )
+    {
+        int rows = 8 >> i;
+        intptr_t i_dst = frame->i_stride_pyramid[i];
+        pixel *dst = frame->pyramid[i] + rows*mb_y*i_dst;
+        width >>= 1;
+        x264_frame_pyramid_scale( dst, i_dst, src, i_src, width, rows );
+        plane_expand_border( dst, i_dst, width, rows, PADH, PADV, pad_top, pad_bot, 0 );
+        src = dst;
+        i_src = i_dst;
+    }
+}
+
 void x264_frame_expand_border_lowres( x264_frame_t *frame )
 {
     for( int i = 0; i < 4; i++ )
@@ -688,13 +943,19 @@ void x264_frame_cond_broadcast( x264_frame_t *frame, int i_lines_completed )
     x264_pthread_mutex_unlock( &frame->mutex );
 }
 
-int x264_frame_cond_wait( x264_frame_t *frame, int i_lines_completed )
+int x264_frame_cond_wait( x264_t *h, x264_frame_t *frame, int i_lines_completed )
 {
     int completed;
+    int64_t wait_start = 0;
     x264_pthread_mutex_lock( &frame->mutex );
     while( (completed = frame->i_lines_completed) < i_lines_completed && i_lines_completed >= 0 )
+    {
+        if( !wait_start )
+            wait_start = x264_stage_start( h );
         x264_pthread_cond_wait( &frame->cv, &frame->mutex );
+    }
     x264_pthread_mutex_unlock( &frame->mutex );
+    x264_stage_end( h, X264_STAGE_WAIT, wait_start );
     return completed;
 }
 
@@ -780,19 +1041,47 @@ void x264_frame_push_unused( x264_t *h, x264_frame_t *frame )
 x264_frame_t *x264_frame_pop_unused( x264_t *h, int b_fdec )
 {
     x264_frame_t *frame;
+    /* Rather than growing the pool, use a spare frame with hpel planes. */
+    if( b_fdec == 2 && !h->frames.unused[2][0] && h->frames.unused[1][0] )
+        b_fdec = 1;
     if( h->frames.unused[b_fdec][0] )
+    {
+        /* Reconstructed frames are written by the thread that pops them: prefer one that's
+         * already on its node. */
+        if( b_fdec && h->param.b_numa )
+        {
+            x264_frame_t **list = h->frames.unused[b_fdec];
+            int i = 0, last = 0;
+            while( list[last+1] ) last++;
+            while( i < last && list[i]->i_numa_node != h->i_numa_node ) i++;
+            XCHG( x264_frame_t*, list[i], list[last] );
+        }
         frame = x264_frame_pop( h->frames.unused[b_fdec] );
+    }
     else
-        frame = frame_new( h, b_fdec );
+        frame = frame_new( h, b_fdec, NULL );
     if( !frame )
         return NULL;
+    if( !b_fdec && h->param.b_low_memory && h->frames.b_have_lowres && !frame->buffer_lowres &&
+        frame_lowres_acquire( h, frame ) < 0 )
+    {
+        x264_frame_push( h->frames.unused[0], frame );
+        return NULL;
+    }
+    if( b_fdec && h->param.b_numa && frame->i_numa_node != h->i_numa_node )
+    {
+        x264_numa_bind( frame->base, frame->i_base_size, h->i_numa_node );
+        frame->i_numa_node = h->i_numa_node;
+    }
+    if( frame->hpel_tiles )
+        memset( frame->hpel_tiles, 0, h->mb.i_mb_count * sizeof(uint8_t) );
     frame->b_last_minigop_bframe = 0;
     frame->i_reference_count = 1;
     frame->b_intra_calculated = 0;
     frame->b_scenecut = 1;
     frame->b_keyframe = 0;
     frame->b_corrupt = 0;
-    frame->i_slice_count = h->param.b_sliced_threads ? h->param.i_threads : 1;
+    frame->i_slice_count = h->param.b_sliced_threads ? h->param.i_slice_threads : 1;
 
     memset( frame->weight, 0, sizeof(frame->weight) );
     memset( frame->f_weighted_cost_delta, 0, sizeof(frame->f_weighted_cost_delta) );
@@ -855,11 +1144,12 @@ int x264_sync_frame_list_init( x264_sync_frame_list_t *slist, int max_size )
     if( max_size < 0 )
         return -1;
     slist->i_max_size = max_size;
-    slist->i_size = 0;
+    slist->i_head = slist->i_tail = slist->i_size = 0;
+    slist->i_waiting = 0;
+    slist->b_closed = 0;
     CHECKED_MALLOCZERO( slist->list, (max_size+1) * sizeof(x264_frame_t*) );
     if( x264_pthread_mutex_init( &slist->mutex, NULL ) ||
-        x264_pthread_cond_init( &slist->cv_fill, NULL ) ||
-        x264_pthread_cond_init( &slist->cv_empty, NULL ) )
+        x264_pthread_cond_init( &slist->cv, NULL ) )
         return -1;
     return 0;
 fail:
@@ -869,30 +1159,86 @@ fail:
 void x264_sync_frame_list_delete( x264_sync_frame_list_t *slist )
 {
     x264_pthread_mutex_destroy( &slist->mutex );
-    x264_pthread_cond_destroy( &slist->cv_fill );
-    x264_pthread_cond_destroy( &slist->cv_empty );
-    x264_frame_delete_list( slist->list );
+    x264_pthread_cond_destroy( &slist->cv );
+    if( !slist->list )
+        return;
+    for( int i = 0; i < slist->i_size; i++ )
+        x264_frame_delete( slist->list[(slist->i_head + i) % slist->i_max_size] );
+    x264_free( slist->list );
 }
 
-void x264_sync_frame_list_push( x264_sync_frame_list_t *slist, x264_frame_t *frame )
+#define sync_frame_list_atomic_add( slist, val, add ) x264_pthread_fetch_and_add( val, add, &(slist)->mutex )
+
+/* Parking uses the same pattern on both sides: announce the waiter, then check
+ * the list under the mutex.  The other side always changes i_size before it looks
+ * for waiters, so either the waiter sees the change or it gets woken up. */
+static void sync_frame_list_wake( x264_sync_frame_list_t *slist )
 {
-    x264_pthread_mutex_lock( &slist->mutex );
-    while( slist->i_size == slist->i_max_size )
-        x264_pthread_cond_wait( &slist->cv_empty, &slist->mutex );
-    slist->list[ slist->i_size++ ] = frame;
-    x264_pthread_mutex_unlock( &slist->mutex );
-    x264_pthread_cond_broadcast( &slist->cv_fill );
+    if( sync_frame_list_atomic_add( slist, &slist->i_waiting, 0 ) )
+    {
+        x264_pthread_mutex_lock( &slist->mutex );
+        x264_pthread_cond_broadcast( &slist->cv );
+        x264_pthread_mutex_unlock( &slist->mutex );
+    }
 }
 
+/* Producer: append count frames, which become visible to the consumer all at once. */
+void x264_sync_frame_list_push( x264_sync_frame_list_t *slist, x264_frame_t **frames, int count )
+{
+    assert( count <= slist->i_max_size );
+    if( sync_frame_list_atomic_add( slist, &slist->i_size, 0 ) > slist->i_max_size - count )
+    {
+        sync_frame_list_atomic_add( slist, &slist->i_waiting, 1 );
+        x264_pthread_mutex_lock( &slist->mutex );
+        while( sync_frame_list_atomic_add( slist, &slist->i_size, 0 ) > slist->i_max_size - count )
+            x264_pthread_cond_wait( &slist->cv, &slist->mutex );
+        x264_pthread_mutex_unlock( &slist->mutex );
+        sync_frame_list_atomic_add( slist, &slist->i_waiting, -1 );
+    }
+    for( int i = 0; i < count; i++ )
+    {
+        slist->list[slist->i_tail] = frames[i];
+        slist->i_tail = (slist->i_tail + 1) % slist->i_max_size;
+    }
+    sync_frame_list_atomic_add( slist, &slist->i_size, count );
+    sync_frame_list_wake( slist );
+}
+
+/* Consumer: wait until the list isn't empty, or until it's closed.
+ * Returns the number of frames available. */
+int x264_sync_frame_list_wait( x264_sync_frame_list_t *slist )
+{
+    int i_size = sync_frame_list_atomic_add( slist, &slist->i_size, 0 );
+    if( !i_size && !slist->b_closed )
+    {
+        sync_frame_list_atomic_add( slist, &slist->i_waiting, 1 );
+        x264_pthread_mutex_lock( &slist->mutex );
+        while( !(i_size = sync_frame_list_atomic_add( slist, &slist->i_size, 0 )) && !slist->b_closed )
+            x264_pthread_cond_wait( &slist->cv, &slist->mutex );
+        x264_pthread_mutex_unlock( &slist->mutex );
+        sync_frame_list_atomic_add( slist, &slist->i_waiting, -1 );
+    }
+    return i_size;
+}
+
+/* Consumer: take the oldest frame, or NULL if the list is empty. */
 x264_frame_t *x264_sync_frame_list_pop( x264_sync_frame_list_t *slist )
 {
-    x264_frame_t *frame;
+    if( !sync_frame_list_atomic_add( slist, &slist->i_size, 0 ) )
+        return NULL;
+    x264_frame_t *frame = slist->list[slist->i_head];
+    slist->list[slist->i_head] = NULL;
+    slist->i_head = (slist->i_head + 1) % slist->i_max_size;
+    sync_frame_list_atomic_add( slist, &slist->i_size, -1 );
+    sync_frame_list_wake( slist );
+    return frame;
+}
+
+/* Producer: no more frames will be pushed; wakes a consumer waiting on an empty list. */
+void x264_sync_frame_list_close( x264_sync_frame_list_t *slist )
+{
     x264_pthread_mutex_lock( &slist->mutex );
-    while( !slist->i_size )
-        x264_pthread_cond_wait( &slist->cv_fill, &slist->mutex );
-    frame = slist->list[ --slist->i_size ];
-    slist->list[ slist->i_size ] = NULL;
-    x264_pthread_cond_broadcast( &slist->cv_empty );
+    slist->b_closed = 1;
+    x264_pthread_cond_broadcast( &slist->cv );
     x264_pthread_mutex_unlock( &slist->mutex );
-    return frame;
 }
@@ -33,11 +33,21 @@
 #define PADV 32
 #define PADH_ALIGN X264_MAX( PADH, NATIVE_ALIGN / SIZEOF_PIXEL )
 #define PADH2 (PADH_ALIGN + PADH)
+#define LOOKAHEAD_BATCH_PAD 16
+
+/* lazy hpel: size in pixels of one plane of the tile scratch, up to 32 rows filtered plus
+ * what the filter writes past them, and room to match the frame's alignment */
+#define HPEL_SCRATCH_PLANE(stride) (33*(stride) + 128/SIZEOF_PIXEL)
 
 typedef struct x264_frame
 {
     /* */
     uint8_t *base;       /* Base pointer for all malloced data in this frame. */
+    int64_t i_base_size;
+    int     i_numa_node; /* node the memory is bound to, -1 if none */
+    int     b_arena;     /* base is a part of the frame arena rather than an allocation of its own */
+    int     b_lowres_pooled; /* buffer_lowres is lent by the arena's lowres pool rather than part of base:
+                              * 1 if the pool allocated it, 2 if it's a part of the arena */
     int     i_poc;
     int     i_delta_poc[2];
     int     i_type;
@@ -60,13 +70,14 @@ typedef struct x264_frame
     int     b_kept_as_ref;
     int     i_pic_struct;
     int     b_keyframe;
-    uint8_t b_fdec;
+    uint8_t b_fdec;      /* 0 = fenc, 1 = fdec, 2 = fdec without hpel planes for frames nobody references */
     uint8_t b_last_minigop_bframe; /* this frame is the last b in a sequence of bframes */
     uint8_t i_bframes;   /* number of bframes following this nonb in coded order */
     float   f_qp_avg_rc; /* QPs as decided by ratecontrol */
     float   f_qp_avg_aq; /* QPs as decided by AQ in addition to ratecontrol */
     float   f_crf_avg;   /* Average effective CRF for this frame */
     int     i_poc_l0ref0; /* poc of first refframe in L0, used to check if direct temporal is possible */
+    int64_t i_slicetype_time; /* stage timing: the slicetype decision of this frame's minigop, on its first frame */
 
     /* YUV buffer */
     int     i_csp; /* Internal csp */
@@ -77,12 +88,16 @@ typedef struct x264_frame
     int     i_stride_lowres;
     int     i_width_lowres;
     int     i_lines_lowres;
+    int     i_stride_pyramid[2];
     pixel *plane[3];
     pixel *plane_fld[3];
     pixel *filtered[3][4]; /* plane[0], H, V, HV */
     pixel *filtered_fld[3][4];
+    uint8_t *hpel_tiles; /* lazy hpel: per MB, whether that 16x16 tile of the hpel planes has been filtered */
+    x264_pthread_mutex_t hpel_mutex; /* lazy hpel: held while filtering a tile and setting its flag */
     pixel *lowres[4]; /* half-size copy of input frame: Orig, H, V, HV */
     uint16_t *integral;
+    pixel *pyramid[2]; /* me=pyr: half- and quarter-size copies of the reconstructed luma */
 
     /* for unrestricted mv we allocate more data than needed
      * allocated data are stored in buffer */
@@ -122,6 +137,7 @@ typedef struct x264_frame
      * FIXME: how big an array do we need? */
     int     i_cost_est[X264_BFRAME_MAX+2][X264_BFRAME_MAX+2];
     int     i_cost_est_aq[X264_BFRAME_MAX+2][X264_BFRAME_MAX+2];
+    int     i_cost_est_mbtree[X264_BFRAME_MAX+2][X264_BFRAME_MAX+2]; /* MB-tree reweighted cost as a B-frame, -1 if not known */
     int     i_satd; // the i_cost_est of the selected frametype
     int     i_intra_mbs[X264_BFRAME_MAX+2];
     int     *i_row_satds[X264_BFRAME_MAX+2][X264_BFRAME_MAX+2];
@@ -182,15 +198,29 @@ typedef struct x264_frame
 #endif
 } x264_frame_t;
 
-/* synchronized frame list */
+/* frame list private to one thread */
 typedef struct
 {
-   x264_frame_t **list;
+   x264_frame_t **list; /* NULL-terminated, i_max_size+1 entries */
    int i_max_size;
    int i_size;
+} x264_frame_list_t;
+
+/* synchronized frame list: a ring shared by exactly one producer and one consumer.
+ * The producer only moves i_tail and the consumer only moves i_head; i_size is the
+ * only field both write, always atomically, so neither side takes a lock unless it
+ * has to park because the list is full or empty. */
+typedef struct
+{
+   x264_frame_t **list;
+   int i_max_size;
+   int i_head;      /* consumer only */
+   int i_tail;      /* producer only */
+   int i_size;      /* atomic */
+   int i_waiting;   /* atomic, threads parked on cv */
+   int b_closed;    /* no more frames will be pushed */
    x264_pthread_mutex_t     mutex;
-   x264_pthread_cond_t      cv_fill;  /* event signaling that the list became fuller */
-   x264_pthread_cond_t      cv_empty; /* event signaling that the list became emptier */
+   x264_pthread_cond_t      cv;       /* event signaling a change of i_size or b_closed to parked threads */
 } x264_sync_frame_list_t;
 
 typedef void (*x264_deblock_inter_t)( pixel *pix, intptr_t stride, int alpha, int beta, int8_t *tc0 );
@@ -218,6 +248,31 @@ typedef struct
                               int bframe );
 } x264_deblock_function_t;
 
+/* Frame memory accounting, and optionally one block holding the buffers of every frame
+ * the encoder is expected to need, carved up as the frame pool grows. */
+typedef struct
+{
+    uint8_t *base;
+    int64_t i_size;
+    int64_t i_used;
+    int64_t i_heap_size; /* frame memory allocated outside the arena */
+
+    /* Low-memory mode: the lowres planes of input frames are only lent to them while they're
+     * in the lookahead, instead of living as long as the frame.  With an arena, as many as the
+     * pool can hold are carved from it. */
+    x264_pthread_mutex_t mutex;
+    int64_t i_lowres_size;
+    pixel   **lowres_unused;
+    int     i_lowres_unused;
+} x264_frame_arena_t;
+
+#define x264_frame_arena_init x264_template(frame_arena_init)
+int           x264_frame_arena_init( x264_t *h );
+#define x264_frame_arena_delete x264_template(frame_arena_delete)
+void          x264_frame_arena_delete( x264_frame_arena_t *arena );
+#define x264_frame_lowres_release x264_template(frame_lowres_release)
+void          x264_frame_lowres_release( x264_t *h, x264_frame_t *frame );
+
 #define x264_frame_delete x264_template(frame_delete)
 void          x264_frame_delete( x264_frame_t *frame );
 
@@ -244,6 +299,12 @@ void          x264_macroblock_deblock( x264_t *h );
 
 #define x264_frame_filter x264_template(frame_filter)
 void          x264_frame_filter( x264_t *h, x264_frame_t *frame, int mb_y, int b_end );
+#define x264_frame_filter_pyramid x264_template(frame_filter_pyramid)
+void          x264_frame_filter_pyramid( x264_t *h, x264_frame_t *frame, int mb_y );
+#define x264_frame_pyramid_scale x264_template(frame_pyramid_scale)
+void          x264_frame_pyramid_scale( pixel *dst, intptr_t i_dst, pixel *src, intptr_t i_src, int i_width, int i_height );
+#define x264_frame_hpel_ensure x264_template(frame_hpel_ensure)
+void          x264_frame_hpel_ensure( x264_t *h, x264_frame_t *frame, int x0, int y0, int x1, int y1 );
 #define x264_frame_init_lowres x264_template(frame_init_lowres)
 void          x264_frame_init_lowres( x264_t *h, x264_frame_t *frame );
 
@@ -253,7 +314,7 @@ void          x264_deblock_init( uint32_t cpu, x264_deblock_function_t *pf, int
 #define x264_frame_cond_broadcast x264_template(frame_cond_broadcast)
 void          x264_frame_cond_broadcast( x264_frame_t *frame, int i_lines_completed );
 #define x264_frame_cond_wait x264_template(frame_cond_wait)
-int           x264_frame_cond_wait( x264_frame_t *frame, int i_lines_completed );
+int           x264_frame_cond_wait( x264_t *h, x264_frame_t *frame, int i_lines_completed );
 #define x264_frame_new_slice x264_template(frame_new_slice)
 int           x264_frame_new_slice( x264_t *h, x264_frame_t *frame );
 
@@ -290,8 +351,12 @@ int           x264_sync_frame_list_init( x264_sync_frame_list_t *slist, int nele
 #define x264_sync_frame_list_delete x264_template(sync_frame_list_delete)
 void          x264_sync_frame_list_delete( x264_sync_frame_list_t *slist );
 #define x264_sync_frame_list_push x264_template(sync_frame_list_push)
-void          x264_sync_frame_list_push( x264_sync_frame_list_t *slist, x264_frame_t *frame );
+void          x264_sync_frame_list_push( x264_sync_frame_list_t *slist, x264_frame_t **frames, int count );
+#define x264_sync_frame_list_wait x264_template(sync_frame_list_wait)
+int           x264_sync_frame_list_wait( x264_sync_frame_list_t *slist );
 #define x264_sync_frame_list_pop x264_template(sync_frame_list_pop)
 x264_frame_t *x264_sync_frame_list_pop( x264_sync_frame_list_t *slist );
+#define x264_sync_frame_list_close x264_template(sync_frame_list_close)
+void          x264_sync_frame_list_close( x264_sync_frame_list_t *slist );
 
 #endif
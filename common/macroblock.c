@@ -29,6 +29,7 @@
 #include "common.h"
 
 #define MC_LUMA(list,p) \
+    x264_mb_hpel_ensure( h, list, i_ref, mvx, mvy, 4*width, 4*height ); \
     h->mc.mc_luma( &h->mb.pic.p_fdec[p][4*y*FDEC_STRIDE+4*x], FDEC_STRIDE, \
                    &h->mb.pic.p_fref[list][i_ref][p*4], h->mb.pic.i_stride[p], \
                    mvx, mvy, 4*width, 4*height, \
@@ -102,6 +103,8 @@ static NOINLINE void mb_mc_1xywh( x264_t *h, int x, int y, int width, int height
 }
 
 #define MC_LUMA_BI(p) \
+    x264_mb_hpel_ensure( h, 0, i_ref0, mvx0, mvy0, 4*width, 4*height ); \
+    x264_mb_hpel_ensure( h, 1, i_ref1, mvx1, mvy1, 4*width, 4*height ); \
     src0 = h->mc.get_ref( tmp0, &i_stride0, &h->mb.pic.p_fref[0][i_ref0][p*4], h->mb.pic.i_stride[p], \
                           mvx0, mvy0, 4*width, 4*height, x264_weight_none ); \
     src1 = h->mc.get_ref( tmp1, &i_stride1, &h->mb.pic.p_fref[1][i_ref1][p*4], h->mb.pic.i_stride[p], \
@@ -357,19 +360,26 @@ int x264_macroblock_thread_allocate( x264_t *h, int b_lookahead )
         for( int i = 0; i < (PARAM_INTERLACED ? 5 : 2); i++ )
             for( int j = 0; j < (CHROMA444 ? 3 : 2); j++ )
             {
+                /* Wavefront rows predict from the row above, whichever thread encoded it. */
+                if( h->param.b_wavefront && h != h->slice_thread[0] )
+                {
+                    h->intra_border_backup[i][j] = h->slice_thread[0]->intra_border_backup[i][j];
+                    continue;
+                }
                 CHECKED_MALLOC( h->intra_border_backup[i][j], (h->sps->i_mb_width*16+32) * SIZEOF_PIXEL );
                 h->intra_border_backup[i][j] += 16;
             }
         for( int i = 0; i <= PARAM_INTERLACED; i++ )
         {
-            if( h->param.b_sliced_threads )
+            if( h->param.b_sliced_threads || h->param.b_wavefront )
             {
                 /* Only allocate the first one, and allocate it for the whole frame, because we
-                 * won't be deblocking until after the frame is fully encoded. */
-                if( h == h->thread[0] && !i )
+                 * won't be deblocking until after the frame is fully encoded, or in the case of
+                 * wavefront rows, until long after the rows below have been analysed. */
+                if( h == h->slice_thread[0] && !i )
                     CHECKED_MALLOC( h->deblock_strength[0], sizeof(**h->deblock_strength) * h->mb.i_mb_count );
                 else
-                    h->deblock_strength[i] = h->thread[0]->deblock_strength[0];
+                    h->deblock_strength[i] = h->slice_thread[0]->deblock_strength[0];
             }
             else
                 CHECKED_MALLOC( h->deblock_strength[i], sizeof(**h->deblock_strength) * h->mb.i_mb_width );
@@ -384,7 +394,7 @@ int x264_macroblock_thread_allocate( x264_t *h, int b_lookahead )
         int buf_hpel = (h->thread[0]->fdec->i_width[0]+48+32) * sizeof(int16_t);
         int buf_ssim = h->param.analyse.b_ssim * 8 * (h->param.i_width/4+3) * sizeof(int);
         int me_range = X264_MIN(h->param.analyse.i_me_range, h->param.analyse.i_mv_range);
-        int buf_tesa = (h->param.analyse.i_me_method >= X264_ME_ESA) *
+        int buf_tesa = ME_EXHAUSTIVE( h->param.analyse.i_me_method ) *
             ((me_range*2+24) * sizeof(int16_t) + (me_range+4) * (me_range+1) * 4 * sizeof(mvsad_t));
         scratch_size = X264_MAX3( buf_hpel, buf_ssim, buf_tesa );
     }
@@ -395,6 +405,53 @@ int x264_macroblock_thread_allocate( x264_t *h, int b_lookahead )
     else
         h->scratch_buffer = NULL;
 
+    if( !b_lookahead && h->param.b_lazy_hpel )
+    {
+        int stride = h->thread[0]->fdec->i_stride[0];
+        CHECKED_MALLOC( h->hpel_scratch, 3 * HPEL_SCRATCH_PLANE( stride ) * SIZEOF_PIXEL );
+        CHECKED_MALLOC( h->hpel_scratch_buf, (h->thread[0]->fdec->i_width[0]+48+32) * sizeof(int16_t) );
+    }
+    else
+    {
+        h->hpel_scratch = NULL;
+        h->hpel_scratch_buf = NULL;
+    }
+
+    /* Only the contexts that run the lookahead's motion search need the batch pyramid: the lookahead's
+     * own, or without a lookahead thread every frame thread, as each runs the lookahead in turn. */
+    int b_batch = b_lookahead;
+    if( !h->param.i_sync_lookahead )
+        for( int i = 0; i < h->i_thread_frames; i++ )
+            b_batch |= h == h->thread[i];
+    if( h->param.b_lookahead_batch && b_batch )
+    {
+        int plane_size = 0;
+        for( int s = 1; s < 4; s++ )
+        {
+            h->batch.i_stride[s] = ALIGN( ((8*h->mb.i_mb_width)>>s) + 2*LOOKAHEAD_BATCH_PAD, NATIVE_ALIGN/SIZEOF_PIXEL );
+            plane_size += h->batch.i_stride[s] * (((8*h->mb.i_mb_height)>>s) + 2*LOOKAHEAD_BATCH_PAD);
+        }
+        CHECKED_MALLOC( h->batch.buffer, 2 * plane_size * SIZEOF_PIXEL );
+        pixel *plane = h->batch.buffer;
+        for( int i = 0; i < 2; i++ )
+            for( int s = 1; s < 4; s++ )
+            {
+                h->batch.plane[i][s] = plane + h->batch.i_stride[s] * LOOKAHEAD_BATCH_PAD + LOOKAHEAD_BATCH_PAD;
+                plane += h->batch.i_stride[s] * (((8*h->mb.i_mb_height)>>s) + 2*LOOKAHEAD_BATCH_PAD);
+            }
+
+        int mv_size = ALIGN( h->mb.i_mb_count, NATIVE_ALIGN/sizeof(int16_t) );
+        CHECKED_MALLOC( h->batch.mv_buffer, 6 * mv_size * sizeof(int16_t) );
+        for( int i = 0; i < 2; i++ )
+        {
+            h->batch.mv[i][0] = h->batch.mv_buffer + (2*i+0) * mv_size;
+            h->batch.mv[i][1] = h->batch.mv_buffer + (2*i+1) * mv_size;
+            h->batch.mvp[i]   = h->batch.mv_buffer + (4+i) * mv_size;
+        }
+    }
+    else
+        memset( &h->batch, 0, sizeof(h->batch) );
+
     int buf_lookahead_threads = (h->mb.i_mb_height + (4 + 32) * h->param.i_lookahead_threads) * sizeof(int) * 2;
     int buf_mbtree2 = buf_mbtree * 12; /* size of the internal propagate_list asm buffer */
     scratch_size = X264_MAX( buf_lookahead_threads, buf_mbtree2 );
@@ -410,14 +467,19 @@ void x264_macroblock_thread_free( x264_t *h, int b_lookahead )
     if( !b_lookahead )
     {
         for( int i = 0; i <= PARAM_INTERLACED; i++ )
-            if( !h->param.b_sliced_threads || (h == h->thread[0] && !i) )
+            if( !(h->param.b_sliced_threads || h->param.b_wavefront) || (h == h->slice_thread[0] && !i) )
                 x264_free( h->deblock_strength[i] );
-        for( int i = 0; i < (PARAM_INTERLACED ? 5 : 2); i++ )
-            for( int j = 0; j < (CHROMA444 ? 3 : 2); j++ )
-                x264_free( h->intra_border_backup[i][j] - 16 );
+        if( !h->param.b_wavefront || h == h->slice_thread[0] )
+            for( int i = 0; i < (PARAM_INTERLACED ? 5 : 2); i++ )
+                for( int j = 0; j < (CHROMA444 ? 3 : 2); j++ )
+                    x264_free( h->intra_border_backup[i][j] - 16 );
     }
     x264_free( h->scratch_buffer );
     x264_free( h->scratch_buffer2 );
+    x264_free( h->hpel_scratch );
+    x264_free( h->hpel_scratch_buf );
+    x264_free( h->batch.buffer );
+    x264_free( h->batch.mv_buffer );
 }
 
 void x264_macroblock_slice_init( x264_t *h )
@@ -873,7 +935,7 @@ static ALWAYS_INLINE void macroblock_cache_load( x264_t *h, int mb_x, int mb_y,
 
     const x264_left_table_t *left_index_table = h->mb.left_index_table;
 
-    h->mb.cache.deblock_strength = h->deblock_strength[mb_y&1][h->param.b_sliced_threads?h->mb.i_mb_xy:mb_x];
+    h->mb.cache.deblock_strength = h->deblock_strength[mb_y&1][h->param.b_sliced_threads||h->param.b_wavefront?h->mb.i_mb_xy:mb_x];
 
     /* load cache */
     if( h->mb.i_neighbour & MB_TOP )
@@ -1035,7 +1097,8 @@ static ALWAYS_INLINE void macroblock_cache_load( x264_t *h, int mb_x, int mb_y,
             macroblock_load_pic_pointers( h, mb_x, mb_y, 1, 1, 1 );
     }
 
-    if( h->fdec->integral )
+    /* Not h->fdec->integral: frames that won't be referenced may not have one of their own. */
+    if( ME_EXHAUSTIVE( h->param.analyse.i_me_method ) )
     {
         int offset = 16 * (mb_x + mb_y * h->fdec->i_stride[0]);
         for( int list = 0; list < 2; list++ )
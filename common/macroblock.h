@@ -460,4 +460,17 @@ static ALWAYS_INLINE int x264_mb_transform_8x8_allowed( x264_t *h )
     return M32( h->mb.i_sub_partition ) == D_L0_8x8*0x01010101;
 }
 
+/* x264_mb_hpel_ensure:
+ *      with lazy hpel, filter the tiles of a reference frame that MC of a width x height
+ *      block reads, mv (mvx,mvy) being relative to the top left of the macroblock */
+static ALWAYS_INLINE void x264_mb_hpel_ensure( x264_t *h, int i_list, int i_ref, int mvx, int mvy, int width, int height )
+{
+    if( h->param.b_lazy_hpel && ((mvx|mvy)&3) )
+    {
+        int x = 16*h->mb.i_mb_x + (mvx>>2);
+        int y = 16*h->mb.i_mb_y + (mvy>>2);
+        x264_frame_hpel_ensure( h, h->fref[i_list][i_ref], x, y, x+width+1, y+height+1 );
+    }
+}
+
 #endif
@@ -468,6 +468,7 @@ void x264_frame_init_lowres( x264_t *h, x264_frame_t *frame )
     x264_frame_expand_border_lowres( frame );
 
     memset( frame->i_cost_est, -1, sizeof(frame->i_cost_est) );
+    memset( frame->i_cost_est_mbtree, -1, sizeof(frame->i_cost_est_mbtree) );
 
     for( int y = 0; y < h->param.i_bframe + 2; y++ )
         for( int x = 0; x < h->param.i_bframe + 2; x++ )
@@ -710,7 +711,8 @@ void x264_frame_filter( x264_t *h, x264_frame_t *frame, int mb_y, int b_end )
         const int width = frame->i_width[p];
         int offs = start*stride - 8; // buffer = 3 for 6tap, aligned to 8 for simd
 
-        if( !b_interlaced || h->mb.b_adaptive_mbaff )
+        /* With lazy hpel, x264_frame_hpel_ensure filters the tiles as they're needed. */
+        if( (!b_interlaced || h->mb.b_adaptive_mbaff) && !frame->hpel_tiles )
             h->mc.hpel_filter(
                 frame->filtered[p][1] + offs,
                 frame->filtered[p][2] + offs,
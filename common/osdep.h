@@ -392,6 +392,7 @@ static inline int x264_pthread_create( x264_pthread_t *t, void *a, void *(*f)(vo
 #define x264_pthread_cond_init       pthread_cond_init
 #define x264_pthread_cond_destroy    pthread_cond_destroy
 #define x264_pthread_cond_broadcast  pthread_cond_broadcast
+#define x264_pthread_cond_signal     pthread_cond_signal
 #define x264_pthread_cond_wait       pthread_cond_wait
 #define x264_pthread_attr_t          pthread_attr_t
 #define x264_pthread_attr_init       pthread_attr_init
@@ -418,6 +419,7 @@ static inline int x264_pthread_create( x264_pthread_t *t, void *a, void *(*f)(vo
 #define x264_pthread_cond_init(c,f)  0
 #define x264_pthread_cond_destroy(c)
 #define x264_pthread_cond_broadcast(c)
+#define x264_pthread_cond_signal(c)
 #define x264_pthread_cond_wait(c,m)
 #define x264_pthread_attr_t          int
 #define x264_pthread_attr_init(a)    0
@@ -450,6 +452,38 @@ static ALWAYS_INLINE int x264_pthread_fetch_and_add( int *val, int add, x264_pth
 #endif
 }
 
+/* For flags published outside any lock: the store orders the data written before it, the load
+ * orders the reads after it.  Without the builtins the load takes the mutex the stores are made under. */
+#if defined(__GNUC__) && (__GNUC__ > 4 || __GNUC__ == 4 && __GNUC_MINOR__ > 6 || defined(__clang__))
+#define HAVE_ATOMIC_BUILTINS 1
+#else
+#define HAVE_ATOMIC_BUILTINS 0
+#endif
+
+static ALWAYS_INLINE int x264_pthread_load_acquire( uint8_t *val, x264_pthread_mutex_t *mutex )
+{
+#if HAVE_THREAD && HAVE_ATOMIC_BUILTINS
+    return __atomic_load_n( val, __ATOMIC_ACQUIRE );
+#elif HAVE_THREAD
+    x264_pthread_mutex_lock( mutex );
+    int res = *val;
+    x264_pthread_mutex_unlock( mutex );
+    return res;
+#else
+    return *val;
+#endif
+}
+
+/* The caller holds the mutex given to the matching loads. */
+static ALWAYS_INLINE void x264_pthread_store_release( uint8_t *val, uint8_t set )
+{
+#if HAVE_THREAD && HAVE_ATOMIC_BUILTINS
+    __atomic_store_n( val, set, __ATOMIC_RELEASE );
+#else
+    *val = set;
+#endif
+}
+
 #define WORD_SIZE sizeof(void*)
 
 #define asm __asm__
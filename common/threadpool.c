@@ -23,137 +23,477 @@
  * For more information, contact us at licensing@x264.com.
  *****************************************************************************/
 
-#include "common.h"
+#include "base.h"
+#include "threadpool.h"
 
-typedef struct
+typedef struct x264_threadpool_job_t
 {
     void *(*func)(void *);
     void *arg;
     void *ret;
+    x264_threadpool_t *owner;
 } x264_threadpool_job_t;
 
-struct x264_threadpool_t
+typedef struct threadpool_core_t threadpool_core_t;
+
+/* Every worker owns a small ring of queued jobs guarded by its own mutex.
+ * Jobs are queued on an idle worker whenever possible; a worker that runs out
+ * of local jobs steals from the other queues before going to sleep, so job
+ * submission and execution no longer serialize on a single pool-wide lock.
+ * Each ring is FIFO, and a thief takes the oldest job of the first non-empty
+ * queue after its own, which isn't necessarily the oldest job in the pool.
+ * No global order is needed: admission keeps the jobs queued or running at
+ * most one per worker, so every admitted job gets a worker whatever order the
+ * queues are drained in, and a frame waiting on an earlier frame can't hold
+ * that frame back. */
+typedef struct
+{
+    threadpool_core_t     *core;
+    x264_pthread_mutex_t  mutex;
+    x264_pthread_cond_t   cv;
+    x264_threadpool_job_t **queue; /* ring of core->threads entries */
+    int                   i_head;
+    volatile int          i_size;
+    volatile int          b_busy;
+    int                   b_sleeping; /* protected by core->sleep_mutex */
+
+    /* profiling, only written by the worker itself */
+    x264_threadpool_stats_t stats;
+} threadpool_worker_t;
+
+/* The worker threads, shared by every x264_threadpool_t attached to them. */
+struct threadpool_core_t
 {
     volatile int   exit;
     int            threads;
+    int            i_numa_node; /* node the workers are pinned to, -1 if none */
+    int            i_refcount; /* protected by mutex */
     x264_pthread_t *thread_handle;
+    threadpool_worker_t *workers;
+    int            i_next_worker; /* round-robin hint, racy by design */
+
+    /* Workers with nothing to do park here. i_queued and i_sleeping are only
+     * modified atomically, so a submitter only needs this lock when there is
+     * someone to wake up. */
+    x264_pthread_mutex_t sleep_mutex;
+    x264_pthread_mutex_t atomic_mutex; /* for threadpool_atomic_add without atomic instructions */
+    int            i_queued;
+    int            i_sleeping;
 
-    /* requires a synchronized list structure and associated methods,
-       so use what is already implemented for frames */
-    x264_sync_frame_list_t uninit; /* list of jobs that are awaiting use */
-    x264_sync_frame_list_t run;    /* list of jobs that are queued for processing by the pool */
-    x264_sync_frame_list_t done;   /* list of jobs that have finished processing */
+    /* Admission: at most `threads` jobs are queued or running at any time, so an
+     * admitted job always gets a worker and never waits behind a job that might
+     * itself be waiting on it. Submitters only take the lock once the pool is
+     * saturated; they are then admitted in favour of the client with the fewest
+     * jobs in flight, so encoders sharing the pool get a fair share of it. */
+    x264_pthread_mutex_t mutex;
+    x264_pthread_cond_t  cv_admit;
+    int            i_active;
+    int            i_waiting;
+    int            i_ticket;
+    x264_threadpool_t *clients;
 };
 
-REALIGN_STACK static void *threadpool_thread( x264_threadpool_t *pool )
+/* A client of the workers: its own job storage and completion list, so that
+ * encoders sharing the workers don't contend on each other's results. */
+struct x264_threadpool_t
+{
+    threadpool_core_t *core;
+    x264_threadpool_t *next;
+
+    int            i_active;  /* jobs queued or running */
+    int            i_waiting; /* submitters waiting for admission, protected by core->mutex */
+    int            i_ticket;  /* protected by core->mutex */
+
+    x264_pthread_mutex_t mutex;
+    x264_pthread_cond_t  cv;
+    int            i_jobs;
+    int            i_uninit;
+    int            i_done;
+    x264_threadpool_job_t **uninit; /* jobs that are awaiting use */
+    x264_threadpool_job_t **done;   /* jobs that have finished processing */
+};
+
+/* Counters changed with threadpool_atomic_add are read with threadpool_atomic_load, also
+ * where a lock is held, since the atomic writers don't take it. */
+#define threadpool_atomic_add( core, val, add ) x264_pthread_fetch_and_add( val, add, &(core)->atomic_mutex )
+#define threadpool_atomic_load( core, val ) threadpool_atomic_add( core, val, 0 )
+
+static x264_threadpool_job_t *threadpool_worker_pop( threadpool_worker_t *w )
 {
-    while( !pool->exit )
+    x264_threadpool_job_t *job = NULL;
+    x264_pthread_mutex_lock( &w->mutex );
+    if( w->i_size )
     {
-        x264_threadpool_job_t *job = NULL;
-        x264_pthread_mutex_lock( &pool->run.mutex );
-        while( !pool->exit && !pool->run.i_size )
-            x264_pthread_cond_wait( &pool->run.cv_fill, &pool->run.mutex );
-        if( pool->run.i_size )
-        {
-            job = (void*)x264_frame_shift( pool->run.list );
-            pool->run.i_size--;
-        }
-        x264_pthread_mutex_unlock( &pool->run.mutex );
+        job = w->queue[w->i_head];
+        w->i_head = (w->i_head + 1) % w->core->threads;
+        w->i_size--;
+    }
+    x264_pthread_mutex_unlock( &w->mutex );
+    return job;
+}
+
+static x264_threadpool_job_t *threadpool_steal( threadpool_worker_t *w )
+{
+    threadpool_core_t *core = w->core;
+    int idx = w - core->workers;
+    for( int i = 1; i < core->threads; i++ )
+    {
+        threadpool_worker_t *victim = &core->workers[(idx + i) % core->threads];
+        if( !victim->i_size )
+            continue;
+        x264_threadpool_job_t *job = threadpool_worker_pop( victim );
+        if( job )
+            return job;
+    }
+    return NULL;
+}
+
+static void threadpool_sleep( threadpool_worker_t *w )
+{
+    threadpool_core_t *core = w->core;
+    int64_t start = x264_mdate();
+    /* Announce ourselves before checking for queued work; the submitter does the
+     * reverse (publish the job, then check for sleepers), so one of the two
+     * always sees the other. */
+    threadpool_atomic_add( core, &core->i_sleeping, 1 );
+    x264_pthread_mutex_lock( &core->sleep_mutex );
+    w->b_sleeping = 1;
+    while( !core->exit && !threadpool_atomic_load( core, &core->i_queued ) )
+        x264_pthread_cond_wait( &w->cv, &core->sleep_mutex );
+    w->b_sleeping = 0;
+    x264_pthread_mutex_unlock( &core->sleep_mutex );
+    threadpool_atomic_add( core, &core->i_sleeping, -1 );
+    w->stats.i_idle_time += x264_mdate() - start;
+}
+
+static void threadpool_job_done( x264_threadpool_job_t *job )
+{
+    x264_threadpool_t *pool = job->owner;
+    threadpool_core_t *core = pool->core;
+
+    x264_pthread_mutex_lock( &pool->mutex );
+    pool->done[pool->i_done++] = job;
+    x264_pthread_cond_broadcast( &pool->cv );
+    x264_pthread_mutex_unlock( &pool->mutex );
+
+    threadpool_atomic_add( core, &pool->i_active, -1 );
+    threadpool_atomic_add( core, &core->i_active, -1 );
+    if( threadpool_atomic_load( core, &core->i_waiting ) )
+    {
+        x264_pthread_mutex_lock( &core->mutex );
+        x264_pthread_cond_broadcast( &core->cv_admit );
+        x264_pthread_mutex_unlock( &core->mutex );
+    }
+}
+
+REALIGN_STACK static void *threadpool_thread( threadpool_worker_t *w )
+{
+    threadpool_core_t *core = w->core;
+    if( core->i_numa_node >= 0 )
+        x264_numa_run_on_node( core->i_numa_node );
+    while( !core->exit )
+    {
+        int b_stolen = 0;
+        x264_threadpool_job_t *job = threadpool_worker_pop( w );
+        if( !job && (job = threadpool_steal( w )) )
+            b_stolen = 1;
         if( !job )
+        {
+            threadpool_sleep( w );
             continue;
+        }
+        threadpool_atomic_add( core, &core->i_queued, -1 );
+        w->b_busy = 1;
         job->ret = job->func( job->arg );
-        x264_sync_frame_list_push( &pool->done, (void*)job );
+        w->b_busy = 0;
+        w->stats.i_jobs++;
+        w->stats.i_steals += b_stolen;
+        threadpool_job_done( job );
     }
     return NULL;
 }
 
-int x264_threadpool_init( x264_threadpool_t **p_pool, int threads )
+static void threadpool_core_delete( threadpool_core_t *core )
 {
-    if( threads <= 0 )
-        return -1;
+    x264_pthread_mutex_lock( &core->sleep_mutex );
+    core->exit = 1;
+    for( int i = 0; i < core->threads; i++ )
+        x264_pthread_cond_broadcast( &core->workers[i].cv );
+    x264_pthread_mutex_unlock( &core->sleep_mutex );
+    for( int i = 0; i < core->threads; i++ )
+        x264_pthread_join( core->thread_handle[i], NULL );
 
-    if( x264_threading_init() < 0 )
+    for( int i = 0; i < core->threads; i++ )
+    {
+        threadpool_worker_t *w = &core->workers[i];
+        x264_free( w->queue );
+        x264_pthread_mutex_destroy( &w->mutex );
+        x264_pthread_cond_destroy( &w->cv );
+    }
+    x264_pthread_mutex_destroy( &core->sleep_mutex );
+    x264_pthread_mutex_destroy( &core->atomic_mutex );
+    x264_pthread_mutex_destroy( &core->mutex );
+    x264_pthread_cond_destroy( &core->cv_admit );
+    x264_free( core->workers );
+    x264_free( core->thread_handle );
+    x264_free( core );
+}
+
+static threadpool_core_t *threadpool_core_new( int threads, int numa_node )
+{
+    threadpool_core_t *core;
+    CHECKED_MALLOCZERO( core, sizeof(threadpool_core_t) );
+    core->threads = threads;
+    core->i_numa_node = numa_node;
+
+    CHECKED_MALLOC( core->thread_handle, core->threads * sizeof(x264_pthread_t) );
+    CHECKED_MALLOCZERO( core->workers, core->threads * sizeof(threadpool_worker_t) );
+
+    if( x264_pthread_mutex_init( &core->sleep_mutex, NULL ) ||
+        x264_pthread_mutex_init( &core->atomic_mutex, NULL ) ||
+        x264_pthread_mutex_init( &core->mutex, NULL ) ||
+        x264_pthread_cond_init( &core->cv_admit, NULL ) )
+        goto fail;
+
+    for( int i = 0; i < core->threads; i++ )
+    {
+        threadpool_worker_t *w = &core->workers[i];
+        w->core = core;
+        CHECKED_MALLOCZERO( w->queue, core->threads * sizeof(x264_threadpool_job_t*) );
+        if( x264_pthread_mutex_init( &w->mutex, NULL ) ||
+            x264_pthread_cond_init( &w->cv, NULL ) )
+            goto fail;
+    }
+
+    for( int i = 0; i < core->threads; i++ )
+        if( x264_pthread_create( core->thread_handle+i, NULL, (void*)threadpool_thread, &core->workers[i] ) )
+            goto fail;
+
+    return core;
+fail:
+    return NULL;
+}
+
+int x264_threadpool_attach( x264_threadpool_t **p_pool, x264_threadpool_t *shared, int max_jobs )
+{
+    if( max_jobs <= 0 )
         return -1;
 
     x264_threadpool_t *pool;
     CHECKED_MALLOCZERO( pool, sizeof(x264_threadpool_t) );
     *p_pool = pool;
 
-    pool->threads   = threads;
-
-    CHECKED_MALLOC( pool->thread_handle, pool->threads * sizeof(x264_pthread_t) );
-
-    if( x264_sync_frame_list_init( &pool->uninit, pool->threads ) ||
-        x264_sync_frame_list_init( &pool->run, pool->threads ) ||
-        x264_sync_frame_list_init( &pool->done, pool->threads ) )
+    pool->i_jobs = max_jobs;
+    CHECKED_MALLOCZERO( pool->uninit, pool->i_jobs * sizeof(x264_threadpool_job_t*) );
+    CHECKED_MALLOCZERO( pool->done, pool->i_jobs * sizeof(x264_threadpool_job_t*) );
+    if( x264_pthread_mutex_init( &pool->mutex, NULL ) ||
+        x264_pthread_cond_init( &pool->cv, NULL ) )
         goto fail;
-
-    for( int i = 0; i < pool->threads; i++ )
+    for( int i = 0; i < pool->i_jobs; i++ )
     {
-       x264_threadpool_job_t *job;
-       CHECKED_MALLOC( job, sizeof(x264_threadpool_job_t) );
-       x264_sync_frame_list_push( &pool->uninit, (void*)job );
+        CHECKED_MALLOC( pool->uninit[i], sizeof(x264_threadpool_job_t) );
+        pool->uninit[i]->owner = pool;
+        pool->i_uninit++;
     }
-    for( int i = 0; i < pool->threads; i++ )
-        if( x264_pthread_create( pool->thread_handle+i, NULL, (void*)threadpool_thread, pool ) )
-            goto fail;
+
+    threadpool_core_t *core = pool->core = shared->core;
+    x264_pthread_mutex_lock( &core->mutex );
+    core->i_refcount++;
+    pool->next = core->clients;
+    core->clients = pool;
+    x264_pthread_mutex_unlock( &core->mutex );
 
     return 0;
 fail:
     return -1;
 }
 
+int x264_threadpool_init_numa( x264_threadpool_t **p_pool, int threads, int numa_node )
+{
+    if( threads <= 0 )
+        return -1;
+
+    if( x264_threading_init() < 0 )
+        return -1;
+
+    x264_threadpool_t root;
+    root.core = threadpool_core_new( threads, numa_node );
+    if( !root.core )
+        return -1;
+
+    return x264_threadpool_attach( p_pool, &root, threads );
+}
+
+int x264_threadpool_init( x264_threadpool_t **p_pool, int threads )
+{
+    return x264_threadpool_init_numa( p_pool, threads, -1 );
+}
+
+int x264_threadpool_threads( x264_threadpool_t *pool )
+{
+    return pool->core->threads;
+}
+
+/* Whether the pool has room for another job and no other waiting client deserves it more. */
+static int threadpool_admissible( threadpool_core_t *core, x264_threadpool_t *pool )
+{
+    if( threadpool_atomic_load( core, &core->i_active ) >= core->threads )
+        return 0;
+    int i_active = threadpool_atomic_load( core, &pool->i_active );
+    for( x264_threadpool_t *c = core->clients; c; c = c->next )
+        if( c != pool && c->i_waiting )
+        {
+            int c_active = threadpool_atomic_load( core, &c->i_active );
+            if( c_active < i_active || (c_active == i_active && c->i_ticket < pool->i_ticket) )
+                return 0;
+        }
+    return 1;
+}
+
+static void threadpool_admit( x264_threadpool_t *pool )
+{
+    threadpool_core_t *core = pool->core;
+
+    if( !threadpool_atomic_load( core, &core->i_waiting ) )
+    {
+        if( threadpool_atomic_add( core, &core->i_active, 1 ) < core->threads )
+            goto admitted;
+        threadpool_atomic_add( core, &core->i_active, -1 );
+    }
+
+    x264_pthread_mutex_lock( &core->mutex );
+    threadpool_atomic_add( core, &core->i_waiting, 1 );
+    pool->i_waiting++;
+    pool->i_ticket = core->i_ticket++;
+    while( 1 )
+    {
+        if( threadpool_admissible( core, pool ) )
+        {
+            if( threadpool_atomic_add( core, &core->i_active, 1 ) < core->threads )
+                break;
+            threadpool_atomic_add( core, &core->i_active, -1 );
+        }
+        x264_pthread_cond_wait( &core->cv_admit, &core->mutex );
+    }
+    pool->i_waiting--;
+    threadpool_atomic_add( core, &core->i_waiting, -1 );
+    /* Someone else may be admissible now that we're no longer waiting. */
+    x264_pthread_cond_broadcast( &core->cv_admit );
+    x264_pthread_mutex_unlock( &core->mutex );
+
+admitted:
+    threadpool_atomic_add( core, &pool->i_active, 1 );
+}
+
 void x264_threadpool_run( x264_threadpool_t *pool, void *(*func)(void *), void *arg )
 {
-    x264_threadpool_job_t *job = (void*)x264_sync_frame_list_pop( &pool->uninit );
+    threadpool_core_t *core = pool->core;
+
+    x264_pthread_mutex_lock( &pool->mutex );
+    while( !pool->i_uninit )
+        x264_pthread_cond_wait( &pool->cv, &pool->mutex );
+    x264_threadpool_job_t *job = pool->uninit[--pool->i_uninit];
+    x264_pthread_mutex_unlock( &pool->mutex );
     job->func = func;
     job->arg  = arg;
-    x264_sync_frame_list_push( &pool->run, (void*)job );
+
+    threadpool_admit( pool );
+
+    /* The number of admitted jobs never exceeds the number of workers,
+     * so there is normally an idle worker to hand the job to directly. */
+    int start = core->i_next_worker;
+    int target = start;
+    for( int i = 0; i < core->threads; i++ )
+    {
+        int idx = (start + i) % core->threads;
+        if( !core->workers[idx].b_busy && !core->workers[idx].i_size )
+        {
+            target = idx;
+            break;
+        }
+    }
+    core->i_next_worker = (target + 1) % core->threads;
+
+    threadpool_worker_t *w = &core->workers[target];
+    x264_pthread_mutex_lock( &w->mutex );
+    w->queue[(w->i_head + w->i_size) % core->threads] = job;
+    w->i_size++;
+    x264_pthread_mutex_unlock( &w->mutex );
+
+    threadpool_atomic_add( core, &core->i_queued, 1 );
+    if( threadpool_atomic_load( core, &core->i_sleeping ) )
+    {
+        /* Wake the worker the job was queued on, or any other sleeper to steal it. */
+        x264_pthread_mutex_lock( &core->sleep_mutex );
+        if( !w->b_sleeping )
+            for( int i = 1; i < core->threads; i++ )
+                if( core->workers[(target + i) % core->threads].b_sleeping )
+                {
+                    w = &core->workers[(target + i) % core->threads];
+                    break;
+                }
+        if( w->b_sleeping )
+            x264_pthread_cond_signal( &w->cv );
+        x264_pthread_mutex_unlock( &core->sleep_mutex );
+    }
 }
 
 void *x264_threadpool_wait( x264_threadpool_t *pool, void *arg )
 {
-    x264_pthread_mutex_lock( &pool->done.mutex );
+    x264_pthread_mutex_lock( &pool->mutex );
     while( 1 )
     {
-        for( int i = 0; i < pool->done.i_size; i++ )
-            if( ((x264_threadpool_job_t*)pool->done.list[i])->arg == arg )
+        for( int i = 0; i < pool->i_done; i++ )
+            if( pool->done[i]->arg == arg )
             {
-                x264_threadpool_job_t *job = (void*)x264_frame_shift( pool->done.list+i );
-                pool->done.i_size--;
-                x264_pthread_mutex_unlock( &pool->done.mutex );
+                x264_threadpool_job_t *job = pool->done[i];
+                memmove( pool->done+i, pool->done+i+1, (pool->i_done-i-1) * sizeof(x264_threadpool_job_t*) );
+                pool->i_done--;
 
                 void *ret = job->ret;
-                x264_sync_frame_list_push( &pool->uninit, (void*)job );
+                pool->uninit[pool->i_uninit++] = job;
+                x264_pthread_cond_broadcast( &pool->cv );
+                x264_pthread_mutex_unlock( &pool->mutex );
                 return ret;
             }
 
-        x264_pthread_cond_wait( &pool->done.cv_fill, &pool->done.mutex );
+        x264_pthread_cond_wait( &pool->cv, &pool->mutex );
     }
 }
 
-static void threadpool_list_delete( x264_sync_frame_list_t *slist )
+int x264_threadpool_stats( x264_threadpool_t *pool, x264_threadpool_stats_t *stats, int i_max )
 {
-    for( int i = 0; slist->list[i]; i++ )
-    {
-        x264_free( slist->list[i] );
-        slist->list[i] = NULL;
-    }
-    x264_sync_frame_list_delete( slist );
+    threadpool_core_t *core = pool->core;
+    int i_count = X264_MIN( i_max, core->threads );
+    for( int i = 0; i < i_count; i++ )
+        stats[i] = core->workers[i].stats;
+    return i_count;
 }
 
 void x264_threadpool_delete( x264_threadpool_t *pool )
 {
-    x264_pthread_mutex_lock( &pool->run.mutex );
-    pool->exit = 1;
-    x264_pthread_cond_broadcast( &pool->run.cv_fill );
-    x264_pthread_mutex_unlock( &pool->run.mutex );
-    for( int i = 0; i < pool->threads; i++ )
-        x264_pthread_join( pool->thread_handle[i], NULL );
-
-    threadpool_list_delete( &pool->uninit );
-    threadpool_list_delete( &pool->run );
-    threadpool_list_delete( &pool->done );
-    x264_free( pool->thread_handle );
+    threadpool_core_t *core = pool->core;
+
+    x264_pthread_mutex_lock( &core->mutex );
+    for( x264_threadpool_t **c = &core->clients; *c; c = &(*c)->next )
+        if( *c == pool )
+        {
+            *c = pool->next;
+            break;
+        }
+    int b_last = !--core->i_refcount;
+    x264_pthread_mutex_unlock( &core->mutex );
+    if( b_last )
+        threadpool_core_delete( core );
+
+    /* Jobs still owned by the pool are either unused or finished but never waited for. */
+    for( int i = 0; i < pool->i_uninit; i++ )
+        x264_free( pool->uninit[i] );
+    for( int i = 0; i < pool->i_done; i++ )
+        x264_free( pool->done[i] );
+    x264_free( pool->uninit );
+    x264_free( pool->done );
+    x264_pthread_mutex_destroy( &pool->mutex );
+    x264_pthread_cond_destroy( &pool->cv );
     x264_free( pool );
 }
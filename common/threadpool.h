@@ -26,22 +26,37 @@
 #ifndef X264_THREADPOOL_H
 #define X264_THREADPOOL_H
 
-typedef struct x264_threadpool_t x264_threadpool_t;
+/* per-worker counters, for profiling */
+typedef struct
+{
+    int64_t i_jobs;      /* jobs executed by this worker */
+    int64_t i_steals;    /* jobs taken from another worker's queue */
+    int64_t i_idle_time; /* microseconds spent waiting for work */
+} x264_threadpool_stats_t;
 
+/* A pool is a handle on a set of worker threads. x264_threadpool_init creates new
+ * workers; x264_threadpool_attach creates another handle on the workers of an
+ * existing pool, with room for max_jobs outstanding jobs of its own. The workers
+ * are destroyed along with the last handle using them. */
 #if HAVE_THREAD
-#define x264_threadpool_init x264_template(threadpool_init)
 X264_API int   x264_threadpool_init( x264_threadpool_t **p_pool, int threads );
-#define x264_threadpool_run x264_template(threadpool_run)
+/* the same, with the workers pinned to a NUMA node once when they start */
+int            x264_threadpool_init_numa( x264_threadpool_t **p_pool, int threads, int numa_node );
+X264_API int   x264_threadpool_attach( x264_threadpool_t **p_pool, x264_threadpool_t *shared, int max_jobs );
 X264_API void  x264_threadpool_run( x264_threadpool_t *pool, void *(*func)(void *), void *arg );
-#define x264_threadpool_wait x264_template(threadpool_wait)
 X264_API void *x264_threadpool_wait( x264_threadpool_t *pool, void *arg );
-#define x264_threadpool_delete x264_template(threadpool_delete)
 X264_API void  x264_threadpool_delete( x264_threadpool_t *pool );
+X264_API int   x264_threadpool_threads( x264_threadpool_t *pool );
+X264_API int   x264_threadpool_stats( x264_threadpool_t *pool, x264_threadpool_stats_t *stats, int i_max );
 #else
 #define x264_threadpool_init(p,t) -1
+#define x264_threadpool_init_numa(p,t,n) -1
+#define x264_threadpool_attach(p,s,m) -1
 #define x264_threadpool_run(p,f,a)
 #define x264_threadpool_wait(p,a)     NULL
 #define x264_threadpool_delete(p)
+#define x264_threadpool_threads(p)    1
+#define x264_threadpool_stats(p,s,m)  0
 #endif
 
 #endif
@@ -30,6 +30,8 @@
 #include "me.h"
 #include "ratecontrol.h"
 #include "analyse.h"
+#include "ladder.h"
+#include "analyse_et.h"
 #include "rdo.c"
 
 typedef struct
@@ -158,7 +160,7 @@ static int init_costs( x264_t *h, float *logs, int qp )
     for( int i = 0; i < 3; i++ )
         for( int j = 0; j < 33; j++ )
             h->cost_table->ref[qp][i][j] = i ? X264_MIN( lambda * bs_size_te( i, j ), UINT16_MAX ) : 0;
-    if( h->param.analyse.i_me_method >= X264_ME_ESA && !h->cost_mv_fpel[qp][0] )
+    if( ME_EXHAUSTIVE( h->param.analyse.i_me_method ) && !h->cost_mv_fpel[qp][0] )
     {
         for( int j = 0; j < 4; j++ )
         {
@@ -359,7 +361,7 @@ static void mb_analyse_init( x264_t *h, x264_mb_analysis_t *a, int qp )
                 for( int i = (h->sh.i_type == SLICE_TYPE_B); i >= 0; i-- )
                     for( int j = 0; j < h->i_ref[i]; j++ )
                     {
-                        int completed = x264_frame_cond_wait( h->fref[i][j]->orig, thresh );
+                        int completed = x264_frame_cond_wait( h, h->fref[i][j]->orig, thresh );
                         thread_mvy_range = X264_MIN( thread_mvy_range, completed - pix_y );
                     }
 
@@ -368,7 +370,9 @@ static void mb_analyse_init( x264_t *h, x264_mb_analysis_t *a, int qp )
                 if( PARAM_INTERLACED )
                     thread_mvy_range >>= 1;
 
-                x264_analyse_weight_frame( h, pix_y + thread_mvy_range );
+                /* Sliced threads weight the whole frame before they start. */
+                if( !h->param.b_sliced_threads )
+                    x264_analyse_weight_frame( h, pix_y + thread_mvy_range );
             }
 
             if( PARAM_INTERLACED )
@@ -1239,10 +1243,14 @@ static void intra_rd_refine( x264_t *h, x264_mb_analysis_t *a )
     } \
     else if( CHROMA_FORMAT ) \
         (m)->p_fref[4] = &(src)[4][(xoff)+((yoff)>>CHROMA_V_SHIFT)*(m)->i_stride[1]]; \
-    if( h->param.analyse.i_me_method >= X264_ME_ESA ) \
+    if( ME_EXHAUSTIVE( h->param.analyse.i_me_method ) ) \
         (m)->integral = &h->mb.pic.p_integral[list][ref][(xoff)+(yoff)*(m)->i_stride[0]]; \
     (m)->weight = x264_weight_none; \
     (m)->i_ref = ref; \
+    (m)->fref = h->param.b_lazy_hpel ? h->fref[list][ref] : NULL; \
+    (m)->i_pix_x = 16*h->mb.i_mb_x + (xoff); \
+    (m)->i_pix_y = 16*h->mb.i_mb_y + (yoff); \
+    (m)->pyr = h->param.analyse.i_me_method == X264_ME_PYR ? h->fref[list][ref] : NULL; \
 }
 
 #define LOAD_WPELS(m, src, list, ref, xoff, yoff) \
@@ -1627,6 +1635,7 @@ static ALWAYS_INLINE int mb_analyse_inter_p4x4_chroma_internal( x264_t *h, x264_
     { \
         int mvx = (me).mv[0] + 4*2*x; \
         int mvy = (me).mv[1] + 4*2*y; \
+        x264_mb_hpel_ensure( h, 0, i_ref, mvx, mvy, 2*width, 2*height ); \
         h->mc.mc_luma( &pix1[2*x+2*y*16], 16, &h->mb.pic.p_fref[0][i_ref][4], i_stride, \
                        mvx, mvy, 2*width, 2*height, &h->sh.weight[i_ref][1] ); \
         h->mc.mc_luma( &pix2[2*x+2*y*16], 16, &h->mb.pic.p_fref[0][i_ref][8], i_stride, \
@@ -1804,6 +1813,8 @@ static ALWAYS_INLINE int analyse_bi_chroma( x264_t *h, x264_mb_analysis_t *a, in
 { \
     if( CHROMA444 ) \
     { \
+        x264_me_hpel_ensure( h, &m0, m0.mv[0], m0.mv[1], width, height ); \
+        x264_me_hpel_ensure( h, &m1, m1.mv[0], m1.mv[1], width, height ); \
         h->mc.mc_luma( pix[0], 16, &m0.p_fref[4], m0.i_stride[1], \
                        m0.mv[0], m0.mv[1], width, height, x264_weight_none ); \
         h->mc.mc_luma( pix[1], 16, &m0.p_fref[8], m0.i_stride[2], \
@@ -1976,6 +1987,8 @@ static void mb_analyse_inter_b16x16( x264_t *h, x264_mb_analysis_t *a )
     h->mc.memcpy_aligned( &a->l0.bi16x16, &a->l0.me16x16, sizeof(x264_me_t) );
     h->mc.memcpy_aligned( &a->l1.bi16x16, &a->l1.me16x16, sizeof(x264_me_t) );
     int ref_costs = REF_COST( 0, a->l0.bi16x16.i_ref ) + REF_COST( 1, a->l1.bi16x16.i_ref );
+    x264_me_hpel_ensure( h, &a->l0.bi16x16, a->l0.bi16x16.mv[0], a->l0.bi16x16.mv[1], 16, 16 );
+    x264_me_hpel_ensure( h, &a->l1.bi16x16, a->l1.bi16x16.mv[0], a->l1.bi16x16.mv[1], 16, 16 );
     src0 = h->mc.get_ref( pix0, &stride0,
                           h->mb.pic.p_fref[0][a->l0.bi16x16.i_ref], h->mb.pic.i_stride[0],
                           a->l0.bi16x16.mv[0], a->l0.bi16x16.mv[1], 16, 16, x264_weight_none );
@@ -2243,6 +2256,8 @@ static void mb_analyse_inter_b8x8_mixed_ref( x264_t *h, x264_mb_analysis_t *a )
         }
 
         /* BI mode */
+        x264_me_hpel_ensure( h, &a->l0.me8x8[i], a->l0.me8x8[i].mv[0], a->l0.me8x8[i].mv[1], 8, 8 );
+        x264_me_hpel_ensure( h, &a->l1.me8x8[i], a->l1.me8x8[i].mv[0], a->l1.me8x8[i].mv[1], 8, 8 );
         src[0] = h->mc.get_ref( pix[0], &stride[0], a->l0.me8x8[i].p_fref, a->l0.me8x8[i].i_stride[0],
                                 a->l0.me8x8[i].mv[0], a->l0.me8x8[i].mv[1], 8, 8, x264_weight_none );
         src[1] = h->mc.get_ref( pix[1], &stride[1], a->l1.me8x8[i].p_fref, a->l1.me8x8[i].i_stride[0],
@@ -2325,6 +2340,7 @@ static void mb_analyse_inter_b8x8( x264_t *h, x264_mb_analysis_t *a )
             CP32( lX->mvc[lX->me16x16.i_ref][i+1], m->mv );
 
             /* BI mode */
+            x264_me_hpel_ensure( h, m, m->mv[0], m->mv[1], 8, 8 );
             src[l] = h->mc.get_ref( pix[l], &stride[l], m->p_fref, m->i_stride[0],
                                     m->mv[0], m->mv[1], 8, 8, x264_weight_none );
             i_part_cost_bi += m->cost_mv + m->i_ref_cost;
@@ -2403,6 +2419,8 @@ static void mb_analyse_inter_b16x8( x264_t *h, x264_mb_analysis_t *a, int i_best
         }
 
         /* BI mode */
+        x264_me_hpel_ensure( h, &a->l0.me16x8[i], a->l0.me16x8[i].mv[0], a->l0.me16x8[i].mv[1], 16, 8 );
+        x264_me_hpel_ensure( h, &a->l1.me16x8[i], a->l1.me16x8[i].mv[0], a->l1.me16x8[i].mv[1], 16, 8 );
         src[0] = h->mc.get_ref( pix[0], &stride[0], a->l0.me16x8[i].p_fref, a->l0.me16x8[i].i_stride[0],
                                 a->l0.me16x8[i].mv[0], a->l0.me16x8[i].mv[1], 16, 8, x264_weight_none );
         src[1] = h->mc.get_ref( pix[1], &stride[1], a->l1.me16x8[i].p_fref, a->l1.me16x8[i].i_stride[0],
@@ -2497,6 +2515,8 @@ static void mb_analyse_inter_b8x16( x264_t *h, x264_mb_analysis_t *a, int i_best
         }
 
         /* BI mode */
+        x264_me_hpel_ensure( h, &a->l0.me8x16[i], a->l0.me8x16[i].mv[0], a->l0.me8x16[i].mv[1], 8, 16 );
+        x264_me_hpel_ensure( h, &a->l1.me8x16[i], a->l1.me8x16[i].mv[0], a->l1.me8x16[i].mv[1], 8, 16 );
         src[0] = h->mc.get_ref( pix[0], &stride[0], a->l0.me8x16[i].p_fref, a->l0.me8x16[i].i_stride[0],
                                 a->l0.me8x16[i].mv[0], a->l0.me8x16[i].mv[1], 8, 16, x264_weight_none );
         src[1] = h->mc.get_ref( pix[1], &stride[1], a->l1.me8x16[i].p_fref, a->l1.me8x16[i].i_stride[0],
@@ -2912,6 +2932,68 @@ static inline void mb_analyse_qp_rd( x264_t *h, x264_mb_analysis_t *a )
     }
 }
 
+/* --et-model: P-mbs are binned by what is known once the 16x16 search is done, and trained
+ * tables (analyse_et.h, made by tools/et_train.py from --dump-et statistics) give the chance
+ * that the full analysis would pick a sub-16x16 partition or an intra mode. */
+enum { ET_TOTAL, ET_SUB, ET_INTRA };
+
+static int mb_analyse_et_cell( x264_t *h, x264_mb_analysis_t *a )
+{
+    int qp = x264_clip3( (h->mb.i_qp - QP_BD_OFFSET - 14) / 6, 0, ET_QP_BINS-1 );
+
+    /* The 16x16 cost in units of lambda, which takes out most of the qp dependency. */
+    int cost = a->l0.me16x16.cost / a->i_lambda;
+    cost = x264_clip3( 26 - x264_clz( cost + 1 ), 0, ET_COST_BINS-1 );
+
+    /* How many of the left and top neighbours were split, and how many were intra. */
+    int split = 0, intra = 0;
+    int type[2] = { h->mb.i_mb_type_left[0], h->mb.i_mb_type_top };
+    int xy[2] = { h->mb.i_mb_left_xy[0], h->mb.i_mb_top_xy };
+    for( int i = 0; i < 2; i++ )
+        if( type[i] >= 0 )
+        {
+            intra += IS_INTRA( type[i] );
+            split += !IS_INTRA( type[i] ) && h->mb.partition[xy[i]] != D_16x16;
+        }
+    int nb = split + intra * (7 - intra) / 2;
+
+    /* How the lookahead's inter cost compares to its intra cost, if it measured this reference. */
+    int lowres = ET_LOWRES_BINS-1;
+    int dist = h->fenc->i_frame - h->fref[0][0]->i_frame;
+    if( h->frames.b_have_lowres && dist > 0 && dist <= h->param.i_bframe+1 && h->fenc->i_cost_est[dist][0] >= 0 )
+    {
+        int lcost = h->fenc->lowres_costs[dist][0][h->mb.i_mb_xy];
+        int icost = h->fenc->i_intra_cost[h->mb.i_mb_xy];
+        if( !(lcost >> LOWRES_COST_SHIFT) )
+            lowres = ET_LOWRES_BINS-2;
+        else
+            lowres = X264_MIN( 4 * (lcost & LOWRES_COST_MASK) / (icost + 1), ET_LOWRES_BINS-3 );
+    }
+
+    return ((qp * ET_COST_BINS + cost) * ET_NB_BINS + nb) * ET_LOWRES_BINS + lowres;
+}
+
+void x264_analyse_et_dump( x264_t *h )
+{
+    FILE *f = x264_fopen( h->param.psz_dump_et, "w" );
+    if( !f )
+    {
+        x264_log( h, X264_LOG_ERROR, "dump_et: can't write to %s\n", h->param.psz_dump_et );
+        return;
+    }
+    fprintf( f, "#x264-et qp=%d cost=%d nb=%d lowres=%d\n", ET_QP_BINS, ET_COST_BINS, ET_NB_BINS, ET_LOWRES_BINS );
+    for( int cell = 0; cell < ET_CELLS; cell++ )
+    {
+        uint32_t n[3] = {0};
+        for( int i = 0; i < h->param.i_threads; i++ )
+            for( int j = 0; j < 3; j++ )
+                n[j] += h->thread[i]->et_stats[cell][j];
+        if( n[ET_TOTAL] )
+            fprintf( f, "%d %u %u %u\n", cell, n[ET_TOTAL], n[ET_SUB], n[ET_INTRA] );
+    }
+    fclose( f );
+}
+
 /*****************************************************************************
  * x264_macroblock_analyse:
  *****************************************************************************/
@@ -3028,10 +3110,12 @@ skip_analysis:
         }
         else
         {
-            const unsigned int flags = h->param.analyse.inter;
+            unsigned int flags = h->param.analyse.inter;
             int i_type;
             int i_partition;
             int i_satd_inter, i_satd_intra;
+            int et_cell = -1;
+            int b_try_intra = 1;
 
             mb_analyse_load_costs( h, &analysis );
 
@@ -3044,6 +3128,15 @@ skip_analysis:
                 return;
             }
 
+            if( (h->et_stats || h->param.analyse.b_et_model) && !analysis.b_force_intra )
+                et_cell = mb_analyse_et_cell( h, &analysis );
+            if( h->param.analyse.b_et_model && et_cell >= 0 )
+            {
+                if( et_prob[ET_SUB-1][et_cell] < ET_SUB_THRESH )
+                    flags &= ~(X264_ANALYSE_PSUB16x16|X264_ANALYSE_PSUB8x8);
+                b_try_intra = et_prob[ET_INTRA-1][et_cell] >= ET_INTRA_THRESH;
+            }
+
             if( flags & X264_ANALYSE_PSUB16x16 )
             {
                 if( h->param.analyse.b_mixed_references )
@@ -3178,7 +3271,8 @@ skip_analysis:
                 }
             }
 
-            if( h->mb.b_chroma_me )
+            /* when the intra modes are skipped their costs stay at COST_MAX */
+            if( b_try_intra && h->mb.b_chroma_me )
             {
                 if( CHROMA444 )
                 {
@@ -3194,7 +3288,7 @@ skip_analysis:
                 analysis.i_satd_i8x8   += analysis.i_satd_chroma;
                 analysis.i_satd_i4x4   += analysis.i_satd_chroma;
             }
-            else
+            else if( b_try_intra )
                 mb_analyse_intra( h, &analysis, i_cost );
 
             i_satd_inter = i_cost;
@@ -3225,6 +3319,13 @@ skip_analysis:
 
             h->mb.i_type = i_type;
 
+            if( h->et_stats && et_cell >= 0 )
+            {
+                h->et_stats[et_cell][ET_TOTAL]++;
+                h->et_stats[et_cell][ET_SUB] += i_type == P_8x8 || (i_type == P_L0 && h->mb.i_partition != D_16x16);
+                h->et_stats[et_cell][ET_INTRA] += IS_INTRA( i_type );
+            }
+
             if( analysis.b_force_intra && !IS_INTRA(i_type) )
             {
                 /* Intra masking: copy fdec to fenc and re-encode the block as intra in order to make it appear as if
@@ -3869,7 +3970,7 @@ static void analyse_update_cache( x264_t *h, x264_mb_analysis_t *a  )
             int ref = h->mb.cache.ref[l][x264_scan8[0]];
             if( ref < 0 )
                 continue;
-            completed = x264_frame_cond_wait( h->fref[l][ ref >> MB_INTERLACED ]->orig, -1 );
+            completed = x264_frame_cond_wait( h, h->fref[l][ ref >> MB_INTERLACED ]->orig, -1 );
             if( (h->mb.cache.mv[l][x264_scan8[15]][1] >> (2 - MB_INTERLACED)) + h->mb.i_mb_y*16 > completed )
             {
                 x264_log( h, X264_LOG_WARNING, "internal error (MV out of thread range)\n");
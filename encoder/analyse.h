@@ -35,11 +35,22 @@ void x264_analyse_free_costs( x264_t *h );
 void x264_analyse_weight_frame( x264_t *h, int end );
 #define x264_macroblock_analyse x264_template(macroblock_analyse)
 void x264_macroblock_analyse( x264_t *h );
+#define x264_analyse_et_dump x264_template(analyse_et_dump)
+void x264_analyse_et_dump( x264_t *h );
+
+/* Feature cells of the --et-model early termination model, see mb_analyse_et_cell. */
+#define ET_QP_BINS     4
+#define ET_COST_BINS   8
+#define ET_NB_BINS     6
+#define ET_LOWRES_BINS 6
+#define ET_CELLS (ET_QP_BINS * ET_COST_BINS * ET_NB_BINS * ET_LOWRES_BINS)
 #define x264_slicetype_decide x264_template(slicetype_decide)
 void x264_slicetype_decide( x264_t *h );
 
 #define x264_slicetype_analyse x264_template(slicetype_analyse)
 void x264_slicetype_analyse( x264_t *h, int intra_minigop );
+#define x264_slicetype_estimate x264_template(slicetype_estimate)
+void x264_slicetype_estimate( x264_t *h, x264_frame_t *prev, x264_frame_t *frame );
 
 #define x264_lookahead_init x264_template(lookahead_init)
 int  x264_lookahead_init( x264_t *h, int i_slicetype_length );
@@ -0,0 +1,186 @@
+/*****************************************************************************
+ * analyse_et.h: early termination model tables
+ *****************************************************************************
+ * Copyright (C) 2003-2022 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+/* Generated by tools/et_train.py --sub-miss 0.02 --intra-miss 0.005 from x264 --preset
+ * medium --crf 18/23/28 --dump-et on two synthetic 352x288 clips, 120 and 75 frames (66220
+ * P-mbs), do not edit. */
+
+#if ET_QP_BINS != 4 || ET_COST_BINS != 8 || ET_NB_BINS != 6 || ET_LOWRES_BINS != 6
+#error "analyse_et.h was trained with different feature bins"
+#endif
+
+#define ET_SUB_THRESH   4
+#define ET_INTRA_THRESH 21
+
+/* [sub-16x16 partition, intra][cell]: chance of winning, out of 255 */
+static const uint8_t et_prob[2][ET_CELLS] =
+{
+    {
+          2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,
+          2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,
+          2,   2,   2,   2,  32,  32,  32,  32,  32,  32,  32,  32,  32,  32,  32,  32,
+         32,  32,  32,  32,  32,  32,  32,  32,  32,  32,  32,  32,  32,  32,  32,  32,
+         32,  32,  32,  32,  32,  32,  32,  32,  10,  10,  10,  10,  10,  10,  10,  10,
+         10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,
+         10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  53,  53,  53,  53,
+         53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,
+         53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,  53,
+         85,  92,  85,  85,  85,  85,  77,  81,  62,  77,  77,  77, 104, 104, 104, 104,
+        104, 104,  63,  68,  49,  63,  63,  63,  72,  87,  53,  72,  72,  72,  25,  30,
+         25,  25,  25,  25,  18,  18,  18,  18,  18,  18,  18,  18,  18,  18,  18,  18,
+         18,  18,  18,  18,  18,  18,  18,  18,  18,  18,  18,  18,  18,  18,  18,  18,
+         18,  18,  18,  18,  18,  18,  18,  18,  16,  16,  16,  16,  16,  16,  16,  16,
+         16,  16,  16,  16,  16,  16,  16,  16,  16,  16,  16,  16,  16,  16,  16,  16,
+         16,  16,  16,  16,  16,  16,  16,  16,  16,  16,  16,  16,   7,   7,   7,   7,
+          7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,
+          7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,
+          2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,
+          2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,
+          2,   2,   2,   2,  40,  42,  42,  42,  66,  42, 139, 133, 133, 133, 133, 133,
+         55,  55,  55,  55,  55,  55,  55,  55,  55,  55,  55,  55,  55,  55,  55,  55,
+         55,  55,  55,  55,  55,  55,  55,  55, 105,  33,  82,  82,  82,  82, 169, 138,
+        138, 138, 138, 138,  93,  93,  93,  93,  93,  93,  93,  93,  93,  93,  93,  93,
+         93,  93,  93,  93,  93,  93,  93,  93,  93,  93,  93,  93,  91,  77,  70,  76,
+         76,  76,  86,  95,  86,  91,  91,  91, 106, 111, 106, 106, 106, 106,  46,  46,
+         46,  46,  46,  46,  33,  33,  33,  33,  33,  33,  15,  15,  45,  10,   5,  15,
+        132, 124,  96, 122, 122, 122, 132, 124, 108, 121, 121, 121, 120, 122, 120, 120,
+        120, 120,  66,  87,  52,  18,   7,  66,  83, 100,  45,  83,  83,  83,  18,  45,
+         18,  18,   0,  18,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+          1,   1,   1,   1,   1,   1,   5,   5,   5,   5,   5,   5,   1,   1,   1,   1,
+          1,   1,   0,   0,   0,   1,   1,   0,   2,   2,   2,   2,   2,   2,   2,   2,
+          2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   9,   9,   9,   8,   5,   9,
+          2,   2,   2,   2,   2,   2,   1,   1,   2,   0,   2,   1,   7,   7,   7,   7,
+          7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,
+          7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,
+          4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,
+          4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,   4,
+          4,   4,   4,   4,  23,   2,  21,  21,  21,  21,  22,  22,  22,  22,  22,  22,
+         22,  22,  22,  22,  22,  22,  22,  22,  22,  22,  22,  22,  22,  22,  22,  22,
+         22,  22,  22,  22,  22,  22,  22,  22,   2,   2,   4,  10,  22,   3,  25,  17,
+         25,  25,  25,  25,   4,   4,   4,   4,   4,   4,  20,  20,  20,  20,  20,  20,
+          4,   4,   4,   4,   4,   4,   5,   5,  13,   6,   2,   5,  21,  28,  27,  28,
+         48,  28,  72,  46,  37,  49,  49,  49, 113,  99, 113, 113, 113, 113,  23,  23,
+         23,  23,  16,  23,  30,  30,  30,  30,  30,  30,   4,   4,  33,   1,   0,   4,
+         17,  17,  17,  17,  17,  17,  17,  17,  17,  17,  17,  17,  17,  17,  17,  17,
+         17,  17,  25,  25,  25,  46,   7,  25,  70,  70,  70,  70,  70,  70,   5,   5,
+          5,   5,   3,   5,  43,  43,  43,  28,  43,  43,  61,  61,  61,  61,  61,  61,
+          7,   7,   7,   7,   7,   7,  17,  17,  17,  16,  12,  17,  58,  58,  58,  49,
+         57,  58,   1,   1,   1,   1,   1,   1,  41,  41,  41,  41,  41,  41,  74,  74,
+         74,  74,  74,  74,  29,  29,  29,  29,  29,  29,  31,  31,  31,  30,  24,  31,
+         55,  55,  55,  67,  41,  55,  21,  21, 118,  29,  14,  21,  40,  40,  40,  40,
+         44,  40,  28,  28,  28,  28,  31,  28,   7,   7,   7,   7,   7,   7,  11,  11,
+         11,  12,  11,  11,  28,  28,  28,  24,  30,  28,   4,   4,   4,   2,   4,   4,
+          2,   1,   1,   1,   2,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+          1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,   1,
+          1,   1,   1,   1,   9,   4,   7,   7,   7,   7,  10,  10,  10,  10,  10,  10,
+         10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,  10,
+         10,  10,   4,   4,   4,   4,   4,   4,   1,   3,   4,   4,   4,   4,   6,   6,
+          6,   6,   6,   6,   6,   6,   6,   6,   6,   6,  19,  19,  19,  19,   9,  19,
+         43,  43,  43,  43,  43,  43,   3,   3,  17,   2,   0,   3,  34,  34,  34,  34,
+         34,  34,  34,  34,  34,  34,  34,  34,  34,  34,  34,  34,  34,  34,  32,  32,
+         32,  32,   7,  32, 105, 105, 105, 105, 105, 105,  11,  11,  11,  16,   3,  11,
+         76,  76,  76,  75,  77,  76,  99,  99,  99,  97,  96,  99,  87,  87,  87,  87,
+         87,  87,  31,  31,  76,  33,  19,  31,  60,  60,  87,  54,  55,  60,   8,   8,
+         19,   9,   6,   8,  72,  72,  72,  72,  79,  72,  73,  73,  73,  99,  61,  73,
+         89,  89,  89,  89,  74,  89,  32,  32,  32,  39,  25,  32,  43,  43,  43,  48,
+         36,  43,  19,  19, 136,  28,  15,  19,  49,  49,  49,  49,  49,  49,  66,  66,
+         66,  66,  70,  66,  60,  60,  60,  60,  60,  60,  22,  22,  22,  26,  20,  22,
+         26,  26,  26,  26,  24,  26,   9,   9,   9,  14,   7,   9,   7,   7,   7,   7,
+          7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,
+          7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,   7,
+    },
+    {
+          0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+          0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+          0,   0,   0,   0,  14,  14,  14,  14,  14,  14,  14,  14,  14,  14,  14,  14,
+         14,  14,  14,  14,  14,  14,  14,  14,  14,  14,  14,  14,  14,  14,  14,  14,
+         14,  14,  14,  14,  14,  14,  14,  14,  49,  49,  49,  49,  49,  49,  49,  49,
+         49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,
+         49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  65,  65,  65,  65,
+         65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,
+         65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,  65,
+         98,  89,  98,  98,  98,  98,  99,  92, 126,  99,  99,  99,  73,  72,  73,  73,
+         73,  73, 135, 112, 180, 135, 135, 135, 126,  99, 158, 126, 126, 126, 179, 174,
+        179, 179, 179, 179, 220, 220, 220, 220, 220, 220, 220, 220, 220, 220, 220, 220,
+        220, 220, 220, 220, 220, 220, 220, 220, 220, 220, 220, 220, 220, 220, 220, 220,
+        220, 220, 220, 220, 220, 220, 220, 220, 228, 228, 228, 228, 228, 228, 228, 228,
+        228, 228, 228, 228, 228, 228, 228, 228, 228, 228, 228, 228, 228, 228, 228, 228,
+        228, 228, 228, 228, 228, 228, 228, 228, 228, 228, 228, 228, 246, 246, 246, 246,
+        246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246,
+        246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246,
+          0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+          0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+          0,   0,   0,   0,   0,   0,   0,   0,   1,   0,   1,   1,   1,   1,   1,   1,
+          0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+          0,   0,   0,   0,   0,   0,   0,   0,   1,   7,   3,   3,   3,   3,   2,   1,
+          1,   1,   1,   1,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,
+          2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   2,   1,   2,  18,   5,
+          5,   5,   1,   1,  19,   6,   6,   6,   6,   1,   6,   6,   6,   6, 103, 103,
+        103, 103, 103, 103, 172, 172, 172, 172, 172, 172, 231, 231, 191, 240, 248, 231,
+          1,  21,  57,  23,  23,  23,   4,  25,  63,  28,  28,  28,  32,  27,  31,  31,
+         31,  31, 121,  71, 162, 237, 233, 121,  86,  50, 159,  86,  86,  86, 214, 140,
+        214, 214, 255, 214, 189, 189, 189, 189, 189, 189, 189, 189, 189, 189, 189, 189,
+        189, 189, 189, 189, 189, 189, 104, 104, 104, 104, 104, 104, 189, 189, 189, 189,
+        189, 189, 248, 248, 248, 232, 254, 248, 250, 250, 250, 250, 250, 250, 250, 250,
+        250, 250, 250, 250, 250, 250, 250, 250, 250, 250, 227, 227, 227, 226, 243, 227,
+        250, 250, 250, 250, 250, 250, 254, 254, 253, 255, 253, 254, 246, 246, 246, 246,
+        246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246,
+        246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246,
+          0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+          0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+          0,   0,   0,   0,   0,   2,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+          0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+          0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   1,   7,  26,   1,  19,   2,
+         19,  19,  19,  19,  25,  25,  25,  25,  25,  25, 199, 199, 199, 199, 199, 199,
+         25,  25,  25,  25,  25,  25, 236, 236, 204, 230, 252, 236,   1,   0,   9,   3,
+         34,   3,   2,   0,   5,  10,  10,  10,  16,   2,  16,  16,  16,  16, 203, 203,
+        203, 203, 228, 203,  64,  64,  64,  64,  64,  64, 247, 247, 205, 250, 253, 247,
+        210, 210, 210, 210, 210, 210, 210, 210, 210, 210, 210, 210, 210, 210, 210, 210,
+        210, 210, 184, 184, 184, 144, 226, 184, 109, 109, 109, 109, 109, 109, 242, 242,
+        242, 242, 247, 242, 156, 156, 156, 176, 156, 156, 120, 120, 120, 120, 120, 120,
+        237, 237, 237, 237, 237, 237, 200, 200, 200, 195, 219, 200, 144, 144, 144, 131,
+        169, 144, 252, 252, 251, 252, 252, 252, 164, 164, 164, 164, 164, 164, 126, 126,
+        126, 126, 126, 126, 197, 197, 197, 197, 197, 197, 184, 184, 184, 198, 201, 184,
+        165, 165, 165, 162, 182, 165, 210, 210,  71, 198, 221, 210, 208, 208, 208, 208,
+        204, 208, 221, 221, 221, 221, 217, 221, 246, 246, 246, 246, 246, 246, 242, 242,
+        242, 243, 241, 242, 227, 227, 227, 231, 225, 227, 251, 251, 251, 253, 250, 251,
+          0,   0,   0,   0,   2,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+          0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+          0,   0,   0,   0,   1,   0,   3,   3,   3,   3,  49,  49,  49,  49,  49,  49,
+         49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,  49,
+         49,  49, 239, 239, 239, 239, 239, 239,   1,   0,   1,   4,   4,   4, 114, 114,
+        114, 114, 114, 114, 114, 114, 114, 114, 114, 114, 201, 201, 201, 201, 232, 201,
+        178, 178, 178, 178, 178, 178, 244, 244, 207, 247, 254, 244, 189, 189, 189, 189,
+        189, 189, 189, 189, 189, 189, 189, 189, 189, 189, 189, 189, 189, 189, 193, 193,
+        193, 193, 234, 193,  96,  96,  96,  96,  96,  96, 236, 236, 236, 223, 250, 236,
+         85,  85,  85,  89,  99,  85,  72,  72,  72,  84,  77,  72,  55,  55,  55,  55,
+         55,  55, 191, 191, 120, 187, 218, 191, 161, 161, 119, 171, 174, 161, 237, 237,
+        213, 234, 244, 237, 144, 144, 144, 144, 159, 144, 137, 137, 137, 113, 163, 137,
+        132, 132, 132, 132, 147, 132, 205, 205, 205, 194, 219, 205, 186, 186, 186, 176,
+        199, 186, 222, 222,  55, 206, 229, 222, 199, 199, 199, 199, 201, 199, 181, 181,
+        181, 181, 177, 181, 177, 177, 177, 177, 177, 177, 227, 227, 227, 222, 230, 227,
+        225, 225, 225, 226, 227, 225, 244, 244, 244, 240, 245, 244, 246, 246, 246, 246,
+        246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246,
+        246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246, 246,
+    },
+};
@@ -25,6 +25,8 @@
  *****************************************************************************/
 
 #include "common/base.h"
+#include "common/threadpool.h"
+#include "ladder.h"
 
 /****************************************************************************
  * global symbols
@@ -40,8 +42,10 @@ int  x264_8_encoder_encode( x264_t *, x264_nal_t **pp_nal, int *pi_nal, x264_pic
 void x264_8_encoder_close( x264_t * );
 int  x264_8_encoder_delayed_frames( x264_t * );
 int  x264_8_encoder_maximum_delayed_frames( x264_t * );
+int64_t x264_8_encoder_resident_memory( x264_t * );
 void x264_8_encoder_intra_refresh( x264_t * );
 int  x264_8_encoder_invalidate_reference( x264_t *, int64_t pts );
+int  x264_8_encoder_estimate( x264_t *, const float *f_crf, int i_crf, double *p_bits, double *p_seconds );
 
 x264_t *x264_10_encoder_open( x264_param_t *, void * );
 void x264_10_nal_encode( x264_t *h, uint8_t *dst, x264_nal_t *nal );
@@ -52,8 +56,10 @@ int  x264_10_encoder_encode( x264_t *, x264_nal_t **pp_nal, int *pi_nal, x264_pi
 void x264_10_encoder_close( x264_t * );
 int  x264_10_encoder_delayed_frames( x264_t * );
 int  x264_10_encoder_maximum_delayed_frames( x264_t * );
+int64_t x264_10_encoder_resident_memory( x264_t * );
 void x264_10_encoder_intra_refresh( x264_t * );
 int  x264_10_encoder_invalidate_reference( x264_t *, int64_t pts );
+int  x264_10_encoder_estimate( x264_t *, const float *f_crf, int i_crf, double *p_bits, double *p_seconds );
 
 typedef struct x264_api_t
 {
@@ -69,8 +75,10 @@ typedef struct x264_api_t
     void (*encoder_close)( x264_t * );
     int  (*encoder_delayed_frames)( x264_t * );
     int  (*encoder_maximum_delayed_frames)( x264_t * );
+    int64_t (*encoder_resident_memory)( x264_t * );
     void (*encoder_intra_refresh)( x264_t * );
     int  (*encoder_invalidate_reference)( x264_t *, int64_t pts );
+    int  (*encoder_estimate)( x264_t *, const float *f_crf, int i_crf, double *p_bits, double *p_seconds );
 } x264_api_t;
 
 REALIGN_STACK x264_t *x264_encoder_open( x264_param_t *param )
@@ -89,8 +97,10 @@ REALIGN_STACK x264_t *x264_encoder_open( x264_param_t *param )
         api->encoder_close = x264_8_encoder_close;
         api->encoder_delayed_frames = x264_8_encoder_delayed_frames;
         api->encoder_maximum_delayed_frames = x264_8_encoder_maximum_delayed_frames;
+        api->encoder_resident_memory = x264_8_encoder_resident_memory;
         api->encoder_intra_refresh = x264_8_encoder_intra_refresh;
         api->encoder_invalidate_reference = x264_8_encoder_invalidate_reference;
+        api->encoder_estimate = x264_8_encoder_estimate;
 
         api->x264 = x264_8_encoder_open( param, api );
     }
@@ -104,8 +114,10 @@ REALIGN_STACK x264_t *x264_encoder_open( x264_param_t *param )
         api->encoder_close = x264_10_encoder_close;
         api->encoder_delayed_frames = x264_10_encoder_delayed_frames;
         api->encoder_maximum_delayed_frames = x264_10_encoder_maximum_delayed_frames;
+        api->encoder_resident_memory = x264_10_encoder_resident_memory;
         api->encoder_intra_refresh = x264_10_encoder_intra_refresh;
         api->encoder_invalidate_reference = x264_10_encoder_invalidate_reference;
+        api->encoder_estimate = x264_10_encoder_estimate;
 
         api->x264 = x264_10_encoder_open( param, api );
     }
@@ -179,6 +191,13 @@ REALIGN_STACK int x264_encoder_maximum_delayed_frames( x264_t *h )
     return api->encoder_maximum_delayed_frames( api->x264 );
 }
 
+REALIGN_STACK int64_t x264_encoder_resident_memory( x264_t *h )
+{
+    x264_api_t *api = (x264_api_t *)h;
+
+    return api->encoder_resident_memory( api->x264 );
+}
+
 REALIGN_STACK void x264_encoder_intra_refresh( x264_t *h )
 {
     x264_api_t *api = (x264_api_t *)h;
@@ -192,3 +211,40 @@ REALIGN_STACK int x264_encoder_invalidate_reference( x264_t *h, int64_t pts )
 
     return api->encoder_invalidate_reference( api->x264, pts );
 }
+
+REALIGN_STACK int x264_encoder_estimate( x264_t *h, const float *f_crf, int i_crf, double *p_bits, double *p_seconds )
+{
+    x264_api_t *api = (x264_api_t *)h;
+
+    return api->encoder_estimate( api->x264, f_crf, i_crf, p_bits, p_seconds );
+}
+
+REALIGN_STACK x264_threadpool_t *x264_threadpool_open( int i_threads )
+{
+    x264_threadpool_t *pool = NULL;
+    if( i_threads <= 0 )
+        i_threads = x264_cpu_num_processors();
+    if( x264_threadpool_init( &pool, i_threads ) )
+        return NULL;
+    return pool;
+}
+
+REALIGN_STACK void x264_threadpool_close( x264_threadpool_t *pool )
+{
+    if( pool )
+        x264_threadpool_delete( pool );
+}
+
+REALIGN_STACK x264_ladder_t *x264_ladder_open( void )
+{
+    x264_ladder_t *ladder = NULL;
+    if( x264_ladder_init( &ladder ) )
+        return NULL;
+    return ladder;
+}
+
+REALIGN_STACK void x264_ladder_close( x264_ladder_t *ladder )
+{
+    if( ladder )
+        x264_ladder_delete( ladder );
+}
@@ -32,6 +32,7 @@
 #include "ratecontrol.h"
 #include "macroblock.h"
 #include "me.h"
+#include "ladder.h"
 #if HAVE_INTEL_DISPATCHER
 #include "extras/intel_dispatcher.h"
 #endif
@@ -73,16 +74,432 @@ static double calc_ssim_db( double ssim )
 
 static int threadpool_wait_all( x264_t *h )
 {
-    for( int i = 0; i < h->param.i_threads; i++ )
-        if( h->thread[i]->b_thread_active )
+    for( int i = 0; i < h->param.i_slice_threads; i++ )
+        if( h->slice_thread[i]->b_thread_active )
         {
-            h->thread[i]->b_thread_active = 0;
-            if( (intptr_t)x264_threadpool_wait( h->threadpool, h->thread[i] ) < 0 )
+            h->slice_thread[i]->b_thread_active = 0;
+            if( (intptr_t)x264_threadpool_wait( h->threadpool, h->slice_thread[i] ) < 0 )
                 return -1;
         }
     return 0;
 }
 
+/* The frame threads come first in h->thread[], followed by the contexts encoding
+ * the other slices of each of their frames. Returns the frame thread of context i. */
+static int thread_frame_idx( x264_t *h, int i )
+{
+    return i < h->i_thread_frames ? i : (i - h->i_thread_frames) / (h->param.i_slice_threads - 1);
+}
+
+/* Wavefront: the slice_thread contexts other than [0] analyse and encode the rows of the
+ * frame, each row lagging WAVEFRONT_LAG macroblocks behind the one above so that all its
+ * neighbours are done, while slice_thread[0] writes the slice in order from their records. */
+#define WAVEFRONT_LAG 2
+#define WAVEFRONT_INDEX_SIZE (offsetof(x264_t, mb.base) - offsetof(x264_t, mb.i_mb_x))
+#define WAVEFRONT_VALUE_SIZE (offsetof(x264_t, mb.pic) - offsetof(x264_t, mb.i_type))
+#define WAVEFRONT_CACHE_SIZE (offsetof(x264_t, mb.i_last_qp) - offsetof(x264_t, mb.cache))
+
+typedef struct
+{
+    ALIGNED_64( uint8_t dct[sizeof(((x264_t*)0)->dct)] );
+    ALIGNED_64( pixel fenc_buf[48*FENC_STRIDE] ); /* I_PCM only */
+    uint8_t index[WAVEFRONT_INDEX_SIZE];
+    uint8_t value[WAVEFRONT_VALUE_SIZE];
+    uint8_t cache[WAVEFRONT_CACHE_SIZE];
+} wavefront_mb_t;
+
+struct x264_wavefront_t
+{
+    x264_pthread_mutex_t mutex;
+    x264_pthread_cond_t  cv;
+    int i_next_row;         /* next row to hand out to a row thread */
+    int i_rows_written;     /* rows slice_write is done with */
+    int b_abort;
+    int b_deblock;          /* compute the deblock strengths along with the macroblocks */
+    int *i_mbs_done;        /* macroblocks done in each row */
+    int i_writer_done;      /* slice_write's copy of i_mbs_done for the row it's writing */
+
+    /* The rows in flight, indexed by mb_y % i_ring. */
+    int i_ring;
+    wavefront_mb_t *mb;
+    uint8_t (*cabac_state)[1024];
+};
+
+static int wavefront_init( x264_t *h )
+{
+    x264_wavefront_t *wf;
+    CHECKED_MALLOCZERO( wf, sizeof(x264_wavefront_t) );
+    for( int i = 0; i < h->param.i_threads; i++ )
+        h->thread[i]->wavefront = wf;
+    /* One row per row thread, plus the one being written and the one it has to keep. */
+    wf->i_ring = h->param.i_slice_threads + 1;
+    CHECKED_MALLOCZERO( wf->i_mbs_done, h->mb.i_mb_height * sizeof(int) );
+    CHECKED_MALLOC( wf->mb, wf->i_ring * h->mb.i_mb_width * sizeof(wavefront_mb_t) );
+    CHECKED_MALLOC( wf->cabac_state, wf->i_ring * sizeof(*wf->cabac_state) );
+    if( x264_pthread_mutex_init( &wf->mutex, NULL ) || x264_pthread_cond_init( &wf->cv, NULL ) )
+        goto fail;
+    return 0;
+fail:
+    return -1;
+}
+
+static void wavefront_free( x264_t *h )
+{
+    x264_wavefront_t *wf = h->wavefront;
+    if( !wf )
+        return;
+    x264_pthread_mutex_destroy( &wf->mutex );
+    x264_pthread_cond_destroy( &wf->cv );
+    x264_free( wf->i_mbs_done );
+    x264_free( wf->mb );
+    x264_free( wf->cabac_state );
+    x264_free( wf );
+}
+
+/* Returns the number of macroblocks done in row i_mb_y once there are at least i_mbs,
+ * or -1 if the frame was aborted. */
+static int wavefront_wait( x264_wavefront_t *wf, int i_mb_y, int i_mbs )
+{
+    x264_pthread_mutex_lock( &wf->mutex );
+    while( wf->i_mbs_done[i_mb_y] < i_mbs && !wf->b_abort )
+        x264_pthread_cond_wait( &wf->cv, &wf->mutex );
+    int done = wf->b_abort ? -1 : wf->i_mbs_done[i_mb_y];
+    x264_pthread_mutex_unlock( &wf->mutex );
+    return done;
+}
+
+static void wavefront_row( x264_t *h, int i_mb_y )
+{
+    x264_wavefront_t *wf = h->wavefront;
+    int i_mb_width = h->mb.i_mb_width;
+    int i_above = i_mb_y ? 0 : i_mb_width;
+    wavefront_mb_t *rec = &wf->mb[(i_mb_y % wf->i_ring) * i_mb_width];
+
+    /* The quantizer is predicted from the start of the row, and so are the frame stats
+     * that analysis looks at, so that the row's decisions don't depend on which thread
+     * encoded the rows before it. */
+    h->mb.i_last_qp = h->sh.i_qp;
+    h->mb.i_last_dqp = 0;
+    h->mb.i_mb_prev_xy = -1;
+    memset( h->stat.frame.i_mb_count, 0, sizeof(h->stat.frame.i_mb_count) );
+
+    for( int i_mb_x = 0; i_mb_x < i_mb_width; i_mb_x++, rec++ )
+    {
+        int i_needed = X264_MIN( i_mb_x + WAVEFRONT_LAG, i_mb_width );
+        if( i_above < i_needed && (i_above = wavefront_wait( wf, i_mb_y - 1, i_needed )) < 0 )
+            return;
+
+        /* As in WPP, carry the CABAC contexts down from the start of the row above:
+         * they stand in for the ones slice_write will have for RD. */
+        if( !i_mb_x )
+        {
+            if( i_mb_y )
+                memcpy( h->cabac.state, wf->cabac_state[(i_mb_y-1) % wf->i_ring], sizeof(h->cabac.state) );
+            else
+                x264_cabac_context_init( h, &h->cabac, h->sh.i_type, x264_clip3( h->sh.i_qp-QP_BD_OFFSET, 0, 51 ), h->sh.i_cabac_init_idc );
+        }
+
+        x264_macroblock_cache_load_progressive( h, i_mb_x, i_mb_y );
+        int64_t stage_start = x264_stage_start( h );
+        x264_macroblock_analyse( h );
+        x264_stage_end( h, X264_STAGE_ANALYSE, stage_start );
+        stage_start = x264_stage_start( h );
+        x264_macroblock_encode( h );
+        x264_stage_end( h, X264_STAGE_ENCODE, stage_start );
+
+        memcpy( rec->index, &h->mb.i_mb_x, WAVEFRONT_INDEX_SIZE );
+        memcpy( rec->value, &h->mb.i_type, WAVEFRONT_VALUE_SIZE );
+        memcpy( rec->cache, &h->mb.cache, WAVEFRONT_CACHE_SIZE );
+        memcpy( rec->dct, &h->dct, sizeof(rec->dct) );
+        if( h->mb.i_type == I_PCM )
+            memcpy( rec->fenc_buf, h->mb.pic.fenc_buf, sizeof(rec->fenc_buf) );
+
+        /* Write the macroblock into scratch space, only to update the contexts. */
+        x264_cabac_encode_init( &h->cabac, h->out.p_bitstream, h->out.p_bitstream + h->out.i_bitstream );
+        if( IS_SKIP( h->mb.i_type ) )
+            x264_cabac_mb_skip( h, 1 );
+        else
+        {
+            if( h->sh.i_type != SLICE_TYPE_I )
+                x264_cabac_mb_skip( h, 0 );
+            x264_macroblock_write_cabac( h, &h->cabac );
+        }
+
+        x264_macroblock_cache_save( h );
+        h->stat.frame.i_mb_count[h->mb.i_type]++;
+        if( wf->b_deblock )
+            x264_macroblock_deblock_strength( h );
+
+        if( i_mb_x == X264_MIN( WAVEFRONT_LAG, i_mb_width ) - 1 )
+            memcpy( wf->cabac_state[i_mb_y % wf->i_ring], h->cabac.state, sizeof(h->cabac.state) );
+
+        x264_pthread_mutex_lock( &wf->mutex );
+        wf->i_mbs_done[i_mb_y] = i_mb_x + 1;
+        x264_pthread_cond_broadcast( &wf->cv );
+        x264_pthread_mutex_unlock( &wf->mutex );
+    }
+}
+
+static void *wavefront_rows( x264_t *h )
+{
+    x264_wavefront_t *wf = h->wavefront;
+    x264_pthread_mutex_lock( &wf->mutex );
+    while( !wf->b_abort && wf->i_next_row < h->mb.i_mb_height )
+    {
+        /* A row reuses the records of the row i_ring above it, and the CABAC contexts
+         * of the row above that one, which must be done with them. */
+        int i_mb_y = wf->i_next_row;
+        if( i_mb_y + 1 - wf->i_rows_written >= wf->i_ring )
+        {
+            x264_pthread_cond_wait( &wf->cv, &wf->mutex );
+            continue;
+        }
+        wf->i_next_row++;
+        x264_pthread_mutex_unlock( &wf->mutex );
+        wavefront_row( h, i_mb_y );
+        x264_pthread_mutex_lock( &wf->mutex );
+    }
+    x264_pthread_mutex_unlock( &wf->mutex );
+    return NULL;
+}
+
+static void wavefront_start( x264_t *h, int b_deblock )
+{
+    x264_wavefront_t *wf = h->wavefront;
+    wf->i_next_row = 0;
+    wf->i_rows_written = 0;
+    wf->b_abort = 0;
+    wf->b_deblock = b_deblock;
+    memset( wf->i_mbs_done, 0, h->mb.i_mb_height * sizeof(int) );
+
+    x264_threads_distribute_ratecontrol( h );
+    for( int i = 1; i < h->param.i_slice_threads; i++ )
+    {
+        x264_t *t = h->slice_thread[i];
+        t->param = h->param;
+        memcpy( &t->i_frame, &h->i_frame, offsetof(x264_t, rc) - offsetof(x264_t, i_frame) );
+        t->i_threadslice_start = h->i_threadslice_start;
+        t->i_threadslice_end = h->i_threadslice_end;
+        x264_macroblock_thread_init( t );
+        memset( &t->stat.frame, 0, sizeof(t->stat.frame) );
+        memset( t->i_stage_time, 0, sizeof(t->i_stage_time) );
+        memcpy( t->nr_offset_denoise, h->nr_offset_denoise, sizeof(t->nr_offset_denoise) );
+        memset( t->nr_residual_sum_buf, 0, sizeof(t->nr_residual_sum_buf) );
+        memset( t->nr_count_buf, 0, sizeof(t->nr_count_buf) );
+        x264_threadpool_run( h->threadpool, (void*)wavefront_rows, t );
+    }
+}
+
+static void wavefront_finish( x264_t *h, int b_abort )
+{
+    x264_wavefront_t *wf = h->wavefront;
+    if( b_abort )
+    {
+        x264_pthread_mutex_lock( &wf->mutex );
+        wf->b_abort = 1;
+        x264_pthread_cond_broadcast( &wf->cv );
+        x264_pthread_mutex_unlock( &wf->mutex );
+    }
+    for( int i = 1; i < h->param.i_slice_threads; i++ )
+    {
+        x264_t *t = h->slice_thread[i];
+        x264_threadpool_wait( h->threadpool, t );
+        for( int j = 0; j < 2; j++ )
+            h->stat.frame.i_direct_score[j] += t->stat.frame.i_direct_score[j];
+        for( int j = 0; j < X264_STAGE_MAX; j++ )
+            h->i_stage_time[j] += t->i_stage_time[j];
+        for( int j = 0; j < 2; j++ )
+            for( int cat = 0; cat < 4; cat++ )
+            {
+                h->nr_count_buf[j][cat] += t->nr_count_buf[j][cat];
+                for( int k = 0; k < 64; k++ )
+                    h->nr_residual_sum_buf[j][cat][k] += t->nr_residual_sum_buf[j][cat][k];
+            }
+    }
+}
+
+/* Load the macroblock into slice_write's context once a row thread is done with it. */
+static void wavefront_mb_load( x264_t *h, int i_mb_x, int i_mb_y )
+{
+    x264_wavefront_t *wf = h->wavefront;
+    if( !i_mb_x )
+        wf->i_writer_done = 0;
+    if( i_mb_x >= wf->i_writer_done )
+        wf->i_writer_done = wavefront_wait( wf, i_mb_y, i_mb_x + 1 );
+
+    wavefront_mb_t *rec = &wf->mb[(i_mb_y % wf->i_ring) * h->mb.i_mb_width + i_mb_x];
+    memcpy( &h->mb.i_mb_x, rec->index, WAVEFRONT_INDEX_SIZE );
+    memcpy( &h->mb.i_type, rec->value, WAVEFRONT_VALUE_SIZE );
+    memcpy( &h->mb.cache, rec->cache, WAVEFRONT_CACHE_SIZE );
+    memcpy( &h->dct, rec->dct, sizeof(rec->dct) );
+    if( h->mb.i_type == I_PCM )
+        memcpy( h->mb.pic.fenc_buf, rec->fenc_buf, sizeof(rec->fenc_buf) );
+    h->mb.i_mb_prev_xy = h->mb.i_mb_xy - 1;
+}
+
+/* The row threads saved everything but the quantizer, which is only known in bitstream order. */
+static void wavefront_mb_save( x264_t *h )
+{
+    x264_wavefront_t *wf = h->wavefront;
+    int i_mb_xy = h->mb.i_mb_xy;
+    if( h->mb.i_type == I_PCM )
+    {
+        h->mb.qp[i_mb_xy] = 0;
+        h->mb.i_last_dqp = 0;
+        h->mb.i_cbp_chroma = CHROMA444 ? 0 : 2;
+        h->mb.i_cbp_luma = 0xf;
+        h->mb.b_transform_8x8 = 0;
+        for( int i = 0; i < 48; i++ )
+            h->mb.cache.non_zero_count[x264_scan8[i]] = 1;
+    }
+    else
+    {
+        if( h->mb.i_type != I_16x16 && h->mb.i_cbp_luma == 0 && h->mb.i_cbp_chroma == 0 )
+            h->mb.i_qp = h->mb.i_last_qp;
+        h->mb.qp[i_mb_xy] = h->mb.i_qp;
+        h->mb.i_last_dqp = h->mb.i_qp - h->mb.i_last_qp;
+        h->mb.i_last_qp = h->mb.i_qp;
+    }
+    h->mb.i_mb_prev_xy = i_mb_xy;
+
+    if( h->mb.i_mb_x == h->mb.i_mb_width - 1 )
+    {
+        x264_pthread_mutex_lock( &wf->mutex );
+        wf->i_rows_written = h->mb.i_mb_y + 1;
+        x264_pthread_cond_broadcast( &wf->cv );
+        x264_pthread_mutex_unlock( &wf->mutex );
+    }
+}
+
+static int threadpool_open( x264_t *h, x264_threadpool_t **p_pool, int threads )
+{
+    if( h->param.threadpool )
+        return x264_threadpool_attach( p_pool, h->param.threadpool, threads );
+    return x264_threadpool_init( p_pool, threads );
+}
+
+/* --numa: the workers are split into a pool per node, pinned there once as they start, and each
+ * context runs its jobs on the pool of its node. */
+static int numa_pools_open( x264_t *h )
+{
+    int nodes = x264_numa_num_nodes();
+    h->i_numa_pools = X264_MIN( nodes, h->param.i_threads );
+    CHECKED_MALLOCZERO( h->numa_pool, h->i_numa_pools * sizeof(x264_threadpool_t*) );
+    for( int i = 0; i < h->i_numa_pools; i++ )
+        if( x264_threadpool_init_numa( &h->numa_pool[i], h->param.i_threads / nodes + (i < h->param.i_threads % nodes), i ) )
+            return -1;
+    h->threadpool = h->numa_pool[0];
+    return 0;
+fail:
+    return -1;
+}
+
+/* Followers of a ladder replay the leader's GOP structure, so everything that
+ * shapes it has to match. */
+#define CMP_OPT_LADDER( opt, var )\
+{\
+    if( h->param.var != leader->var )\
+    {\
+        x264_log( h, X264_LOG_ERROR, "different " opt " setting than ladder leader (%d vs %d)\n", h->param.var, leader->var );\
+        return -1;\
+    }\
+}
+
+static int ladder_validate( x264_t *h )
+{
+    x264_ladder_t *ladder = h->param.ladder;
+    x264_param_t *leader = &ladder->param;
+
+    if( !ladder->b_leader )
+    {
+        x264_log( h, X264_LOG_ERROR, "ladder has no leader, open the leading encoder first\n" );
+        return -1;
+    }
+    CMP_OPT_LADDER( "keyint", i_keyint_max );
+    CMP_OPT_LADDER( "min-keyint", i_keyint_min );
+    CMP_OPT_LADDER( "bframes", i_bframe );
+    CMP_OPT_LADDER( "b-pyramid", i_bframe_pyramid );
+    CMP_OPT_LADDER( "open-gop", b_open_gop );
+    CMP_OPT_LADDER( "intra-refresh", b_intra_refresh );
+    CMP_OPT_LADDER( "bluray-compat", b_bluray_compat );
+    CMP_OPT_LADDER( "interlaced", b_interlaced );
+    CMP_OPT_LADDER( "fake-interlaced", b_fake_interlaced );
+    if( h->param.rc.b_mb_tree && !ladder->b_mb_tree )
+    {
+        x264_log( h, X264_LOG_ERROR, "mbtree requires the ladder leader to use mbtree too\n" );
+        return -1;
+    }
+
+    /* The leader only decides a frame once it's far enough into its own lookahead, so a
+     * follower fed by the same thread must not ask for that decision any sooner. */
+    h->frames.i_delay = X264_MAX( h->frames.i_delay, ladder->i_delay );
+    return 0;
+}
+#undef CMP_OPT_LADDER
+
+static int ladder_attach( x264_t *h )
+{
+    if( h->param.b_ladder_leader )
+    {
+        if( x264_ladder_attach_leader( h->param.ladder, &h->param, h->mb.i_mb_count, h->frames.i_delay ) < 0 )
+        {
+            x264_log( h, X264_LOG_ERROR, "ladder already has a leader\n" );
+            return -1;
+        }
+        h->lookahead->b_ladder_leader = 1;
+        return 0;
+    }
+    if( x264_ladder_attach_follower( h->param.ladder ) < 0 )
+    {
+        x264_log( h, X264_LOG_ERROR, "ladder leader has already started encoding\n" );
+        return -1;
+    }
+    h->lookahead->b_ladder_follower = 1;
+    h->lookahead->b_analyse_keyframe = 0;
+    return 0;
+}
+
+static void threadpool_log_stats( x264_t *h, x264_threadpool_t *pool, const char *name )
+{
+    x264_threadpool_stats_t stats[X264_THREAD_MAX];
+    int i_workers = x264_threadpool_stats( pool, stats, X264_THREAD_MAX );
+    for( int i = 0; i < i_workers; i++ )
+        x264_log( h, X264_LOG_DEBUG, "%s worker %d: jobs:%"PRId64" steals:%"PRId64" idle:%.3fs\n",
+                  name, i, stats[i].i_jobs, stats[i].i_steals, stats[i].i_idle_time / 1e6 );
+}
+
+/* Count the reference frames this frame reads from another node's memory. */
+static void numa_count_refs( x264_t *h )
+{
+    for( int l = 0; l < 2; l++ )
+        for( int i = 0; i < h->i_ref[l]; i++ )
+        {
+            x264_frame_t *ref = h->fref[l][i];
+            if( ref->b_duplicate )
+                continue;
+            h->i_numa_refs[0]++;
+            if( ref->i_numa_node != h->i_numa_node )
+            {
+                h->i_numa_refs[1]++;
+                h->i_numa_remote_bytes += ref->i_base_size;
+            }
+        }
+}
+
+static void numa_log_stats( x264_t *h )
+{
+    int64_t refs[2] = {0}, remote_bytes = 0;
+    for( int i = 0; i < h->param.i_threads; i++ )
+    {
+        refs[0] += h->thread[i]->i_numa_refs[0];
+        refs[1] += h->thread[i]->i_numa_refs[1];
+        remote_bytes += h->thread[i]->i_numa_remote_bytes;
+    }
+    x264_log( h, X264_LOG_INFO, "numa: %d nodes, references to a frame on another node: %"PRId64"/%"PRId64", "
+              "%.1f MB of frame buffers counted once per reference\n",
+              x264_numa_num_nodes(), refs[1], refs[0], remote_bytes / 1048576. );
+}
+
 static void frame_dump( x264_t *h )
 {
     FILE *f = x264_fopen( h->param.psz_dump_yuv, "r+b" );
@@ -556,35 +973,113 @@ static int validate_parameters( x264_t *h, int b_open )
         h->param.vui.i_sar_height = 0;
     }
 
+    if( h->param.rc.b_estimate )
+    {
+        if( h->param.rc.i_rc_method != X264_RC_CRF || h->param.rc.b_stat_read )
+        {
+            x264_log( h, X264_LOG_ERROR, "estimate requires 1-pass CRF\n" );
+            return -1;
+        }
+        if( h->param.rc.i_vbv_buffer_size || h->param.rc.i_vbv_max_bitrate )
+        {
+            x264_log( h, X264_LOG_WARNING, "estimate doesn't model VBV, ignored\n" );
+            h->param.rc.i_vbv_buffer_size = 0;
+            h->param.rc.i_vbv_max_bitrate = 0;
+        }
+        /* Nothing is encoded, so frame and slice threads would have nothing to do. */
+        h->param.i_threads = 1;
+        h->param.rc.b_stat_write = 0;
+    }
+
     if( h->param.i_threads == X264_THREADS_AUTO )
     {
-        h->param.i_threads = x264_cpu_num_processors() * (h->param.b_sliced_threads?2:3)/2;
+        /* With a shared pool, size for the cores we're allowed to use rather than the whole machine. */
+        int i_cpus = h->param.threadpool ? x264_threadpool_threads( h->param.threadpool ) : x264_cpu_num_processors();
+        h->param.i_threads = i_cpus * (h->param.b_sliced_threads || h->param.b_wavefront ? 2 : 3)/2;
         /* Avoid too many threads as they don't improve performance and
          * complicate VBV. Capped at an arbitrary 2 rows per thread. */
         int max_threads = X264_MAX( 1, (h->param.i_height+15)/16 / 2 );
         h->param.i_threads = X264_MIN( h->param.i_threads, max_threads );
     }
     int max_sliced_threads = X264_MAX( 1, (h->param.i_height+15)/16 / 4 );
-    if( h->param.i_threads > 1 )
+    /* Hybrid threading: split the threads into frame threads, each encoding its frame with
+     * i_slice_threads sliced threads.  Until the end of validation, i_threads counts the latter. */
+    int i_frame_threads = 1;
+    if( h->param.b_sliced_threads && h->param.i_slice_threads > 0 && h->param.i_slice_threads < h->param.i_threads )
+    {
+        if( h->param.i_avcintra_class )
+            x264_log( h, X264_LOG_WARNING, "frame threads are not supported with sliced threads in AVC-Intra mode\n" );
+        else
+            i_frame_threads = h->param.i_threads / h->param.i_slice_threads;
+        h->param.i_threads = h->param.i_slice_threads;
+    }
+    if( h->param.i_threads > 1 || i_frame_threads > 1 )
     {
 #if !HAVE_THREAD
         x264_log( h, X264_LOG_WARNING, "not compiled with thread support!\n");
         h->param.i_threads = 1;
+        i_frame_threads = 1;
 #endif
         /* Avoid absurdly small thread slices as they can reduce performance
          * and VBV compliance.  Capped at an arbitrary 4 rows per thread. */
         if( h->param.b_sliced_threads )
             h->param.i_threads = X264_MIN( h->param.i_threads, max_sliced_threads );
+        /* Each row lags two macroblocks behind the one above it, which bounds the rows in flight. */
+        else if( h->param.b_wavefront )
+            h->param.i_threads = X264_MIN( h->param.i_threads, X264_MAX( 2, (h->param.i_width+15)/16 / 2 ) );
     }
     h->param.i_threads = x264_clip3( h->param.i_threads, 1, X264_THREAD_MAX );
+    if( i_frame_threads > 1 )
+    {
+        /* A single slice per frame is plain frame threading. */
+        if( h->param.i_threads == 1 )
+        {
+            h->param.b_sliced_threads = 0;
+            h->param.i_threads = X264_MIN( i_frame_threads, X264_THREAD_MAX );
+            i_frame_threads = 1;
+        }
+        else
+            i_frame_threads = X264_MIN( i_frame_threads, X264_THREAD_MAX / h->param.i_threads );
+    }
     if( h->param.i_threads == 1 )
     {
         h->param.b_sliced_threads = 0;
+        h->param.b_wavefront = 0;
         h->param.i_lookahead_threads = 1;
     }
-    h->i_thread_frames = h->param.b_sliced_threads ? 1 : h->param.i_threads;
+    if( h->param.b_wavefront )
+    {
+        /* The rows are written in order into a single slice, and can't be re-encoded once written. */
+        const char *conflict = h->param.b_sliced_threads ? "sliced threads" :
+                               !h->param.b_cabac ? "CAVLC" :
+                               PARAM_INTERLACED ? "interlaced" :
+                               h->param.i_avcintra_class ? "AVC-Intra" :
+                               h->param.rc.i_vbv_max_bitrate > 0 && h->param.rc.i_vbv_buffer_size > 0 ? "VBV" :
+                               h->param.i_slice_count > 1 || h->param.i_slice_max_size > 0 || h->param.i_slice_max_mbs > 0 ? "multiple slices" :
+                               NULL;
+        if( conflict )
+        {
+            x264_log( h, X264_LOG_WARNING, "wavefront is not compatible with %s, disabling\n", conflict );
+            h->param.b_wavefront = 0;
+        }
+    }
+    h->i_thread_frames = h->param.b_sliced_threads || h->param.b_wavefront ? i_frame_threads : h->param.i_threads;
+    if( h->param.b_numa && !x264_numa_num_nodes() )
+    {
+        x264_log( h, X264_LOG_WARNING, "NUMA is not supported on this system, disabling\n" );
+        h->param.b_numa = 0;
+    }
+    if( h->param.b_numa && h->param.threadpool )
+        x264_log( h, X264_LOG_WARNING, "numa: the workers of a shared threadpool aren't pinned to the nodes\n" );
     if( h->i_thread_frames > 1 )
         h->param.nalu_process = NULL;
+#if !HAVE_STAGE_TIMING
+    if( h->param.stage_timing )
+    {
+        x264_log( h, X264_LOG_WARNING, "not compiled with stage timing support!\n" );
+        h->param.stage_timing = NULL;
+    }
+#endif
 
     if( h->param.b_opencl )
     {
@@ -607,6 +1102,11 @@ static int validate_parameters( x264_t *h, int b_open )
             h->param.i_opencl_device = 0;
         }
     }
+    if( h->param.b_lookahead_batch && h->param.b_opencl )
+    {
+        x264_log( h, X264_LOG_WARNING, "lookahead-batch is redundant with opencl, disabling it\n" );
+        h->param.b_lookahead_batch = 0;
+    }
 
     h->param.i_keyint_max = x264_clip3( h->param.i_keyint_max, 1, X264_KEYINT_MAX_INFINITE );
     if( h->param.i_keyint_max == 1 )
@@ -1133,6 +1633,30 @@ static int validate_parameters( x264_t *h, int b_open )
     }
     if( b_open && h->param.rc.b_stat_read )
         h->param.rc.i_lookahead = 0;
+    if( h->param.rc.i_stats_range_frames > 0 && !h->param.rc.b_stat_read )
+    {
+        x264_log( h, X264_LOG_WARNING, "stats range requires a 2nd pass\n" );
+        h->param.rc.i_stats_range_frames = 0;
+    }
+    if( h->param.rc.i_stats_range_frames > 0 && h->param.rc.i_stats_range_start >= 0 )
+        h->param.b_stitchable = 1;
+    else
+        h->param.rc.i_stats_range_start = h->param.rc.i_stats_range_frames = 0;
+    if( h->param.rc.i_stats_window > 0 && (!h->param.rc.b_stat_read || h->param.rc.i_rc_method != X264_RC_ABR) )
+        h->param.rc.i_stats_window = 0;
+    if( h->param.rc.i_stats_window > 0 && h->param.rc.i_stats_range_frames )
+    {
+        x264_log( h, X264_LOG_WARNING, "stats window is not supported with a stats range\n" );
+        h->param.rc.i_stats_window = 0;
+    }
+    h->param.rc.i_stats_window = X264_MAX( h->param.rc.i_stats_window, 0 );
+    if( b_open && h->param.ladder && !h->param.b_ladder_leader && h->param.rc.b_stat_read )
+    {
+        x264_log( h, X264_LOG_WARNING, "ladder is not used in the second pass, frame types come from the stats file\n" );
+        h->param.ladder = NULL;
+    }
+    if( !h->param.ladder )
+        h->param.b_ladder_leader = 0;
 #if HAVE_THREAD
     if( h->param.i_sync_lookahead < 0 )
         h->param.i_sync_lookahead = h->param.i_bframe + 1;
@@ -1154,7 +1678,7 @@ static int validate_parameters( x264_t *h, int b_open )
         h->param.i_cqm_preset = X264_CQM_FLAT;
 
     if( h->param.analyse.i_me_method < X264_ME_DIA ||
-        h->param.analyse.i_me_method > X264_ME_TESA )
+        h->param.analyse.i_me_method > X264_ME_PYR )
         h->param.analyse.i_me_method = X264_ME_HEX;
     h->param.analyse.i_me_range = x264_clip3( h->param.analyse.i_me_range, 4, 1024 );
     if( h->param.analyse.i_me_range > 16 && h->param.analyse.i_me_method <= X264_ME_HEX )
@@ -1277,7 +1801,7 @@ static int validate_parameters( x264_t *h, int b_open )
 
     if( h->param.i_lookahead_threads == X264_THREADS_AUTO )
     {
-        if( h->param.b_sliced_threads )
+        if( h->param.b_sliced_threads || h->param.b_wavefront )
             h->param.i_lookahead_threads = h->param.i_threads;
         else
         {
@@ -1304,23 +1828,45 @@ static int validate_parameters( x264_t *h, int b_open )
     }
     h->param.i_lookahead_threads = x264_clip3( h->param.i_lookahead_threads, 1, X264_MIN( max_sliced_threads, X264_LOOKAHEAD_THREAD_MAX ) );
 
+    /* From here on, i_threads counts all the threads again. */
+    h->param.i_slice_threads = h->param.b_sliced_threads || h->param.b_wavefront ? h->param.i_threads : 1;
+    if( h->param.b_sliced_threads )
+        h->param.i_threads *= h->i_thread_frames;
+
     if( PARAM_INTERLACED )
     {
-        if( h->param.analyse.i_me_method >= X264_ME_ESA )
+        if( ME_EXHAUSTIVE( h->param.analyse.i_me_method ) )
         {
             x264_log( h, X264_LOG_WARNING, "interlace + me=esa is not implemented\n" );
             h->param.analyse.i_me_method = X264_ME_UMH;
         }
+        if( h->param.analyse.i_me_method == X264_ME_PYR )
+        {
+            x264_log( h, X264_LOG_WARNING, "interlace + me=pyr is not implemented\n" );
+            h->param.analyse.i_me_method = X264_ME_UMH;
+        }
         if( h->param.analyse.i_weighted_pred > 0 )
         {
             x264_log( h, X264_LOG_WARNING, "interlace + weightp is not implemented\n" );
             h->param.analyse.i_weighted_pred = X264_WEIGHTP_NONE;
         }
+        if( h->param.b_lazy_hpel )
+        {
+            x264_log( h, X264_LOG_WARNING, "interlace + lazy-hpel is not implemented\n" );
+            h->param.b_lazy_hpel = 0;
+        }
     }
 
     if( !h->param.analyse.i_weighted_pred && h->param.rc.b_mb_tree && h->param.analyse.b_psy )
         h->param.analyse.i_weighted_pred = X264_WEIGHTP_FAKE;
 
+    /* The statistics have to come from the full analysis, or the model would only learn from itself. */
+    if( h->param.psz_dump_et && h->param.analyse.b_et_model )
+    {
+        x264_log( h, X264_LOG_WARNING, "dump-et is incompatible with et-model, disabling et-model\n" );
+        h->param.analyse.b_et_model = 0;
+    }
+
     if( h->i_thread_frames > 1 )
     {
         int r = h->param.analyse.i_mv_range_thread;
@@ -1378,6 +1924,12 @@ static int validate_parameters( x264_t *h, int b_open )
     BOOLIFY( b_deblocking_filter );
     BOOLIFY( b_deterministic );
     BOOLIFY( b_sliced_threads );
+    BOOLIFY( b_wavefront );
+    BOOLIFY( b_numa );
+    BOOLIFY( b_frame_arena );
+    BOOLIFY( b_low_memory );
+    BOOLIFY( b_lazy_hpel );
+    BOOLIFY( b_ladder_leader );
     BOOLIFY( b_interlaced );
     BOOLIFY( b_intra_refresh );
     BOOLIFY( b_aud );
@@ -1393,17 +1945,20 @@ static int validate_parameters( x264_t *h, int b_open )
     BOOLIFY( b_stitchable );
     BOOLIFY( b_full_recon );
     BOOLIFY( b_opencl );
+    BOOLIFY( b_lookahead_batch );
     BOOLIFY( analyse.b_transform_8x8 );
     BOOLIFY( analyse.b_weighted_bipred );
     BOOLIFY( analyse.b_chroma_me );
     BOOLIFY( analyse.b_mixed_references );
     BOOLIFY( analyse.b_fast_pskip );
+    BOOLIFY( analyse.b_et_model );
     BOOLIFY( analyse.b_dct_decimate );
     BOOLIFY( analyse.b_psy );
     BOOLIFY( analyse.b_psnr );
     BOOLIFY( analyse.b_ssim );
     BOOLIFY( rc.b_stat_write );
     BOOLIFY( rc.b_stat_read );
+    BOOLIFY( rc.b_stat_binary );
     BOOLIFY( rc.b_mb_tree );
     BOOLIFY( rc.b_filler );
 #undef BOOLIFY
@@ -1526,6 +2081,8 @@ x264_t *x264_encoder_open( x264_param_t *param, void *api )
         CHECKED_PARAM_STRDUP( h->param.psz_cqm_file, &h->param, h->param.psz_cqm_file );
     if( h->param.psz_dump_yuv )
         CHECKED_PARAM_STRDUP( h->param.psz_dump_yuv, &h->param, h->param.psz_dump_yuv );
+    if( h->param.psz_dump_et )
+        CHECKED_PARAM_STRDUP( h->param.psz_dump_et, &h->param, h->param.psz_dump_et );
     if( h->param.rc.psz_stat_out )
         CHECKED_PARAM_STRDUP( h->param.rc.psz_stat_out, &h->param, h->param.rc.psz_stat_out );
     if( h->param.rc.psz_stat_in )
@@ -1615,6 +2172,8 @@ x264_t *x264_encoder_open( x264_param_t *param, void *api )
     h->frames.i_delay += h->i_thread_frames - 1;
     h->frames.i_delay += h->param.i_sync_lookahead;
     h->frames.i_delay += h->param.b_vfr_input;
+    if( h->param.ladder && !h->param.b_ladder_leader && ladder_validate( h ) < 0 )
+        goto fail;
     h->frames.i_bframe_delay = h->param.i_bframe ? (h->param.i_bframe_pyramid ? 2 : 1) : 0;
 
     h->frames.i_max_ref0 = h->param.i_frame_reference;
@@ -1640,10 +2199,14 @@ x264_t *x264_encoder_open( x264_param_t *param, void *api )
     CHECKED_MALLOCZERO( h->frames.unused[0], (h->frames.i_delay + 3) * sizeof(x264_frame_t *) );
     /* Allocate room for max refs plus a few extra just in case. */
     CHECKED_MALLOCZERO( h->frames.unused[1], (h->i_thread_frames + X264_REF_MAX + 4) * sizeof(x264_frame_t *) );
+    if( h->param.b_low_memory )
+        CHECKED_MALLOCZERO( h->frames.unused[2], (h->i_thread_frames + 4) * sizeof(x264_frame_t *) );
     CHECKED_MALLOCZERO( h->frames.current, (h->param.i_sync_lookahead + h->param.i_bframe
                         + h->i_thread_frames + 3) * sizeof(x264_frame_t *) );
     if( h->param.analyse.i_weighted_pred > 0 )
         CHECKED_MALLOCZERO( h->frames.blank_unused, h->i_thread_frames * 4 * sizeof(x264_frame_t *) );
+    if( x264_frame_arena_init( h ) < 0 )
+        goto fail;
     h->i_ref[0] = h->i_ref[1] = 0;
     h->i_cpb_delay = h->i_coded_fields = h->i_disp_fields = 0;
     h->i_prev_duration = ((uint64_t)h->param.i_fps_den * h->sps->vui.i_time_scale) / ((uint64_t)h->param.i_fps_num * h->sps->vui.i_num_units_in_tick);
@@ -1740,10 +2303,10 @@ x264_t *x264_encoder_open( x264_param_t *param, void *api )
     CHECKED_MALLOC( h->reconfig_h, sizeof(x264_t) );
 
     if( h->param.i_threads > 1 &&
-        x264_threadpool_init( &h->threadpool, h->param.i_threads ) )
+        (h->param.b_numa && !h->param.threadpool ? numa_pools_open( h ) : threadpool_open( h, &h->threadpool, h->param.i_threads )) )
         goto fail;
     if( h->param.i_lookahead_threads > 1 &&
-        x264_threadpool_init( &h->lookaheadpool, h->param.i_lookahead_threads ) )
+        threadpool_open( h, &h->lookaheadpool, h->param.i_lookahead_threads ) )
         goto fail;
 
 #if HAVE_OPENCL
@@ -1766,29 +2329,43 @@ x264_t *x264_encoder_open( x264_param_t *param, void *api )
         {
             CHECKED_MALLOC( h->lookahead_thread[i], sizeof(x264_t) );
             *h->lookahead_thread[i] = *h;
+            /* The macroblock cache of the main thread isn't set up yet, but MB-tree needs its stride. */
+            h->lookahead_thread[i]->mb.i_mb_stride = h->mb.i_mb_width;
+            if( x264_macroblock_thread_allocate( h->lookahead_thread[i], 1 ) < 0 )
+                goto fail;
+            /* The first slice thread propagates straight into the references, the others accumulate privately. */
+            if( i && h->param.rc.b_mb_tree )
+                for( int j = 0; j < 2; j++ )
+                    CHECKED_MALLOCZERO( h->lookahead_thread[i]->mbtree_propagate_acc[j], h->mb.i_mb_count * sizeof(uint16_t) );
         }
     *h->reconfig_h = *h;
 
     for( int i = 0; i < h->param.i_threads; i++ )
     {
         int init_nal_count = h->param.i_slice_count + 3;
-        int allocate_threadlocal_data = !h->param.b_sliced_threads || !i;
+        int allocate_threadlocal_data = i < h->i_thread_frames;
+        x264_t *owner = h->thread[thread_frame_idx( h, i )];
         if( i > 0 )
-            *h->thread[i] = *h;
+            *h->thread[i] = allocate_threadlocal_data ? *h : *owner;
 
         if( x264_pthread_mutex_init( &h->thread[i]->mutex, NULL ) )
             goto fail;
         if( x264_pthread_cond_init( &h->thread[i]->cv, NULL ) )
             goto fail;
 
+        /* The slices of a frame run on the node of its frame thread. */
+        h->thread[i]->i_numa_node = h->param.b_numa ? thread_frame_idx( h, i ) % x264_numa_num_nodes() : 0;
+        if( h->numa_pool )
+            h->thread[i]->threadpool = h->numa_pool[h->thread[i]->i_numa_node];
+
         if( allocate_threadlocal_data )
         {
-            h->thread[i]->fdec = x264_frame_pop_unused( h, 1 );
+            h->thread[i]->fdec = x264_frame_pop_unused( h->thread[i], 1 );
             if( !h->thread[i]->fdec )
                 goto fail;
         }
         else
-            h->thread[i]->fdec = h->thread[0]->fdec;
+            h->thread[i]->fdec = owner->fdec;
 
         CHECKED_MALLOC( h->thread[i]->out.p_bitstream, h->out.i_bitstream );
         /* Start each thread with room for init_nal_count NAL units; it'll realloc later if needed. */
@@ -1798,6 +2375,14 @@ x264_t *x264_encoder_open( x264_param_t *param, void *api )
         if( allocate_threadlocal_data && x264_macroblock_cache_allocate( h->thread[i] ) < 0 )
             goto fail;
     }
+    for( int i = 0; i < h->param.i_threads; i++ )
+    {
+        int frame = thread_frame_idx( h, i );
+        for( int j = 0; j < h->param.i_slice_threads; j++ )
+            h->thread[i]->slice_thread[j] = h->thread[j ? h->i_thread_frames + frame*(h->param.i_slice_threads-1) + j-1 : frame];
+    }
+    if( h->param.b_wavefront && wavefront_init( h ) < 0 )
+        goto fail;
 
 #if HAVE_OPENCL
     if( h->param.b_opencl && x264_opencl_lookahead_init( h ) < 0 )
@@ -1808,12 +2393,19 @@ x264_t *x264_encoder_open( x264_param_t *param, void *api )
         goto fail;
 
     for( int i = 0; i < h->param.i_threads; i++ )
+    {
         if( x264_macroblock_thread_allocate( h->thread[i], 0 ) < 0 )
             goto fail;
+        if( h->param.psz_dump_et )
+            CHECKED_MALLOCZERO( h->thread[i]->et_stats, ET_CELLS * sizeof(*h->et_stats) );
+    }
 
     if( x264_ratecontrol_new( h ) < 0 )
         goto fail;
 
+    if( h->param.ladder && ladder_attach( h ) < 0 )
+        goto fail;
+
     if( h->param.i_nal_hrd )
     {
         x264_log( h, X264_LOG_DEBUG, "HRD bitrate: %i bits/sec\n", h->sps->vui.hrd.i_bit_rate_unscaled );
@@ -1838,6 +2430,17 @@ x264_t *x264_encoder_open( x264_param_t *param, void *api )
         fclose( f );
     }
 
+    if( h->param.psz_dump_et )
+    {
+        FILE *f = x264_fopen( h->param.psz_dump_et, "w" );
+        if( !f )
+        {
+            x264_log( h, X264_LOG_ERROR, "dump_et: can't write to %s\n", h->param.psz_dump_et );
+            goto fail;
+        }
+        fclose( f );
+    }
+
     const char *profile = h->sps->i_profile_idc == PROFILE_BASELINE ? "Constrained Baseline" :
                           h->sps->i_profile_idc == PROFILE_MAIN ? "Main" :
                           h->sps->i_profile_idc == PROFILE_HIGH ? "High" :
@@ -1891,7 +2494,7 @@ static int encoder_try_reconfig( x264_t *h, x264_param_t *param, int *rc_reconfi
     COPY( analyse.intra );
     COPY( analyse.i_direct_mv_pred );
     /* Scratch buffer prevents me_range from being increased for esa/tesa */
-    if( h->param.analyse.i_me_method < X264_ME_ESA || param->analyse.i_me_range < h->param.analyse.i_me_range )
+    if( !ME_EXHAUSTIVE( h->param.analyse.i_me_method ) || param->analyse.i_me_range < h->param.analyse.i_me_range )
         COPY( analyse.i_me_range );
     COPY( analyse.i_noise_reduction );
     /* We can't switch out of subme=0 during encoding. */
@@ -1901,14 +2504,16 @@ static int encoder_try_reconfig( x264_t *h, x264_param_t *param, int *rc_reconfi
     COPY( analyse.b_chroma_me );
     COPY( analyse.b_dct_decimate );
     COPY( analyse.b_fast_pskip );
+    COPY( analyse.b_et_model );
     COPY( analyse.b_mixed_references );
     COPY( analyse.f_psy_rd );
     COPY( analyse.f_psy_trellis );
     COPY( crop_rect );
     // can only twiddle these if they were enabled to begin with:
-    if( h->param.analyse.i_me_method >= X264_ME_ESA || param->analyse.i_me_method < X264_ME_ESA )
+    if( (ME_EXHAUSTIVE( h->param.analyse.i_me_method ) || !ME_EXHAUSTIVE( param->analyse.i_me_method )) &&
+        (h->param.analyse.i_me_method == X264_ME_PYR || param->analyse.i_me_method != X264_ME_PYR) )
         COPY( analyse.i_me_method );
-    if( h->param.analyse.i_me_method >= X264_ME_ESA && !h->frames.b_have_sub8x8_esa )
+    if( ME_EXHAUSTIVE( h->param.analyse.i_me_method ) && !h->frames.b_have_sub8x8_esa )
         h->param.analyse.inter &= ~X264_ANALYSE_PSUB8x8;
     if( h->pps->b_transform_8x8_mode )
         COPY( analyse.b_transform_8x8 );
@@ -2257,7 +2862,7 @@ static void weighted_pred_init( x264_t *h )
                     {
                         h->fenc->weighted[j] = h->mb.p_weight_buf[buffer_next++] + h->fenc->i_stride[0] * i_padv + PADH_ALIGN;
                         //scale full resolution frame
-                        if( h->param.i_threads == 1 )
+                        if( h->param.i_threads == 1 || h->param.b_wavefront )
                         {
                             pixel *src = h->fref[0][j]->filtered[0][0] - h->fref[0][j]->i_stride[0]*i_padv - PADH_ALIGN;
                             pixel *dst = h->fenc->weighted[j] - h->fenc->i_stride[0]*i_padv - PADH_ALIGN;
@@ -2465,6 +3070,8 @@ static void fdec_filter_row( x264_t *h, int mb_y, int pass )
     if( min_y < h->i_threadslice_start )
         return;
 
+    int64_t stage_start = x264_stage_start( h );
+
     if( b_deblock )
         for( int y = min_y; y < mb_y; y += (1 << SLICE_MBAFF) )
             x264_frame_deblock_row( h, y );
@@ -2488,7 +3095,16 @@ static void fdec_filter_row( x264_t *h, int mb_y, int pass )
         if( h->param.analyse.i_subpel_refine )
         {
             x264_frame_filter( h, h->fdec, min_y, end );
-            x264_frame_expand_border_filtered( h, h->fdec, min_y, end );
+            if( !h->fdec->hpel_tiles )
+                x264_frame_expand_border_filtered( h, h->fdec, min_y, end );
+        }
+        /* Deblocking the rows up to mb_y finished the one above min_y. */
+        if( h->fdec->pyramid[0] )
+        {
+            if( min_y > 0 )
+                x264_frame_filter_pyramid( h, h->fdec, min_y-1 );
+            if( end )
+                x264_frame_filter_pyramid( h, h->fdec, min_y );
         }
     }
 
@@ -2499,7 +3115,7 @@ static void fdec_filter_row( x264_t *h, int mb_y, int pass )
             XCHG( pixel *, h->intra_border_backup[1][i], h->intra_border_backup[4][i] );
         }
 
-    if( h->i_thread_frames > 1 && h->fdec->b_kept_as_ref )
+    if( h->i_thread_frames > 1 && h->fdec->b_kept_as_ref && !h->param.b_sliced_threads )
         x264_frame_cond_broadcast( h->fdec, mb_y*16 + (b_end ? 10000 : -(X264_THREAD_HEIGHT << SLICE_MBAFF)) );
 
     if( b_measure_quality )
@@ -2540,16 +3156,27 @@ static void fdec_filter_row( x264_t *h, int mb_y, int pass )
             h->stat.frame.i_ssim_cnt += ssim_cnt;
         }
     }
+
+    x264_stage_end( h, X264_STAGE_FILTER, stage_start );
+}
+
+/* Which unused list to reconstruct the current frame into, see x264_frame_t.b_fdec.
+ * A frame with hpel planes does for any frame, one without only for frames nobody references. */
+static inline int fdec_kind( x264_t *h, int b_kept_as_ref )
+{
+    return h->param.b_low_memory && !b_kept_as_ref ? 2 : 1;
 }
 
 static inline int reference_update( x264_t *h )
 {
+    /* Only an IDR forced onto a B-frame can still change this, see x264_encoder_encode. */
+    int kind = fdec_kind( h, h->fenc->i_type != X264_TYPE_B && h->param.i_keyint_max > 1 );
     if( !h->fdec->b_kept_as_ref )
     {
-        if( h->i_thread_frames > 1 )
+        if( h->i_thread_frames > 1 || h->fdec->b_fdec > kind )
         {
             x264_frame_push_unused( h, h->fdec );
-            h->fdec = x264_frame_pop_unused( h, 1 );
+            h->fdec = x264_frame_pop_unused( h, kind );
             if( !h->fdec )
                 return -1;
         }
@@ -2566,7 +3193,7 @@ static inline int reference_update( x264_t *h )
     x264_frame_push( h->frames.reference, h->fdec );
     if( h->frames.reference[h->sps->i_num_ref_frames] )
         x264_frame_push_unused( h, x264_frame_shift( h->frames.reference ) );
-    h->fdec = x264_frame_pop_unused( h, 1 );
+    h->fdec = x264_frame_pop_unused( h, kind );
     if( !h->fdec )
         return -1;
     return 0;
@@ -2817,6 +3444,9 @@ static intptr_t slice_write( x264_t *h )
     h->mb.i_last_dqp = 0;
     h->mb.field_decoding_flag = 0;
 
+    if( h->param.b_wavefront )
+        wavefront_start( h, b_deblock );
+
     i_mb_y = h->sh.i_first_mb / h->mb.i_mb_width;
     i_mb_x = h->sh.i_first_mb % h->mb.i_mb_width;
     i_skip = 0;
@@ -2829,7 +3459,11 @@ static intptr_t slice_write( x264_t *h )
         if( i_mb_x == 0 )
         {
             if( bitstream_check_buffer( h ) )
+            {
+                if( h->param.b_wavefront )
+                    wavefront_finish( h, 1 );
                 return -1;
+            }
             if( !(i_mb_y & SLICE_MBAFF) && h->param.rc.i_vbv_buffer_size )
                 bitstream_backup( h, &bs_bak[BS_BAK_ROW_VBV], i_skip, 1 );
             if( !h->mb.b_reencode_mb )
@@ -2865,16 +3499,28 @@ static intptr_t slice_write( x264_t *h )
         }
 
         /* load cache */
-        if( SLICE_MBAFF )
-            x264_macroblock_cache_load_interlaced( h, i_mb_x, i_mb_y );
+        if( h->param.b_wavefront )
+            wavefront_mb_load( h, i_mb_x, i_mb_y );
         else
-            x264_macroblock_cache_load_progressive( h, i_mb_x, i_mb_y );
+        {
+            if( SLICE_MBAFF )
+                x264_macroblock_cache_load_interlaced( h, i_mb_x, i_mb_y );
+            else
+                x264_macroblock_cache_load_progressive( h, i_mb_x, i_mb_y );
 
-        x264_macroblock_analyse( h );
+            int64_t stage_start = x264_stage_start( h );
+            x264_macroblock_analyse( h );
+            x264_stage_end( h, X264_STAGE_ANALYSE, stage_start );
+        }
 
         /* encode this macroblock -> be careful it can change the mb type to P_SKIP if needed */
 reencode:
-        x264_macroblock_encode( h );
+        if( !h->param.b_wavefront )
+        {
+            int64_t stage_start = x264_stage_start( h );
+            x264_macroblock_encode( h );
+            x264_stage_end( h, X264_STAGE_ENCODE, stage_start );
+        }
 
         if( h->param.b_cabac )
         {
@@ -2981,9 +3627,15 @@ cont:
         h->mb.b_reencode_mb = 0;
 
         /* save cache */
-        x264_macroblock_cache_save( h );
+        if( h->param.b_wavefront )
+            wavefront_mb_save( h );
+        else
+            x264_macroblock_cache_save( h );
 
-        if( x264_ratecontrol_mb( h, mb_size ) < 0 )
+        int64_t stage_start = x264_stage_start( h );
+        int rc_ret = x264_ratecontrol_mb( h, mb_size );
+        x264_stage_end( h, X264_STAGE_RATECONTROL, stage_start );
+        if( rc_ret < 0 )
         {
             bitstream_restore( h, &bs_bak[BS_BAK_ROW_VBV], &i_skip, 1 );
             h->mb.b_reencode_mb = 1;
@@ -3065,7 +3717,7 @@ cont:
         }
 
         /* calculate deblock strength values (actual deblocking is done per-row along with hpel) */
-        if( b_deblock )
+        if( b_deblock && !h->param.b_wavefront )
             x264_macroblock_deblock_strength( h );
 
         if( mb_xy == h->sh.i_last_mb )
@@ -3084,6 +3736,8 @@ cont:
             i_mb_x = 0;
         }
     }
+    if( h->param.b_wavefront )
+        wavefront_finish( h, 0 );
     if( h->sh.i_last_mb < h->sh.i_first_mb )
         return 0;
 
@@ -3120,17 +3774,35 @@ cont:
             /* Do hpel now */
             for( int mb_y = h->i_threadslice_start; mb_y <= h->i_threadslice_end; mb_y++ )
                 fdec_filter_row( h, mb_y, 1 );
-            x264_threadslice_cond_broadcast( h, 2 );
-            /* Do the first row of hpel, now that the previous slice is done */
-            if( h->i_thread_idx > 0 )
+            if( h->i_thread_frames > 1 )
             {
-                x264_threadslice_cond_wait( h->thread[h->i_thread_idx-1], 2 );
-                fdec_filter_row( h, h->i_threadslice_start + (1 << SLICE_MBAFF), 2 );
+                /* Other frames use our rows as references, so finish the row between us and
+                 * the previous slice first: the slices then finish from top to bottom, and all
+                 * the rows above the end of this one can be released at once. */
+                if( h->i_thread_idx > 0 )
+                {
+                    x264_threadslice_cond_wait( h->slice_thread[h->i_thread_idx-1], 2 );
+                    fdec_filter_row( h, h->i_threadslice_start + (1 << SLICE_MBAFF), 2 );
+                }
+                if( h->fdec->b_kept_as_ref )
+                    x264_frame_cond_broadcast( h->fdec, h->i_threadslice_end*16 + (h->i_threadslice_end == h->mb.i_mb_height
+                                               ? 10000 : -(X264_THREAD_HEIGHT << SLICE_MBAFF)) );
+                x264_threadslice_cond_broadcast( h, 2 );
+            }
+            else
+            {
+                x264_threadslice_cond_broadcast( h, 2 );
+                /* Do the first row of hpel, now that the previous slice is done */
+                if( h->i_thread_idx > 0 )
+                {
+                    x264_threadslice_cond_wait( h->slice_thread[h->i_thread_idx-1], 2 );
+                    fdec_filter_row( h, h->i_threadslice_start + (1 << SLICE_MBAFF), 2 );
+                }
             }
         }
 
         /* Free mb info after the last thread's done using it */
-        if( h->fdec->mb_info_free && (!h->param.b_sliced_threads || h->i_thread_idx == (h->param.i_threads-1)) )
+        if( h->fdec->mb_info_free && (!h->param.b_sliced_threads || h->i_thread_idx == (h->param.i_slice_threads-1)) )
         {
             h->fdec->mb_info_free( h->fdec->mb_info );
             h->fdec->mb_info = NULL;
@@ -3228,67 +3900,85 @@ fail:
     return (void *)-1;
 }
 
+static int threaded_slices_merge( x264_t *h )
+{
+    x264_threads_merge_ratecontrol( h );
+
+    for( int i = 1; i < h->param.i_slice_threads; i++ )
+    {
+        x264_t *t = h->slice_thread[i];
+        for( int j = 0; j < t->out.i_nal; j++ )
+        {
+            h->out.nal[h->out.i_nal] = t->out.nal[j];
+            h->out.i_nal++;
+            nal_check_buffer( h );
+        }
+        /* All entries in stat.frame are ints except for ssd/ssim. */
+        for( size_t j = 0; j < (offsetof(x264_t,stat.frame.i_ssd) - offsetof(x264_t,stat.frame.i_mv_bits)) / sizeof(int); j++ )
+            ((int*)&h->stat.frame)[j] += ((int*)&t->stat.frame)[j];
+        for( int j = 0; j < 3; j++ )
+            h->stat.frame.i_ssd[j] += t->stat.frame.i_ssd[j];
+        h->stat.frame.f_ssim += t->stat.frame.f_ssim;
+        h->stat.frame.i_ssim_cnt += t->stat.frame.i_ssim_cnt;
+        for( int j = 0; j < X264_STAGE_MAX; j++ )
+            h->i_stage_time[j] += t->i_stage_time[j];
+    }
+
+    return 0;
+}
+
 static int threaded_slices_write( x264_t *h )
 {
     int round_bias = h->param.i_avcintra_class ? 0 : h->param.i_slice_count/2;
 
     /* set first/last mb and sync contexts */
-    for( int i = 0; i < h->param.i_threads; i++ )
+    for( int i = 0; i < h->param.i_slice_threads; i++ )
     {
-        x264_t *t = h->thread[i];
+        x264_t *t = h->slice_thread[i];
         if( i )
         {
             t->param = h->param;
             memcpy( &t->i_frame, &h->i_frame, offsetof(x264_t, rc) - offsetof(x264_t, i_frame) );
+            memset( t->i_stage_time, 0, sizeof(t->i_stage_time) );
         }
         int height = h->mb.i_mb_height >> PARAM_INTERLACED;
-        t->i_threadslice_start = ((height *  i    + round_bias) / h->param.i_threads) << PARAM_INTERLACED;
-        t->i_threadslice_end   = ((height * (i+1) + round_bias) / h->param.i_threads) << PARAM_INTERLACED;
+        t->i_threadslice_start = ((height *  i    + round_bias) / h->param.i_slice_threads) << PARAM_INTERLACED;
+        t->i_threadslice_end   = ((height * (i+1) + round_bias) / h->param.i_slice_threads) << PARAM_INTERLACED;
         t->sh.i_first_mb = t->i_threadslice_start * h->mb.i_mb_width;
         t->sh.i_last_mb  =   t->i_threadslice_end * h->mb.i_mb_width - 1;
     }
 
+    /* With frame threads, the slices can't share the weighting of a reference
+     * frame as it's reconstructed, so weight it in one go once it's done. */
+    if( h->i_thread_frames > 1 )
+        for( int j = 0; j < h->i_ref[0]; j++ )
+            if( h->sh.weight[j][0].weightfn )
+                x264_frame_cond_wait( h, h->fref[0][j]->orig, h->mb.i_mb_height*16 + 16 );
     x264_analyse_weight_frame( h, h->mb.i_mb_height*16 + 16 );
 
     x264_threads_distribute_ratecontrol( h );
 
     /* setup */
-    for( int i = 0; i < h->param.i_threads; i++ )
+    for( int i = 0; i < h->param.i_slice_threads; i++ )
     {
-        h->thread[i]->i_thread_idx = i;
-        h->thread[i]->b_thread_active = 1;
-        x264_threadslice_cond_broadcast( h->thread[i], 0 );
+        h->slice_thread[i]->i_thread_idx = i;
+        h->slice_thread[i]->b_thread_active = 1;
+        x264_threadslice_cond_broadcast( h->slice_thread[i], 0 );
     }
     /* dispatch */
-    for( int i = 0; i < h->param.i_threads; i++ )
-        x264_threadpool_run( h->threadpool, (void*)slices_write, h->thread[i] );
+    for( int i = 0; i < h->param.i_slice_threads; i++ )
+        x264_threadpool_run( h->threadpool, (void*)slices_write, h->slice_thread[i] );
+    /* With frame threads, the slices are collected in encoder_frame_end */
+    if( h->i_thread_frames > 1 )
+        return 0;
     /* wait */
-    for( int i = 0; i < h->param.i_threads; i++ )
-        x264_threadslice_cond_wait( h->thread[i], 1 );
-
-    x264_threads_merge_ratecontrol( h );
-
-    for( int i = 1; i < h->param.i_threads; i++ )
-    {
-        x264_t *t = h->thread[i];
-        for( int j = 0; j < t->out.i_nal; j++ )
-        {
-            h->out.nal[h->out.i_nal] = t->out.nal[j];
-            h->out.i_nal++;
-            nal_check_buffer( h );
-        }
-        /* All entries in stat.frame are ints except for ssd/ssim. */
-        for( size_t j = 0; j < (offsetof(x264_t,stat.frame.i_ssd) - offsetof(x264_t,stat.frame.i_mv_bits)) / sizeof(int); j++ )
-            ((int*)&h->stat.frame)[j] += ((int*)&t->stat.frame)[j];
-        for( int j = 0; j < 3; j++ )
-            h->stat.frame.i_ssd[j] += t->stat.frame.i_ssd[j];
-        h->stat.frame.f_ssim += t->stat.frame.f_ssim;
-        h->stat.frame.i_ssim_cnt += t->stat.frame.i_ssim_cnt;
-    }
+    for( int i = 0; i < h->param.i_slice_threads; i++ )
+        x264_threadslice_cond_wait( h->slice_thread[i], 1 );
 
-    return 0;
+    return threaded_slices_merge( h );
 }
 
+
 void x264_encoder_intra_refresh( x264_t *h )
 {
     h = h->thread[h->i_thread_phase];
@@ -3431,9 +4121,6 @@ int     x264_encoder_encode( x264_t *h,
         if( pic_in->prop.quant_offsets_free )
             pic_in->prop.quant_offsets_free( pic_in->prop.quant_offsets );
 
-        if( h->frames.b_have_lowres )
-            x264_frame_init_lowres( h, fenc );
-
         /* 2: Place the frame into the queue for its slice type decision */
         x264_lookahead_put_frame( h, fenc );
 
@@ -3447,10 +4134,8 @@ int     x264_encoder_encode( x264_t *h,
     else
     {
         /* signal kills for lookahead thread */
-        x264_pthread_mutex_lock( &h->lookahead->ifbuf.mutex );
         h->lookahead->b_exit_thread = 1;
-        x264_pthread_cond_broadcast( &h->lookahead->ifbuf.cv_fill );
-        x264_pthread_mutex_unlock( &h->lookahead->ifbuf.mutex );
+        x264_sync_frame_list_close( &h->lookahead->ifbuf );
     }
 
     h->i_frame++;
@@ -3464,6 +4149,20 @@ int     x264_encoder_encode( x264_t *h,
     /* ------------------- Get frame to be encoded ------------------------- */
     /* 4: get picture to encode */
     h->fenc = x264_frame_shift( h->frames.current );
+    if( h->param.stage_timing )
+    {
+        memset( h->i_stage_time, 0, sizeof(h->i_stage_time) );
+        h->i_stage_time[X264_STAGE_SLICETYPE] = h->fenc->i_slicetype_time;
+    }
+
+    /* In estimate mode the frame is only planned, not encoded. */
+    if( h->param.rc.b_estimate )
+    {
+        x264_ratecontrol_estimate_frame( h );
+        x264_frame_push_unused( thread_current, h->fenc );
+        pic_out->i_type = X264_TYPE_AUTO;
+        return 0;
+    }
 
     /* If applicable, wait for previous frame reconstruction to finish */
     if( h->param.b_sliced_threads )
@@ -3566,10 +4265,22 @@ int     x264_encoder_encode( x264_t *h,
         h->sh.i_type = SLICE_TYPE_B;
     }
 
+    if( h->fdec->b_fdec > fdec_kind( h, i_nal_ref_idc != NAL_PRIORITY_DISPOSABLE && h->param.i_keyint_max > 1 ) )
+    {
+        x264_frame_push_unused( h, h->fdec );
+        h->fdec = x264_frame_pop_unused( h, 1 );
+        if( !h->fdec )
+            return -1;
+        h->fdec->i_lines_completed = -1;
+        h->fdec->i_poc = h->fenc->i_poc;
+    }
+
     h->fdec->i_type = h->fenc->i_type;
     h->fdec->i_frame = h->fenc->i_frame;
     h->fenc->b_kept_as_ref =
     h->fdec->b_kept_as_ref = i_nal_ref_idc != NAL_PRIORITY_DISPOSABLE && h->param.i_keyint_max > 1;
+    if( h->fdec->b_kept_as_ref && h->fdec->hpel_tiles )
+        h->i_hpel_tiles[1] += h->mb.i_mb_count;
 
     h->fdec->mb_info = h->fenc->mb_info;
     h->fdec->mb_info_free = h->fenc->mb_info_free;
@@ -3593,15 +4304,17 @@ int     x264_encoder_encode( x264_t *h,
     /* ------------------- Init                ----------------------------- */
     /* build ref list 0/1 */
     reference_build_list( h, h->fdec->i_poc );
+    if( h->param.b_numa )
+        numa_count_refs( h );
 
     /* ---------------------- Write the bitstream -------------------------- */
     /* Init bitstream context */
     if( h->param.b_sliced_threads )
     {
-        for( int i = 0; i < h->param.i_threads; i++ )
+        for( int i = 0; i < h->param.i_slice_threads; i++ )
         {
-            bs_init( &h->thread[i]->out.bs, h->thread[i]->out.p_bitstream, h->thread[i]->out.i_bitstream );
-            h->thread[i]->out.i_nal = 0;
+            bs_init( &h->slice_thread[i]->out.bs, h->slice_thread[i]->out.p_bitstream, h->slice_thread[i]->out.i_bitstream );
+            h->slice_thread[i]->out.i_nal = 0;
         }
     }
     else
@@ -3896,16 +4609,16 @@ int     x264_encoder_encode( x264_t *h,
     /* Write frame */
     h->i_threadslice_start = 0;
     h->i_threadslice_end = h->mb.i_mb_height;
-    if( h->i_thread_frames > 1 )
-    {
-        x264_threadpool_run( h->threadpool, (void*)slices_write, h );
-        h->b_thread_active = 1;
-    }
-    else if( h->param.b_sliced_threads )
+    if( h->param.b_sliced_threads )
     {
         if( threaded_slices_write( h ) )
             return -1;
     }
+    else if( h->i_thread_frames > 1 )
+    {
+        x264_threadpool_run( h->threadpool, (void*)slices_write, h );
+        h->b_thread_active = 1;
+    }
     else
         if( (intptr_t)slices_write( h ) )
             return -1;
@@ -3919,7 +4632,14 @@ static int encoder_frame_end( x264_t *h, x264_t *thread_current,
 {
     char psz_message[80];
 
-    if( !h->param.b_sliced_threads && h->b_thread_active )
+    if( h->param.b_sliced_threads )
+    {
+        /* With frame threads, the slices of this frame may still be encoding. */
+        if( h->i_thread_frames > 1 && h->b_thread_active &&
+            (threadpool_wait_all( h ) < 0 || threaded_slices_merge( h ) < 0) )
+            return -1;
+    }
+    else if( h->b_thread_active )
     {
         h->b_thread_active = 0;
         if( (intptr_t)x264_threadpool_wait( h->threadpool, h ) )
@@ -3931,6 +4651,7 @@ static int encoder_frame_end( x264_t *h, x264_t *thread_current,
         return 0;
     }
 
+    int64_t stage_start = x264_stage_start( h );
     x264_emms();
 
     /* generate buffering period sei and insert it into place */
@@ -4158,6 +4879,12 @@ static int encoder_frame_end( x264_t *h, x264_t *thread_current,
     // for the use of the next frame
     thread_sync_stat( thread_current, h );
 
+    if( stage_start )
+    {
+        x264_stage_end( h, X264_STAGE_FRAME_END, stage_start );
+        h->param.stage_timing( h, pic_out->i_type, h->i_stage_time, pic_out->opaque );
+    }
+
 #ifdef DEBUG_MB_TYPE
 {
     static const char mb_chars[] = { 'i', 'i', 'I', 'C', 'P', '8', 'S',
@@ -4222,11 +4949,59 @@ void    x264_encoder_close  ( x264_t *h )
 #endif
 
     if( h->param.b_sliced_threads )
-        threadpool_wait_all( h );
-    if( h->param.i_threads > 1 )
+        for( int i = 0; i < h->i_thread_frames; i++ )
+        {
+            /* A frame thread that was never collected still owns its frame, see below. */
+            int b_thread_active = h->thread[i]->b_thread_active && h->i_thread_frames > 1;
+            threadpool_wait_all( h->thread[i] );
+            h->thread[i]->b_thread_active = b_thread_active;
+        }
+    if( h->param.b_numa )
+        numa_log_stats( h );
+    if( h->param.b_lazy_hpel )
+    {
+        int64_t tiles[2] = {0};
+        for( int i = 0; i < h->param.i_threads; i++ )
+        {
+            tiles[0] += h->thread[i]->i_hpel_tiles[0];
+            tiles[1] += h->thread[i]->i_hpel_tiles[1];
+        }
+        if( tiles[1] )
+            x264_log( h, X264_LOG_INFO, "lazy hpel: filtered %.1f%% of the reference frames' tiles\n",
+                      100. * tiles[0] / tiles[1] );
+    }
+    if( h->param.psz_dump_et )
+        x264_analyse_et_dump( h );
+    x264_frame_arena_t *arena = h->frames.arena;
+    if( h->param.b_frame_arena )
+        x264_log( h, X264_LOG_INFO, "frame arena: %.1f of %.1f MB used, %.1f MB allocated outside it\n",
+                  arena->i_used / 1048576., arena->i_size / 1048576., arena->i_heap_size / 1048576. );
+    /* Frame memory is pooled rather than freed, so what's held at the end is the peak. */
+    if( h->param.b_low_memory )
+        x264_log( h, X264_LOG_INFO, "low-memory: peak frame memory %.1f MB\n",
+                  (arena->i_size + arena->i_heap_size) / 1048576. );
+    if( h->numa_pool )
+    {
+        for( int i = 0; i < h->i_numa_pools; i++ )
+            if( h->numa_pool[i] )
+            {
+                char name[32];
+                snprintf( name, sizeof(name), "threadpool node %d", i );
+                threadpool_log_stats( h, h->numa_pool[i], name );
+                x264_threadpool_delete( h->numa_pool[i] );
+            }
+        x264_free( h->numa_pool );
+    }
+    else if( h->param.i_threads > 1 )
+    {
+        threadpool_log_stats( h, h->threadpool, "threadpool" );
         x264_threadpool_delete( h->threadpool );
+    }
     if( h->param.i_lookahead_threads > 1 )
+    {
+        threadpool_log_stats( h, h->lookaheadpool, "lookaheadpool" );
         x264_threadpool_delete( h->lookaheadpool );
+    }
     if( h->i_thread_frames > 1 )
     {
         for( int i = 0; i < h->i_thread_frames; i++ )
@@ -4538,11 +5313,14 @@ void    x264_encoder_close  ( x264_t *h )
     /* frames */
     x264_frame_delete_list( h->frames.unused[0] );
     x264_frame_delete_list( h->frames.unused[1] );
+    x264_frame_delete_list( h->frames.unused[2] );
     x264_frame_delete_list( h->frames.current );
     x264_frame_delete_list( h->frames.blank_unused );
 
     h = h->thread[0];
 
+    wavefront_free( h );
+
     for( int i = 0; i < h->i_thread_frames; i++ )
         if( h->thread[i]->b_thread_active )
             for( int j = 0; j < h->thread[i]->i_ref[0]; j++ )
@@ -4551,13 +5329,18 @@ void    x264_encoder_close  ( x264_t *h )
 
     if( h->param.i_lookahead_threads > 1 )
         for( int i = 0; i < h->param.i_lookahead_threads; i++ )
+        {
+            x264_macroblock_thread_free( h->lookahead_thread[i], 1 );
+            for( int j = 0; j < 2; j++ )
+                x264_free( h->lookahead_thread[i]->mbtree_propagate_acc[j] );
             x264_free( h->lookahead_thread[i] );
+        }
 
     for( int i = h->param.i_threads - 1; i >= 0; i-- )
     {
         x264_frame_t **frame;
 
-        if( !h->param.b_sliced_threads || i == 0 )
+        if( i < h->i_thread_frames )
         {
             for( frame = h->thread[i]->frames.reference; *frame; frame++ )
             {
@@ -4577,12 +5360,14 @@ void    x264_encoder_close  ( x264_t *h )
             x264_macroblock_cache_free( h->thread[i] );
         }
         x264_macroblock_thread_free( h->thread[i], 0 );
+        x264_free( h->thread[i]->et_stats );
         x264_free( h->thread[i]->out.p_bitstream );
         x264_free( h->thread[i]->out.nal );
         x264_pthread_mutex_destroy( &h->thread[i]->mutex );
         x264_pthread_cond_destroy( &h->thread[i]->cv );
         x264_free( h->thread[i] );
     }
+    x264_frame_arena_delete( arena );
 #if HAVE_OPENCL
     x264_opencl_close_library( ocl );
 #endif
@@ -4599,13 +5384,7 @@ int x264_encoder_delayed_frames( x264_t *h )
     }
     for( int i = 0; h->frames.current[i]; i++ )
         delayed_frames++;
-    x264_pthread_mutex_lock( &h->lookahead->ofbuf.mutex );
-    x264_pthread_mutex_lock( &h->lookahead->ifbuf.mutex );
-    x264_pthread_mutex_lock( &h->lookahead->next.mutex );
-    delayed_frames += h->lookahead->ifbuf.i_size + h->lookahead->next.i_size + h->lookahead->ofbuf.i_size;
-    x264_pthread_mutex_unlock( &h->lookahead->next.mutex );
-    x264_pthread_mutex_unlock( &h->lookahead->ifbuf.mutex );
-    x264_pthread_mutex_unlock( &h->lookahead->ofbuf.mutex );
+    delayed_frames += h->lookahead->i_frames;
     return delayed_frames;
 }
 
@@ -4613,3 +5392,18 @@ int x264_encoder_maximum_delayed_frames( x264_t *h )
 {
     return h->frames.i_delay;
 }
+
+int64_t x264_encoder_resident_memory( x264_t *h )
+{
+    return h->frames.arena->i_size + h->frames.arena->i_heap_size;
+}
+
+/****************************************************************************
+ * x264_encoder_estimate:
+ ****************************************************************************/
+int x264_encoder_estimate( x264_t *h, const float *f_crf, int i_crf, double *p_bits, double *p_seconds )
+{
+    if( !h->param.rc.b_estimate )
+        return -1;
+    return x264_ratecontrol_estimate( h, f_crf, i_crf, p_bits, p_seconds );
+}
@@ -0,0 +1,215 @@
+/*****************************************************************************
+ * ladder.c: lookahead sharing between the rungs of an ABR ladder
+ *****************************************************************************
+ * Copyright (C) 2022 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+/* The leader appends one entry per minigop as frames leave its lookahead; each
+ * entry stays in the list until every follower that was attached when it was
+ * published has consumed it.  Followers walk the list in the same order, so a
+ * minigop is found by its index alone.  The structure is independent of bit
+ * depth, so rungs of different depths can share a ladder. */
+
+#include "common/base.h"
+#include "ladder.h"
+
+int x264_ladder_init( x264_ladder_t **p_ladder )
+{
+    x264_ladder_t *ladder;
+    CHECKED_MALLOCZERO( ladder, sizeof(x264_ladder_t) );
+    if( x264_pthread_mutex_init( &ladder->mutex, NULL ) ||
+        x264_pthread_cond_init( &ladder->cv, NULL ) )
+    {
+        x264_free( ladder );
+        return -1;
+    }
+    *p_ladder = ladder;
+    return 0;
+fail:
+    return -1;
+}
+
+static void ladder_gop_free( x264_ladder_gop_t *gop )
+{
+    for( int i = 0; i < gop->i_frames; i++ )
+        x264_free( gop->qp_offset[i] );
+    x264_free( gop );
+}
+
+void x264_ladder_delete( x264_ladder_t *ladder )
+{
+    while( ladder->head )
+    {
+        x264_ladder_gop_t *next = ladder->head->next;
+        ladder_gop_free( ladder->head );
+        ladder->head = next;
+    }
+    x264_pthread_mutex_destroy( &ladder->mutex );
+    x264_pthread_cond_destroy( &ladder->cv );
+    x264_free( ladder );
+}
+
+int x264_ladder_attach_leader( x264_ladder_t *ladder, x264_param_t *param, int i_mb_count, int i_delay )
+{
+    int ret = -1;
+    x264_pthread_mutex_lock( &ladder->mutex );
+    if( !ladder->b_leader )
+    {
+        ladder->b_leader = 1;
+        ladder->param = *param;
+        ladder->i_width = param->i_width;
+        ladder->i_height = param->i_height;
+        ladder->b_mb_tree = param->rc.b_mb_tree;
+        ladder->i_mb_count = i_mb_count;
+        ladder->i_delay = i_delay;
+        ret = 0;
+    }
+    x264_pthread_mutex_unlock( &ladder->mutex );
+    return ret;
+}
+
+void x264_ladder_publish( x264_ladder_t *ladder, int i_frames, int *frame, int *type, float **qp_offset )
+{
+    x264_ladder_gop_t *gop;
+    CHECKED_MALLOCZERO( gop, sizeof(x264_ladder_gop_t) );
+    gop->i_frames = i_frames;
+    gop->i_first_frame = frame[0];
+    for( int i = 0; i < i_frames; i++ )
+    {
+        gop->i_frame[i] = frame[i];
+        gop->i_type[i] = type[i];
+        gop->i_first_frame = X264_MIN( gop->i_first_frame, frame[i] );
+        if( qp_offset[i] )
+        {
+            CHECKED_MALLOC( gop->qp_offset[i], ladder->i_mb_count * sizeof(float) );
+            memcpy( gop->qp_offset[i], qp_offset[i], ladder->i_mb_count * sizeof(float) );
+        }
+    }
+
+    x264_pthread_mutex_lock( &ladder->mutex );
+    ladder->i_published++;
+    gop->i_pending = ladder->i_followers;
+    if( gop->i_pending )
+    {
+        if( ladder->tail )
+            ladder->tail->next = gop;
+        else
+            ladder->head = gop;
+        ladder->tail = gop;
+        gop = NULL;
+    }
+    else
+        ladder->i_head++;
+    x264_pthread_cond_broadcast( &ladder->cv );
+    x264_pthread_mutex_unlock( &ladder->mutex );
+    if( gop )
+        ladder_gop_free( gop );
+    return;
+fail:
+    /* Followers can't skip a minigop, so stop here and let them fall back to their own lookahead. */
+    if( gop )
+        ladder_gop_free( gop );
+    x264_ladder_finish( ladder );
+}
+
+void x264_ladder_finish( x264_ladder_t *ladder )
+{
+    x264_pthread_mutex_lock( &ladder->mutex );
+    ladder->b_finished = 1;
+    x264_pthread_cond_broadcast( &ladder->cv );
+    x264_pthread_mutex_unlock( &ladder->mutex );
+}
+
+int x264_ladder_attach_follower( x264_ladder_t *ladder )
+{
+    int ret;
+    x264_pthread_mutex_lock( &ladder->mutex );
+    if( !ladder->b_leader )
+        ret = -1;
+    else if( ladder->i_published || ladder->b_finished )
+        ret = -2;
+    else
+    {
+        ladder->i_followers++;
+        ret = 0;
+    }
+    x264_pthread_mutex_unlock( &ladder->mutex );
+    return ret;
+}
+
+x264_ladder_gop_t *x264_ladder_get( x264_ladder_t *ladder, int i_gop, volatile uint8_t *b_cancel )
+{
+    x264_ladder_gop_t *gop = NULL;
+    x264_pthread_mutex_lock( &ladder->mutex );
+    /* Without threads nothing can publish while we wait, so only take what's already there. */
+    while( HAVE_THREAD && i_gop >= ladder->i_published && !ladder->b_finished && !*b_cancel )
+        x264_pthread_cond_wait( &ladder->cv, &ladder->mutex );
+    if( i_gop < ladder->i_published && !*b_cancel )
+    {
+        gop = ladder->head;
+        for( int i = ladder->i_head; i < i_gop; i++ )
+            gop = gop->next;
+    }
+    x264_pthread_mutex_unlock( &ladder->mutex );
+    return gop;
+}
+
+void x264_ladder_cancel( x264_ladder_t *ladder, volatile uint8_t *b_cancel )
+{
+    x264_pthread_mutex_lock( &ladder->mutex );
+    *b_cancel = 1;
+    x264_pthread_cond_broadcast( &ladder->cv );
+    x264_pthread_mutex_unlock( &ladder->mutex );
+}
+
+/* Must be called with the mutex held. */
+static void ladder_release( x264_ladder_t *ladder, int i_gop )
+{
+    x264_ladder_gop_t *gop = ladder->head;
+    for( int i = ladder->i_head; i < i_gop; i++ )
+        gop = gop->next;
+    gop->i_pending--;
+
+    while( ladder->head && !ladder->head->i_pending )
+    {
+        gop = ladder->head;
+        ladder->head = gop->next;
+        if( !ladder->head )
+            ladder->tail = NULL;
+        ladder->i_head++;
+        ladder_gop_free( gop );
+    }
+}
+
+void x264_ladder_release( x264_ladder_t *ladder, int i_gop )
+{
+    x264_pthread_mutex_lock( &ladder->mutex );
+    ladder_release( ladder, i_gop );
+    x264_pthread_mutex_unlock( &ladder->mutex );
+}
+
+void x264_ladder_detach_follower( x264_ladder_t *ladder, int i_gop )
+{
+    x264_pthread_mutex_lock( &ladder->mutex );
+    for( ; i_gop < ladder->i_published; i_gop++ )
+        ladder_release( ladder, i_gop );
+    ladder->i_followers--;
+    x264_pthread_mutex_unlock( &ladder->mutex );
+}
@@ -0,0 +1,79 @@
+/*****************************************************************************
+ * ladder.h: lookahead sharing between the rungs of an ABR ladder
+ *****************************************************************************
+ * Copyright (C) 2022 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+#ifndef X264_ENCODER_LADDER_H
+#define X264_ENCODER_LADDER_H
+
+/* The decisions of the leader's lookahead for one minigop, in coded order. */
+typedef struct x264_ladder_gop_t
+{
+    struct x264_ladder_gop_t *next;
+    int   i_pending;      /* followers that have not consumed this minigop yet */
+    int   i_frames;
+    int   i_first_frame;  /* lowest display number in the minigop */
+    int   i_frame[X264_BFRAME_MAX+1];
+    int   i_type[X264_BFRAME_MAX+1];
+    float *qp_offset[X264_BFRAME_MAX+1]; /* MB-tree offsets of reference frames, NULL otherwise */
+} x264_ladder_gop_t;
+
+struct x264_ladder_t
+{
+    x264_pthread_mutex_t mutex;
+    x264_pthread_cond_t  cv;
+
+    /* the leader's settings; followers may only attach after the leader did */
+    int  b_leader;
+    int  b_finished;     /* the leader won't publish any more minigops */
+    int  i_delay;        /* frame delay of the leader */
+    int  i_width;
+    int  i_height;
+    int  i_mb_count;
+    int  b_mb_tree;
+    x264_param_t param;
+
+    int  i_followers;
+    int  i_published;    /* minigops published so far */
+    int  i_head;         /* index of the oldest minigop still in the list */
+    x264_ladder_gop_t *head;
+    x264_ladder_gop_t *tail;
+};
+
+int   x264_ladder_init( x264_ladder_t **p_ladder );
+void  x264_ladder_delete( x264_ladder_t *ladder );
+
+/* Leader side: minigops are published in coded order as they leave the lookahead. */
+int   x264_ladder_attach_leader( x264_ladder_t *ladder, x264_param_t *param, int i_mb_count, int i_delay );
+void  x264_ladder_publish( x264_ladder_t *ladder, int i_frames, int *frame, int *type, float **qp_offset );
+void  x264_ladder_finish( x264_ladder_t *ladder );
+
+/* Follower side: x264_ladder_get blocks until minigop i_gop is published and returns
+ * NULL once the leader has finished without publishing it, or once the follower was
+ * cancelled through x264_ladder_cancel.  Minigops are given back with
+ * x264_ladder_release; detaching gives back all those from i_gop on. */
+int   x264_ladder_attach_follower( x264_ladder_t *ladder );
+x264_ladder_gop_t *x264_ladder_get( x264_ladder_t *ladder, int i_gop, volatile uint8_t *b_cancel );
+void  x264_ladder_cancel( x264_ladder_t *ladder, volatile uint8_t *b_cancel );
+void  x264_ladder_release( x264_ladder_t *ladder, int i_gop );
+void  x264_ladder_detach_follower( x264_ladder_t *ladder, int i_gop );
+
+#endif
@@ -38,92 +38,137 @@
  */
 #include "common/common.h"
 #include "analyse.h"
-
-static void lookahead_shift( x264_sync_frame_list_t *dst, x264_sync_frame_list_t *src, int count )
-{
-    int i = count;
-    while( i-- )
-    {
-        assert( dst->i_size < dst->i_max_size );
-        assert( src->i_size );
-        dst->list[ dst->i_size++ ] = x264_frame_shift( src->list );
-        src->i_size--;
-    }
-    if( count )
-    {
-        x264_pthread_cond_broadcast( &dst->cv_fill );
-        x264_pthread_cond_broadcast( &src->cv_empty );
-    }
-}
+#include "ladder.h"
 
 static void lookahead_update_last_nonb( x264_t *h, x264_frame_t *new_nonb )
 {
     if( h->lookahead->last_nonb )
+    {
+        x264_frame_lowres_release( h, h->lookahead->last_nonb );
         x264_frame_push_unused( h, h->lookahead->last_nonb );
+    }
     h->lookahead->last_nonb = new_nonb;
     new_nonb->i_reference_count++;
 }
 
-#if HAVE_THREAD
+/* Hand the minigop that just left the lookahead to the other rungs of the ladder. */
+static void lookahead_ladder_publish( x264_t *h, x264_frame_t **frames, int count )
+{
+    int frame[X264_BFRAME_MAX+1];
+    int type[X264_BFRAME_MAX+1];
+    float *qp_offset[X264_BFRAME_MAX+1];
+
+    for( int i = 0; i < count; i++ )
+    {
+        frame[i] = frames[i]->i_frame;
+        type[i] = frames[i]->i_type;
+        qp_offset[i] = h->param.rc.b_mb_tree && frames[i]->i_type != X264_TYPE_B ? frames[i]->f_qp_offset : NULL;
+    }
+    x264_ladder_publish( h->param.ladder, count, frame, type, qp_offset );
+}
+
+/* Decide the next minigop and move it from the next list to ofbuf. */
 static void lookahead_slicetype_decide( x264_t *h )
 {
+    x264_lookahead_t *look = h->lookahead;
+    x264_frame_t *frames[X264_BFRAME_MAX+1];
+    int64_t stage_start = x264_stage_start( h );
+
     x264_slicetype_decide( h );
 
-    lookahead_update_last_nonb( h, h->lookahead->next.list[0] );
-    int shift_frames = h->lookahead->next.list[0]->i_bframes + 1;
+    lookahead_update_last_nonb( h, look->next.list[0] );
+    int shift_frames = look->next.list[0]->i_bframes + 1;
+    for( int i = 0; i < shift_frames; i++ )
+    {
+        frames[i] = x264_frame_shift( look->next.list );
+        look->next.i_size--;
+    }
 
-    x264_pthread_mutex_lock( &h->lookahead->ofbuf.mutex );
-    while( h->lookahead->ofbuf.i_size == h->lookahead->ofbuf.i_max_size )
-        x264_pthread_cond_wait( &h->lookahead->ofbuf.cv_empty, &h->lookahead->ofbuf.mutex );
+    /* For MB-tree and VBV lookahead, we have to perform propagation analysis on I-frames too.
+     * The minigop isn't in ofbuf yet, so the encoder can't pick it up before that's done. */
+    if( look->b_analyse_keyframe && IS_X264_TYPE_I( look->last_nonb->i_type ) )
+        x264_slicetype_analyse( h, shift_frames );
 
-    x264_pthread_mutex_lock( &h->lookahead->next.mutex );
-    lookahead_shift( &h->lookahead->ofbuf, &h->lookahead->next, shift_frames );
-    x264_pthread_mutex_unlock( &h->lookahead->next.mutex );
+    if( stage_start )
+        for( int i = 0; i < shift_frames; i++ )
+            frames[i]->i_slicetype_time = i ? 0 : x264_mdate() - stage_start;
 
-    /* For MB-tree and VBV lookahead, we have to perform propagation analysis on I-frames too. */
-    if( h->lookahead->b_analyse_keyframe && IS_X264_TYPE_I( h->lookahead->last_nonb->i_type ) )
-        x264_slicetype_analyse( h, shift_frames );
+    if( look->b_ladder_leader )
+        lookahead_ladder_publish( h, frames, shift_frames );
+
+    /* Past this point only the last non-B is ever looked at in lowres again. */
+    for( int i = 0; i < shift_frames; i++ )
+        if( frames[i] != look->last_nonb )
+            x264_frame_lowres_release( h, frames[i] );
+
+    x264_sync_frame_list_push( &look->ofbuf, frames, shift_frames );
+}
+
+#if HAVE_THREAD
+/* The threaded lookahead is a pipeline: the lowres planes are built, the costs that every
+ * decision needs are estimated and the slicetype decision is made, each on a thread of its
+ * own.  The stages are connected by single-producer single-consumer lists; closing a list
+ * passes the end of the stream on to the next stage. */
+REALIGN_STACK static void *lookahead_lowres_thread( x264_t *h )
+{
+    x264_lookahead_t *look = h->lookahead;
+    x264_frame_t *frame;
+    while( x264_sync_frame_list_wait( &look->ifbuf ) )
+        while( (frame = x264_sync_frame_list_pop( &look->ifbuf )) )
+        {
+            x264_frame_init_lowres( h, frame );
+            x264_sync_frame_list_push( &look->lowresbuf, &frame, 1 );
+        }
+    x264_sync_frame_list_close( &look->lowresbuf );
+    return NULL;
+}
 
-    x264_pthread_mutex_unlock( &h->lookahead->ofbuf.mutex );
+/* The P cost of a frame is estimated from the previous one, so that one is held back until
+ * the next frame arrives.  Threaded lookahead always has at least one frame of sync-lookahead
+ * to make up for it. */
+REALIGN_STACK static void *lookahead_cost_thread( x264_t *h )
+{
+    x264_lookahead_t *look = h->lookahead;
+    x264_sync_frame_list_t *in = look->b_lowres_stage ? &look->lowresbuf : &look->ifbuf;
+    x264_frame_t *prev = NULL;
+    x264_frame_t *frame;
+    while( x264_sync_frame_list_wait( in ) )
+        while( (frame = x264_sync_frame_list_pop( in )) )
+        {
+            x264_slicetype_estimate( h, prev, frame );
+            if( prev )
+                x264_sync_frame_list_push( &look->costbuf, &prev, 1 );
+            prev = frame;
+        }
+    if( prev )
+        x264_sync_frame_list_push( &look->costbuf, &prev, 1 );
+    x264_sync_frame_list_close( &look->costbuf );
+    return NULL;
 }
 
 REALIGN_STACK static void *lookahead_thread( x264_t *h )
 {
+    x264_lookahead_t *look = h->lookahead;
+    x264_sync_frame_list_t *in = look->b_cost_stage ? &look->costbuf : look->b_lowres_stage ? &look->lowresbuf : &look->ifbuf;
     while( 1 )
     {
-        x264_pthread_mutex_lock( &h->lookahead->ifbuf.mutex );
-        if( h->lookahead->b_exit_thread )
-        {
-            x264_pthread_mutex_unlock( &h->lookahead->ifbuf.mutex );
-            break;
-        }
-        x264_pthread_mutex_lock( &h->lookahead->next.mutex );
-        int shift = X264_MIN( h->lookahead->next.i_max_size - h->lookahead->next.i_size, h->lookahead->ifbuf.i_size );
-        lookahead_shift( &h->lookahead->next, &h->lookahead->ifbuf, shift );
-        x264_pthread_mutex_unlock( &h->lookahead->next.mutex );
-        if( h->lookahead->next.i_size <= h->lookahead->i_slicetype_length + h->param.b_vfr_input )
+        x264_frame_t *frame;
+        while( look->next.i_size < look->next.i_max_size && (frame = x264_sync_frame_list_pop( in )) )
+            look->next.list[look->next.i_size++] = frame;
+        if( look->next.i_size <= look->i_slicetype_length + h->param.b_vfr_input )
         {
-            while( !h->lookahead->ifbuf.i_size && !h->lookahead->b_exit_thread )
-                x264_pthread_cond_wait( &h->lookahead->ifbuf.cv_fill, &h->lookahead->ifbuf.mutex );
-            x264_pthread_mutex_unlock( &h->lookahead->ifbuf.mutex );
+            /* The input is only closed once the encoder is flushed or closed. */
+            if( !x264_sync_frame_list_wait( in ) )
+                break;
         }
         else
-        {
-            x264_pthread_mutex_unlock( &h->lookahead->ifbuf.mutex );
             lookahead_slicetype_decide( h );
-        }
     }   /* end of input frames */
-    x264_pthread_mutex_lock( &h->lookahead->ifbuf.mutex );
-    x264_pthread_mutex_lock( &h->lookahead->next.mutex );
-    lookahead_shift( &h->lookahead->next, &h->lookahead->ifbuf, h->lookahead->ifbuf.i_size );
-    x264_pthread_mutex_unlock( &h->lookahead->next.mutex );
-    x264_pthread_mutex_unlock( &h->lookahead->ifbuf.mutex );
-    while( h->lookahead->next.i_size )
+    while( look->next.i_size )
         lookahead_slicetype_decide( h );
-    x264_pthread_mutex_lock( &h->lookahead->ofbuf.mutex );
-    h->lookahead->b_thread_active = 0;
-    x264_pthread_cond_broadcast( &h->lookahead->ofbuf.cv_fill );
-    x264_pthread_mutex_unlock( &h->lookahead->ofbuf.mutex );
+    if( look->b_ladder_leader )
+        x264_ladder_finish( h->param.ladder );
+    x264_sync_frame_list_close( &look->ofbuf );
     return NULL;
 }
 
@@ -140,10 +185,18 @@ int x264_lookahead_init( x264_t *h, int i_slicetype_length )
     look->b_analyse_keyframe = (h->param.rc.b_mb_tree || (h->param.rc.i_vbv_buffer_size && h->param.rc.i_lookahead))
                                && !h->param.rc.b_stat_read;
     look->i_slicetype_length = i_slicetype_length;
+    look->b_estimate_costs = ((h->param.i_bframe && h->param.i_bframe_adaptive)
+                              || h->param.i_scenecut_threshold
+                              || h->param.rc.b_mb_tree
+                              || (h->param.rc.i_vbv_buffer_size && h->param.rc.i_lookahead))
+                             && !h->param.rc.b_stat_read && !h->param.b_opencl;
 
     /* init frame lists */
+    look->next.i_max_size = h->frames.i_delay+3;
+    CHECKED_MALLOCZERO( look->next.list, (look->next.i_max_size+1) * sizeof(x264_frame_t*) );
     if( x264_sync_frame_list_init( &look->ifbuf, h->param.i_sync_lookahead+3 ) ||
-        x264_sync_frame_list_init( &look->next, h->frames.i_delay+3 ) ||
+        x264_sync_frame_list_init( &look->lowresbuf, h->param.i_sync_lookahead+3 ) ||
+        x264_sync_frame_list_init( &look->costbuf, h->param.i_sync_lookahead+3 ) ||
         x264_sync_frame_list_init( &look->ofbuf, h->frames.i_delay+3 ) )
         goto fail;
 
@@ -158,9 +211,28 @@ int x264_lookahead_init( x264_t *h, int i_slicetype_length )
     if( x264_macroblock_thread_allocate( look_h, 1 ) < 0 )
         goto fail;
 
+    look->b_lowres_stage = h->frames.b_have_lowres;
+    look->b_cost_stage = look->b_estimate_costs;
+    if( look->b_cost_stage )
+    {
+        CHECKED_MALLOC( look->cost_h, sizeof(x264_t) );
+        *look->cost_h = *h;
+        /* The lookahead pool belongs to the slicetype decision. */
+        look->cost_h->lookaheadpool = NULL;
+        if( x264_macroblock_cache_allocate( look->cost_h ) )
+            goto fail;
+        if( x264_macroblock_thread_allocate( look->cost_h, 1 ) < 0 )
+            goto fail;
+        if( x264_pthread_create( &look->cost_handle, NULL, (void*)lookahead_cost_thread, look->cost_h ) )
+            goto fail;
+    }
+
+    if( look->b_lowres_stage &&
+        x264_pthread_create( &look->lowres_handle, NULL, (void*)lookahead_lowres_thread, look_h ) )
+        goto fail;
+
     if( x264_pthread_create( &look->thread_handle, NULL, (void*)lookahead_thread, look_h ) )
         goto fail;
-    look->b_thread_active = 1;
 
     return 0;
 fail:
@@ -168,21 +240,61 @@ fail:
     return -1;
 }
 
+/* Every context that ran lowres analysis has its own counters. */
+static void lookahead_log_cost_cache( x264_t *h )
+{
+    int64_t hits[2] = {0}, misses[2] = {0};
+    int i_contexts = h->param.i_threads + !!h->param.i_sync_lookahead;
+    for( int i = 0; i <= i_contexts; i++ )
+    {
+        x264_t *t = i < i_contexts ? h->thread[i] : h->lookahead->cost_h;
+        for( int j = 0; j < 2 && t; j++ )
+        {
+            hits[j] += t->i_cost_cache_hits[j];
+            misses[j] += t->i_cost_cache_misses[j];
+        }
+    }
+    if( hits[0] + misses[0] )
+        x264_log( h, X264_LOG_DEBUG, "lowres cost cache: frame costs hits:%"PRId64" misses:%"PRId64", "
+                  "MB-tree reweighting hits:%"PRId64" misses:%"PRId64"\n", hits[0], misses[0], hits[1], misses[1] );
+}
+
 void x264_lookahead_delete( x264_t *h )
 {
+    /* A follower closed before the end of the stream mustn't wait for the leader any more. */
+    if( h->lookahead->b_ladder_follower )
+        x264_ladder_cancel( h->param.ladder, &h->lookahead->b_ladder_cancel );
     if( h->param.i_sync_lookahead )
     {
-        x264_pthread_mutex_lock( &h->lookahead->ifbuf.mutex );
         h->lookahead->b_exit_thread = 1;
-        x264_pthread_cond_broadcast( &h->lookahead->ifbuf.cv_fill );
-        x264_pthread_mutex_unlock( &h->lookahead->ifbuf.mutex );
+        x264_sync_frame_list_close( &h->lookahead->ifbuf );
+        if( h->lookahead->b_lowres_stage )
+            x264_pthread_join( h->lookahead->lowres_handle, NULL );
+        if( h->lookahead->b_cost_stage )
+            x264_pthread_join( h->lookahead->cost_handle, NULL );
         x264_pthread_join( h->lookahead->thread_handle, NULL );
+    }
+    lookahead_log_cost_cache( h );
+    if( h->param.i_sync_lookahead )
+    {
+        if( h->lookahead->b_cost_stage )
+        {
+            x264_macroblock_cache_free( h->lookahead->cost_h );
+            x264_macroblock_thread_free( h->lookahead->cost_h, 1 );
+            x264_free( h->lookahead->cost_h );
+        }
         x264_macroblock_cache_free( h->thread[h->param.i_threads] );
         x264_macroblock_thread_free( h->thread[h->param.i_threads], 1 );
         x264_free( h->thread[h->param.i_threads] );
     }
+    if( h->lookahead->b_ladder_leader )
+        x264_ladder_finish( h->param.ladder );
+    else if( h->lookahead->b_ladder_follower )
+        x264_ladder_detach_follower( h->param.ladder, h->lookahead->i_ladder_gop );
     x264_sync_frame_list_delete( &h->lookahead->ifbuf );
-    x264_sync_frame_list_delete( &h->lookahead->next );
+    x264_sync_frame_list_delete( &h->lookahead->lowresbuf );
+    x264_sync_frame_list_delete( &h->lookahead->costbuf );
+    x264_frame_delete_list( h->lookahead->next.list );
     if( h->lookahead->last_nonb )
         x264_frame_push_unused( h, h->lookahead->last_nonb );
     x264_sync_frame_list_delete( &h->lookahead->ofbuf );
@@ -192,43 +304,53 @@ void x264_lookahead_delete( x264_t *h )
 void x264_lookahead_put_frame( x264_t *h, x264_frame_t *frame )
 {
     if( h->param.i_sync_lookahead )
-        x264_sync_frame_list_push( &h->lookahead->ifbuf, frame );
+        x264_sync_frame_list_push( &h->lookahead->ifbuf, &frame, 1 );
     else
-        x264_sync_frame_list_push( &h->lookahead->next, frame );
+    {
+        x264_lookahead_t *look = h->lookahead;
+        if( h->frames.b_have_lowres )
+            x264_frame_init_lowres( h, frame );
+        if( look->b_estimate_costs )
+        {
+            /* The previous frame is either still waiting for its decision or it was the last one decided. */
+            x264_frame_t *prev = look->next.i_size ? look->next.list[look->next.i_size-1] : look->last_nonb;
+            x264_slicetype_estimate( h, prev && prev->i_frame == frame->i_frame-1 ? prev : NULL, frame );
+        }
+        assert( look->next.i_size < look->next.i_max_size );
+        look->next.list[look->next.i_size++] = frame;
+    }
+    h->lookahead->i_frames++;
 }
 
 int x264_lookahead_is_empty( x264_t *h )
 {
-    x264_pthread_mutex_lock( &h->lookahead->ofbuf.mutex );
-    x264_pthread_mutex_lock( &h->lookahead->next.mutex );
-    int b_empty = !h->lookahead->next.i_size && !h->lookahead->ofbuf.i_size;
-    x264_pthread_mutex_unlock( &h->lookahead->next.mutex );
-    x264_pthread_mutex_unlock( &h->lookahead->ofbuf.mutex );
-    return b_empty;
+    return !h->lookahead->i_frames;
 }
 
 static void lookahead_encoder_shift( x264_t *h )
 {
-    if( !h->lookahead->ofbuf.i_size )
+    x264_frame_t *frame = x264_sync_frame_list_pop( &h->lookahead->ofbuf );
+    if( !frame )
         return;
-    int i_frames = h->lookahead->ofbuf.list[0]->i_bframes + 1;
-    while( i_frames-- )
+    /* minigops are pushed as a whole, so the rest of this one is already there */
+    int i_frames = frame->i_bframes + 1;
+    while( 1 )
     {
-        x264_frame_push( h->frames.current, x264_frame_shift( h->lookahead->ofbuf.list ) );
-        h->lookahead->ofbuf.i_size--;
+        x264_frame_push( h->frames.current, frame );
+        h->lookahead->i_frames--;
+        if( !--i_frames )
+            break;
+        frame = x264_sync_frame_list_pop( &h->lookahead->ofbuf );
+        assert( frame );
     }
-    x264_pthread_cond_broadcast( &h->lookahead->ofbuf.cv_empty );
 }
 
 void x264_lookahead_get_frames( x264_t *h )
 {
     if( h->param.i_sync_lookahead )
     {   /* We have a lookahead thread, so get frames from there */
-        x264_pthread_mutex_lock( &h->lookahead->ofbuf.mutex );
-        while( !h->lookahead->ofbuf.i_size && h->lookahead->b_thread_active )
-            x264_pthread_cond_wait( &h->lookahead->ofbuf.cv_fill, &h->lookahead->ofbuf.mutex );
-        lookahead_encoder_shift( h );
-        x264_pthread_mutex_unlock( &h->lookahead->ofbuf.mutex );
+        if( x264_sync_frame_list_wait( &h->lookahead->ofbuf ) )
+            lookahead_encoder_shift( h );
     }
     else
     {   /* We are not running a lookahead thread, so perform all the slicetype decide on the fly */
@@ -236,14 +358,9 @@ void x264_lookahead_get_frames( x264_t *h )
         if( h->frames.current[0] || !h->lookahead->next.i_size )
             return;
 
-        x264_slicetype_decide( h );
-        lookahead_update_last_nonb( h, h->lookahead->next.list[0] );
-        int shift_frames = h->lookahead->next.list[0]->i_bframes + 1;
-        lookahead_shift( &h->lookahead->ofbuf, &h->lookahead->next, shift_frames );
-
-        /* For MB-tree and VBV lookahead, we have to perform propagation analysis on I-frames too. */
-        if( h->lookahead->b_analyse_keyframe && IS_X264_TYPE_I( h->lookahead->last_nonb->i_type ) )
-            x264_slicetype_analyse( h, shift_frames );
+        lookahead_slicetype_decide( h );
+        if( h->lookahead->b_ladder_leader && h->lookahead->b_exit_thread && !h->lookahead->next.i_size )
+            x264_ladder_finish( h->param.ladder );
 
         lookahead_encoder_shift( h );
     }
@@ -73,6 +73,7 @@ do\
 do\
 {\
     intptr_t stride2 = 16;\
+    x264_me_hpel_ensure( h, m, mx, my, bw, bh );\
     pixel *src = h->mc.get_ref( pix, &stride2, m->p_fref, stride, mx, my, bw, bh, &m->weight[0] );\
     cost = h->pixf.fpelcmp[i_pixel]( p_fenc, FENC_STRIDE, src, stride2 )\
          + p_cost_mvx[ mx ] + p_cost_mvy[ my ];\
@@ -179,6 +180,29 @@ do\
 #define SPEL(mv) ((mv)*4)      /* ... and the reverse. */
 #define SPELx2(mv) (SPEL(mv)&0xFFFCFFFC) /* for two packed MVs */
 
+/* me=pyr keeps the PYR_KEEP best vectors of each pyramid level, best first, to refine in the next. */
+#define PYR_KEEP 4
+typedef struct
+{
+    int cost;
+    int mv[2];
+} pyr_cand_t;
+
+static void pyr_keep( pyr_cand_t *keep, int *p_nkeep, int cost, int mx, int my )
+{
+    int n = *p_nkeep;
+    if( n == PYR_KEEP && cost >= keep[n-1].cost )
+        return;
+    for( int i = 0; i < n; i++ )
+        if( keep[i].mv[0] == mx && keep[i].mv[1] == my )
+            return;
+    int i = X264_MIN( n, PYR_KEEP-1 );
+    for( ; i > 0 && keep[i-1].cost > cost; i-- )
+        keep[i] = keep[i-1];
+    keep[i] = (pyr_cand_t){ cost, { mx, my } };
+    *p_nkeep = X264_MIN( n+1, PYR_KEEP );
+}
+
 void x264_me_search_ref( x264_t *h, x264_me_t *m, int16_t (*mvc)[2], int i_mvc, int *p_halfpel_thresh )
 {
     const int bw = x264_pixel_size[m->i_pixel].w;
@@ -769,6 +793,112 @@ void x264_me_search_ref( x264_t *h, x264_me_t *m, int16_t (*mvc)[2], int i_mvc,
 #endif
         }
         break;
+
+        case X264_ME_PYR:
+        {
+            /* Pyramid search: look for the motion in the quarter and half size reconstructions
+             * first, where a window of a given range costs 16 and 4 times fewer compares, then
+             * refine the few best results at full size.  Partitions too small to scale down, and
+             * blocks whose predictors are already good (same threshold as umh's first early
+             * termination), just get the hexagon search around the best predictor. */
+            static const uint8_t pyr_levels[7] = { 2, 1, 1, 1, 0, 0, 0 };
+            int levels = m->pyr ? pyr_levels[i_pixel] : 0;
+            if( !levels || bcost < 2000*bw*bh >> 8 )
+                goto me_hex2;
+
+            ALIGNED_ARRAY_16( pixel, pyr_fenc,[2],[8*FENC_STRIDE] );
+            for( int l = 0; l < levels; l++ )
+                x264_frame_pyramid_scale( pyr_fenc[l], FENC_STRIDE, l ? pyr_fenc[l-1] : p_fenc, FENC_STRIDE,
+                                          bw >> (l+1), bh >> (l+1) );
+
+            /* Start from the full size predictors, plus the motion the lookahead found for this mb
+             * if it searched between these two frames. */
+            pyr_cand_t keep[2][PYR_KEEP] = {{{ 0, { bmx, bmy } }, { 0, { pmx, pmy } }, { 0, { 0, 0 } }}};
+            int nkeep = 3;
+            int dist = h->fenc->i_frame - m->pyr->i_frame;
+            int list = dist < 0;
+            dist = abs( dist ) - 1;
+            if( dist <= h->param.i_bframe && h->fenc->lowres_mvs[list][dist] &&
+                h->fenc->lowres_mvs[list][dist][0][0] != 0x7FFF )
+            {
+                int16_t *lowres_mv = h->fenc->lowres_mvs[list][dist][h->mb.i_mb_xy];
+                keep[0][nkeep++] = (pyr_cand_t){ 0, { (lowres_mv[0] + 1) >> 1, (lowres_mv[1] + 1) >> 1 } };
+            }
+
+            for( int l = levels; l > 0; l-- )
+            {
+                int lpixel = x264_size2pixel[bh >> (l+2)][bw >> (l+2)];
+                pixel *lfenc = pyr_fenc[l-1];
+                intptr_t lstride = m->pyr->i_stride_pyramid[l-1];
+                pixel *lref = m->pyr->pyramid[l-1] + (m->i_pix_y >> l)*lstride + (m->i_pix_x >> l);
+                /* Round the limits inwards so that the search never reads outside what the full
+                 * size search may. */
+                int lx_min = -(-mv_x_min >> l), lx_max = mv_x_max >> l;
+                int ly_min = -(-mv_y_min >> l), ly_max = mv_y_max >> l;
+                pyr_cand_t *prev = keep[(levels-l)&1];
+                pyr_cand_t *next = keep[(levels-l+1)&1];
+                int nprev = nkeep;
+                nkeep = 0;
+                if( lx_min > lx_max || ly_min > ly_max )
+                    break;
+#define COST_MV_PYR( mx, my )\
+do\
+{\
+    int cost = (h->pixf.fpelcmp[lpixel]( lfenc, FENC_STRIDE, &lref[(my)*lstride+(mx)], lstride ) << (2*l))\
+             + BITS_MVD( (mx) << l, (my) << l );\
+    pyr_keep( next, &nkeep, cost, mx, my );\
+} while( 0 )
+
+                if( l == levels )
+                {
+                    /* Pick the best starting point, then search exhaustively around it: twice
+                     * merange at full size for 16x16, half of it for the partitions, which start
+                     * from the 16x16 vector. */
+                    for( int i = 0; i < nprev; i++ )
+                    {
+                        int mx = x264_clip3( (prev[i].mv[0] + (1 << l >> 1)) >> l, lx_min, lx_max );
+                        int my = x264_clip3( (prev[i].mv[1] + (1 << l >> 1)) >> l, ly_min, ly_max );
+                        COST_MV_PYR( mx, my );
+                    }
+                    int range = X264_MAX( i_me_range >> (3 - levels), 1 );
+                    int x0 = X264_MAX( next[0].mv[0] - range, lx_min ), x1 = X264_MIN( next[0].mv[0] + range, lx_max );
+                    int y0 = X264_MAX( next[0].mv[1] - range, ly_min ), y1 = X264_MIN( next[0].mv[1] + range, ly_max );
+                    for( int my = y0; my <= y1; my++ )
+                    {
+                        pixel *row = lref + my*lstride;
+                        int mx = x0;
+                        for( ; mx + 3 <= x1; mx += 4 )
+                        {
+                            h->pixf.fpelcmp_x4[lpixel]( lfenc, row+mx, row+mx+1, row+mx+2, row+mx+3, lstride, costs );
+                            for( int i = 0; i < 4; i++ )
+                                pyr_keep( next, &nkeep, (costs[i] << (2*l)) + BITS_MVD( (mx+i) << l, my << l ), mx+i, my );
+                        }
+                        for( ; mx <= x1; mx++ )
+                            COST_MV_PYR( mx, my );
+                    }
+                }
+                else
+                {
+                    /* Refine the coarser level's results by a pixel in each direction. */
+                    for( int i = 0; i < nprev; i++ )
+                        for( int j = 0; j < 9; j++ )
+                        {
+                            int mx = 2*prev[i].mv[0] + square1[j][0];
+                            int my = 2*prev[i].mv[1] + square1[j][1];
+                            if( mx >= lx_min && mx <= lx_max && my >= ly_min && my <= ly_max )
+                                COST_MV_PYR( mx, my );
+                        }
+                }
+#undef COST_MV_PYR
+            }
+
+            /* Rounding the limits inwards kept these inside the full size ones. */
+            pyr_cand_t *last = keep[levels&1];
+            for( int i = 0; i < nkeep; i++ )
+                if( 2*last[i].mv[0] != bmx || 2*last[i].mv[1] != bmy )
+                    COST_MV( 2*last[i].mv[0], 2*last[i].mv[1] );
+            goto me_hex2;
+        }
     }
 
     /* -> qpel mv */
@@ -809,6 +939,16 @@ void x264_me_refine_qpel( x264_t *h, x264_me_t *m )
     refine_subpel( h, m, hpel, qpel, NULL, 1 );
 }
 
+void x264_me_refine_subpel( x264_t *h, x264_me_t *m )
+{
+    if( h->mb.i_subpel_refine >= 2 )
+    {
+        int hpel = subpel_iterations[h->mb.i_subpel_refine][2];
+        int qpel = subpel_iterations[h->mb.i_subpel_refine][3];
+        refine_subpel( h, m, hpel, qpel, NULL, 0 );
+    }
+}
+
 void x264_me_refine_qpel_refdupe( x264_t *h, x264_me_t *m, int *p_halfpel_thresh )
 {
     refine_subpel( h, m, 0, X264_MIN( 2, subpel_iterations[h->mb.i_subpel_refine][3] ), p_halfpel_thresh, 0 );
@@ -817,6 +957,7 @@ void x264_me_refine_qpel_refdupe( x264_t *h, x264_me_t *m, int *p_halfpel_thresh
 #define COST_MV_SAD( mx, my ) \
 { \
     intptr_t stride = 16; \
+    x264_me_hpel_ensure( h, m, mx, my, bw, bh ); \
     pixel *src = h->mc.get_ref( pix, &stride, m->p_fref, m->i_stride[0], mx, my, bw, bh, &m->weight[0] ); \
     int cost = h->pixf.fpelcmp[i_pixel]( m->p_fenc[0], FENC_STRIDE, src, stride ) \
              + p_cost_mvx[ mx ] + p_cost_mvy[ my ]; \
@@ -827,6 +968,7 @@ void x264_me_refine_qpel_refdupe( x264_t *h, x264_me_t *m, int *p_halfpel_thresh
 if( b_refine_qpel || (dir^1) != odir ) \
 { \
     intptr_t stride = 16; \
+    x264_me_hpel_ensure( h, m, mx, my, bw, bh ); \
     pixel *src = h->mc.get_ref( pix, &stride, &m->p_fref[0], m->i_stride[0], mx, my, bw, bh, &m->weight[0] ); \
     int cost = h->pixf.mbcmp_unaligned[i_pixel]( m->p_fenc[0], FENC_STRIDE, src, stride ) \
              + p_cost_mvx[ mx ] + p_cost_mvy[ my ]; \
@@ -900,6 +1042,8 @@ static void refine_subpel( x264_t *h, x264_me_t *m, int hpel_iters, int qpel_ite
             int omx = bmx, omy = bmy;
             intptr_t stride = 64; // candidates are either all hpel or all qpel, so one stride is enough
             pixel *src0, *src1, *src2, *src3;
+            x264_me_hpel_ensure( h, m, omx, omy-2, bw, bh+1 );
+            x264_me_hpel_ensure( h, m, omx-2, omy, bw+4, bh );
             src0 = h->mc.get_ref( pix,    &stride, m->p_fref, m->i_stride[0], omx, omy-2, bw, bh+1, &m->weight[0] );
             src2 = h->mc.get_ref( pix+32, &stride, m->p_fref, m->i_stride[0], omx-2, omy, bw+4, bh, &m->weight[0] );
             src1 = src0 + stride;
@@ -966,6 +1110,10 @@ static void refine_subpel( x264_t *h, x264_me_t *m, int hpel_iters, int qpel_ite
     {
         int omx = bmx, omy = bmy;
         /* We have to use mc_luma because all strides must be the same to use fpelcmp_x4 */
+        x264_me_hpel_ensure( h, m, omx, omy-1, bw, bh );
+        x264_me_hpel_ensure( h, m, omx, omy+1, bw, bh );
+        x264_me_hpel_ensure( h, m, omx-1, omy, bw, bh );
+        x264_me_hpel_ensure( h, m, omx+1, omy, bw, bh );
         h->mc.mc_luma( pix   , 64, m->p_fref, m->i_stride[0], omx, omy-1, bw, bh, &m->weight[0] );
         h->mc.mc_luma( pix+16, 64, m->p_fref, m->i_stride[0], omx, omy+1, bw, bh, &m->weight[0] );
         h->mc.mc_luma( pix+32, 64, m->p_fref, m->i_stride[0], omx-1, omy, bw, bh, &m->weight[0] );
@@ -998,6 +1146,7 @@ static void refine_subpel( x264_t *h, x264_me_t *m, int hpel_iters, int qpel_ite
     int mvx = bm##list##x+dx;\
     int mvy = bm##list##y+dy;\
     stride[0][list][i] = bw;\
+    x264_me_hpel_ensure( h, m, mvx, mvy, bw, bh );\
     src[0][list][i] = h->mc.get_ref( pixy_buf[list][i], &stride[0][list][i], &m->p_fref[0],\
                                      m->i_stride[0], mvx, mvy, bw, bh, x264_weight_none );\
     if( rd )\
@@ -1196,6 +1345,7 @@ void x264_me_refine_bidir_rd( x264_t *h, x264_me_t *m0, x264_me_t *m1, int i_wei
 { \
     if( !avoid_mvp || !(mx == pmx && my == pmy) ) \
     { \
+        x264_me_hpel_ensure( h, m, mx, my, bw, bh ); \
         h->mc.mc_luma( pix, FDEC_STRIDE, m->p_fref, m->i_stride[0], mx, my, bw, bh, &m->weight[0] ); \
         dst = h->pixf.mbcmp[i_pixel]( m->p_fenc[0], FENC_STRIDE, pix, FDEC_STRIDE ) \
             + p_cost_mvx[mx] + p_cost_mvy[my]; \
@@ -1213,6 +1363,7 @@ void x264_me_refine_bidir_rd( x264_t *h, x264_me_t *m0, x264_me_t *m1, int i_wei
         M32( cache_mv ) = pack16to32_mask(mx,my); \
         if( CHROMA444 ) \
         { \
+            x264_me_hpel_ensure( h, m, mx, my, bw, bh ); \
             h->mc.mc_luma( pixu, FDEC_STRIDE, &m->p_fref[4], m->i_stride[1], mx, my, bw, bh, &m->weight[1] ); \
             h->mc.mc_luma( pixv, FDEC_STRIDE, &m->p_fref[8], m->i_stride[2], mx, my, bw, bh, &m->weight[2] ); \
         } \
@@ -46,6 +46,10 @@ typedef struct
     pixel *p_fenc[3];
     uint16_t *integral;
     int      i_stride[3];
+    x264_frame_t *fref;  /* with lazy hpel, the frame p_fref points into, else NULL */
+    int      i_pix_x;    /* and the position of the block in it */
+    int      i_pix_y;
+    x264_frame_t *pyr;   /* with me=pyr, the frame whose pyramid to search, else NULL */
 
     ALIGNED_4( int16_t mvp[2] );
 
@@ -62,6 +66,9 @@ void x264_me_search_ref( x264_t *h, x264_me_t *m, int16_t (*mvc)[2], int i_mvc,
 
 #define x264_me_refine_qpel x264_template(me_refine_qpel)
 void x264_me_refine_qpel( x264_t *h, x264_me_t *m );
+/* The subpel stage of x264_me_search, for a fullpel m->mv and its fpelcmp m->cost found some other way. */
+#define x264_me_refine_subpel x264_template(me_refine_subpel)
+void x264_me_refine_subpel( x264_t *h, x264_me_t *m );
 #define x264_me_refine_qpel_refdupe x264_template(me_refine_qpel_refdupe)
 void x264_me_refine_qpel_refdupe( x264_t *h, x264_me_t *m, int *p_halfpel_thresh );
 #define x264_me_refine_qpel_rd x264_template(me_refine_qpel_rd)
@@ -73,6 +80,17 @@ void x264_me_refine_bidir_satd( x264_t *h, x264_me_t *m0, x264_me_t *m1, int i_w
 #define x264_rd_cost_part x264_template(rd_cost_part)
 uint64_t x264_rd_cost_part( x264_t *h, int i_lambda2, int i8, int i_pixel );
 
+/* With lazy hpel, filter the tiles of m's reference that MC of a bw x bh block at mv (mx,my) reads. */
+static ALWAYS_INLINE void x264_me_hpel_ensure( x264_t *h, x264_me_t *m, int mx, int my, int bw, int bh )
+{
+    if( m->fref && ((mx|my)&3) )
+    {
+        int x = m->i_pix_x + (mx>>2);
+        int y = m->i_pix_y + (my>>2);
+        x264_frame_hpel_ensure( h, m->fref, x, y, x+bw+1, y+bh+1 );
+    }
+}
+
 #define COPY1_IF_LT(x,y)\
 if( (y) < (x) )\
     (x) = (y);
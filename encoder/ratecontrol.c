@@ -32,6 +32,8 @@
 #include "common/common.h"
 #include "ratecontrol.h"
 #include "me.h"
+#include "ladder.h"
+#include "statsfile.h"
 
 typedef struct
 {
@@ -58,6 +60,7 @@ typedef struct
     int64_t i_duration;
     int64_t i_cpb_duration;
     int out_num;
+    const uint8_t *mbtree;      /* binary stats: this frame's MB-tree data, in the stats file */
 } ratecontrol_entry_t;
 
 typedef struct
@@ -69,6 +72,75 @@ typedef struct
     float offset;
 } predictor_t;
 
+/* What the 2nd pass qscale planning carries from one frame to the next: the qp step limit and
+ * the I/B qscales depend on the frames before. */
+typedef struct
+{
+    double last_qscale_for[3];
+    int last_non_b_pict_type;
+    double accum_p_qp;
+    double accum_p_norm;
+    double last_accum_p_norm;
+} rc_plan_state_t;
+
+/* Windowed 2nd pass (--stats-window): entry[] is a ring around the frames being encoded,
+ * filled from the binary stats as the encode goes.  The rate factor comes from a summary
+ * of the whole file built by one streaming pass at init, and each block of frames is then
+ * planned as init_pass2 plans the whole file, looking a margin of frames past the block.
+ * The lookahead and the frame threads all ask for entries, so everything below is under mutex. */
+typedef struct
+{
+    x264_pthread_mutex_t mutex;
+    int block;                  /* frames planned at a time, in display order */
+    int margin;                 /* frames after a block that its planning takes into account */
+    int radius;                 /* complexity blur reach */
+    int reorder;                /* maximum distance between display and coded order */
+    int filter;                 /* qblur filter size */
+    int *slot_frame;            /* frame held by each slot of the ring, -1 if none */
+    double *qscale;             /* planning buffers */
+    double *blurred_qscale;
+    double *fills;              /* VBV fill of the block being planned */
+    int next_coded;             /* next stats record to load */
+    int blurred;                /* frames below this have their blurred complexity */
+    int planned;                /* frames below this have their new_qscale */
+    float res_factor;
+    float res_factor_bits;
+    double rate_factor;         /* rate factor of the whole file, from the summary */
+    double block_rate_factor;   /* rate factor of the next block, corrected for the summary's error */
+    double ideal_bits;          /* bits of the planned frames as the summary predicts them */
+    double model_bits;          /* the same at the rate factors they were planned with */
+    double unclipped_bits;      /* bits of the planned frames as planned, before VBV */
+    double planned_bits;        /* the same after VBV */
+    double total_bits;          /* expected bits of the whole file */
+    double expected_bits;       /* expected bits of the frames started so far */
+    double vbv_fill;            /* expected VBV fill after the planned frames */
+    double accum_p_qp;          /* the planner's, carried from block to block as init_pass2 carries it from step to step */
+    int b_vbv_warned;
+} rc_stream_t;
+
+/* Estimate mode (rc.b_estimate): each frame is planned as 1-pass CRF plans it at the CRF of the
+ * params, and its predicted size is binned by the offset of its qp from that CRF.  The offsets
+ * don't depend on the CRF, so the bins give the size at any other CRF, qp limits included. */
+#define ESTIMATE_BINS       1024
+#define ESTIMATE_BIN_SCALE  8     /* bins per qp */
+#define ESTIMATE_BIN_OFFSET 64    /* qp offset of the first bin, negated */
+#define ESTIMATE_REFS       8
+
+typedef struct
+{
+    double bits[3][ESTIMATE_BINS]; /* predicted bits at the CRF of the params, per slice type */
+    double seconds;
+    int frames;
+    int anchor_satd;            /* satd of the last I/P-frame, which B-frames are predicted from */
+    int i_refs;                 /* reference frames planned so far */
+    struct
+    {
+        int i_frame;
+        int i_type;
+        float qp;
+    } refs[ESTIMATE_REFS];      /* the last ones, for the qps of B-frames */
+} rc_estimate_t;
+
 struct x264_ratecontrol_t
 {
     /* constants */
@@ -124,10 +196,18 @@ struct x264_ratecontrol_t
     char *psz_mbtree_stat_file_tmpname;
     char *psz_mbtree_stat_file_name;
     FILE *p_mbtree_stat_file_in;
+    x264_statsfile_t *stats_in; /* binary stats being read, shared by all threads */
+    x264_statsfile_writer_t *stats_out;
 
     int num_entries;            /* number of ratecontrol_entry_ts */
+    int entry_offset;           /* stats range: entry of the first frame encoded */
+    int range_entries;          /* number of entries encoded */
+    double expected_bits_offset; /* expected bits of the frames before the range */
     ratecontrol_entry_t *entry; /* FIXME: copy needed data and free this once init is done */
     ratecontrol_entry_t **entry_out;
+    int entry_mask;             /* entry[i & entry_mask] is frame i: -1, or the ring size - 1 when streaming */
+    rc_stream_t *stream;        /* windowed 2nd pass, shared by all threads */
+    rc_estimate_t *estimate;
     double last_qscale;
     double last_qscale_for[3];  /* last qscale for a specific pict type, used for max_diff & ipb factor stuff */
     int last_non_b_pict_type;
@@ -180,6 +260,10 @@ struct x264_ratecontrol_t
 
 static int parse_zones( x264_t *h );
 static int init_pass2(x264_t *);
+static int stream_init( x264_t *h, float res_factor, float res_factor_bits, double *total_qp_aq );
+static ratecontrol_entry_t *rc_entry( x264_t *h, int frame );
+static const ratecontrol_entry_t *rc_entry_frame( x264_t *h, const ratecontrol_entry_t *rce, ratecontrol_entry_t *tmp );
+static void stream_start( x264_t *h, ratecontrol_entry_t *rce );
 static float rate_estimate_qscale( x264_t *h );
 static int update_vbv( x264_t *h, int bits );
 static void update_vbv_plan( x264_t *h, int overhead );
@@ -428,7 +512,8 @@ static int macroblock_tree_rescale_init( x264_t *h, x264_ratecontrol_t *rc )
 
     rc->mbtree.src_mb_count = srcdimi[0] * srcdimi[1];
 
-    CHECKED_MALLOC( rc->mbtree.qp_buffer[0], rc->mbtree.src_mb_count * sizeof(uint16_t) );
+    /* A ladder follower can write first pass stats of a different size than it reads. */
+    CHECKED_MALLOC( rc->mbtree.qp_buffer[0], X264_MAX( rc->mbtree.src_mb_count, h->mb.i_mb_count ) * sizeof(uint16_t) );
     if( h->param.i_bframe_pyramid && h->param.rc.b_stat_read )
         CHECKED_MALLOC( rc->mbtree.qp_buffer[1], rc->mbtree.src_mb_count * sizeof(uint16_t) );
     rc->mbtree.qpbuf_pos = -1;
@@ -505,13 +590,13 @@ static ALWAYS_INLINE float tapfilter( float *src, int pos, int max, int stride,
     return sum;
 }
 
-static void macroblock_tree_rescale( x264_t *h, x264_ratecontrol_t *rc, float *dst )
+static void macroblock_tree_rescale( x264_t *h, x264_ratecontrol_t *rc, float *src, float *dst )
 {
     float *input, *output;
     int filtersize, stride, height;
 
     /* H scale first */
-    input = rc->mbtree.scale_buffer[0];
+    input = src;
     output = rc->mbtree.scale_buffer[1];
     filtersize = rc->mbtree.filtersize[0];
     stride = rc->mbtree.srcdim[0];
@@ -540,12 +625,25 @@ static void macroblock_tree_rescale( x264_t *h, x264_ratecontrol_t *rc, float *d
 int x264_macroblock_tree_read( x264_t *h, x264_frame_t *frame, float *quant_offsets )
 {
     x264_ratecontrol_t *rc = h->rc;
-    uint8_t i_type_actual = rc->entry[frame->i_frame].pict_type;
+    ratecontrol_entry_t *rce = rc_entry( h, frame->i_frame );
+    uint8_t i_type_actual = rce->pict_type;
 
-    if( rc->entry[frame->i_frame].kept_as_ref )
+    if( rce->kept_as_ref )
     {
         uint8_t i_type;
-        if( rc->mbtree.qpbuf_pos < 0 )
+        uint16_t *qp_buffer;
+        /* The binary stats are indexed, so the frame's data is found without reading ahead.
+         * It's copied out of the file, where it isn't aligned. */
+        if( rc->stats_in )
+        {
+            ratecontrol_entry_t tmp;
+            const ratecontrol_entry_t *rcf = rc_entry_frame( h, rce, &tmp );
+            if( !rcf->mbtree )
+                goto fail;
+            qp_buffer = rc->mbtree.qp_buffer[0];
+            memcpy( qp_buffer, rcf->mbtree, rc->mbtree.src_mb_count * sizeof(uint16_t) );
+        }
+        else if( rc->mbtree.qpbuf_pos < 0 )
         {
             do
             {
@@ -563,15 +661,16 @@ int x264_macroblock_tree_read( x264_t *h, x264_frame_t *frame, float *quant_offs
                 }
             } while( i_type != i_type_actual );
         }
+        if( !rc->stats_in )
+            qp_buffer = rc->mbtree.qp_buffer[rc->mbtree.qpbuf_pos--];
 
         float *dst = rc->mbtree.rescale_enabled ? rc->mbtree.scale_buffer[0] : frame->f_qp_offset;
-        h->mc.mbtree_fix8_unpack( dst, rc->mbtree.qp_buffer[rc->mbtree.qpbuf_pos], rc->mbtree.src_mb_count );
+        h->mc.mbtree_fix8_unpack( dst, qp_buffer, rc->mbtree.src_mb_count );
         if( rc->mbtree.rescale_enabled )
-            macroblock_tree_rescale( h, rc, frame->f_qp_offset );
+            macroblock_tree_rescale( h, rc, dst, frame->f_qp_offset );
         if( h->frames.b_have_lowres )
             for( int i = 0; i < h->mb.i_mb_count; i++ )
                 frame->i_inv_qscale_factor[i] = x264_exp2fix8( frame->f_qp_offset[i] );
-        rc->mbtree.qpbuf_pos--;
     }
     else
         x264_adaptive_quant_frame( h, frame, quant_offsets );
@@ -581,9 +680,21 @@ fail:
     return -1;
 }
 
+void x264_macroblock_tree_ladder( x264_t *h, x264_frame_t *frame, float *qp_offset )
+{
+    /* Called from the lookahead, which has no ratecontrol of its own. */
+    x264_ratecontrol_t *rc = h->thread[0]->rc;
+
+    if( rc->mbtree.rescale_enabled )
+        macroblock_tree_rescale( h, rc, qp_offset, frame->f_qp_offset );
+    else
+        memcpy( frame->f_qp_offset, qp_offset, h->mb.i_mb_count * sizeof(float) );
+}
+
 int x264_reference_build_list_optimal( x264_t *h )
 {
-    ratecontrol_entry_t *rce = h->rc->rce;
+    ratecontrol_entry_t tmp;
+    const ratecontrol_entry_t *rce = rc_entry_frame( h, h->rc->rce, &tmp );
     x264_frame_t *frames[16];
     x264_weight_t weights[16][3];
     int refcount[16];
@@ -740,6 +851,204 @@ void x264_ratecontrol_init_reconfigurable( x264_t *h, int b_init )
     }
 }
 
+static int parse_frame_type( ratecontrol_entry_t *rce, char pict_type )
+{
+    if( pict_type != 'b' )
+        rce->kept_as_ref = 1;
+    switch( pict_type )
+    {
+        case 'I':
+            rce->frame_type = X264_TYPE_IDR;
+            rce->pict_type  = SLICE_TYPE_I;
+            break;
+        case 'i':
+            rce->frame_type = X264_TYPE_I;
+            rce->pict_type  = SLICE_TYPE_I;
+            break;
+        case 'P':
+            rce->frame_type = X264_TYPE_P;
+            rce->pict_type  = SLICE_TYPE_P;
+            break;
+        case 'B':
+            rce->frame_type = X264_TYPE_BREF;
+            rce->pict_type  = SLICE_TYPE_B;
+            break;
+        case 'b':
+            rce->frame_type = X264_TYPE_B;
+            rce->pict_type  = SLICE_TYPE_B;
+            break;
+        default:
+            return -1;
+    }
+    return 0;
+}
+
+static int read_stats_text( x264_t *h, char *p, float res_factor, float res_factor_bits, double *total_qp_aq )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    for( int i = 0; i < rc->num_entries; i++ )
+    {
+        ratecontrol_entry_t *rce;
+        int frame_number = 0;
+        int frame_out_number = 0;
+        char pict_type = 0;
+        int e;
+        char *next;
+        float qp_rc, qp_aq;
+        int ref;
+
+        next= strchr(p, ';');
+        if( next )
+            *next++ = 0; //sscanf is unbelievably slow on long strings
+        e = sscanf( p, " in:%d out:%d ", &frame_number, &frame_out_number );
+
+        if( frame_number < 0 || frame_number >= rc->num_entries )
+        {
+            x264_log( h, X264_LOG_ERROR, "bad frame number (%d) at stats line %d\n", frame_number, i );
+            return -1;
+        }
+        if( frame_out_number < 0 || frame_out_number >= rc->num_entries )
+        {
+            x264_log( h, X264_LOG_ERROR, "bad frame output number (%d) at stats line %d\n", frame_out_number, i );
+            return -1;
+        }
+        rce = &rc->entry[frame_number];
+        rc->entry_out[frame_out_number] = rce;
+        rce->direct_mode = 0;
+
+        e += sscanf( p, " in:%*d out:%*d type:%c dur:%"SCNd64" cpbdur:%"SCNd64" q:%f aq:%f tex:%d mv:%d misc:%d imb:%d pmb:%d smb:%d d:%c",
+               &pict_type, &rce->i_duration, &rce->i_cpb_duration, &qp_rc, &qp_aq, &rce->tex_bits,
+               &rce->mv_bits, &rce->misc_bits, &rce->i_count, &rce->p_count,
+               &rce->s_count, &rce->direct_mode );
+        rce->tex_bits  *= res_factor_bits;
+        rce->mv_bits   *= res_factor_bits;
+        rce->misc_bits *= res_factor_bits;
+        rce->i_count   *= res_factor;
+        rce->p_count   *= res_factor;
+        rce->s_count   *= res_factor;
+
+        p = strstr( p, "ref:" );
+        if( !p )
+            goto parse_error;
+        p += 4;
+        for( ref = 0; ref < 16; ref++ )
+        {
+            if( sscanf( p, " %d", &rce->refcount[ref] ) != 1 )
+                break;
+            p = strchr( p+1, ' ' );
+            if( !p )
+                goto parse_error;
+        }
+        rce->refs = ref;
+
+        /* find weights */
+        rce->i_weight_denom[0] = rce->i_weight_denom[1] = -1;
+        char *w = strchr( p, 'w' );
+        if( w )
+        {
+            int count = sscanf( w, "w:%hd,%hd,%hd,%hd,%hd,%hd,%hd,%hd",
+                                &rce->i_weight_denom[0], &rce->weight[0][0], &rce->weight[0][1],
+                                &rce->i_weight_denom[1], &rce->weight[1][0], &rce->weight[1][1],
+                                &rce->weight[2][0], &rce->weight[2][1] );
+            if( count == 3 )
+                rce->i_weight_denom[1] = -1;
+            else if( count != 8 )
+                rce->i_weight_denom[0] = rce->i_weight_denom[1] = -1;
+        }
+
+        if( parse_frame_type( rce, pict_type ) < 0 )
+            e = -1;
+        if( e < 14 )
+        {
+parse_error:
+            x264_log( h, X264_LOG_ERROR, "statistics are damaged at line %d, parser out=%d\n", i, e );
+            return -1;
+        }
+        rce->qscale = qp2qscale( qp_rc );
+        *total_qp_aq += qp_aq;
+        p = next;
+    }
+    return 0;
+}
+
+static int decode_record( x264_t *h, int i_frame_out, x264_statsfile_record_t *rec )
+{
+    if( x264_statsfile_read( h->rc->stats_in, i_frame_out, rec ) < 0 )
+    {
+        x264_log( h, X264_LOG_ERROR, "statistics are damaged in record %d\n", i_frame_out );
+        return -1;
+    }
+    if( rec->i_frame < 0 || rec->i_frame >= h->rc->num_entries )
+    {
+        x264_log( h, X264_LOG_ERROR, "bad frame number (%d) in stats record %d\n", rec->i_frame, i_frame_out );
+        return -1;
+    }
+    return 0;
+}
+
+/* Only what the planning needs is taken from the record here; the rest of it is decoded
+ * again by rc_entry_frame when the frame is encoded. */
+static int read_record( x264_t *h, ratecontrol_entry_t *rce, const x264_statsfile_record_t *rec,
+                        float res_factor, float res_factor_bits )
+{
+    if( parse_frame_type( rce, rec->c_type ) < 0 )
+    {
+        x264_log( h, X264_LOG_ERROR, "statistics are damaged in record %d\n", rec->i_frame_out );
+        return -1;
+    }
+    rce->i_duration     = rec->i_duration;
+    rce->i_cpb_duration = rec->i_cpb_duration;
+    rce->tex_bits       = rec->i_tex_bits * res_factor_bits;
+    rce->mv_bits        = rec->i_mv_bits * res_factor_bits;
+    rce->misc_bits      = rec->i_misc_bits * res_factor_bits;
+    rce->i_count        = rec->i_mb_count_i * res_factor;
+    rce->p_count        = rec->i_mb_count_p * res_factor;
+    rce->s_count        = rec->i_mb_count_skip * res_factor;
+    rce->out_num        = rec->i_frame_out;
+    if( h->param.rc.b_mb_tree && rce->kept_as_ref && !rec->mbtree )
+    {
+        x264_log( h, X264_LOG_ERROR, "MB-tree data missing for frame %d in stats file\n", rec->i_frame );
+        return -1;
+    }
+    rce->qscale = qp2qscale( rec->f_qp_rc );
+    return 0;
+}
+
+static int read_stats_binary( x264_t *h, float res_factor, float res_factor_bits, double *total_qp_aq )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    for( int i = 0; i < rc->num_entries; i++ )
+    {
+        x264_statsfile_record_t rec;
+        if( decode_record( h, i, &rec ) < 0 )
+            return -1;
+        ratecontrol_entry_t *rce = &rc->entry[rec.i_frame];
+        rc->entry_out[i] = rce;
+        if( read_record( h, rce, &rec, res_factor, res_factor_bits ) < 0 )
+            return -1;
+        *total_qp_aq += rec.f_qp_aq;
+    }
+    return 0;
+}
+
+/* The frames of a stats range have to be coded by themselves, so that the chunks can be concatenated. */
+static int check_stats_range( x264_t *h )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    int end = rc->entry_offset + rc->range_entries;
+    if( rc->entry[rc->entry_offset].frame_type != X264_TYPE_IDR || rc->entry_out[rc->entry_offset] != &rc->entry[rc->entry_offset] )
+    {
+        x264_log( h, X264_LOG_ERROR, "stats range must start at an IDR frame, frame %d isn't one\n", rc->entry_offset );
+        return -1;
+    }
+    if( end < rc->num_entries && rc->entry[end].frame_type != X264_TYPE_IDR )
+    {
+        x264_log( h, X264_LOG_ERROR, "stats range must end before an IDR frame, frame %d isn't one\n", end );
+        return -1;
+    }
+    return 0;
+}
+
 int x264_ratecontrol_new( x264_t *h )
 {
     x264_ratecontrol_t *rc;
@@ -771,6 +1080,7 @@ int x264_ratecontrol_new( x264_t *h )
     rc->nmb = h->mb.i_mb_count;
     rc->last_non_b_pict_type = -1;
     rc->cbr_decay = 1.0;
+    rc->entry_mask = -1;
 
     if( h->param.rc.i_rc_method != X264_RC_ABR && h->param.rc.b_stat_read )
     {
@@ -826,7 +1136,7 @@ int x264_ratecontrol_new( x264_t *h )
 
     rc->lstep = pow( 2, h->param.rc.i_qp_step / 6.0 );
     rc->last_qscale = qp2qscale( 26 + QP_BD_OFFSET );
-    int num_preds = h->param.b_sliced_threads * h->param.i_threads + 1;
+    int num_preds = h->param.b_sliced_threads * h->param.i_slice_threads + 1;
     CHECKED_MALLOC( rc->pred, 5 * sizeof(predictor_t) * num_preds );
     CHECKED_MALLOC( rc->pred_b_from_p, sizeof(predictor_t) );
     static const float pred_coeff_table[3] = { 1.0, 1.0, 1.5 };
@@ -857,6 +1167,8 @@ int x264_ratecontrol_new( x264_t *h )
     rc->pred_b_from_p->count = 1.0;
     rc->pred_b_from_p->decay = 0.5;
     rc->pred_b_from_p->offset = 0.0;
+    if( h->param.rc.b_estimate )
+        CHECKED_MALLOCZERO( rc->estimate, sizeof(rc_estimate_t) );
 
     if( parse_zones( h ) < 0 )
     {
@@ -867,17 +1179,31 @@ int x264_ratecontrol_new( x264_t *h )
     /* Load stat file and init 2pass algo */
     if( h->param.rc.b_stat_read )
     {
-        char *p, *stats_in, *stats_buf;
+        char *p, *stats_in = NULL, *stats_buf = NULL;
+        const char *opts;
 
         /* read 1st pass stats */
         assert( h->param.rc.psz_stat_in );
-        stats_buf = stats_in = x264_slurp_file( h->param.rc.psz_stat_in );
-        if( !stats_buf )
+        if( x264_statsfile_probe( h->param.rc.psz_stat_in ) )
+        {
+            int ret = x264_statsfile_open( &rc->stats_in, h->param.rc.psz_stat_in );
+            if( ret < 0 )
+            {
+                x264_log( h, X264_LOG_ERROR, ret == -2 ? "stats file is damaged\n" : "ratecontrol_init: can't open stats file\n" );
+                return -1;
+            }
+            opts = rc->stats_in->options;
+            /* An Nth pass writes its stats back in the format it read them in. */
+            h->param.rc.b_stat_binary |= h->param.rc.b_stat_write;
+        }
+        else if( !(stats_buf = stats_in = x264_slurp_file( h->param.rc.psz_stat_in )) )
         {
             x264_log( h, X264_LOG_ERROR, "ratecontrol_init: can't open stats file\n" );
             return -1;
         }
-        if( h->param.rc.b_mb_tree )
+        else
+            opts = stats_buf;
+        if( h->param.rc.b_mb_tree && !rc->stats_in )
         {
             char *mbtree_stats_in = strcat_filename( h->param.rc.psz_stat_in, ".mbtree" );
             if( !mbtree_stats_in )
@@ -892,7 +1218,7 @@ int x264_ratecontrol_new( x264_t *h )
         }
 
         /* check whether 1st pass options were compatible with current options */
-        if( strncmp( stats_buf, "#options:", 9 ) )
+        if( strncmp( opts, "#options:", 9 ) )
         {
             x264_log( h, X264_LOG_ERROR, "options list in stats file not valid\n" );
             return -1;
@@ -902,12 +1228,14 @@ int x264_ratecontrol_new( x264_t *h )
         {
             int i, j;
             uint32_t k, l;
-            char *opts = stats_buf;
-            stats_in = strchr( stats_buf, '\n' );
-            if( !stats_in )
-                return -1;
-            *stats_in = '\0';
-            stats_in++;
+            if( stats_buf )
+            {
+                stats_in = strchr( stats_buf, '\n' );
+                if( !stats_in )
+                    return -1;
+                *stats_in = '\0';
+                stats_in++;
+            }
             if( sscanf( opts, "#options: %dx%d", &i, &j ) != 2 )
             {
                 x264_log( h, X264_LOG_ERROR, "resolution specified in stats file not valid\n" );
@@ -992,29 +1320,59 @@ int x264_ratecontrol_new( x264_t *h )
         }
 
         /* find number of pics */
-        p = stats_in;
         int num_entries;
-        for( num_entries = -1; p; num_entries++ )
-            p = strchr( p + 1, ';' );
+        if( rc->stats_in )
+            num_entries = rc->stats_in->i_frames;
+        else
+            for( p = stats_in, num_entries = -1; p; num_entries++ )
+                p = strchr( p + 1, ';' );
         if( !num_entries )
         {
             x264_log( h, X264_LOG_ERROR, "empty stats file\n" );
             return -1;
         }
         rc->num_entries = num_entries;
+        rc->range_entries = num_entries;
+        if( h->param.rc.i_stats_range_frames )
+        {
+            if( h->param.rc.i_stats_range_start + (int64_t)h->param.rc.i_stats_range_frames > rc->num_entries )
+            {
+                x264_log( h, X264_LOG_ERROR, "stats range %d-%d is beyond the %d frames of the 1st pass\n",
+                          h->param.rc.i_stats_range_start,
+                          h->param.rc.i_stats_range_start + h->param.rc.i_stats_range_frames - 1, rc->num_entries );
+                return -1;
+            }
+            rc->entry_offset = h->param.rc.i_stats_range_start;
+            rc->range_entries = h->param.rc.i_stats_range_frames;
+        }
 
-        if( h->param.i_frame_total < rc->num_entries && h->param.i_frame_total > 0 )
+        if( h->param.i_frame_total < rc->range_entries && h->param.i_frame_total > 0 )
         {
             x264_log( h, X264_LOG_WARNING, "2nd pass has fewer frames than 1st pass (%d vs %d)\n",
-                      h->param.i_frame_total, rc->num_entries );
+                      h->param.i_frame_total, rc->range_entries );
         }
-        if( h->param.i_frame_total > rc->num_entries )
+        if( h->param.i_frame_total > rc->range_entries )
         {
             x264_log( h, X264_LOG_ERROR, "2nd pass has more frames than 1st pass (%d vs %d)\n",
-                      h->param.i_frame_total, rc->num_entries );
+                      h->param.i_frame_total, rc->range_entries );
             return -1;
         }
 
+        if( h->param.rc.i_stats_window && !rc->stats_in )
+        {
+            x264_log( h, X264_LOG_WARNING, "stats window requires binary stats, planning the whole file\n" );
+            h->param.rc.i_stats_window = 0;
+        }
+        if( h->param.rc.i_stats_window )
+        {
+            double total_qp_aq = 0;
+            if( stream_init( h, res_factor, res_factor_bits, &total_qp_aq ) < 0 )
+                return -1;
+            if( !h->param.b_stitchable )
+                h->pps->i_pic_init_qp = SPEC_QP( (int)(total_qp_aq / rc->num_entries + 0.5) );
+            goto stats_done;
+        }
+
         CHECKED_MALLOCZERO( rc->entry, rc->num_entries * sizeof(ratecontrol_entry_t) );
         CHECKED_MALLOC( rc->entry_out, rc->num_entries * sizeof(ratecontrol_entry_t*) );
 
@@ -1030,114 +1388,12 @@ int x264_ratecontrol_new( x264_t *h )
         }
 
         /* read stats */
-        p = stats_in;
         double total_qp_aq = 0;
-        for( int i = 0; i < rc->num_entries; i++ )
-        {
-            ratecontrol_entry_t *rce;
-            int frame_number = 0;
-            int frame_out_number = 0;
-            char pict_type = 0;
-            int e;
-            char *next;
-            float qp_rc, qp_aq;
-            int ref;
-
-            next= strchr(p, ';');
-            if( next )
-                *next++ = 0; //sscanf is unbelievably slow on long strings
-            e = sscanf( p, " in:%d out:%d ", &frame_number, &frame_out_number );
-
-            if( frame_number < 0 || frame_number >= rc->num_entries )
-            {
-                x264_log( h, X264_LOG_ERROR, "bad frame number (%d) at stats line %d\n", frame_number, i );
-                return -1;
-            }
-            if( frame_out_number < 0 || frame_out_number >= rc->num_entries )
-            {
-                x264_log( h, X264_LOG_ERROR, "bad frame output number (%d) at stats line %d\n", frame_out_number, i );
-                return -1;
-            }
-            rce = &rc->entry[frame_number];
-            rc->entry_out[frame_out_number] = rce;
-            rce->direct_mode = 0;
-
-            e += sscanf( p, " in:%*d out:%*d type:%c dur:%"SCNd64" cpbdur:%"SCNd64" q:%f aq:%f tex:%d mv:%d misc:%d imb:%d pmb:%d smb:%d d:%c",
-                   &pict_type, &rce->i_duration, &rce->i_cpb_duration, &qp_rc, &qp_aq, &rce->tex_bits,
-                   &rce->mv_bits, &rce->misc_bits, &rce->i_count, &rce->p_count,
-                   &rce->s_count, &rce->direct_mode );
-            rce->tex_bits  *= res_factor_bits;
-            rce->mv_bits   *= res_factor_bits;
-            rce->misc_bits *= res_factor_bits;
-            rce->i_count   *= res_factor;
-            rce->p_count   *= res_factor;
-            rce->s_count   *= res_factor;
-
-            p = strstr( p, "ref:" );
-            if( !p )
-                goto parse_error;
-            p += 4;
-            for( ref = 0; ref < 16; ref++ )
-            {
-                if( sscanf( p, " %d", &rce->refcount[ref] ) != 1 )
-                    break;
-                p = strchr( p+1, ' ' );
-                if( !p )
-                    goto parse_error;
-            }
-            rce->refs = ref;
-
-            /* find weights */
-            rce->i_weight_denom[0] = rce->i_weight_denom[1] = -1;
-            char *w = strchr( p, 'w' );
-            if( w )
-            {
-                int count = sscanf( w, "w:%hd,%hd,%hd,%hd,%hd,%hd,%hd,%hd",
-                                    &rce->i_weight_denom[0], &rce->weight[0][0], &rce->weight[0][1],
-                                    &rce->i_weight_denom[1], &rce->weight[1][0], &rce->weight[1][1],
-                                    &rce->weight[2][0], &rce->weight[2][1] );
-                if( count == 3 )
-                    rce->i_weight_denom[1] = -1;
-                else if( count != 8 )
-                    rce->i_weight_denom[0] = rce->i_weight_denom[1] = -1;
-            }
-
-            if( pict_type != 'b' )
-                rce->kept_as_ref = 1;
-            switch( pict_type )
-            {
-                case 'I':
-                    rce->frame_type = X264_TYPE_IDR;
-                    rce->pict_type  = SLICE_TYPE_I;
-                    break;
-                case 'i':
-                    rce->frame_type = X264_TYPE_I;
-                    rce->pict_type  = SLICE_TYPE_I;
-                    break;
-                case 'P':
-                    rce->frame_type = X264_TYPE_P;
-                    rce->pict_type  = SLICE_TYPE_P;
-                    break;
-                case 'B':
-                    rce->frame_type = X264_TYPE_BREF;
-                    rce->pict_type  = SLICE_TYPE_B;
-                    break;
-                case 'b':
-                    rce->frame_type = X264_TYPE_B;
-                    rce->pict_type  = SLICE_TYPE_B;
-                    break;
-                default:  e = -1; break;
-            }
-            if( e < 14 )
-            {
-parse_error:
-                x264_log( h, X264_LOG_ERROR, "statistics are damaged at line %d, parser out=%d\n", i, e );
-                return -1;
-            }
-            rce->qscale = qp2qscale( qp_rc );
-            total_qp_aq += qp_aq;
-            p = next;
-        }
+        if( rc->stats_in ? read_stats_binary( h, res_factor, res_factor_bits, &total_qp_aq ) < 0
+                         : read_stats_text( h, stats_in, res_factor, res_factor_bits, &total_qp_aq ) < 0 )
+            return -1;
+        if( h->param.rc.i_stats_range_frames && check_stats_range( h ) < 0 )
+            return -1;
         if( !h->param.b_stitchable )
             h->pps->i_pic_init_qp = SPEC_QP( (int)(total_qp_aq / rc->num_entries + 0.5) );
 
@@ -1147,8 +1403,18 @@ parse_error:
         {
             if( init_pass2( h ) < 0 )
                 return -1;
+            /* The bits were planned for the whole stats file, so the range starts where the plan
+             * has it: after the expected bits of the frames before it, with the VBV fill they left. */
+            if( rc->entry_offset )
+            {
+                rc->expected_bits_offset = rc->entry_out[rc->entry_offset]->expected_bits;
+                if( rc->b_vbv )
+                    rc->buffer_fill_final =
+                    rc->buffer_fill_final_min = rc->entry_out[rc->entry_offset-1]->expected_vbv * h->sps->vui.i_time_scale;
+            }
         } /* else we're using constant quant, so no need to run the bitrate allocation */
     }
+stats_done:
 
     /* Open output file */
     /* If input and output files are the same, output to a temp file
@@ -1168,10 +1434,26 @@ parse_error:
         }
 
         p = x264_param2string( &h->param, 1 );
-        if( p )
+        if( h->param.rc.b_stat_binary )
+        {
+            char *opts = p ? x264_malloc( strlen( p ) + 11 ) : NULL;
+            if( opts )
+                sprintf( opts, "#options: %s", p );
+            if( !opts || x264_statsfile_writer_open( &rc->stats_out, rc->p_stat_file_out, opts,
+                                                     h->param.rc.b_mb_tree ? h->mb.i_mb_count : 0 ) < 0 )
+            {
+                x264_log( h, X264_LOG_ERROR, "ratecontrol_init: can't write stats file\n" );
+                x264_free( opts );
+                x264_free( p );
+                return -1;
+            }
+            x264_free( opts );
+        }
+        else if( p )
             fprintf( rc->p_stat_file_out, "#options: %s\n", p );
         x264_free( p );
-        if( h->param.rc.b_mb_tree && !h->param.rc.b_stat_read )
+        /* Binary stats carry the MB-tree data themselves. */
+        if( h->param.rc.b_mb_tree && !h->param.rc.b_stat_binary && !h->param.rc.b_stat_read )
         {
             rc->psz_mbtree_stat_file_tmpname = strcat_filename( h->param.rc.psz_stat_out, ".mbtree.temp" );
             rc->psz_mbtree_stat_file_name = strcat_filename( h->param.rc.psz_stat_out, ".mbtree" );
@@ -1187,7 +1469,14 @@ parse_error:
         }
     }
 
-    if( h->param.rc.b_mb_tree && (h->param.rc.b_stat_read || h->param.rc.b_stat_write) )
+    if( h->param.rc.b_mb_tree && h->param.ladder && !h->param.b_ladder_leader )
+    {
+        rc->mbtree.srcdim[0] = h->param.ladder->i_width;
+        rc->mbtree.srcdim[1] = h->param.ladder->i_height;
+        if( macroblock_tree_rescale_init( h, rc ) < 0 )
+            return -1;
+    }
+    else if( h->param.rc.b_mb_tree && (h->param.rc.b_stat_read || h->param.rc.b_stat_write) )
     {
         if( !h->param.rc.b_stat_read )
         {
@@ -1196,6 +1485,23 @@ parse_error:
         }
         if( macroblock_tree_rescale_init( h, rc ) < 0 )
             return -1;
+        if( rc->stats_in && rc->stats_in->i_mbtree_mbs != rc->mbtree.src_mb_count )
+        {
+            x264_log( h, X264_LOG_ERROR, "MB-tree data in stats file doesn't match its resolution\n" );
+            return -1;
+        }
+        /* Skip the .mbtree data of the frames before the stats range, all of which are coded before it. */
+        if( rc->p_mbtree_stat_file_in && rc->entry_offset )
+        {
+            int64_t skip = 0;
+            for( int i = 0; i < rc->entry_offset; i++ )
+                skip += rc->entry_out[i]->kept_as_ref;
+            if( fseek( rc->p_mbtree_stat_file_in, skip * (1 + rc->mbtree.src_mb_count * sizeof(uint16_t)), SEEK_SET ) )
+            {
+                x264_log( h, X264_LOG_ERROR, "can't seek in mbtree stats file\n" );
+                return -1;
+            }
+        }
     }
 
     for( int i = 0; i<h->param.i_threads; i++ )
@@ -1361,9 +1667,12 @@ void x264_ratecontrol_delete( x264_t *h )
 
     if( rc->p_stat_file_out )
     {
+        if( rc->stats_out && x264_statsfile_finish( rc->stats_out ) < 0 )
+            x264_log( h, X264_LOG_ERROR, "failed to write stats file index\n" );
+        x264_statsfile_writer_close( rc->stats_out );
         b_regular_file = x264_is_regular_file( rc->p_stat_file_out );
         fclose( rc->p_stat_file_out );
-        if( h->i_frame >= rc->num_entries && b_regular_file )
+        if( h->i_frame >= rc->range_entries && b_regular_file )
             if( x264_rename( rc->psz_stat_file_tmpname, h->param.rc.psz_stat_out ) != 0 )
             {
                 x264_log( h, X264_LOG_ERROR, "failed to rename \"%s\" to \"%s\"\n",
@@ -1375,7 +1684,7 @@ void x264_ratecontrol_delete( x264_t *h )
     {
         b_regular_file = x264_is_regular_file( rc->p_mbtree_stat_file_out );
         fclose( rc->p_mbtree_stat_file_out );
-        if( h->i_frame >= rc->num_entries && b_regular_file )
+        if( h->i_frame >= rc->range_entries && b_regular_file )
             if( x264_rename( rc->psz_mbtree_stat_file_tmpname, rc->psz_mbtree_stat_file_name ) != 0 )
             {
                 x264_log( h, X264_LOG_ERROR, "failed to rename \"%s\" to \"%s\"\n",
@@ -1386,10 +1695,20 @@ void x264_ratecontrol_delete( x264_t *h )
     }
     if( rc->p_mbtree_stat_file_in )
         fclose( rc->p_mbtree_stat_file_in );
+    x264_statsfile_close( rc->stats_in );
     x264_free( rc->pred );
     x264_free( rc->pred_b_from_p );
     x264_free( rc->entry );
     x264_free( rc->entry_out );
+    if( rc->stream )
+    {
+        x264_pthread_mutex_destroy( &rc->stream->mutex );
+        x264_free( rc->stream->slot_frame );
+        x264_free( rc->stream->qscale );
+        x264_free( rc->stream->fills );
+        x264_free( rc->stream );
+    }
+    x264_free( rc->estimate );
     macroblock_tree_rescale_destroy( rc );
     if( rc->zones )
     {
@@ -1439,15 +1758,18 @@ void x264_ratecontrol_start( x264_t *h, int i_force_qp, int overhead )
 
     if( h->param.rc.b_stat_read )
     {
-        int frame = h->fenc->i_frame;
-        assert( frame >= 0 && frame < rc->num_entries );
-        rce = rc->rce = &rc->entry[frame];
+        assert( rc->entry_offset + h->fenc->i_frame < rc->num_entries );
+        rce = rc->rce = rc_entry( h, h->fenc->i_frame );
+        if( rc->stream )
+            stream_start( h, rce );
 
         if( h->sh.i_type == SLICE_TYPE_B
             && h->param.analyse.i_direct_mv_pred == X264_DIRECT_PRED_AUTO )
         {
-            h->sh.b_direct_spatial_mv_pred = ( rce->direct_mode == 's' );
-            h->mb.b_direct_auto_read = ( rce->direct_mode == 's' || rce->direct_mode == 't' );
+            ratecontrol_entry_t tmp;
+            char direct_mode = rc_entry_frame( h, rce, &tmp )->direct_mode;
+            h->sh.b_direct_spatial_mv_pred = ( direct_mode == 's' );
+            h->mb.b_direct_auto_read = ( direct_mode == 's' || direct_mode == 't' );
         }
     }
 
@@ -1636,11 +1958,11 @@ int x264_ratecontrol_mb( x264_t *h, int bits )
     if( h->param.b_sliced_threads )
     {
         float size_of_other_slices_planned = 0;
-        for( int i = 0; i < h->param.i_threads; i++ )
-            if( h != h->thread[i] )
+        for( int i = 0; i < h->param.i_slice_threads; i++ )
+            if( h != h->slice_thread[i] )
             {
-                size_of_other_slices += h->thread[i]->rc->frame_size_estimated;
-                size_of_other_slices_planned += h->thread[i]->rc->slice_size_planned;
+                size_of_other_slices += h->slice_thread[i]->rc->frame_size_estimated;
+                size_of_other_slices_planned += h->slice_thread[i]->rc->slice_size_planned;
             }
         float weight = rc->slice_size_planned / rc->frame_size_planned;
         size_of_other_slices = (size_of_other_slices - size_of_other_slices_planned) * weight + size_of_other_slices_planned;
@@ -1768,7 +2090,7 @@ int x264_ratecontrol_slice_type( x264_t *h, int frame_num )
     x264_ratecontrol_t *rc = h->rc;
     if( h->param.rc.b_stat_read )
     {
-        if( frame_num >= rc->num_entries )
+        if( frame_num >= rc->range_entries )
         {
             /* We could try to initialize everything required for ABR and
              * adaptive B-frames, but that would be complicated.
@@ -1779,7 +2101,7 @@ int x264_ratecontrol_slice_type( x264_t *h, int frame_num )
             rc->qp_constant[SLICE_TYPE_I] = x264_clip3( (int)( qscale2qp( qp2qscale( h->param.rc.i_qp_constant ) / h->param.rc.f_ip_factor ) + 0.5 ), 0, QP_MAX );
             rc->qp_constant[SLICE_TYPE_B] = x264_clip3( (int)( qscale2qp( qp2qscale( h->param.rc.i_qp_constant ) * h->param.rc.f_pb_factor ) + 0.5 ), 0, QP_MAX );
 
-            x264_log( h, X264_LOG_ERROR, "2nd pass has more frames than 1st pass (%d)\n", rc->num_entries );
+            x264_log( h, X264_LOG_ERROR, "2nd pass has more frames than 1st pass (%d)\n", rc->range_entries );
             x264_log( h, X264_LOG_ERROR, "continuing anyway, at constant QP=%d\n", h->param.rc.i_qp_constant );
             if( h->param.i_bframe_adaptive )
                 x264_log( h, X264_LOG_ERROR, "disabling adaptive B-frames\n" );
@@ -1798,7 +2120,7 @@ int x264_ratecontrol_slice_type( x264_t *h, int frame_num )
             }
             return X264_TYPE_AUTO;
         }
-        return rc->entry[frame_num].frame_type;
+        return rc_entry( h, frame_num )->frame_type;
     }
     else
         return X264_TYPE_AUTO;
@@ -1806,9 +2128,10 @@ int x264_ratecontrol_slice_type( x264_t *h, int frame_num )
 
 void x264_ratecontrol_set_weights( x264_t *h, x264_frame_t *frm )
 {
-    ratecontrol_entry_t *rce = &h->rc->entry[frm->i_frame];
     if( h->param.analyse.i_weighted_pred <= 0 )
         return;
+    ratecontrol_entry_t tmp;
+    const ratecontrol_entry_t *rce = rc_entry_frame( h, rc_entry( h, frm->i_frame ), &tmp );
 
     if( rce->i_weight_denom[0] >= 0 )
         SET_WEIGHT( frm->weight[0][0], 1, rce->weight[0][0], rce->i_weight_denom[0], rce->weight[0][1] );
@@ -1821,6 +2144,125 @@ void x264_ratecontrol_set_weights( x264_t *h, x264_frame_t *frm )
 }
 
 /* After encoding one frame, save stats and update ratecontrol state */
+static int write_stats_text( x264_t *h, char c_type, char c_direct )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    if( fprintf( rc->p_stat_file_out,
+             "in:%d out:%d type:%c dur:%"PRId64" cpbdur:%"PRId64" q:%.2f aq:%.2f tex:%d mv:%d misc:%d imb:%d pmb:%d smb:%d d:%c ref:",
+             h->fenc->i_frame, h->i_frame,
+             c_type, h->fenc->i_duration,
+             h->fenc->i_cpb_duration,
+             rc->qpa_rc, h->fdec->f_qp_avg_aq,
+             h->stat.frame.i_tex_bits,
+             h->stat.frame.i_mv_bits,
+             h->stat.frame.i_misc_bits,
+             h->stat.frame.i_mb_count_i,
+             h->stat.frame.i_mb_count_p,
+             h->stat.frame.i_mb_count_skip,
+             c_direct) < 0 )
+        return -1;
+
+    /* Only write information for reference reordering once. */
+    ratecontrol_entry_t tmp;
+    const ratecontrol_entry_t *rce = h->param.rc.b_stat_read ? rc_entry_frame( h, rc->rce, &tmp ) : NULL;
+    int use_old_stats = rce && rce->refs > 1;
+    for( int i = 0; i < (use_old_stats ? rce->refs : h->i_ref[0]); i++ )
+    {
+        int refcount = use_old_stats         ? rce->refcount[i]
+                     : PARAM_INTERLACED      ? h->stat.frame.i_mb_count_ref[0][i*2]
+                                             + h->stat.frame.i_mb_count_ref[0][i*2+1]
+                     :                         h->stat.frame.i_mb_count_ref[0][i];
+        if( fprintf( rc->p_stat_file_out, "%d ", refcount ) < 0 )
+            return -1;
+    }
+
+    if( h->param.analyse.i_weighted_pred >= X264_WEIGHTP_SIMPLE && h->sh.weight[0][0].weightfn )
+    {
+        if( fprintf( rc->p_stat_file_out, "w:%d,%d,%d",
+                     h->sh.weight[0][0].i_denom, h->sh.weight[0][0].i_scale, h->sh.weight[0][0].i_offset ) < 0 )
+            return -1;
+        if( h->sh.weight[0][1].weightfn || h->sh.weight[0][2].weightfn )
+        {
+            if( fprintf( rc->p_stat_file_out, ",%d,%d,%d,%d,%d ",
+                         h->sh.weight[0][1].i_denom, h->sh.weight[0][1].i_scale, h->sh.weight[0][1].i_offset,
+                         h->sh.weight[0][2].i_scale, h->sh.weight[0][2].i_offset ) < 0 )
+                return -1;
+        }
+        else if( fprintf( rc->p_stat_file_out, " " ) < 0 )
+            return -1;
+    }
+
+    if( fprintf( rc->p_stat_file_out, ";\n") < 0 )
+        return -1;
+
+    /* Don't re-write the data in multi-pass mode. */
+    if( h->param.rc.b_mb_tree && h->fenc->b_kept_as_ref && rc->p_mbtree_stat_file_out )
+    {
+        uint8_t i_type = h->sh.i_type;
+        h->mc.mbtree_fix8_pack( rc->mbtree.qp_buffer[0], h->fenc->f_qp_offset, h->mb.i_mb_count );
+        if( fwrite( &i_type, 1, 1, rc->p_mbtree_stat_file_out ) < 1 )
+            return -1;
+        if( fwrite( rc->mbtree.qp_buffer[0], sizeof(uint16_t), h->mb.i_mb_count, rc->p_mbtree_stat_file_out ) < (unsigned)h->mb.i_mb_count )
+            return -1;
+    }
+    return 0;
+}
+
+static int write_stats_binary( x264_t *h, char c_type, char c_direct )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    x264_statsfile_record_t rec = {0};
+    rec.i_frame         = h->fenc->i_frame;
+    rec.i_duration      = h->fenc->i_duration;
+    rec.i_cpb_duration  = h->fenc->i_cpb_duration;
+    rec.f_qp_rc         = rc->qpa_rc;
+    rec.f_qp_aq         = h->fdec->f_qp_avg_aq;
+    rec.i_tex_bits      = h->stat.frame.i_tex_bits;
+    rec.i_mv_bits       = h->stat.frame.i_mv_bits;
+    rec.i_misc_bits     = h->stat.frame.i_misc_bits;
+    rec.i_mb_count_i    = h->stat.frame.i_mb_count_i;
+    rec.i_mb_count_p    = h->stat.frame.i_mb_count_p;
+    rec.i_mb_count_skip = h->stat.frame.i_mb_count_skip;
+    rec.c_type          = c_type;
+    rec.c_direct        = c_direct;
+
+    /* Only write information for reference reordering once. */
+    ratecontrol_entry_t tmp;
+    const ratecontrol_entry_t *rce = h->param.rc.b_stat_read ? rc_entry_frame( h, rc->rce, &tmp ) : NULL;
+    int use_old_stats = rce && rce->refs > 1;
+    rec.i_refs = X264_MIN( use_old_stats ? rce->refs : h->i_ref[0], 16 );
+    for( int i = 0; i < rec.i_refs; i++ )
+        rec.i_refcount[i] = use_old_stats         ? rce->refcount[i]
+                          : PARAM_INTERLACED      ? h->stat.frame.i_mb_count_ref[0][i*2]
+                                                  + h->stat.frame.i_mb_count_ref[0][i*2+1]
+                          :                         h->stat.frame.i_mb_count_ref[0][i];
+
+    rec.i_weight_denom[0] = rec.i_weight_denom[1] = -1;
+    if( h->param.analyse.i_weighted_pred >= X264_WEIGHTP_SIMPLE && h->sh.weight[0][0].weightfn )
+    {
+        rec.i_weight_denom[0] = h->sh.weight[0][0].i_denom;
+        rec.i_weight[0][0] = h->sh.weight[0][0].i_scale;
+        rec.i_weight[0][1] = h->sh.weight[0][0].i_offset;
+        if( h->sh.weight[0][1].weightfn || h->sh.weight[0][2].weightfn )
+        {
+            rec.i_weight_denom[1] = h->sh.weight[0][1].i_denom;
+            for( int i = 1; i < 3; i++ )
+            {
+                rec.i_weight[i][0] = h->sh.weight[0][i].i_scale;
+                rec.i_weight[i][1] = h->sh.weight[0][i].i_offset;
+            }
+        }
+    }
+
+    /* Unlike .mbtree files, the data is rewritten on every pass so that each file is complete. */
+    if( h->param.rc.b_mb_tree && h->fenc->b_kept_as_ref )
+    {
+        h->mc.mbtree_fix8_pack( rc->mbtree.qp_buffer[0], h->fenc->f_qp_offset, h->mb.i_mb_count );
+        rec.mbtree = (uint8_t*)rc->mbtree.qp_buffer[0];
+    }
+    return x264_statsfile_write( rc->stats_out, &rec );
+}
+
 int x264_ratecontrol_end( x264_t *h, int bits, int *filler )
 {
     x264_ratecontrol_t *rc = h->rc;
@@ -1849,62 +2291,9 @@ int x264_ratecontrol_end( x264_t *h, int bits, int *filler )
                         ( dir_frame>0 ? 's' : dir_frame<0 ? 't' :
                           dir_avg>0 ? 's' : dir_avg<0 ? 't' : '-' )
                         : '-';
-        if( fprintf( rc->p_stat_file_out,
-                 "in:%d out:%d type:%c dur:%"PRId64" cpbdur:%"PRId64" q:%.2f aq:%.2f tex:%d mv:%d misc:%d imb:%d pmb:%d smb:%d d:%c ref:",
-                 h->fenc->i_frame, h->i_frame,
-                 c_type, h->fenc->i_duration,
-                 h->fenc->i_cpb_duration,
-                 rc->qpa_rc, h->fdec->f_qp_avg_aq,
-                 h->stat.frame.i_tex_bits,
-                 h->stat.frame.i_mv_bits,
-                 h->stat.frame.i_misc_bits,
-                 h->stat.frame.i_mb_count_i,
-                 h->stat.frame.i_mb_count_p,
-                 h->stat.frame.i_mb_count_skip,
-                 c_direct) < 0 )
-            goto fail;
-
-        /* Only write information for reference reordering once. */
-        int use_old_stats = h->param.rc.b_stat_read && rc->rce->refs > 1;
-        for( int i = 0; i < (use_old_stats ? rc->rce->refs : h->i_ref[0]); i++ )
-        {
-            int refcount = use_old_stats         ? rc->rce->refcount[i]
-                         : PARAM_INTERLACED      ? h->stat.frame.i_mb_count_ref[0][i*2]
-                                                 + h->stat.frame.i_mb_count_ref[0][i*2+1]
-                         :                         h->stat.frame.i_mb_count_ref[0][i];
-            if( fprintf( rc->p_stat_file_out, "%d ", refcount ) < 0 )
-                goto fail;
-        }
-
-        if( h->param.analyse.i_weighted_pred >= X264_WEIGHTP_SIMPLE && h->sh.weight[0][0].weightfn )
-        {
-            if( fprintf( rc->p_stat_file_out, "w:%d,%d,%d",
-                         h->sh.weight[0][0].i_denom, h->sh.weight[0][0].i_scale, h->sh.weight[0][0].i_offset ) < 0 )
-                goto fail;
-            if( h->sh.weight[0][1].weightfn || h->sh.weight[0][2].weightfn )
-            {
-                if( fprintf( rc->p_stat_file_out, ",%d,%d,%d,%d,%d ",
-                             h->sh.weight[0][1].i_denom, h->sh.weight[0][1].i_scale, h->sh.weight[0][1].i_offset,
-                             h->sh.weight[0][2].i_scale, h->sh.weight[0][2].i_offset ) < 0 )
-                    goto fail;
-            }
-            else if( fprintf( rc->p_stat_file_out, " " ) < 0 )
-                goto fail;
-        }
-
-        if( fprintf( rc->p_stat_file_out, ";\n") < 0 )
+        if( (h->param.rc.b_stat_binary ? write_stats_binary( h, c_type, c_direct )
+                                       : write_stats_text( h, c_type, c_direct )) < 0 )
             goto fail;
-
-        /* Don't re-write the data in multi-pass mode. */
-        if( h->param.rc.b_mb_tree && h->fenc->b_kept_as_ref && !h->param.rc.b_stat_read )
-        {
-            uint8_t i_type = h->sh.i_type;
-            h->mc.mbtree_fix8_pack( rc->mbtree.qp_buffer[0], h->fenc->f_qp_offset, h->mb.i_mb_count );
-            if( fwrite( &i_type, 1, 1, rc->p_mbtree_stat_file_out ) < 1 )
-                goto fail;
-            if( fwrite( rc->mbtree.qp_buffer[0], sizeof(uint16_t), h->mb.i_mb_count, rc->p_mbtree_stat_file_out ) < (unsigned)h->mb.i_mb_count )
-                goto fail;
-        }
     }
 
     if( rc->b_abr )
@@ -1994,10 +2383,12 @@ fail:
 
 /**
  * modify the bitrate curve from pass1 for one frame
+ * frames without a usable complexity get fallback, the others set *rceq
  */
-static double get_qscale(x264_t *h, ratecontrol_entry_t *rce, double rate_factor, int frame_num)
+static double rceq_qscale( x264_t *h, ratecontrol_entry_t *rce, double rate_factor, int frame_num,
+                           double fallback, double *rceq )
 {
-    x264_ratecontrol_t *rcc= h->rc;
+    x264_ratecontrol_t *rcc = h->rc;
     x264_zone_t *zone = get_zone( h, frame_num );
     double q;
     if( h->param.rc.b_mb_tree )
@@ -2010,12 +2401,11 @@ static double get_qscale(x264_t *h, ratecontrol_entry_t *rce, double rate_factor
 
     // avoid NaN's in the rc_eq
     if( !isfinite(q) || rce->tex_bits + rce->mv_bits == 0 )
-        q = rcc->last_qscale_for[rce->pict_type];
+        q = fallback;
     else
     {
-        rcc->last_rceq = q;
+        *rceq = q;
         q /= rate_factor;
-        rcc->last_qscale = q;
     }
 
     if( zone )
@@ -2029,7 +2419,20 @@ static double get_qscale(x264_t *h, ratecontrol_entry_t *rce, double rate_factor
     return q;
 }
 
-static double get_diff_limited_q(x264_t *h, ratecontrol_entry_t *rce, double q, int frame_num)
+static double get_qscale(x264_t *h, ratecontrol_entry_t *rce, double rate_factor, int frame_num)
+{
+    x264_ratecontrol_t *rcc = h->rc;
+    double rceq = -1;
+    double q = rceq_qscale( h, rce, rate_factor, frame_num, rcc->last_qscale_for[rce->pict_type], &rceq );
+    if( rceq >= 0 )
+    {
+        rcc->last_rceq = rceq;
+        rcc->last_qscale = rceq / rate_factor;
+    }
+    return q;
+}
+
+static double get_diff_limited_q(x264_t *h, rc_plan_state_t *st, ratecontrol_entry_t *rce, double q, int frame_num)
 {
     x264_ratecontrol_t *rcc = h->rc;
     const int pict_type = rce->pict_type;
@@ -2039,34 +2442,34 @@ static double get_diff_limited_q(x264_t *h, ratecontrol_entry_t *rce, double q,
     if( pict_type == SLICE_TYPE_I )
     {
         double iq = q;
-        double pq = qp2qscale( rcc->accum_p_qp / rcc->accum_p_norm );
+        double pq = qp2qscale( st->accum_p_qp / st->accum_p_norm );
         double ip_factor = h->param.rc.f_ip_factor;
         /* don't apply ip_factor if the following frame is also I */
-        if( rcc->accum_p_norm <= 0 )
+        if( st->accum_p_norm <= 0 )
             q = iq;
-        else if( rcc->accum_p_norm >= 1 )
+        else if( st->accum_p_norm >= 1 )
             q = pq / ip_factor;
         else
-            q = rcc->accum_p_norm * pq / ip_factor + (1 - rcc->accum_p_norm) * iq;
+            q = st->accum_p_norm * pq / ip_factor + (1 - st->accum_p_norm) * iq;
     }
     else if( pict_type == SLICE_TYPE_B )
     {
-        q = rcc->last_qscale_for[rcc->last_non_b_pict_type];
+        q = st->last_qscale_for[st->last_non_b_pict_type];
         if( !rce->kept_as_ref )
             q *= h->param.rc.f_pb_factor;
     }
     else if( pict_type == SLICE_TYPE_P
-             && rcc->last_non_b_pict_type == SLICE_TYPE_P
+             && st->last_non_b_pict_type == SLICE_TYPE_P
              && rce->tex_bits == 0 )
     {
-        q = rcc->last_qscale_for[SLICE_TYPE_P];
+        q = st->last_qscale_for[SLICE_TYPE_P];
     }
 
     /* last qscale / qdiff stuff */
-    if( rcc->last_non_b_pict_type == pict_type &&
-        (pict_type!=SLICE_TYPE_I || rcc->last_accum_p_norm < 1) )
+    if( st->last_non_b_pict_type == pict_type &&
+        (pict_type!=SLICE_TYPE_I || st->last_accum_p_norm < 1) )
     {
-        double last_q = rcc->last_qscale_for[pict_type];
+        double last_q = st->last_qscale_for[pict_type];
         double max_qscale = last_q * rcc->lstep;
         double min_qscale = last_q / rcc->lstep;
 
@@ -2074,20 +2477,20 @@ static double get_diff_limited_q(x264_t *h, ratecontrol_entry_t *rce, double q,
         else if( q < min_qscale ) q = min_qscale;
     }
 
-    rcc->last_qscale_for[pict_type] = q;
+    st->last_qscale_for[pict_type] = q;
     if( pict_type != SLICE_TYPE_B )
-        rcc->last_non_b_pict_type = pict_type;
+        st->last_non_b_pict_type = pict_type;
     if( pict_type == SLICE_TYPE_I )
     {
-        rcc->last_accum_p_norm = rcc->accum_p_norm;
-        rcc->accum_p_norm = 0;
-        rcc->accum_p_qp = 0;
+        st->last_accum_p_norm = st->accum_p_norm;
+        st->accum_p_norm = 0;
+        st->accum_p_qp = 0;
     }
     if( pict_type == SLICE_TYPE_P )
     {
         float mask = 1 - pow( (float)rce->i_count / rcc->nmb, 2 );
-        rcc->accum_p_qp   = mask * (qscale2qp( q ) + rcc->accum_p_qp);
-        rcc->accum_p_norm = mask * (1 + rcc->accum_p_norm);
+        st->accum_p_qp   = mask * (qscale2qp( q ) + st->accum_p_qp);
+        st->accum_p_norm = mask * (1 + st->accum_p_norm);
     }
 
     if( zone )
@@ -2234,30 +2637,50 @@ static void update_vbv_plan( x264_t *h, int overhead )
 }
 
 // apply VBV constraints and clip qscale to between lmin and lmax
-static double clip_qscale( x264_t *h, int pict_type, double q )
+/* The qscale limits of clip_qscale, without its VBV adjustment. */
+static double clip_qscale_limits( x264_t *h, int pict_type, double q )
 {
     x264_ratecontrol_t *rcc = h->rc;
     double lmin = rcc->lmin[pict_type];
     double lmax = rcc->lmax[pict_type];
     if( rcc->rate_factor_max_increment )
         lmax = X264_MIN( lmax, qp2qscale( rcc->qp_novbv + rcc->rate_factor_max_increment ) );
-    double q0 = q;
-
-    /* B-frames are not directly subject to VBV,
-     * since they are controlled by the P-frames' QPs. */
 
-    if( rcc->b_vbv && rcc->last_satd > 0 )
+    if( lmin==lmax )
+        return lmin;
+    else if( rcc->b_2pass )
     {
-        double fenc_cpb_duration = (double)h->fenc->i_cpb_duration *
-                                   h->sps->vui.i_num_units_in_tick / h->sps->vui.i_time_scale;
-        /* Lookahead VBV: raise the quantizer as necessary such that no frames in
-         * the lookahead overflow and such that the buffer is in a reasonable state
-         * by the end of the lookahead. */
-        if( h->param.rc.i_lookahead )
-        {
-            int terminate = 0;
-
-            /* Avoid an infinite loop. */
+        double min2 = log( lmin );
+        double max2 = log( lmax );
+        q = (log(q) - min2)/(max2-min2) - 0.5;
+        q = 1.0/(1.0 + exp( -4*q ));
+        q = q*(max2-min2) + min2;
+        return exp( q );
+    }
+    else
+        return x264_clip3f( q, lmin, lmax );
+}
+
+static double clip_qscale( x264_t *h, int pict_type, double q )
+{
+    x264_ratecontrol_t *rcc = h->rc;
+    double q0 = q;
+
+    /* B-frames are not directly subject to VBV,
+     * since they are controlled by the P-frames' QPs. */
+
+    if( rcc->b_vbv && rcc->last_satd > 0 )
+    {
+        double fenc_cpb_duration = (double)h->fenc->i_cpb_duration *
+                                   h->sps->vui.i_num_units_in_tick / h->sps->vui.i_time_scale;
+        /* Lookahead VBV: raise the quantizer as necessary such that no frames in
+         * the lookahead overflow and such that the buffer is in a reasonable state
+         * by the end of the lookahead. */
+        if( h->param.rc.i_lookahead )
+        {
+            int terminate = 0;
+
+            /* Avoid an infinite loop. */
             for( int iterations = 0; iterations < 1000 && terminate != 3; iterations++ )
             {
                 double frame_q[3];
@@ -2375,19 +2798,7 @@ static double clip_qscale( x264_t *h, int pict_type, double q )
             q = X264_MAX( q0, q );
     }
 
-    if( lmin==lmax )
-        return lmin;
-    else if( rcc->b_2pass )
-    {
-        double min2 = log( lmin );
-        double max2 = log( lmax );
-        q = (log(q) - min2)/(max2-min2) - 0.5;
-        q = 1.0/(1.0 + exp( -4*q ));
-        q = q*(max2-min2) + min2;
-        return exp( q );
-    }
-    else
-        return x264_clip3f( q, lmin, lmax );
+    return clip_qscale_limits( h, pict_type, q );
 }
 
 // update qscale for 1 frame based on actual bits used so far
@@ -2484,22 +2895,22 @@ static float rate_estimate_qscale( x264_t *h )
             double diff;
 
             /* Adjust ABR buffer based on distance to the end of the video. */
-            if( rcc->num_entries > h->i_frame )
+            if( rcc->range_entries > h->i_frame )
             {
-                double final_bits = rcc->entry_out[rcc->num_entries-1]->expected_bits;
+                double final_bits = rcc->stream ? rcc->stream->total_bits : rcc->entry_out[rcc->num_entries-1]->expected_bits;
                 double video_pos = rce.expected_bits / final_bits;
                 double scale_factor = sqrt( (1 - video_pos) * rcc->num_entries );
                 abr_buffer *= 0.5 * X264_MAX( scale_factor, 0.5 );
             }
 
-            diff = predicted_bits - rce.expected_bits;
+            diff = predicted_bits - (rce.expected_bits - rcc->expected_bits_offset);
             q = rce.new_qscale;
             q /= x264_clip3f((abr_buffer - diff) / abr_buffer, .5, 2);
             if( h->i_frame >= rcc->fps && rcc->expected_bits_sum >= 1 )
             {
                 /* Adjust quant based on the difference between
                  * achieved and expected bitrate so far */
-                double cur_time = (double)h->i_frame / rcc->num_entries;
+                double cur_time = (double)h->i_frame / rcc->range_entries;
                 double w = x264_clip3f( cur_time*100, 0.0, 1.0 );
                 q *= pow( (double)total_bits / rcc->expected_bits_sum, w );
             }
@@ -2639,14 +3050,142 @@ static float rate_estimate_qscale( x264_t *h )
     }
 }
 
+/* Estimate mode: plan h->fenc as rate_estimate_qscale would in 1-pass CRF, as it leaves the
+ * lookahead, and add the size the predictors give.  Nothing is encoded, so the predictors keep
+ * their initial coefficients and the references are found by frame number. */
+void x264_ratecontrol_estimate_frame( x264_t *h )
+{
+    x264_ratecontrol_t *rcc = h->rc;
+    rc_estimate_t *est = rcc->estimate;
+    x264_frame_t *fenc = h->fenc;
+    double bits;
+    float qp;
+
+    x264_emms();
+    h->sh.i_type = IS_X264_TYPE_I( fenc->i_type ) ? SLICE_TYPE_I :
+                   IS_X264_TYPE_B( fenc->i_type ) ? SLICE_TYPE_B : SLICE_TYPE_P;
+    if( h->sh.i_type == SLICE_TYPE_B )
+    {
+        int r0 = -1, r1 = -1;
+        for( int i = 0; i < X264_MIN( est->i_refs, ESTIMATE_REFS ); i++ )
+        {
+            int frame = est->refs[i].i_frame;
+            if( frame < fenc->i_frame && (r0 < 0 || frame > est->refs[r0].i_frame) )
+                r0 = i;
+            else if( frame > fenc->i_frame && (r1 < 0 || frame < est->refs[r1].i_frame) )
+                r1 = i;
+        }
+        if( r0 < 0 )
+            r0 = r1;
+        if( r1 < 0 )
+            r1 = r0;
+        if( r0 < 0 )
+            return;
+
+        int i0 = IS_X264_TYPE_I( est->refs[r0].i_type );
+        int i1 = IS_X264_TYPE_I( est->refs[r1].i_type );
+        int dt0 = abs( fenc->i_frame - est->refs[r0].i_frame );
+        int dt1 = abs( fenc->i_frame - est->refs[r1].i_frame );
+        float q0 = est->refs[r0].qp;
+        float q1 = est->refs[r1].qp;
+
+        if( est->refs[r0].i_type == X264_TYPE_BREF )
+            q0 -= rcc->pb_offset/2;
+        if( est->refs[r1].i_type == X264_TYPE_BREF )
+            q1 -= rcc->pb_offset/2;
+
+        if( i0 && i1 )
+            qp = (q0 + q1) / 2 + rcc->ip_offset;
+        else if( i0 )
+            qp = q1;
+        else if( i1 )
+            qp = q0;
+        else
+            qp = (q0*dt1 + q1*dt0) / X264_MAX( dt0 + dt1, 1 );
+
+        if( fenc->i_type == X264_TYPE_BREF )
+            qp += rcc->pb_offset/2;
+        else
+            qp += rcc->pb_offset;
+
+        bits = predict_size( rcc->pred_b_from_p, qp2qscale( qp ), est->anchor_satd );
+    }
+    else
+    {
+        ratecontrol_entry_t rce = {0};
+        rcc->last_satd = x264_rc_analyse_slice( h );
+        rcc->short_term_cplxsum *= 0.5;
+        rcc->short_term_cplxcount *= 0.5;
+        rcc->short_term_cplxsum += rcc->last_satd / (CLIP_DURATION(fenc->f_duration) / BASE_FRAME_DURATION);
+        rcc->short_term_cplxcount ++;
+
+        rce.tex_bits = rcc->last_satd;
+        rce.blurred_complexity = rcc->short_term_cplxsum / rcc->short_term_cplxcount;
+        rce.p_count = rcc->nmb;
+        rce.qscale = 1;
+        rce.pict_type = h->sh.i_type;
+        rce.i_duration = fenc->i_duration;
+
+        double q = get_qscale( h, &rce, rcc->rate_factor_constant, fenc->i_frame );
+        if( h->sh.i_type == SLICE_TYPE_I && h->param.i_keyint_max > 1
+            && rcc->last_non_b_pict_type != SLICE_TYPE_I )
+            q = qp2qscale( rcc->accum_p_qp / rcc->accum_p_norm ) / h->param.rc.f_ip_factor;
+        else if( !est->frames && rcc->qcompress != 1 )
+            q = qp2qscale( ABR_INIT_QP ) / h->param.rc.f_ip_factor;
+        qp = qscale2qp( q );
+
+        bits = predict_size( &rcc->pred[h->sh.i_type], q, rcc->last_satd );
+        est->anchor_satd = rcc->last_satd;
+        rcc->last_non_b_pict_type = h->sh.i_type;
+    }
+
+    /* The qps stay unclipped, so that every offset from the CRF holds at any CRF. */
+    accum_p_qp_update( h, qp );
+    if( h->sh.i_type != SLICE_TYPE_B || fenc->i_type == X264_TYPE_BREF )
+    {
+        int i = est->i_refs++ % ESTIMATE_REFS;
+        est->refs[i].i_frame = fenc->i_frame;
+        est->refs[i].i_type = fenc->i_type;
+        est->refs[i].qp = qp;
+    }
+
+    float offset = qp - (h->param.rc.f_rf_constant + QP_BD_OFFSET);
+    int bin = x264_clip3( (offset + ESTIMATE_BIN_OFFSET) * ESTIMATE_BIN_SCALE, 0, ESTIMATE_BINS-1 );
+    est->bits[h->sh.i_type][bin] += bits;
+    est->seconds += fenc->f_duration;
+    est->frames++;
+}
+
+int x264_ratecontrol_estimate( x264_t *h, const float *f_crf, int i_crf, double *p_bits, double *p_seconds )
+{
+    static const int slice_type[3] = { SLICE_TYPE_I, SLICE_TYPE_P, SLICE_TYPE_B };
+    rc_estimate_t *est = h->rc->estimate;
+    double base_qp = h->param.rc.f_rf_constant + QP_BD_OFFSET;
+    for( int i = 0; i < i_crf; i++ )
+        for( int t = 0; t < 3; t++ )
+        {
+            double bits = 0;
+            for( int j = 0; j < ESTIMATE_BINS; j++ )
+                if( est->bits[slice_type[t]][j] )
+                {
+                    double offset = (j + 0.5) / ESTIMATE_BIN_SCALE - ESTIMATE_BIN_OFFSET;
+                    double qp = x264_clip3f( f_crf[i] + QP_BD_OFFSET + offset, h->param.rc.i_qp_min, h->param.rc.i_qp_max );
+                    bits += est->bits[slice_type[t]][j] * qp2qscale( base_qp + offset ) / qp2qscale( qp );
+                }
+            p_bits[3*i+t] = bits;
+        }
+    *p_seconds = est->seconds;
+    return est->frames;
+}
+
 static void threads_normalize_predictors( x264_t *h )
 {
     double totalsize = 0;
-    for( int i = 0; i < h->param.i_threads; i++ )
-        totalsize += h->thread[i]->rc->slice_size_planned;
+    for( int i = 0; i < h->param.i_slice_threads; i++ )
+        totalsize += h->slice_thread[i]->rc->slice_size_planned;
     double factor = h->rc->frame_size_planned / totalsize;
-    for( int i = 0; i < h->param.i_threads; i++ )
-        h->thread[i]->rc->slice_size_planned *= factor;
+    for( int i = 0; i < h->param.i_slice_threads; i++ )
+        h->slice_thread[i]->rc->slice_size_planned *= factor;
 }
 
 void x264_threads_distribute_ratecontrol( x264_t *h )
@@ -2658,16 +3197,16 @@ void x264_threads_distribute_ratecontrol( x264_t *h )
 
     /* Initialize row predictors */
     if( h->i_frame == 0 )
-        for( int i = 0; i < h->param.i_threads; i++ )
+        for( int i = 0; i < h->param.i_slice_threads; i++ )
         {
-            x264_t *t = h->thread[i];
+            x264_t *t = h->slice_thread[i];
             if( t != h )
                 memcpy( t->rc->row_preds, rc->row_preds, sizeof(rc->row_preds) );
         }
 
-    for( int i = 0; i < h->param.i_threads; i++ )
+    for( int i = 0; i < h->param.i_slice_threads; i++ )
     {
-        x264_t *t = h->thread[i];
+        x264_t *t = h->slice_thread[i];
         if( t != h )
             memcpy( t->rc, rc, offsetof(x264_ratecontrol_t, row_pred) );
         t->rc->row_pred = t->rc->row_preds[h->sh.i_type];
@@ -2689,17 +3228,17 @@ void x264_threads_distribute_ratecontrol( x264_t *h )
         if( rc->single_frame_vbv )
         {
             /* Compensate for our max frame error threshold: give more bits (proportionally) to smaller slices. */
-            for( int i = 0; i < h->param.i_threads; i++ )
+            for( int i = 0; i < h->param.i_slice_threads; i++ )
             {
-                x264_t *t = h->thread[i];
+                x264_t *t = h->slice_thread[i];
                 float max_frame_error = x264_clip3f( 1.0 / (t->i_threadslice_end - t->i_threadslice_start), 0.05, 0.25 );
                 t->rc->slice_size_planned += 2 * max_frame_error * rc->frame_size_planned;
             }
             threads_normalize_predictors( h );
         }
 
-        for( int i = 0; i < h->param.i_threads; i++ )
-            h->thread[i]->rc->frame_size_estimated = h->thread[i]->rc->slice_size_planned;
+        for( int i = 0; i < h->param.i_slice_threads; i++ )
+            h->slice_thread[i]->rc->frame_size_estimated = h->slice_thread[i]->rc->slice_size_planned;
     }
 }
 
@@ -2708,10 +3247,10 @@ void x264_threads_merge_ratecontrol( x264_t *h )
     x264_ratecontrol_t *rc = h->rc;
     x264_emms();
 
-    for( int i = 0; i < h->param.i_threads; i++ )
+    for( int i = 0; i < h->param.i_slice_threads; i++ )
     {
-        x264_t *t = h->thread[i];
-        x264_ratecontrol_t *rct = h->thread[i]->rc;
+        x264_t *t = h->slice_thread[i];
+        x264_ratecontrol_t *rct = h->slice_thread[i]->rc;
         if( h->param.rc.i_vbv_buffer_size )
         {
             int size = 0;
@@ -2779,54 +3318,206 @@ void x264_thread_sync_ratecontrol( x264_t *cur, x264_t *prev, x264_t *next )
     /* the rest of the variables are either constant or thread-local */
 }
 
-static int find_underflow( x264_t *h, double *fills, int *t0, int *t1, int over )
+static int fix_underflow( x264_t *h, int t0, int t1, double adjustment, double qscale_min, double qscale_max )
+{
+    x264_ratecontrol_t *rcc = h->rc;
+    double qscale_orig, qscale_new;
+    int adjusted = 0;
+    if( t0 > 0 )
+        t0++;
+    for( int i = t0; i <= t1; i++ )
+    {
+        qscale_orig = rcc->entry_out[i]->new_qscale;
+        qscale_orig = x264_clip3f( qscale_orig, qscale_min, qscale_max );
+        qscale_new  = qscale_orig * adjustment;
+        qscale_new  = x264_clip3f( qscale_new, qscale_min, qscale_max );
+        rcc->entry_out[i]->new_qscale = qscale_new;
+        adjusted = adjusted || (qscale_new != qscale_orig);
+    }
+    return adjusted;
+}
+
+/* Buffer fullness after a frame of the given size when looking for overflows (parity 1), or its
+ * emptiness when looking for underflows (parity -1). */
+static double vbv_fill( x264_t *h, double fill, ratecontrol_entry_t *rce, double bits, double parity )
+{
+    x264_ratecontrol_t *rcc = h->rc;
+    fill += (rce->i_cpb_duration * rcc->vbv_max_rate * h->sps->vui.i_num_units_in_tick / h->sps->vui.i_time_scale - bits) * parity;
+    return x264_clip3f( fill, 0, rcc->buffer_size );
+}
+
+/* vbv_pass2 keeps every frame's size at its current qscale, and the buffer fills they lead to,
+ * so that a sweep only pays for the frames whose qscale it changed.  After fix_underflow changed
+ * t0..t1, bring them up to date there, so that the sweep can go on after the interval instead of
+ * starting over. */
+static void vbv_refill( x264_t *h, double *bits, double *fills, int t0, int t1, double parity )
+{
+    for( int i = t0; i <= t1; i++ )
+    {
+        ratecontrol_entry_t *rce = h->rc->entry_out[i];
+        bits[i] = qscale2bits( rce, rce->new_qscale );
+        fills[i] = vbv_fill( h, fills[i-1], rce, bits[i], parity );
+    }
+}
+
+/* Put bits back where the buffer overflows: each interval from a nearly empty buffer to the last
+ * overflow before it empties again gets its qscales multiplied by adjustment, once per call, in
+ * one sweep.  It stops at an interval that can't be changed, as all of its qscales are at qp_min. */
+static void fix_overflows( x264_t *h, double *bits, double *fills, double adjustment, double qscale_min, double qscale_max )
 {
-    /* find an interval ending on an overflow or underflow (depending on whether
-     * we're adding or removing bits), and starting on the earliest frame that
-     * can influence the buffer fill of that end frame. */
     x264_ratecontrol_t *rcc = h->rc;
     const double buffer_min = .1 * rcc->buffer_size;
     const double buffer_max = .9 * rcc->buffer_size;
-    double fill = fills[*t0-1];
-    double parity = over ? 1. : -1.;
     int start = -1, end = -1;
-    for( int i = *t0; i < rcc->num_entries; i++ )
+    for( int i = 0; i <= rcc->num_entries; i++ )
     {
-        fill += (rcc->entry_out[i]->i_cpb_duration * rcc->vbv_max_rate * h->sps->vui.i_num_units_in_tick / h->sps->vui.i_time_scale -
-                 qscale2bits( rcc->entry_out[i], rcc->entry_out[i]->new_qscale )) * parity;
-        fill = x264_clip3f(fill, 0, rcc->buffer_size);
-        fills[i] = fill;
-        if( fill <= buffer_min || i == 0 )
+        int b_last = i == rcc->num_entries;
+        if( !b_last )
+            fills[i] = vbv_fill( h, fills[i-1], rcc->entry_out[i], bits[i], 1. );
+        if( b_last || fills[i] <= buffer_min || i == 0 )
         {
             if( end >= 0 )
-                break;
+            {
+                if( !fix_underflow( h, start, end, adjustment, qscale_min, qscale_max ) )
+                    return;
+                vbv_refill( h, bits, fills, start, end, 1. );
+                i = end;
+                start = end = -1;
+                continue;
+            }
             start = i;
         }
-        else if( fill >= buffer_max && start >= 0 )
+        else if( fills[i] >= buffer_max && start >= 0 )
             end = i;
     }
-    *t0 = start;
-    *t1 = end;
-    return start >= 0 && end >= 0;
 }
 
-static int fix_underflow( x264_t *h, int t0, int t1, double adjustment, double qscale_min, double qscale_max )
+/* A frame's bits as a function of a qscale adjustment, for the adjustments that keep its
+ * qscale within qscale_max: tex * adjustment^-1.1 + mv * adjustment^-0.5 + misc. */
+typedef struct
+{
+    double qscale;
+    double tex;
+    double mv;
+    double misc;                /* misc bits, less the bits the buffer gains during the frame */
+} vbv_bits_t;
+
+/* Whether the interval start..end, starting from an emptiness of fill and with the qscales
+ * fix_underflow would touch multiplied by adjustment, either fills the buffer at some point
+ * or doesn't underflow it again.  Like the sweep, the interval's first frame is modelled
+ * too but can't end it, and it is only adjusted if it is the first frame of the stream. */
+static int vbv_segment_fixed( x264_t *h, vbv_bits_t *terms, double start_bits, double fill, int start, int end, double adjustment, double qscale_max )
 {
     x264_ratecontrol_t *rcc = h->rc;
-    double qscale_orig, qscale_new;
-    int adjusted = 0;
-    if( t0 > 0 )
-        t0++;
-    for( int i = t0; i <= t1; i++ )
+    const double buffer_min = .1 * rcc->buffer_size;
+    const double buffer_max = .9 * rcc->buffer_size;
+    double tex_factor = pow( adjustment, -1.1 );
+    double mv_factor = 1 / sqrt( adjustment );
+    int b_underflow = 0;
+    int i = start;
+    if( start > 0 )
     {
-        qscale_orig = rcc->entry_out[i]->new_qscale;
-        qscale_orig = x264_clip3f( qscale_orig, qscale_min, qscale_max );
-        qscale_new  = qscale_orig * adjustment;
-        qscale_new  = x264_clip3f( qscale_new, qscale_min, qscale_max );
-        rcc->entry_out[i]->new_qscale = qscale_new;
-        adjusted = adjusted || (qscale_new != qscale_orig);
+        fill = vbv_fill( h, fill, rcc->entry_out[start], start_bits, -1. );
+        b_underflow = fill >= buffer_max;
+        i++;
     }
-    return adjusted;
+    for( ; i <= end; i++ )
+    {
+        vbv_bits_t *t = &terms[i];
+        if( t->qscale >= 1 && t->qscale * adjustment <= qscale_max )
+            fill += t->tex * tex_factor + t->mv * mv_factor + t->misc;
+        else
+        {
+            ratecontrol_entry_t *rce = rcc->entry_out[i];
+            fill += qscale2bits( rce, X264_MIN( t->qscale * adjustment, qscale_max ) ) - rce->misc_bits + t->misc;
+        }
+        fill = x264_clip3f( fill, 0, rcc->buffer_size );
+        if( fill <= buffer_min && i > start )
+            return 1;
+        b_underflow |= fill >= buffer_max;
+    }
+    return !b_underflow;
+}
+
+/* Split a frame's bits into the terms vbv_segment_fixed scales. */
+static void vbv_bits_init( x264_t *h, vbv_bits_t *t, ratecontrol_entry_t *rce, double qscale_min, double qscale_max )
+{
+    x264_ratecontrol_t *rcc = h->rc;
+    t->qscale = x264_clip3f( rce->new_qscale, qscale_min, qscale_max );
+    t->tex = (rce->tex_bits + .1) * pow( rce->qscale / X264_MAX( t->qscale, 0.1 ), 1.1 );
+    t->mv = rce->mv_bits * sqrt( X264_MAX( rce->qscale, 1 ) / X264_MAX( t->qscale, 1 ) );
+    t->misc = rce->misc_bits - rce->i_cpb_duration * rcc->vbv_max_rate * h->sps->vui.i_num_units_in_tick / h->sps->vui.i_time_scale;
+}
+
+/* Remove the underflows in one sweep.  Each interval from a nearly full buffer to an underflow
+ * gets the smallest uniform qscale increase after which it fills the buffer at some point or no
+ * longer underflows, which is what repeated fix_underflow( 1.001 ) steps converge to.  It is
+ * searched for with the interval's bits split into terms that scale with the adjustment, so
+ * that trying an adjustment costs no pow() per frame.  The fills of the fixed interval are then
+ * brought up to date, and the sweep goes on from the first frame of it that fills the
+ * buffer, where the next interval may start, or else after it.
+ * The iterative solver overshoots by up to one step per interval and sees intervals merge and
+ * split between steps in a different order, so the resulting qscales can differ from it, within
+ * the same VBV constraint.
+ * Returns 0 if some underflow couldn't be fixed within qp_max. */
+static int fix_underflows( x264_t *h, double *bits, double *fills, vbv_bits_t *terms, double qscale_min, double qscale_max )
+{
+    x264_ratecontrol_t *rcc = h->rc;
+    const double buffer_min = .1 * rcc->buffer_size;
+    const double buffer_max = .9 * rcc->buffer_size;
+    int b_fixed = 1;
+    int start = -1;
+    for( int i = 0; i < rcc->num_entries; i++ )
+    {
+        fills[i] = vbv_fill( h, fills[i-1], rcc->entry_out[i], bits[i], -1. );
+        if( fills[i] <= buffer_min || i == 0 )
+            start = i;
+        else if( fills[i] >= buffer_max && start >= 0 )
+        {
+            double max_adjustment = 1;
+            for( int j = start; j <= i; j++ )
+            {
+                vbv_bits_init( h, &terms[j], rcc->entry_out[j], qscale_min, qscale_max );
+                if( j > start || !start )
+                    max_adjustment = X264_MAX( max_adjustment, qscale_max / terms[j].qscale );
+            }
+            if( !vbv_segment_fixed( h, terms, bits[start], fills[start-1], start, i, max_adjustment, qscale_max ) )
+            {
+                /* Do what we can and go on after the interval. */
+                fix_underflow( h, start, i, max_adjustment, qscale_min, qscale_max );
+                vbv_refill( h, bits, fills, start, i, -1. );
+                b_fixed = 0;
+                start = -1;
+                continue;
+            }
+            /* Most intervals need little, so search upwards from small steps before bisecting. */
+            double lo = 0, hi = 1e-3, top = log( max_adjustment );
+            while( hi < top && !vbv_segment_fixed( h, terms, bits[start], fills[start-1], start, i, exp( hi ), qscale_max ) )
+            {
+                lo = hi;
+                hi *= 2;
+            }
+            hi = X264_MIN( hi, top );
+            while( hi - lo > 1e-4 )
+            {
+                double mid = (lo + hi) * 0.5;
+                if( vbv_segment_fixed( h, terms, bits[start], fills[start-1], start, i, exp( mid ), qscale_max ) )
+                    hi = mid;
+                else
+                    lo = mid;
+            }
+            fix_underflow( h, start, i, exp( hi ), qscale_min, qscale_max );
+            vbv_refill( h, bits, fills, start, i, -1. );
+            /* Go on from the first frame that now fills the buffer, or still underflows it. */
+            for( int j = start + 1; j <= i; j++ )
+                if( fills[j] <= buffer_min || fills[j] >= buffer_max )
+                {
+                    i = j - 1;
+                    break;
+                }
+        }
+    }
+    return b_fixed;
 }
 
 static double count_expected_bits( x264_t *h )
@@ -2846,7 +3537,7 @@ static int vbv_pass2( x264_t *h, double all_available_bits )
 {
     /* for each interval of buffer_full .. underflow, uniformly increase the qp of all
      * frames in the interval until either buffer is full at some intermediate frame or the
-     * last frame in the interval no longer underflows.  Recompute intervals and repeat.
+     * last frame in the interval no longer underflows, in one sweep.
      * Then do the converse to put bits back into overflow areas until target size is met */
 
     x264_ratecontrol_t *rcc = h->rc;
@@ -2854,14 +3545,19 @@ static int vbv_pass2( x264_t *h, double all_available_bits )
     double expected_bits = 0;
     double adjustment;
     double prev_bits = 0;
-    int t0, t1;
     double qscale_min = qp2qscale( h->param.rc.i_qp_min );
     double qscale_max = qp2qscale( h->param.rc.i_qp_max );
     int iterations = 0;
-    int adj_min, adj_max;
+    int adj_max;
+    vbv_bits_t *terms = NULL;
+    double *bits = NULL;
     CHECKED_MALLOC( fills, (rcc->num_entries+1)*sizeof(double) );
+    CHECKED_MALLOC( terms, rcc->num_entries*sizeof(vbv_bits_t) );
+    CHECKED_MALLOC( bits, rcc->num_entries*sizeof(double) );
 
     fills++;
+    for( int i = 0; i < rcc->num_entries; i++ )
+        bits[i] = qscale2bits( rcc->entry_out[i], rcc->entry_out[i]->new_qscale );
 
     /* adjust overall stream size */
     do
@@ -2873,24 +3569,19 @@ static int vbv_pass2( x264_t *h, double all_available_bits )
         {   /* not first iteration */
             adjustment = X264_MAX(X264_MIN(expected_bits / all_available_bits, 0.999), 0.9);
             fills[-1] = rcc->buffer_size * h->param.rc.f_vbv_buffer_init;
-            t0 = 0;
-            /* fix overflows */
-            adj_min = 1;
-            while( adj_min && find_underflow( h, fills, &t0, &t1, 1 ) )
-            {
-                adj_min = fix_underflow( h, t0, t1, adjustment, qscale_min, qscale_max );
-                t0 = t1;
-            }
+            fix_overflows( h, bits, fills, adjustment, qscale_min, qscale_max );
         }
 
         fills[-1] = rcc->buffer_size * (1. - h->param.rc.f_vbv_buffer_init);
-        t0 = 0;
         /* fix underflows -- should be done after overflow, as we'd better undersize target than underflowing VBV */
-        adj_max = 1;
-        while( adj_max && find_underflow( h, fills, &t0, &t1, 0 ) )
-            adj_max = fix_underflow( h, t0, t1, 1.001, qscale_min, qscale_max );
+        adj_max = fix_underflows( h, bits, fills, terms, qscale_min, qscale_max );
 
-        expected_bits = count_expected_bits( h );
+        expected_bits = 0;
+        for( int i = 0; i < rcc->num_entries; i++ )
+        {
+            rcc->entry_out[i]->expected_bits = expected_bits;
+            expected_bits += bits[i];
+        }
     } while( (expected_bits < .995*all_available_bits) && ((int64_t)(expected_bits+.5) > (int64_t)(prev_bits+.5)) );
 
     if( !adj_max )
@@ -2901,14 +3592,55 @@ static int vbv_pass2( x264_t *h, double all_available_bits )
         rcc->entry_out[i]->expected_vbv = rcc->buffer_size - fills[i];
 
     x264_free( fills-1 );
+    x264_free( terms );
+    x264_free( bits );
     return 0;
 fail:
     return -1;
 }
 
+/* Weighted average of the complexity of the frames around frame i, which must all be in entry[]. */
+static float blurred_complexity( x264_t *h, int i )
+{
+    x264_ratecontrol_t *rcc = h->rc;
+    double timescale = (double)h->sps->vui.i_num_units_in_tick / h->sps->vui.i_time_scale;
+    double cplxblur = h->param.rc.f_complexity_blur;
+    double weight_sum = 0;
+    double cplx_sum = 0;
+    double weight = 1.0;
+    double gaussian_weight;
+    /* weighted average of cplx of future frames */
+    for( int j = 1; j < cplxblur*2 && j < rcc->num_entries-i; j++ )
+    {
+        ratecontrol_entry_t *rcj = &rcc->entry[(i+j) & rcc->entry_mask];
+        double frame_duration = CLIP_DURATION(rcj->i_duration * timescale) / BASE_FRAME_DURATION;
+        weight *= 1 - pow( (float)rcj->i_count / rcc->nmb, 2 );
+        if( weight < .0001 )
+            break;
+        gaussian_weight = weight * exp( -j*j/200.0 );
+        weight_sum += gaussian_weight;
+        cplx_sum += gaussian_weight * (qscale2bits( rcj, 1 ) - rcj->misc_bits) / frame_duration;
+    }
+    /* weighted average of cplx of past frames */
+    weight = 1.0;
+    for( int j = 0; j <= cplxblur*2 && j <= i; j++ )
+    {
+        ratecontrol_entry_t *rcj = &rcc->entry[(i-j) & rcc->entry_mask];
+        double frame_duration = CLIP_DURATION(rcj->i_duration * timescale) / BASE_FRAME_DURATION;
+        gaussian_weight = weight * exp( -j*j/200.0 );
+        weight_sum += gaussian_weight;
+        cplx_sum += gaussian_weight * (qscale2bits( rcj, 1 ) - rcj->misc_bits) / frame_duration;
+        weight *= 1 - pow( (float)rcj->i_count / rcc->nmb, 2 );
+        if( weight < .0001 )
+            break;
+    }
+    return cplx_sum / weight_sum;
+}
+
 static int init_pass2( x264_t *h )
 {
     x264_ratecontrol_t *rcc = h->rc;
+    int64_t plan_start = x264_mdate();
     uint64_t all_const_bits = 0;
     double timescale = (double)h->sps->vui.i_num_units_in_tick / h->sps->vui.i_time_scale;
     double duration = 0;
@@ -2918,11 +3650,12 @@ static int init_pass2( x264_t *h )
     uint64_t all_available_bits = h->param.rc.i_bitrate * 1000. * duration;
     double rate_factor, step_mult;
     double qblur = h->param.rc.f_qblur;
-    double cplxblur = h->param.rc.f_complexity_blur;
     const int filter_size = (int)(qblur*4) | 1;
     double expected_bits;
     double *qscale, *blurred_qscale;
     double base_cplx = h->mb.i_mb_count * (h->param.i_bframe ? 120 : 80);
+    double rceq = -1;
+    rc_plan_state_t st;
 
     /* find total/average complexity & const_bits */
     for( int i = 0; i < rcc->num_entries; i++ )
@@ -2943,39 +3676,7 @@ static int init_pass2( x264_t *h )
      * could drag down the QP of a nearby complex frame and give it more
      * bits than intended. */
     for( int i = 0; i < rcc->num_entries; i++ )
-    {
-        ratecontrol_entry_t *rce = &rcc->entry[i];
-        double weight_sum = 0;
-        double cplx_sum = 0;
-        double weight = 1.0;
-        double gaussian_weight;
-        /* weighted average of cplx of future frames */
-        for( int j = 1; j < cplxblur*2 && j < rcc->num_entries-i; j++ )
-        {
-            ratecontrol_entry_t *rcj = &rcc->entry[i+j];
-            double frame_duration = CLIP_DURATION(rcj->i_duration * timescale) / BASE_FRAME_DURATION;
-            weight *= 1 - pow( (float)rcj->i_count / rcc->nmb, 2 );
-            if( weight < .0001 )
-                break;
-            gaussian_weight = weight * exp( -j*j/200.0 );
-            weight_sum += gaussian_weight;
-            cplx_sum += gaussian_weight * (qscale2bits( rcj, 1 ) - rcj->misc_bits) / frame_duration;
-        }
-        /* weighted average of cplx of past frames */
-        weight = 1.0;
-        for( int j = 0; j <= cplxblur*2 && j <= i; j++ )
-        {
-            ratecontrol_entry_t *rcj = &rcc->entry[i-j];
-            double frame_duration = CLIP_DURATION(rcj->i_duration * timescale) / BASE_FRAME_DURATION;
-            gaussian_weight = weight * exp( -j*j/200.0 );
-            weight_sum += gaussian_weight;
-            cplx_sum += gaussian_weight * (qscale2bits( rcj, 1 ) - rcj->misc_bits) / frame_duration;
-            weight *= 1 - pow( (float)rcj->i_count / rcc->nmb, 2 );
-            if( weight < .0001 )
-                break;
-        }
-        rce->blurred_complexity = cplx_sum / weight_sum;
-    }
+        rcc->entry[i].blurred_complexity = blurred_complexity( h, i );
 
     CHECKED_MALLOC( qscale, sizeof(double)*rcc->num_entries );
     if( filter_size > 1 )
@@ -2990,12 +3691,14 @@ static int init_pass2( x264_t *h )
      * approximation of scaling the 1st pass by the ratio of bitrates.
      * The search range is probably overkill, but speed doesn't matter here. */
 
+    memcpy( st.last_qscale_for, rcc->last_qscale_for, sizeof(st.last_qscale_for) );
+    st.accum_p_qp = rcc->accum_p_qp;
     expected_bits = 1;
     for( int i = 0; i < rcc->num_entries; i++ )
     {
-        double q = get_qscale(h, &rcc->entry[i], 1.0, i);
+        double q = rceq_qscale( h, &rcc->entry[i], 1.0, i, st.last_qscale_for[rcc->entry[i].pict_type], &rceq );
         expected_bits += qscale2bits(&rcc->entry[i], q);
-        rcc->last_qscale_for[rcc->entry[i].pict_type] = q;
+        st.last_qscale_for[rcc->entry[i].pict_type] = q;
     }
     step_mult = all_available_bits / expected_bits;
 
@@ -3005,25 +3708,25 @@ static int init_pass2( x264_t *h )
         expected_bits = 0;
         rate_factor += step;
 
-        rcc->last_non_b_pict_type = -1;
-        rcc->last_accum_p_norm = 1;
-        rcc->accum_p_norm = 0;
+        st.last_non_b_pict_type = -1;
+        st.last_accum_p_norm = 1;
+        st.accum_p_norm = 0;
 
-        rcc->last_qscale_for[0] =
-        rcc->last_qscale_for[1] =
-        rcc->last_qscale_for[2] = pow( base_cplx, 1 - rcc->qcompress ) / rate_factor;
+        st.last_qscale_for[0] =
+        st.last_qscale_for[1] =
+        st.last_qscale_for[2] = pow( base_cplx, 1 - rcc->qcompress ) / rate_factor;
 
         /* find qscale */
         for( int i = 0; i < rcc->num_entries; i++ )
         {
-            qscale[i] = get_qscale( h, &rcc->entry[i], rate_factor, -1 );
-            rcc->last_qscale_for[rcc->entry[i].pict_type] = qscale[i];
+            qscale[i] = rceq_qscale( h, &rcc->entry[i], rate_factor, -1, st.last_qscale_for[rcc->entry[i].pict_type], &rceq );
+            st.last_qscale_for[rcc->entry[i].pict_type] = qscale[i];
         }
 
         /* fixed I/B qscale relative to P */
         for( int i = rcc->num_entries-1; i >= 0; i-- )
         {
-            qscale[i] = get_diff_limited_q( h, &rcc->entry[i], qscale[i], i );
+            qscale[i] = get_diff_limited_q( h, &st, &rcc->entry[i], qscale[i], i );
             assert(qscale[i] >= 0);
         }
 
@@ -3069,6 +3772,15 @@ static int init_pass2( x264_t *h )
     if( filter_size > 1 )
         x264_free( blurred_qscale );
 
+    /* Encoding starts from the state the last step left. */
+    if( rceq >= 0 )
+        rcc->last_rceq = rceq;
+    memcpy( rcc->last_qscale_for, st.last_qscale_for, sizeof(st.last_qscale_for) );
+    rcc->last_non_b_pict_type = st.last_non_b_pict_type;
+    rcc->accum_p_qp = st.accum_p_qp;
+    rcc->accum_p_norm = st.accum_p_norm;
+    rcc->last_accum_p_norm = st.last_accum_p_norm;
+
     if( rcc->b_vbv )
         if( vbv_pass2( h, all_available_bits ) )
             return -1;
@@ -3105,7 +3817,370 @@ static int init_pass2( x264_t *h )
             x264_log( h, X264_LOG_WARNING, "internal error\n" );
     }
 
+    x264_log( h, X264_LOG_INFO, "2pass planning: %d frames in %.1f ms\n",
+              rcc->num_entries, (x264_mdate() - plan_start) / 1000. );
+    return 0;
+fail:
+    return -1;
+}
+
+#define STREAM_BINS       2048
+#define STREAM_BIN_SCALE  8     /* bins per qp */
+#define STREAM_BIN_OFFSET 64    /* qp of the first bin, negated */
+
+/* Loads the stats records needed to blur the complexity of every frame up to and including
+ * frame, then blurs it.  A frame is complete once every record that can hold it is loaded. */
+static int stream_load( x264_t *h, int frame )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    rc_stream_t *s = rc->stream;
+    int end = X264_MIN( frame + s->radius + s->reorder + 1, rc->num_entries );
+    for( ; s->next_coded < end; s->next_coded++ )
+    {
+        int i = s->next_coded;
+        x264_statsfile_record_t rec;
+        if( decode_record( h, i, &rec ) < 0 )
+            return -1;
+        if( abs( rec.i_frame - i ) > s->reorder )
+        {
+            x264_log( h, X264_LOG_ERROR, "bad frame number (%d) in stats record %d\n", rec.i_frame, i );
+            return -1;
+        }
+        ratecontrol_entry_t *rce = &rc->entry[rec.i_frame & rc->entry_mask];
+        memset( rce, 0, sizeof(ratecontrol_entry_t) );
+        s->slot_frame[rec.i_frame & rc->entry_mask] = rec.i_frame;
+        if( read_record( h, rce, &rec, s->res_factor, s->res_factor_bits ) < 0 )
+            return -1;
+    }
+
+    int complete = s->next_coded == rc->num_entries ? INT_MAX : s->next_coded - s->reorder;
+    for( ; s->blurred <= frame && s->blurred + s->radius < complete; s->blurred++ )
+    {
+        int i = s->blurred;
+        if( s->slot_frame[i & rc->entry_mask] != i )
+        {
+            x264_log( h, X264_LOG_ERROR, "frame %d is missing from the stats file\n", i );
+            return -1;
+        }
+        rc->entry[i & rc->entry_mask].blurred_complexity = blurred_complexity( h, i );
+    }
+    return 0;
+}
+
+/* The frame's qscale at rate factor 1 as the summary models it: init_pass2's I/B offsets,
+ * without their dependence on the neighbouring P-frames. */
+static double stream_base_qscale( x264_t *h, ratecontrol_entry_t *rce, int frame, double fallback,
+                                  double *rceq, int *b_fixed )
+{
+    x264_zone_t *zone = get_zone( h, frame );
+    double q = rceq_qscale( h, rce, 1.0, -1, fallback, rceq );
+    *b_fixed = zone && zone->b_force_qp;
+    if( *b_fixed )
+        return qp2qscale( zone->i_qp );
+    if( rce->pict_type == SLICE_TYPE_I )
+        q /= h->param.rc.f_ip_factor;
+    else if( rce->pict_type == SLICE_TYPE_B && !rce->kept_as_ref )
+        q *= h->param.rc.f_pb_factor;
+    if( zone )
+        q /= zone->f_bitrate_factor;
+    return q;
+}
+
+static double stream_model_bits( x264_t *h, rc_plan_state_t *st, ratecontrol_entry_t *rce, int frame, double rate_factor )
+{
+    int b_fixed;
+    double rceq;
+    double q = stream_base_qscale( h, rce, frame, st->last_qscale_for[rce->pict_type], &rceq, &b_fixed );
+    if( !b_fixed )
+        q = clip_qscale_limits( h, rce->pict_type, q / rate_factor );
+    return qscale2bits( rce, q );
+}
+
+/* bins[i] holds the texture and MV terms of qscale2bits at qscale 1 of the frames whose base
+ * qscale falls in bin i. */
+static double stream_summary_bits( x264_t *h, double (*bins)[2], double rate_factor )
+{
+    double bits = 0;
+    for( int i = 0; i < STREAM_BINS; i++ )
+        if( bins[i][0] || bins[i][1] )
+        {
+            double qp = (i + 0.5) / STREAM_BIN_SCALE - STREAM_BIN_OFFSET;
+            double q = X264_MAX( clip_qscale_limits( h, SLICE_TYPE_P, qp2qscale( qp ) / rate_factor ), 0.1 );
+            bits += bins[i][0] * pow( q, -1.1 ) + bins[i][1] / sqrt( X264_MAX( q, 1 ) );
+        }
+    return bits;
+}
+
+/* VBV for the block [b,e), in display order from the fill left by the previous block: raise
+ * the qscale of the frames since the buffer was last nearly full until it no longer nearly
+ * underflows.  Unlike vbv_pass2 no bits are given back, the block rate factor does that. */
+static void stream_vbv( x264_t *h, int b, int e )
+{
+    x264_ratecontrol_t *rcc = h->rc;
+    rc_stream_t *s = rcc->stream;
+    const double buffer_min = .1 * rcc->buffer_size;
+    const double buffer_max = .9 * rcc->buffer_size;
+    double qscale_max = qp2qscale( h->param.rc.i_qp_max );
+    double *fills = s->fills - b;
+    int start = b;
+    fills[b] = s->vbv_fill;
+    for( int i = b; i < e; )
+    {
+        ratecontrol_entry_t *rce = &rcc->entry[i & rcc->entry_mask];
+        double fill = fills[i] + rce->i_cpb_duration * rcc->vbv_max_rate * h->sps->vui.i_num_units_in_tick / h->sps->vui.i_time_scale
+                    - qscale2bits( rce, rce->new_qscale );
+        fill = x264_clip3f( fill, 0, rcc->buffer_size );
+        if( fill <= buffer_min )
+        {
+            int adjusted = 0;
+            for( int j = start; j <= i; j++ )
+            {
+                ratecontrol_entry_t *rcj = &rcc->entry[j & rcc->entry_mask];
+                double q = X264_MIN( rcj->new_qscale * 1.01, qscale_max );
+                adjusted |= q > rcj->new_qscale;
+                rcj->new_qscale = X264_MAX( q, rcj->new_qscale );
+            }
+            if( adjusted )
+            {
+                i = start;
+                continue;
+            }
+            if( !s->b_vbv_warned )
+                x264_log( h, X264_LOG_WARNING, "vbv-maxrate issue, qpmax or vbv-maxrate too low\n");
+            s->b_vbv_warned = 1;
+        }
+        rce->expected_vbv = fill;
+        fills[i+1] = fill;
+        if( fill >= buffer_max )
+            start = i+1;
+        i++;
+    }
+    s->vbv_fill = fills[e];
+}
+
+/* Plans the next block of frames like one step of init_pass2's rate factor search. */
+static void stream_plan( x264_t *h )
+{
+    x264_ratecontrol_t *rcc = h->rc;
+    rc_stream_t *s = rcc->stream;
+    int b = s->planned;
+    int e = X264_MIN( b + s->block, rcc->num_entries );
+    int lo = X264_MAX( b - s->filter/2, 0 );
+    int hi = X264_MIN( e + s->margin + s->filter/2, rcc->num_entries );
+    double qblur = h->param.rc.f_qblur;
+    double rate_factor = s->block_rate_factor;
+    double base_cplx = h->mb.i_mb_count * (h->param.i_bframe ? 120 : 80);
+    double *qscale = s->qscale - lo;
+    double *blurred_qscale = s->blurred_qscale - lo;
+
+    /* The records were checked by stream_init. */
+    stream_load( h, hi-1 );
+
+    /* Planned from the same state as init_pass2's steps, without touching the encoder's. */
+    rc_plan_state_t st;
+    st.accum_p_qp = s->accum_p_qp;
+    st.last_non_b_pict_type = -1;
+    st.last_accum_p_norm = 1;
+    st.accum_p_norm = 0;
+    st.last_qscale_for[0] =
+    st.last_qscale_for[1] =
+    st.last_qscale_for[2] = pow( base_cplx, 1 - rcc->qcompress ) / rate_factor;
+
+    for( int i = lo; i < hi; i++ )
+    {
+        ratecontrol_entry_t *rce = &rcc->entry[i & rcc->entry_mask];
+        double rceq;
+        qscale[i] = rceq_qscale( h, rce, rate_factor, -1, st.last_qscale_for[rce->pict_type], &rceq );
+        st.last_qscale_for[rce->pict_type] = qscale[i];
+    }
+    for( int i = hi-1; i >= lo; i-- )
+        qscale[i] = get_diff_limited_q( h, &st, &rcc->entry[i & rcc->entry_mask], qscale[i], i );
+    s->accum_p_qp = st.accum_p_qp;
+
+    for( int i = b; i < e; i++ )
+    {
+        ratecontrol_entry_t *rce = &rcc->entry[i & rcc->entry_mask];
+        double q = 0.0, sum = 0.0;
+        for( int j = 0; j < s->filter; j++ )
+        {
+            int idx = i+j-s->filter/2;
+            double d = idx-i;
+            double coeff = qblur==0 ? 1.0 : exp( -d*d/(qblur*qblur) );
+            if( idx < lo || idx >= hi )
+                continue;
+            if( rce->pict_type != rcc->entry[idx & rcc->entry_mask].pict_type )
+                continue;
+            q += qscale[idx] * coeff;
+            sum += coeff;
+        }
+        blurred_qscale[i] = q/sum;
+    }
+
+    for( int i = b; i < e; i++ )
+    {
+        ratecontrol_entry_t *rce = &rcc->entry[i & rcc->entry_mask];
+        rce->new_qscale = clip_qscale_limits( h, rce->pict_type, blurred_qscale[i] );
+        s->ideal_bits += stream_model_bits( h, &st, rce, i, s->rate_factor );
+        s->model_bits += stream_model_bits( h, &st, rce, i, rate_factor );
+        s->unclipped_bits += qscale2bits( rce, rce->new_qscale );
+    }
+
+    if( rcc->b_vbv )
+        stream_vbv( h, b, e );
+    for( int i = b; i < e; i++ )
+    {
+        ratecontrol_entry_t *rce = &rcc->entry[i & rcc->entry_mask];
+        s->planned_bits += qscale2bits( rce, rce->new_qscale );
+    }
+    s->planned = e;
+
+    /* Correct the next block for the bias of the summary's model, and start making up for the
+     * difference between the bits planned so far and the summary's share of them. */
+    double error = (s->model_bits / s->unclipped_bits) * (s->ideal_bits / s->planned_bits);
+    s->block_rate_factor = s->rate_factor * x264_clip3f( pow( error, 1/1.1 ), 0.5, 2.0 );
+}
+
+static ratecontrol_entry_t *rc_entry( x264_t *h, int frame )
+{
+    x264_ratecontrol_t *rc = h->rc;
+    if( !rc->stream )
+        return &rc->entry[rc->entry_offset + frame];
+    assert( frame < rc->num_entries );
+    /* Planning only ever writes the entries of frames not handed out yet. */
+    x264_pthread_mutex_lock( &rc->stream->mutex );
+    while( rc->stream->planned <= frame )
+        stream_plan( h );
+    assert( rc->stream->slot_frame[frame & rc->entry_mask] == frame );
+    x264_pthread_mutex_unlock( &rc->stream->mutex );
+    return &rc->entry[frame & rc->entry_mask];
+}
+
+/* Binary stats leave what only the encode of a frame needs (direct mode, reference counts,
+ * weights and MB-tree data) in the file, and the entry's record is decoded again into tmp when
+ * it's asked for.  Text stats have it all in the entry. */
+static const ratecontrol_entry_t *rc_entry_frame( x264_t *h, const ratecontrol_entry_t *rce, ratecontrol_entry_t *tmp )
+{
+    x264_statsfile_record_t rec;
+    if( !h->rc->stats_in )
+        return rce;
+    *tmp = *rce;
+    /* read_record already checked the record. */
+    x264_statsfile_read( h->rc->stats_in, rce->out_num, &rec );
+    tmp->direct_mode = rec.c_direct;
+    tmp->refs = rec.i_refs;
+    memcpy( tmp->refcount, rec.i_refcount, sizeof(tmp->refcount) );
+    memcpy( tmp->i_weight_denom, rec.i_weight_denom, sizeof(tmp->i_weight_denom) );
+    memcpy( tmp->weight, rec.i_weight, sizeof(tmp->weight) );
+    tmp->mbtree = rec.mbtree;
+    return tmp;
+}
+
+/* Frames start in coded order, which is the order count_expected_bits sums them in. */
+static void stream_start( x264_t *h, ratecontrol_entry_t *rce )
+{
+    rc_stream_t *s = h->rc->stream;
+    x264_pthread_mutex_lock( &s->mutex );
+    rce->expected_bits = s->expected_bits;
+    s->expected_bits += qscale2bits( rce, rce->new_qscale );
+    x264_pthread_mutex_unlock( &s->mutex );
+}
+
+static int stream_init( x264_t *h, float res_factor, float res_factor_bits, double *total_qp_aq )
+{
+    x264_ratecontrol_t *rcc = h->rc;
+    rc_stream_t *s;
+    double (*bins)[2] = NULL;
+    int64_t plan_start = x264_mdate();
+    CHECKED_MALLOCZERO( s, sizeof(rc_stream_t) );
+    rcc->stream = s;
+    if( x264_pthread_mutex_init( &s->mutex, NULL ) )
+        goto fail;
+    s->block = X264_MAX( h->param.rc.i_stats_window, 64 );
+    s->margin = s->block / 2;
+    s->radius = (int)(h->param.rc.f_complexity_blur * 2) + 1;
+    s->reorder = X264_BFRAME_MAX + 2;
+    s->filter = (int)(h->param.rc.f_qblur * 4) | 1;
+    s->res_factor = res_factor;
+    s->res_factor_bits = res_factor_bits;
+
+    /* The ring holds the frames being planned and blurred, and every frame from the oldest one
+     * still being encoded to the newest one the lookahead has asked for. */
+    int span = s->block + s->margin + s->filter + 4*s->radius + 2*s->reorder
+             + X264_LOOKAHEAD_MAX + X264_THREAD_MAX + X264_BFRAME_MAX;
+    int size = 1;
+    while( size < span )
+        size <<= 1;
+    rcc->entry_mask = size - 1;
+    CHECKED_MALLOC( rcc->entry, size * sizeof(ratecontrol_entry_t) );
+    CHECKED_MALLOC( s->slot_frame, size * sizeof(int) );
+    int qscale_size = s->block + s->margin + s->filter;
+    CHECKED_MALLOC( s->qscale, 2 * qscale_size * sizeof(double) );
+    s->blurred_qscale = s->qscale + qscale_size;
+    CHECKED_MALLOC( s->fills, (s->block + 1) * sizeof(double) );
+    CHECKED_MALLOCZERO( bins, STREAM_BINS * sizeof(*bins) );
+
+    /* Summary: histogram of the frames' bits against their base qscale. */
+    double timescale = (double)h->sps->vui.i_num_units_in_tick / h->sps->vui.i_time_scale;
+    double duration = 0;
+    double const_bits = 0;
+    double rceq = -1;
+    for( int i = 0; i < size; i++ )
+        s->slot_frame[i] = -1;
+    for( int i = 0; i < rcc->num_entries; i++ )
+    {
+        x264_statsfile_record_t rec;
+        if( stream_load( h, i ) < 0 || x264_statsfile_read( rcc->stats_in, i, &rec ) < 0 )
+            goto fail;
+        ratecontrol_entry_t *rce = &rcc->entry[i & rcc->entry_mask];
+        *total_qp_aq += rec.f_qp_aq;
+        duration += rce->i_duration;
+        const_bits += rce->misc_bits;
+
+        int b_fixed;
+        double q = stream_base_qscale( h, rce, i, rcc->last_qscale_for[rce->pict_type], &rceq, &b_fixed );
+        if( b_fixed )
+            const_bits += qscale2bits( rce, q ) - rce->misc_bits;
+        else
+        {
+            int bin = x264_clip3( (qscale2qp( q ) + STREAM_BIN_OFFSET) * STREAM_BIN_SCALE, 0, STREAM_BINS-1 );
+            bins[bin][0] += (rce->tex_bits + .1) * pow( rce->qscale, 1.1 );
+            bins[bin][1] += rce->mv_bits * sqrt( X264_MAX( rce->qscale, 1 ) );
+        }
+    }
+    /* Like init_pass2, leave the last frame's rc_eq value for the final ratefactor. */
+    if( rceq >= 0 )
+        rcc->last_rceq = rceq;
+    double all_available_bits = h->param.rc.i_bitrate * 1000. * duration * timescale;
+    if( all_available_bits < const_bits )
+    {
+        x264_log( h, X264_LOG_ERROR, "requested bitrate is too low. estimated minimum is %d kbps\n",
+                  (int)(const_bits * rcc->fps / (rcc->num_entries * 1000.)) );
+        goto fail;
+    }
+
+    double step_mult = all_available_bits / (const_bits + stream_summary_bits( h, bins, 1.0 ));
+    double rate_factor = 0;
+    for( double step = 1E4 * step_mult; step > 1E-7 * step_mult; step *= 0.5 )
+    {
+        rate_factor += step;
+        if( const_bits + stream_summary_bits( h, bins, rate_factor ) > all_available_bits )
+            rate_factor -= step;
+    }
+    s->rate_factor = s->block_rate_factor = rate_factor;
+    s->total_bits = const_bits + stream_summary_bits( h, bins, rate_factor );
+    x264_free( bins );
+
+    x264_log( h, X264_LOG_INFO, "2pass planning: summary of %d frames in %.1f ms, then %d at a time\n",
+              rcc->num_entries, (x264_mdate() - plan_start) / 1000., s->block );
+
+    /* Rewind for the encode. */
+    for( int i = 0; i < size; i++ )
+        s->slot_frame[i] = -1;
+    s->next_coded = s->blurred = 0;
+    s->vbv_fill = rcc->buffer_size * h->param.rc.f_vbv_buffer_init;
+    s->accum_p_qp = rcc->accum_p_qp;
     return 0;
 fail:
+    x264_free( bins );
     return -1;
 }
@@ -53,6 +53,8 @@ int x264_encoder_reconfig_apply( x264_t *h, x264_param_t *param );
 void x264_adaptive_quant_frame( x264_t *h, x264_frame_t *frame, float *quant_offsets );
 #define x264_macroblock_tree_read x264_template(macroblock_tree_read)
 int  x264_macroblock_tree_read( x264_t *h, x264_frame_t *frame, float *quant_offsets );
+#define x264_macroblock_tree_ladder x264_template(macroblock_tree_ladder)
+void x264_macroblock_tree_ladder( x264_t *h, x264_frame_t *frame, float *qp_offset );
 #define x264_reference_build_list_optimal x264_template(reference_build_list_optimal)
 int  x264_reference_build_list_optimal( x264_t *h );
 #define x264_thread_sync_ratecontrol x264_template(thread_sync_ratecontrol)
@@ -75,6 +77,10 @@ int  x264_ratecontrol_mb_qp( x264_t *h );
 int  x264_ratecontrol_end( x264_t *, int bits, int *filler );
 #define x264_ratecontrol_summary x264_template(ratecontrol_summary)
 void x264_ratecontrol_summary( x264_t * );
+#define x264_ratecontrol_estimate_frame x264_template(ratecontrol_estimate_frame)
+void x264_ratecontrol_estimate_frame( x264_t * );
+#define x264_ratecontrol_estimate x264_template(ratecontrol_estimate)
+int  x264_ratecontrol_estimate( x264_t *, const float *f_crf, int i_crf, double *p_bits, double *p_seconds );
 #define x264_rc_analyse_slice x264_template(rc_analyse_slice)
 int  x264_rc_analyse_slice( x264_t *h );
 #define x264_threads_distribute_ratecontrol x264_template(threads_distribute_ratecontrol)
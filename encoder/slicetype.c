@@ -511,6 +511,25 @@ void x264_weights_analyse( x264_t *h, x264_frame_t *fenc, x264_frame_t *ref, int
 #define NUM_ROWS 3
 #define ROW_SATD (NUM_INTS + (h->mb.i_mb_y - h->i_threadslice_start))
 
+/* The vertical limits only change when a row starts, which is the right edge since rows are
+ * searched backwards. */
+static void lowres_mv_limits( x264_t *h, int b_vertical )
+{
+    int mv_range = 2 * h->param.analyse.i_mv_range;
+    // no need for h->mb.mv_min[]
+    h->mb.mv_min_spel[0] = X264_MAX( 4*(-8*h->mb.i_mb_x - 12), -mv_range );
+    h->mb.mv_max_spel[0] = X264_MIN( 4*(8*(h->mb.i_mb_width - h->mb.i_mb_x - 1) + 12), mv_range-1 );
+    h->mb.mv_limit_fpel[0][0] = h->mb.mv_min_spel[0] >> 2;
+    h->mb.mv_limit_fpel[1][0] = h->mb.mv_max_spel[0] >> 2;
+    if( b_vertical )
+    {
+        h->mb.mv_min_spel[1] = X264_MAX( 4*(-8*h->mb.i_mb_y - 12), -mv_range );
+        h->mb.mv_max_spel[1] = X264_MIN( 4*(8*( h->mb.i_mb_height - h->mb.i_mb_y - 1) + 12), mv_range-1 );
+        h->mb.mv_limit_fpel[0][1] = h->mb.mv_min_spel[1] >> 2;
+        h->mb.mv_limit_fpel[1][1] = h->mb.mv_max_spel[1] >> 2;
+    }
+}
+
 static void slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
                                x264_frame_t **frames, int p0, int p1, int b,
                                int dist_scale_factor, int do_search[2], const x264_weight_t *w,
@@ -547,19 +566,7 @@ static void slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
     if( p0 == p1 )
         goto lowres_intra_mb;
 
-    int mv_range = 2 * h->param.analyse.i_mv_range;
-    // no need for h->mb.mv_min[]
-    h->mb.mv_min_spel[0] = X264_MAX( 4*(-8*h->mb.i_mb_x - 12), -mv_range );
-    h->mb.mv_max_spel[0] = X264_MIN( 4*(8*(h->mb.i_mb_width - h->mb.i_mb_x - 1) + 12), mv_range-1 );
-    h->mb.mv_limit_fpel[0][0] = h->mb.mv_min_spel[0] >> 2;
-    h->mb.mv_limit_fpel[1][0] = h->mb.mv_max_spel[0] >> 2;
-    if( h->mb.i_mb_x >= h->mb.i_mb_width - 2 )
-    {
-        h->mb.mv_min_spel[1] = X264_MAX( 4*(-8*h->mb.i_mb_y - 12), -mv_range );
-        h->mb.mv_max_spel[1] = X264_MIN( 4*(8*( h->mb.i_mb_height - h->mb.i_mb_y - 1) + 12), mv_range-1 );
-        h->mb.mv_limit_fpel[0][1] = h->mb.mv_min_spel[1] >> 2;
-        h->mb.mv_limit_fpel[1][1] = h->mb.mv_max_spel[1] >> 2;
-    }
+    lowres_mv_limits( h, h->mb.i_mb_x >= h->mb.i_mb_width - 2 );
 
 #define LOAD_HPELS_LUMA(dst, src) \
     { \
@@ -608,6 +615,7 @@ static void slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
     m[0].p_fenc[0] = h->mb.pic.p_fenc[0];
     m[0].weight = w;
     m[0].i_ref = 0;
+    m[0].fref = NULL;
     LOAD_HPELS_LUMA( m[0].p_fref, fref0->lowres );
     m[0].p_fref_w = m[0].p_fref[0];
     if( w[0].weightfn )
@@ -622,6 +630,7 @@ static void slicetype_mb_cost( x264_t *h, x264_mb_analysis_t *a,
         m[1].i_stride[0] = i_stride;
         m[1].p_fenc[0] = h->mb.pic.p_fenc[0];
         m[1].i_ref = 0;
+        m[1].fref = NULL;
         m[1].weight = x264_weight_none;
         LOAD_HPELS_LUMA( m[1].p_fref, fref1->lowres );
         m[1].p_fref_w = m[1].p_fref[0];
@@ -833,6 +842,427 @@ static void slicetype_slice_cost( x264_slicetype_slice_t *s )
                                s->do_search, s->w, s->output_inter, s->output_intra );
 }
 
+/* lookahead-batch: the hierarchical lowres motion search of the OpenCL lookahead (motionsearch.cl)
+ * on the cpu.  Each pass searches every mb of one scale of a downscaled pyramid against the mv field
+ * left by the previous pass, so the mbs of a pass don't depend on each other and the rows are split
+ * between the lookahead threads.  The mv field is kept by component, in lowres fullpel. */
+#define BATCH_SCALES 4
+
+typedef struct x264_batch_search_t
+{
+    x264_t *h;
+    x264_mb_analysis_t *a;
+    x264_frame_t **frames;
+    int b;
+    int ref;
+    int l;
+    const x264_weight_t *w;
+    pixel *fenc;
+    pixel *fref;
+    int i_stride;
+    int scale;
+    int mb_width;
+    int mb_height;
+    int me_range;
+    int b_shift_index;
+    int b_first_iteration;
+    int b_reverse_references;
+    int16_t **in;
+    int16_t **out;
+    int16_t **mvp;
+    int y_start;
+    int y_end;
+    int i_band;      /* first band of the job */
+    int i_band_step; /* and the jobs run every i_band_step-th band from there */
+    int i_bands;
+    void (*func)( struct x264_batch_search_t * );
+} x264_batch_search_t;
+
+static void batch_downscale( pixel *dst, intptr_t i_dst, pixel *src, intptr_t i_src, int width, int height )
+{
+    for( int y = 0; y < height; y++, dst += i_dst, src += 2*i_src )
+        for( int x = 0; x < width; x++ )
+            dst[x] = (src[2*x] + src[2*x+1] + src[2*x+i_src] + src[2*x+i_src+1] + 2) >> 2;
+
+    /* Replicate the edges, as the OpenCL images clamp their reads. */
+    dst -= height * i_dst;
+    for( int y = 0; y < height; y++ )
+        for( int x = 1; x <= LOOKAHEAD_BATCH_PAD; x++ )
+        {
+            dst[y*i_dst-x] = dst[y*i_dst];
+            dst[y*i_dst+width-1+x] = dst[y*i_dst+width-1];
+        }
+    pixel *row = dst - LOOKAHEAD_BATCH_PAD;
+    for( int y = 1; y <= LOOKAHEAD_BATCH_PAD; y++ )
+    {
+        memcpy( row - y*i_dst, row, (width + 2*LOOKAHEAD_BATCH_PAD) * SIZEOF_PIXEL );
+        memcpy( row + (height-1+y)*i_dst, row + (height-1)*i_dst, (width + 2*LOOKAHEAD_BATCH_PAD) * SIZEOF_PIXEL );
+    }
+}
+
+/* Edge mbs might not have a direct descendant, use the nearest. */
+static ALWAYS_INLINE int batch_downscale_mb_xy( int x, int y, int mb_width, int mb_height )
+{
+    x = x == mb_width-1  ? (x - (mb_width&1)) >> 1  : x >> 1;
+    y = y == mb_height-1 ? (y - (mb_height&1)) >> 1 : y >> 1;
+    return (mb_width>>1) * y + x;
+}
+
+static void batch_search_rows( x264_batch_search_t *s )
+{
+    x264_t *h = s->h;
+    const uint16_t *p_cost_mv = s->a->p_cost_mv;
+    const int scale = s->scale;
+    const int mb_width = s->mb_width;
+    const int mb_height = s->mb_height;
+    const int i_stride = s->i_stride;
+    const int mv_range = h->param.analyse.i_mv_range >> (1 + scale);
+    static const int8_t dia[4][2] = {{0,-1}, {-1,0}, {1,0}, {0,1}};
+    ALIGNED_ARRAY_16( pixel, fenc,[8*FENC_STRIDE] );
+    ALIGNED_ARRAY_16( int, costs,[4] );
+    ALIGNED_ARRAY_8( int16_t, mvc,[4],[2] );
+    ALIGNED_4( int16_t mvp[2] );
+
+#define MV_COST( mx, my ) (p_cost_mv[((mx) - mvp[0]) * (4 << scale)] + p_cost_mv[((my) - mvp[1]) * (4 << scale)])
+
+    for( int mb_y = s->y_start; mb_y < s->y_end; mb_y++ )
+        for( int mb_x = 0; mb_x < mb_width; mb_x++ )
+        {
+            int mb_xy = mb_x + mb_y * mb_width;
+            int i_mvc = 0;
+            M32( mvc[0] ) = 0;
+            M32( mvc[2] ) = 0;
+            M32( mvp ) = 0;
+
+            if( !s->b_first_iteration )
+            {
+#define MVC( dx, dy )\
+                {\
+                    int xy = s->b_shift_index ? batch_downscale_mb_xy( mb_x+(dx), mb_y+(dy), mb_width, mb_height )\
+                                              : mb_x+(dx) + (mb_y+(dy)) * mb_width;\
+                    mvc[i_mvc][0] = s->in[0][xy] >> scale;\
+                    mvc[i_mvc][1] = s->in[1][xy] >> scale;\
+                    i_mvc++;\
+                }
+                if( s->b_reverse_references )
+                {
+                    /* down and right */
+                    if( mb_x < mb_width - 1 )
+                        MVC( 1, 0 );
+                    if( mb_y < mb_height - 1 )
+                    {
+                        MVC( 0, 1 );
+                        if( mb_x > s->b_shift_index )
+                            MVC( -1, 1 );
+                        if( mb_x < mb_width - 1 )
+                            MVC( 1, 1 );
+                    }
+                }
+                else
+                {
+                    /* up and left */
+                    if( mb_x > 0 )
+                        MVC( -1, 0 );
+                    if( mb_y > 0 )
+                    {
+                        MVC( 0, -1 );
+                        if( mb_x < mb_width - 1 )
+                            MVC( 1, -1 );
+                        if( mb_x > s->b_shift_index )
+                            MVC( -1, -1 );
+                    }
+                }
+#undef MVC
+                if( i_mvc <= 1 )
+                    CP32( mvp, mvc[0] );
+                else
+                    x264_median_mv( mvp, mvc[0], mvc[1], mvc[2] );
+            }
+
+            /* Same mvp as last iteration at the same scale, so we would find the same mv again. */
+            if( !s->b_shift_index && mvp[0] == s->mvp[0][mb_xy] && mvp[1] == s->mvp[1][mb_xy] )
+            {
+                s->out[0][mb_xy] = s->in[0][mb_xy];
+                s->out[1][mb_xy] = s->in[1][mb_xy];
+                continue;
+            }
+            s->mvp[0][mb_xy] = mvp[0];
+            s->mvp[1][mb_xy] = mvp[1];
+
+            int mv_min_x = X264_MAX( -8*mb_x - 4, -mv_range );
+            int mv_min_y = X264_MAX( -8*mb_y - 4, -mv_range );
+            int mv_max_x = X264_MIN( 8*(mb_width - mb_x - 1) + 4, mv_range );
+            int mv_max_y = X264_MIN( 8*(mb_height - mb_y - 1) + 4, mv_range );
+            pixel *p_fref = s->fref + 8*(mb_x + mb_y * i_stride);
+            h->mc.copy[PIXEL_8x8]( fenc, FENC_STRIDE, s->fenc + 8*(mb_x + mb_y * i_stride), i_stride, 8 );
+
+            int bmx = x264_clip3( mvp[0], mv_min_x, mv_max_x );
+            int bmy = x264_clip3( mvp[1], mv_min_y, mv_max_y );
+            int bcost = h->pixf.fpelcmp[PIXEL_8x8]( fenc, FENC_STRIDE, p_fref + bmx + bmy*i_stride, i_stride ) + MV_COST( bmx, bmy );
+
+            for( int i = X264_MAX( s->me_range, 1 ); i > 0; i-- )
+            {
+                pixel *pix = p_fref + bmx + bmy*i_stride;
+                int bdir = -1;
+                h->pixf.fpelcmp_x4[PIXEL_8x8]( fenc, pix - i_stride, pix - 1, pix + 1, pix + i_stride, i_stride, costs );
+                for( int j = 0; j < 4; j++ )
+                    COPY2_IF_LT( bcost, costs[j] + MV_COST( bmx + dia[j][0], bmy + dia[j][1] ), bdir, j );
+                if( bdir < 0 )
+                    break;
+                bmx += dia[bdir][0];
+                bmy += dia[bdir][1];
+                if( bmx >= mv_max_x || bmx <= mv_min_x || bmy >= mv_max_y || bmy <= mv_min_y )
+                    break;
+            }
+
+            /* Try the candidates the diamond may not have reached, if they're far enough from the mvp. */
+#define TRY_MV( mx, my, b_mvcost )\
+            {\
+                int tx = x264_clip3( mx, mv_min_x, mv_max_x );\
+                int ty = x264_clip3( my, mv_min_y, mv_max_y );\
+                if( abs( tx - mvp[0] ) > 1 || abs( ty - mvp[1] ) > 1 )\
+                {\
+                    int cost = h->pixf.fpelcmp[PIXEL_8x8]( fenc, FENC_STRIDE, p_fref + tx + ty*i_stride, i_stride );\
+                    if( b_mvcost )\
+                        cost += MV_COST( tx, ty );\
+                COPY3_IF_LT( bcost, cost, bmx, tx, bmy, ty );\
+                }\
+            }
+            TRY_MV( 0, 0, 0 );
+            if( !s->b_first_iteration )
+            {
+                int xy = s->b_shift_index ? batch_downscale_mb_xy( mb_x, mb_y, mb_width, mb_height ) : mb_xy;
+                TRY_MV( s->in[0][xy] >> scale, s->in[1][xy] >> scale, 1 );
+            }
+            for( int i = 0; i < i_mvc; i++ )
+                TRY_MV( mvc[i][0], mvc[i][1], 1 );
+#undef TRY_MV
+
+            s->out[0][mb_xy] = bmx * (1 << scale);
+            s->out[1][mb_xy] = bmy * (1 << scale);
+        }
+#undef MV_COST
+}
+
+/* Turn the mv field at scale 0 into the frame's lowres mvs and costs, which slicetype_mb_cost then
+ * reuses: backwards with the same mvp and fast skip as it, the fullpel search replaced by a check of
+ * the mvp and the batch mv, then the usual subpel refine. */
+static void batch_finalize_rows( x264_batch_search_t *s )
+{
+    x264_t *h = s->h;
+    x264_mb_analysis_t *a = s->a;
+    x264_frame_t *fenc = s->frames[s->b];
+    x264_frame_t *fref = s->frames[s->ref];
+    const int dist = s->l ? s->ref - s->b : s->b - s->ref;
+    int16_t (*lowres_mvs)[2] = fenc->lowres_mvs[s->l][dist-1];
+    int *lowres_mv_costs = fenc->lowres_mv_costs[s->l][dist-1];
+    const int mb_width = s->mb_width;
+    const int i_stride = fenc->i_stride_lowres;
+    ALIGNED_ARRAY_16( pixel, pix,[8*16] );
+    ALIGNED_ARRAY_8( int16_t, mvc,[4],[2] );
+    x264_me_t m;
+
+    h->mb.pic.p_fenc[0] = h->mb.pic.fenc_buf;
+    m.i_pixel = PIXEL_8x8;
+    m.p_cost_mv = a->p_cost_mv;
+    m.i_stride[0] = i_stride;
+    m.p_fenc[0] = h->mb.pic.p_fenc[0];
+    m.weight = s->w;
+    m.i_ref = 0;
+    m.fref = NULL;
+
+    for( h->mb.i_mb_y = s->y_end - 1; h->mb.i_mb_y >= s->y_start; h->mb.i_mb_y-- )
+        for( h->mb.i_mb_x = mb_width - 1; h->mb.i_mb_x >= 0; h->mb.i_mb_x-- )
+        {
+            const int mb_x = h->mb.i_mb_x;
+            const int mb_y = h->mb.i_mb_y;
+            const int mb_xy = mb_x + mb_y * mb_width;
+            const int i_pel_offset = 8 * (mb_x + mb_y * i_stride);
+            int16_t (*fenc_mv)[2] = &lowres_mvs[mb_xy];
+            int i_mvc = 0;
+
+            h->mc.copy[PIXEL_8x8]( m.p_fenc[0], FENC_STRIDE, &fenc->lowres[0][i_pel_offset], i_stride, 8 );
+            lowres_mv_limits( h, mb_x == mb_width - 1 );
+            for( int i = 0; i < 4; i++ )
+                m.p_fref[i] = &fref->lowres[i][i_pel_offset];
+            m.p_fref_w = s->w[0].weightfn ? &fenc->weighted[0][i_pel_offset] : m.p_fref[0];
+
+            /* Reverse-order MV prediction. */
+            M32( mvc[0] ) = 0;
+            M32( mvc[2] ) = 0;
+#define MVC(mv) { CP32( mvc[i_mvc], mv ); i_mvc++; }
+            if( mb_x < mb_width - 1 )
+                MVC( fenc_mv[1] );
+            if( mb_y < s->y_end - 1 )
+            {
+                MVC( fenc_mv[mb_width] );
+                if( mb_x > 0 )
+                    MVC( fenc_mv[mb_width-1] );
+                if( mb_x < mb_width - 1 )
+                    MVC( fenc_mv[mb_width+1] );
+            }
+#undef MVC
+            if( i_mvc <= 1 )
+                CP32( m.mvp, mvc[0] );
+            else
+                x264_median_mv( m.mvp, mvc[0], mvc[1], mvc[2] );
+
+            if( !M32( m.mvp ) )
+            {
+                m.cost = h->pixf.mbcmp[PIXEL_8x8]( m.p_fenc[0], FENC_STRIDE, m.p_fref[0], i_stride );
+                if( m.cost < 64 )
+                {
+                    M32( m.mv ) = 0;
+                    goto skip_refine;
+                }
+            }
+
+            const uint16_t *p_cost_mvx = m.p_cost_mv - m.mvp[0];
+            const uint16_t *p_cost_mvy = m.p_cost_mv - m.mvp[1];
+            int bmx = 0, bmy = 0, bcost = COST_MAX;
+#define COST_MV( mx, my )\
+            {\
+                int tx = x264_clip3( mx, h->mb.mv_limit_fpel[0][0], h->mb.mv_limit_fpel[1][0] );\
+                int ty = x264_clip3( my, h->mb.mv_limit_fpel[0][1], h->mb.mv_limit_fpel[1][1] );\
+                int cost = h->pixf.fpelcmp[PIXEL_8x8]( m.p_fenc[0], FENC_STRIDE, &m.p_fref_w[tx + ty*i_stride], i_stride )\
+                         + p_cost_mvx[tx*4] + p_cost_mvy[ty*4];\
+                COPY3_IF_LT( bcost, cost, bmx, tx*4, bmy, ty*4 );\
+            }
+            /* As in x264_me_search, the mvp is checked at subpel if subme >= 3, else rounded. */
+            if( h->mb.i_subpel_refine >= 3 )
+            {
+                intptr_t stride = 16;
+                int mx = x264_clip3( m.mvp[0], h->mb.mv_limit_fpel[0][0]*4, h->mb.mv_limit_fpel[1][0]*4 );
+                int my = x264_clip3( m.mvp[1], h->mb.mv_limit_fpel[0][1]*4, h->mb.mv_limit_fpel[1][1]*4 );
+                pixel *src = h->mc.get_ref( pix, &stride, m.p_fref, i_stride, mx, my, 8, 8, s->w );
+                bcost = h->pixf.fpelcmp[PIXEL_8x8]( m.p_fenc[0], FENC_STRIDE, src, stride ) + p_cost_mvx[mx] + p_cost_mvy[my];
+                bmx = mx;
+                bmy = my;
+            }
+            else
+                COST_MV( (m.mvp[0] + 2) >> 2, (m.mvp[1] + 2) >> 2 );
+            COST_MV( s->in[0][mb_xy], s->in[1][mb_xy] );
+            if( M32( m.mvp ) )
+                COST_MV( 0, 0 );
+#undef COST_MV
+            m.mv[0] = bmx;
+            m.mv[1] = bmy;
+            m.cost = bcost;
+            x264_me_refine_subpel( h, &m );
+            m.cost -= a->p_cost_mv[0]; // remove mvcost from skip mbs
+            if( M32( m.mv ) )
+                m.cost += 5 * a->i_lambda;
+
+skip_refine:
+            CP32( fenc_mv[0], m.mv );
+            lowres_mv_costs[mb_xy] = m.cost;
+        }
+}
+
+/* The rows are cut into bands of BATCH_BAND_ROWS, or at most X264_LOOKAHEAD_THREAD_MAX of them, which
+ * depends only on the frame size: the finalize pass predicts across rows within a band only, so the
+ * result mustn't depend on how many threads happen to run the bands. */
+#define BATCH_BAND_ROWS 8
+
+static void batch_run_bands( x264_batch_search_t *s )
+{
+    for( int i = s->i_band; i < s->i_bands; i += s->i_band_step )
+    {
+        s->y_start = s->mb_height *  i    / s->i_bands;
+        s->y_end   = s->mb_height * (i+1) / s->i_bands;
+        s->func( s );
+    }
+}
+
+static void batch_run( x264_t *h, x264_batch_search_t *s, void (*func)( x264_batch_search_t * ) )
+{
+    x264_batch_search_t job[X264_LOOKAHEAD_THREAD_MAX];
+    int i_bands = X264_MIN( (s->mb_height + BATCH_BAND_ROWS - 1) / BATCH_BAND_ROWS, X264_LOOKAHEAD_THREAD_MAX );
+    int i_threads = h->lookaheadpool ? X264_MIN( h->param.i_lookahead_threads, i_bands ) : 1;
+
+    for( int i = 0; i < i_threads; i++ )
+    {
+        job[i] = *s;
+        job[i].func = func;
+        job[i].i_band = i;
+        job[i].i_band_step = i_threads;
+        job[i].i_bands = i_bands;
+        if( h->lookaheadpool )
+        {
+            x264_t *t = job[i].h = h->lookahead_thread[i];
+            t->mb.i_me_method = h->mb.i_me_method;
+            t->mb.i_subpel_refine = h->mb.i_subpel_refine;
+            t->mb.b_chroma_me = h->mb.b_chroma_me;
+            x264_threadpool_run( h->lookaheadpool, (void*)batch_run_bands, &job[i] );
+        }
+        else
+            batch_run_bands( &job[i] );
+    }
+    if( h->lookaheadpool )
+        for( int i = 0; i < i_threads; i++ )
+            x264_threadpool_wait( h->lookaheadpool, &job[i] );
+}
+
+/* Search list l of frames[b] against frames[ref] for all mbs at once. */
+static void batch_motionsearch( x264_t *h, x264_mb_analysis_t *a, x264_frame_t **frames, int b, int ref, int l,
+                                const x264_weight_t *w )
+{
+    static const uint8_t num_iterations[BATCH_SCALES] = { 1, 1, 2, 3 };
+    x264_frame_t *fenc = frames[b];
+    pixel *fref = w[0].weightfn ? fenc->weighted[0] : frames[ref]->lowres[0];
+    int i_stride = fenc->i_stride_lowres;
+
+    for( int scale = 1; scale < BATCH_SCALES; scale++ )
+    {
+        int width  = (8*h->mb.i_mb_width)  >> scale;
+        int height = (8*h->mb.i_mb_height) >> scale;
+        int i_src = scale > 1 ? h->batch.i_stride[scale-1] : i_stride;
+        batch_downscale( h->batch.plane[0][scale], h->batch.i_stride[scale],
+                         scale > 1 ? h->batch.plane[0][scale-1] : fenc->lowres[0], i_src, width, height );
+        batch_downscale( h->batch.plane[1][scale], h->batch.i_stride[scale],
+                         scale > 1 ? h->batch.plane[1][scale-1] : fref, i_src, width, height );
+    }
+
+    x264_batch_search_t s = { .h = h, .a = a, .frames = frames, .b = b, .ref = ref, .l = l, .w = w, .mvp = h->batch.mvp };
+    int b_first_iteration = 1;
+    int b_reverse_references = 1;
+    int i_mv_in = 0; /* which of the two mv fields the next pass reads */
+    for( int scale = BATCH_SCALES-1; scale >= 0; scale-- )
+    {
+        s.mb_width  = h->mb.i_mb_width  >> scale;
+        s.mb_height = h->mb.i_mb_height >> scale;
+        if( s.mb_width < 2 || s.mb_height < 2 )
+            continue;
+        s.fenc = scale ? h->batch.plane[0][scale] : fenc->lowres[0];
+        s.fref = scale ? h->batch.plane[1][scale] : fref;
+        s.i_stride = scale ? h->batch.i_stride[scale] : i_stride;
+        s.scale = scale;
+        s.me_range = h->param.analyse.i_me_range >> scale;
+        s.b_shift_index = 1;
+        for( int iter = 0; iter < num_iterations[scale]; iter++ )
+        {
+            s.b_first_iteration = b_first_iteration;
+            s.b_reverse_references = b_reverse_references;
+            s.in  = h->batch.mv[i_mv_in];
+            s.out = h->batch.mv[!i_mv_in];
+            batch_run( h, &s, batch_search_rows );
+
+            s.b_shift_index = 0;
+            b_first_iteration = 0;
+            /* Alternate top-left vs bottom-right neighbours at the lower scales, so the mv field
+             * smooths more quickly. */
+            if( scale > 2 )
+                b_reverse_references ^= 1;
+            else
+                b_reverse_references = 0;
+            i_mv_in = !i_mv_in;
+        }
+    }
+
+    s.in = h->batch.mv[i_mv_in];
+    batch_run( h, &s, batch_finalize_rows );
+}
+
 static int slicetype_frame_cost( x264_t *h, x264_mb_analysis_t *a,
                                  x264_frame_t **frames, int p0, int p1, int b )
 {
@@ -846,10 +1276,14 @@ static int slicetype_frame_cost( x264_t *h, x264_mb_analysis_t *a,
      * the preceding frames as B. (is this still true?) */
     /* Also check that we already calculated the row SATDs for the current frame. */
     if( fenc->i_cost_est[b-p0][p1-b] >= 0 && (!h->param.rc.i_vbv_buffer_size || fenc->i_row_satds[b-p0][p1-b][0] != -1) )
+    {
+        h->i_cost_cache_hits[0]++;
         i_score = fenc->i_cost_est[b-p0][p1-b];
+    }
     else
     {
         int dist_scale_factor = 128;
+        h->i_cost_cache_misses[0]++;
 
         /* For each list, check to see whether we have lowres motion-searched this reference frame before. */
         do_search[0] = b != p0 && fenc->lowres_mvs[0][b-p0-1][0][0] == 0x7FFF;
@@ -898,13 +1332,23 @@ static int slicetype_frame_cost( x264_t *h, x264_mb_analysis_t *a,
         else
 #endif
         {
+            if( h->param.b_lookahead_batch && h->mb.i_mb_width >= 2 && h->mb.i_mb_height >= 2 )
+                for( int l = 0; l < 2; l++ )
+                    if( do_search[l] )
+                    {
+                        batch_motionsearch( h, a, frames, b, l ? p1 : p0, l, l ? x264_weight_none : w );
+                        do_search[l] = 0;
+                    }
+
             if( h->param.i_lookahead_threads > 1 )
             {
                 x264_slicetype_slice_t s[X264_LOOKAHEAD_THREAD_MAX];
 
                 for( int i = 0; i < h->param.i_lookahead_threads; i++ )
                 {
-                    x264_t *t = h->lookahead_thread[i];
+                    /* The cost stage of the lookahead has no pool, so it runs the same slices one after
+                     * another, which gives the same result. */
+                    x264_t *t = h->lookaheadpool ? h->lookahead_thread[i] : h;
 
                     /* FIXME move this somewhere else */
                     t->mb.i_me_method = h->mb.i_me_method;
@@ -926,10 +1370,14 @@ static int slicetype_frame_cost( x264_t *h, x264_mb_analysis_t *a,
                     output_inter[i+1] = output_inter[i] + thread_output_size + PAD_SIZE;
                     output_intra[i+1] = output_intra[i] + thread_output_size + PAD_SIZE;
 
-                    x264_threadpool_run( h->lookaheadpool, (void*)slicetype_slice_cost, &s[i] );
+                    if( h->lookaheadpool )
+                        x264_threadpool_run( h->lookaheadpool, (void*)slicetype_slice_cost, &s[i] );
+                    else
+                        slicetype_slice_cost( &s[i] );
                 }
-                for( int i = 0; i < h->param.i_lookahead_threads; i++ )
-                    x264_threadpool_wait( h->lookaheadpool, &s[i] );
+                if( h->lookaheadpool )
+                    for( int i = 0; i < h->param.i_lookahead_threads; i++ )
+                        x264_threadpool_wait( h->lookaheadpool, &s[i] );
             }
             else
             {
@@ -995,12 +1443,21 @@ static int slicetype_frame_cost( x264_t *h, x264_mb_analysis_t *a,
 }
 
 /* If MB-tree changes the quantizers, we need to recalculate the frame cost without
- * re-running lookahead. */
+ * re-running lookahead.  B-frames are weighted by their AQ offsets, which MB-tree never
+ * changes, so their result (and the row SATDs left behind) only has to be computed once;
+ * the VBV lookahead asks for it again every time the window moves. */
 static int slicetype_frame_cost_recalculate( x264_t *h, x264_frame_t **frames, int p0, int p1, int b )
 {
     int i_score = 0;
     int *row_satd = frames[b]->i_row_satds[b-p0][p1-b];
-    float *qp_offset = IS_X264_TYPE_B(frames[b]->i_type) ? frames[b]->f_qp_offset_aq : frames[b]->f_qp_offset;
+    int b_bframe = IS_X264_TYPE_B(frames[b]->i_type);
+    float *qp_offset = b_bframe ? frames[b]->f_qp_offset_aq : frames[b]->f_qp_offset;
+    if( b_bframe && frames[b]->i_cost_est_mbtree[b-p0][p1-b] >= 0 )
+    {
+        h->i_cost_cache_hits[1]++;
+        return frames[b]->i_cost_est_mbtree[b-p0][p1-b];
+    }
+    h->i_cost_cache_misses[1]++;
     x264_emms();
     for( h->mb.i_mb_y = h->mb.i_mb_height - 1; h->mb.i_mb_y >= 0; h->mb.i_mb_y-- )
     {
@@ -1020,6 +1477,8 @@ static int slicetype_frame_cost_recalculate( x264_t *h, x264_frame_t **frames, i
             }
         }
     }
+    /* The row SATDs are overwritten either way, so only a B-frame's own result stays valid. */
+    frames[b]->i_cost_est_mbtree[b-p0][p1-b] = b_bframe ? i_score : -1;
     return i_score;
 }
 
@@ -1048,9 +1507,9 @@ static void macroblock_tree_finish( x264_t *h, x264_frame_t *frame, float averag
     }
 }
 
-static void macroblock_tree_propagate( x264_t *h, x264_frame_t **frames, float average_duration, int p0, int p1, int b, int referenced )
+static void macroblock_tree_propagate_rows( x264_t *h, x264_frame_t **frames, float *fps_factor, int p0, int p1, int b,
+                                            int referenced, uint16_t *ref_costs[2], int start_y, int end_y )
 {
-    uint16_t *ref_costs[2] = {frames[p0]->i_propagate_cost,frames[p1]->i_propagate_cost};
     int dist_scale_factor = ( ((b-p0) << 8) + ((p1-p0) >> 1) ) / (p1-p0);
     int i_bipred_weight = h->param.analyse.b_weighted_bipred ? 64 - (dist_scale_factor>>2) : 32;
     int16_t (*mvs[2])[2] = { b != p0 ? frames[b]->lowres_mvs[0][b-p0-1] : NULL, b != p1 ? frames[b]->lowres_mvs[1][p1-b-1] : NULL };
@@ -1059,19 +1518,16 @@ static void macroblock_tree_propagate( x264_t *h, x264_frame_t **frames, float a
     uint16_t *propagate_cost = frames[b]->i_propagate_cost;
     uint16_t *lowres_costs = frames[b]->lowres_costs[b-p0][p1-b];
 
-    x264_emms();
-    float fps_factor = CLIP_DURATION(frames[b]->f_duration) / (CLIP_DURATION(average_duration) * 256.0f) * MBTREE_PRECISION;
-
-    /* For non-reffed frames the source costs are always zero, so just memset one row and re-use it. */
-    if( !referenced )
-        memset( frames[b]->i_propagate_cost, 0, h->mb.i_mb_width * sizeof(uint16_t) );
+    /* For non-reffed frames the source costs are always zero, so one zeroed row is re-used. */
+    if( referenced )
+        propagate_cost += start_y * h->mb.i_mb_width;
 
-    for( h->mb.i_mb_y = 0; h->mb.i_mb_y < h->mb.i_mb_height; h->mb.i_mb_y++ )
+    for( h->mb.i_mb_y = start_y; h->mb.i_mb_y < end_y; h->mb.i_mb_y++ )
     {
         int mb_index = h->mb.i_mb_y*h->mb.i_mb_stride;
         h->mc.mbtree_propagate_cost( buf, propagate_cost,
             frames[b]->i_intra_cost+mb_index, lowres_costs+mb_index,
-            frames[b]->i_inv_qscale_factor+mb_index, &fps_factor, h->mb.i_mb_width );
+            frames[b]->i_inv_qscale_factor+mb_index, fps_factor, h->mb.i_mb_width );
         if( referenced )
             propagate_cost += h->mb.i_mb_width;
 
@@ -1083,6 +1539,92 @@ static void macroblock_tree_propagate( x264_t *h, x264_frame_t **frames, float a
                                          bipred_weights[1], h->mb.i_mb_y, h->mb.i_mb_width, 1 );
         }
     }
+}
+
+typedef struct
+{
+    x264_t *h;
+    x264_t **threads;
+    x264_frame_t **frames;
+    float *fps_factor;
+    int p0;
+    int p1;
+    int b;
+    int referenced;
+} x264_mbtree_slice_t;
+
+/* Motion vectors can point anywhere in the reference, so the slices can't share the
+ * references' costs.  All but the first one propagate into their own accumulators. */
+static void macroblock_tree_slice_propagate( x264_mbtree_slice_t *s )
+{
+    x264_t *h = s->h;
+    uint16_t *ref_costs[2] = { s->frames[s->p0]->i_propagate_cost, s->frames[s->p1]->i_propagate_cost };
+    if( h != s->threads[0] )
+    {
+        ref_costs[0] = h->mbtree_propagate_acc[0];
+        ref_costs[1] = h->mbtree_propagate_acc[1];
+    }
+    macroblock_tree_propagate_rows( h, s->frames, s->fps_factor, s->p0, s->p1, s->b, s->referenced,
+                                    ref_costs, h->i_threadslice_start, h->i_threadslice_end );
+}
+
+/* Add the accumulators into the references and clear them for the next frame.  All the
+ * propagated amounts are positive, so the saturating sum doesn't depend on the order in
+ * which they're added and the result is the same as with a single thread. */
+static void macroblock_tree_slice_merge( x264_mbtree_slice_t *s )
+{
+    x264_t *h = s->h;
+    int start = h->i_threadslice_start * h->mb.i_mb_stride;
+    int end = h->i_threadslice_end * h->mb.i_mb_stride;
+    for( int list = 0; list <= (s->b != s->p1); list++ )
+    {
+        uint16_t *ref_costs = s->frames[list ? s->p1 : s->p0]->i_propagate_cost;
+        for( int i = 1; i < h->param.i_lookahead_threads; i++ )
+        {
+            uint16_t *acc = s->threads[i]->mbtree_propagate_acc[list];
+            for( int mb_index = start; mb_index < end; mb_index++ )
+                if( acc[mb_index] )
+                {
+                    MC_CLIP_ADD( ref_costs[mb_index], acc[mb_index] );
+                    acc[mb_index] = 0;
+                }
+        }
+    }
+}
+
+static void macroblock_tree_propagate( x264_t *h, x264_frame_t **frames, float average_duration, int p0, int p1, int b, int referenced )
+{
+    x264_emms();
+    float fps_factor = CLIP_DURATION(frames[b]->f_duration) / (CLIP_DURATION(average_duration) * 256.0f) * MBTREE_PRECISION;
+
+    if( !referenced )
+        memset( frames[b]->i_propagate_cost, 0, h->mb.i_mb_width * sizeof(uint16_t) );
+
+    if( h->param.i_lookahead_threads > 1 )
+    {
+        x264_mbtree_slice_t s[X264_LOOKAHEAD_THREAD_MAX];
+
+        for( int i = 0; i < h->param.i_lookahead_threads; i++ )
+        {
+            x264_t *t = h->lookahead_thread[i];
+            t->i_threadslice_start = ((h->mb.i_mb_height *  i    + h->param.i_lookahead_threads/2) / h->param.i_lookahead_threads);
+            t->i_threadslice_end   = ((h->mb.i_mb_height * (i+1) + h->param.i_lookahead_threads/2) / h->param.i_lookahead_threads);
+            s[i] = (x264_mbtree_slice_t){ t, h->lookahead_thread, frames, &fps_factor, p0, p1, b, referenced };
+            x264_threadpool_run( h->lookaheadpool, (void*)macroblock_tree_slice_propagate, &s[i] );
+        }
+        for( int i = 0; i < h->param.i_lookahead_threads; i++ )
+            x264_threadpool_wait( h->lookaheadpool, &s[i] );
+
+        for( int i = 0; i < h->param.i_lookahead_threads; i++ )
+            x264_threadpool_run( h->lookaheadpool, (void*)macroblock_tree_slice_merge, &s[i] );
+        for( int i = 0; i < h->param.i_lookahead_threads; i++ )
+            x264_threadpool_wait( h->lookaheadpool, &s[i] );
+    }
+    else
+    {
+        uint16_t *ref_costs[2] = { frames[p0]->i_propagate_cost, frames[p1]->i_propagate_cost };
+        macroblock_tree_propagate_rows( h, frames, &fps_factor, p0, p1, b, referenced, ref_costs, 0, h->mb.i_mb_height );
+    }
 
     if( h->param.rc.i_vbv_buffer_size && h->param.rc.i_lookahead && referenced )
         macroblock_tree_finish( h, frames[b], average_duration, b == p1 ? b - p0 : 0 );
@@ -1742,6 +2284,55 @@ void x264_slicetype_analyse( x264_t *h, int intra_minigop )
 #endif
 }
 
+/* Take the frame types of the next minigop, and the MB-tree qp offsets of its
+ * reference frames, from the leader of the ladder.  If the leader has nothing
+ * for us, stop following it and run our own lookahead from now on. */
+static int slicetype_ladder( x264_t *h )
+{
+    x264_lookahead_t *look = h->lookahead;
+    x264_ladder_gop_t *gop = x264_ladder_get( h->param.ladder, look->i_ladder_gop, &look->b_ladder_cancel );
+    int first = look->next.list[0]->i_frame;
+    int b_valid = !!gop && gop->i_first_frame == first;
+
+    for( int i = 0; b_valid && i < gop->i_frames; i++ )
+        b_valid = gop->i_frame[i] - first < look->next.i_size;
+    if( !b_valid )
+    {
+        if( !look->b_ladder_cancel )
+            x264_log( h, X264_LOG_WARNING, "ladder leader has no decision for frame %d, using own lookahead\n", first );
+        x264_ladder_detach_follower( h->param.ladder, look->i_ladder_gop );
+        look->b_ladder_follower = 0;
+        look->b_analyse_keyframe = h->param.rc.b_mb_tree || (h->param.rc.i_vbv_buffer_size && h->param.rc.i_lookahead);
+        return 0;
+    }
+
+    for( int i = 0; i < gop->i_frames; i++ )
+    {
+        x264_frame_t *frm = look->next.list[gop->i_frame[i] - first];
+        frm->i_type = gop->i_type[i];
+        if( gop->qp_offset[i] && h->param.rc.b_mb_tree )
+            x264_macroblock_tree_ladder( h, frm, gop->qp_offset[i] );
+    }
+    x264_ladder_release( h->param.ladder, look->i_ladder_gop++ );
+    return 1;
+}
+
+/* Nearly every slicetype decision needs the intra cost of each frame and its P cost from the
+ * previous one, so the lookahead estimates them as frames come in, in a pipeline stage of
+ * its own when threaded.  The results are cached in the frame and don't depend on when
+ * they were computed. */
+void x264_slicetype_estimate( x264_t *h, x264_frame_t *prev, x264_frame_t *frame )
+{
+    x264_mb_analysis_t a;
+    x264_frame_t *frames[2] = { prev, frame };
+
+    lowres_context_init( h, &a );
+    if( prev )
+        slicetype_frame_cost( h, &a, frames, 0, 1, 1 );
+    else
+        slicetype_frame_cost( h, &a, frames, 1, 1, 1 );
+}
+
 void x264_slicetype_decide( x264_t *h )
 {
     x264_frame_t *frames[X264_BFRAME_MAX+2];
@@ -1790,6 +2381,10 @@ void x264_slicetype_decide( x264_t *h )
             h->lookahead->next.list[i]->i_type =
                 x264_ratecontrol_slice_type( h, h->lookahead->next.list[i]->i_frame );
     }
+    else if( h->lookahead->b_ladder_follower && slicetype_ladder( h ) )
+    {
+        /* Frame types and MB-tree come from the ladder leader */
+    }
     else if( (h->param.i_bframe && h->param.i_bframe_adaptive)
              || h->param.i_scenecut_threshold
              || h->param.rc.b_mb_tree
@@ -0,0 +1,341 @@
+/*****************************************************************************
+ * statsfile.c: binary 2-pass stats container
+ *****************************************************************************
+ * Copyright (C) 2022 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+/* Text stats are parsed with sscanf at startup, which takes seconds on long encodes, and
+ * the MB-tree data lives in a second file.  This container keeps packed records, with the
+ * MB-tree data next to its record, that are decoded from a read-only mapping when needed.
+ * The container is independent of bit depth. */
+
+#include "common/base.h"
+#include "statsfile.h"
+
+#if HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#define HEADER_SIZE  24
+#define TRAILER_SIZE 20
+#define RECORD_SIZE  56  /* without the refcounts, weights and MB-tree data */
+#define RECORD_MAX   (RECORD_SIZE + 16*4 + 3*2 + 5*2)
+
+/* Field by field, so that nothing depends on the alignment or padding of a struct. */
+#define PUT( p, x ) do { memcpy( p, &(x), sizeof(x) ); p += sizeof(x); } while( 0 )
+#define GET( x, p ) do { memcpy( &(x), p, sizeof(x) ); p += sizeof(x); } while( 0 )
+
+int x264_statsfile_probe( const char *filename )
+{
+    char magic[8];
+    FILE *fh = x264_fopen( filename, "rb" );
+    if( !fh )
+        return 0;
+    int b_binary = fread( magic, 1, 8, fh ) == 8 && !memcmp( magic, X264_STATSFILE_MAGIC, 8 );
+    fclose( fh );
+    return b_binary;
+}
+
+static int statsfile_load( x264_statsfile_t *stats, const char *filename )
+{
+    FILE *fh = x264_fopen( filename, "rb" );
+    if( !fh )
+        return -1;
+    x264_struct_stat file_stat;
+    if( x264_fstat( fileno( fh ), &file_stat ) || file_stat.st_size <= 0 ||
+        (uint64_t)file_stat.st_size > SIZE_MAX )
+        goto fail;
+    stats->i_size = file_stat.st_size;
+#if HAVE_MMAP
+    stats->data = mmap( NULL, stats->i_size, PROT_READ, MAP_PRIVATE, fileno( fh ), 0 );
+    if( stats->data != MAP_FAILED )
+    {
+        stats->b_mapped = 1;
+        fclose( fh );
+        return 0;
+    }
+    stats->data = NULL;
+#endif
+    stats->data = x264_malloc( stats->i_size );
+    if( !stats->data || fread( stats->data, 1, stats->i_size, fh ) != (uint64_t)stats->i_size )
+        goto fail;
+    fclose( fh );
+    return 0;
+fail:
+    fclose( fh );
+    return -1;
+}
+
+static uint64_t statsfile_offset( x264_statsfile_t *stats, int i )
+{
+    uint64_t offset;
+    memcpy( &offset, stats->index + i * sizeof(uint64_t), sizeof(uint64_t) );
+    return offset;
+}
+
+int x264_statsfile_open( x264_statsfile_t **p_stats, const char *filename )
+{
+    x264_statsfile_t *stats;
+    *p_stats = NULL;
+    CHECKED_MALLOCZERO( stats, sizeof(x264_statsfile_t) );
+    if( statsfile_load( stats, filename ) < 0 )
+    {
+        x264_statsfile_close( stats );
+        return -1;
+    }
+    if( stats->i_size < HEADER_SIZE + TRAILER_SIZE )
+        goto damaged;
+
+    char magic[8];
+    uint32_t version, byte_order, options_size, mbtree_mbs, frames;
+    uint64_t index_offset;
+    const uint8_t *p = stats->data;
+    GET( magic, p );
+    GET( version, p );
+    GET( byte_order, p );
+    GET( options_size, p );
+    GET( mbtree_mbs, p );
+    int64_t records_start = HEADER_SIZE + (int64_t)options_size;
+    if( memcmp( magic, X264_STATSFILE_MAGIC, 8 ) || version != X264_STATSFILE_VERSION ||
+        byte_order != X264_STATSFILE_BYTE_ORDER || !options_size || mbtree_mbs > INT_MAX / 2 ||
+        records_start > stats->i_size - TRAILER_SIZE )
+        goto damaged;
+    stats->options = (const char*)p;
+    if( stats->options[options_size-1] )
+        goto damaged;
+    stats->i_mbtree_mbs = mbtree_mbs;
+
+    p = stats->data + stats->i_size - TRAILER_SIZE;
+    GET( index_offset, p );
+    GET( frames, p );
+    GET( magic, p );
+    if( memcmp( magic, X264_STATSFILE_MAGIC, 8 ) || index_offset < (uint64_t)records_start ||
+        index_offset > (uint64_t)stats->i_size - TRAILER_SIZE ||
+        (stats->i_size - TRAILER_SIZE - index_offset) / sizeof(uint64_t) != frames || frames > INT_MAX )
+        goto damaged;
+    stats->i_frames = frames;
+    stats->i_index_offset = index_offset;
+    stats->index = stats->data + index_offset;
+
+    /* The records are back to back, so each one ends where the next starts; their contents
+     * are checked as they are decoded. */
+    uint64_t pos = records_start;
+    for( int i = 0; i < stats->i_frames; i++ )
+    {
+        uint64_t end = i+1 < stats->i_frames ? statsfile_offset( stats, i+1 ) : index_offset;
+        if( statsfile_offset( stats, i ) != pos || end < pos + RECORD_SIZE || end > index_offset )
+            goto damaged;
+        pos = end;
+    }
+
+    *p_stats = stats;
+    return 0;
+damaged:
+    x264_statsfile_close( stats );
+    return -2;
+fail:
+    return -1;
+}
+
+void x264_statsfile_close( x264_statsfile_t *stats )
+{
+    if( !stats )
+        return;
+#if HAVE_MMAP
+    if( stats->b_mapped )
+        munmap( stats->data, stats->i_size );
+    else
+#endif
+        x264_free( stats->data );
+    x264_free( stats );
+}
+
+int x264_statsfile_read( x264_statsfile_t *stats, int i_frame_out, x264_statsfile_record_t *rec )
+{
+    uint64_t pos = statsfile_offset( stats, i_frame_out );
+    uint64_t end = i_frame_out+1 < stats->i_frames ? statsfile_offset( stats, i_frame_out+1 ) : stats->i_index_offset;
+    const uint8_t *p = stats->data + pos;
+    uint8_t refs, flags;
+    int32_t refcount;
+
+    rec->c_type = *p++;
+    rec->c_direct = *p++;
+    refs = *p++;
+    flags = *p++;
+    GET( rec->i_frame, p );
+    GET( rec->f_qp_rc, p );
+    GET( rec->f_qp_aq, p );
+    GET( rec->i_tex_bits, p );
+    GET( rec->i_mv_bits, p );
+    GET( rec->i_misc_bits, p );
+    GET( rec->i_mb_count_i, p );
+    GET( rec->i_mb_count_p, p );
+    GET( rec->i_mb_count_skip, p );
+    GET( rec->i_duration, p );
+    GET( rec->i_cpb_duration, p );
+    rec->i_frame_out = i_frame_out;
+
+    int64_t size = RECORD_SIZE + refs * sizeof(int32_t)
+                 + (flags & STATSFILE_WEIGHT_LUMA ? 3 * sizeof(int16_t) : 0)
+                 + (flags & STATSFILE_WEIGHT_CHROMA ? 5 * sizeof(int16_t) : 0)
+                 + (flags & STATSFILE_MBTREE ? stats->i_mbtree_mbs * sizeof(uint16_t) : 0);
+    if( refs > 16 || (flags & STATSFILE_WEIGHT_CHROMA && !(flags & STATSFILE_WEIGHT_LUMA)) ||
+        (flags & STATSFILE_MBTREE && !stats->i_mbtree_mbs) || pos + size != end )
+        return -1;
+
+    rec->i_refs = refs;
+    for( int i = 0; i < 16; i++ )
+    {
+        refcount = 0;
+        if( i < refs )
+            GET( refcount, p );
+        rec->i_refcount[i] = refcount;
+    }
+    memset( rec->i_weight, 0, sizeof(rec->i_weight) );
+    rec->i_weight_denom[0] = rec->i_weight_denom[1] = -1;
+    if( flags & STATSFILE_WEIGHT_LUMA )
+    {
+        GET( rec->i_weight_denom[0], p );
+        GET( rec->i_weight[0], p );
+    }
+    if( flags & STATSFILE_WEIGHT_CHROMA )
+    {
+        GET( rec->i_weight_denom[1], p );
+        GET( rec->i_weight[1], p );
+        GET( rec->i_weight[2], p );
+    }
+    rec->mbtree = flags & STATSFILE_MBTREE ? p : NULL;
+    return 0;
+}
+
+static int statsfile_put( x264_statsfile_writer_t *writer, const void *data, int64_t size )
+{
+    if( fwrite( data, 1, size, writer->fh ) != (uint64_t)size )
+        return -1;
+    writer->i_pos += size;
+    return 0;
+}
+
+int x264_statsfile_writer_open( x264_statsfile_writer_t **p_writer, FILE *fh, const char *options, int i_mbtree_mbs )
+{
+    x264_statsfile_writer_t *writer;
+    CHECKED_MALLOCZERO( writer, sizeof(x264_statsfile_writer_t) );
+    writer->fh = fh;
+    writer->i_mbtree_mbs = i_mbtree_mbs;
+    *p_writer = writer;
+
+    uint8_t header[HEADER_SIZE], *p = header;
+    uint32_t version = X264_STATSFILE_VERSION;
+    uint32_t byte_order = X264_STATSFILE_BYTE_ORDER;
+    uint32_t options_size = strlen( options ) + 1;
+    uint32_t mbtree_mbs = i_mbtree_mbs;
+    memcpy( p, X264_STATSFILE_MAGIC, 8 );
+    p += 8;
+    PUT( p, version );
+    PUT( p, byte_order );
+    PUT( p, options_size );
+    PUT( p, mbtree_mbs );
+    if( statsfile_put( writer, header, HEADER_SIZE ) < 0 ||
+        statsfile_put( writer, options, options_size ) < 0 )
+        return -1;
+    return 0;
+fail:
+    *p_writer = NULL;
+    return -1;
+}
+
+int x264_statsfile_write( x264_statsfile_writer_t *writer, const x264_statsfile_record_t *rec )
+{
+    if( writer->i_frames == writer->i_index_size )
+    {
+        int size = X264_MAX( 2 * writer->i_index_size, 256 );
+        uint64_t *index;
+        CHECKED_MALLOC( index, size * sizeof(uint64_t) );
+        if( writer->i_frames )
+            memcpy( index, writer->index, writer->i_frames * sizeof(uint64_t) );
+        x264_free( writer->index );
+        writer->index = index;
+        writer->i_index_size = size;
+    }
+    writer->index[writer->i_frames++] = writer->i_pos;
+
+    uint8_t buf[RECORD_MAX], *p = buf;
+    int refs = X264_MIN( rec->i_refs, 16 );
+    *p++ = rec->c_type;
+    *p++ = rec->c_direct;
+    *p++ = refs;
+    *p++ = (rec->mbtree ? STATSFILE_MBTREE : 0)
+         | (rec->i_weight_denom[0] >= 0 ? STATSFILE_WEIGHT_LUMA : 0)
+         | (rec->i_weight_denom[0] >= 0 && rec->i_weight_denom[1] >= 0 ? STATSFILE_WEIGHT_CHROMA : 0);
+    PUT( p, rec->i_frame );
+    PUT( p, rec->f_qp_rc );
+    PUT( p, rec->f_qp_aq );
+    PUT( p, rec->i_tex_bits );
+    PUT( p, rec->i_mv_bits );
+    PUT( p, rec->i_misc_bits );
+    PUT( p, rec->i_mb_count_i );
+    PUT( p, rec->i_mb_count_p );
+    PUT( p, rec->i_mb_count_skip );
+    PUT( p, rec->i_duration );
+    PUT( p, rec->i_cpb_duration );
+    for( int i = 0; i < refs; i++ )
+        PUT( p, rec->i_refcount[i] );
+    if( rec->i_weight_denom[0] >= 0 )
+    {
+        PUT( p, rec->i_weight_denom[0] );
+        PUT( p, rec->i_weight[0] );
+        if( rec->i_weight_denom[1] >= 0 )
+        {
+            PUT( p, rec->i_weight_denom[1] );
+            PUT( p, rec->i_weight[1] );
+            PUT( p, rec->i_weight[2] );
+        }
+    }
+
+    if( statsfile_put( writer, buf, p - buf ) < 0 )
+        return -1;
+    if( rec->mbtree && statsfile_put( writer, rec->mbtree, writer->i_mbtree_mbs * sizeof(uint16_t) ) < 0 )
+        return -1;
+    return 0;
+fail:
+    return -1;
+}
+
+int x264_statsfile_finish( x264_statsfile_writer_t *writer )
+{
+    uint8_t trailer[TRAILER_SIZE], *p = trailer;
+    uint64_t index_offset = writer->i_pos;
+    uint32_t frames = writer->i_frames;
+    PUT( p, index_offset );
+    PUT( p, frames );
+    memcpy( p, X264_STATSFILE_MAGIC, 8 );
+    if( statsfile_put( writer, writer->index, writer->i_frames * sizeof(uint64_t) ) < 0 ||
+        statsfile_put( writer, trailer, TRAILER_SIZE ) < 0 )
+        return -1;
+    return 0;
+}
+
+void x264_statsfile_writer_close( x264_statsfile_writer_t *writer )
+{
+    if( !writer )
+        return;
+    x264_free( writer->index );
+    x264_free( writer );
+}
@@ -0,0 +1,118 @@
+/*****************************************************************************
+ * statsfile.h: binary 2-pass stats container
+ *****************************************************************************
+ * Copyright (C) 2022 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+#ifndef X264_ENCODER_STATSFILE_H
+#define X264_ENCODER_STATSFILE_H
+
+/* Layout, in native byte order and without any padding:
+ *   header: magic, uint32 version, byte order, options size, MB-tree mbs per frame (0 if none)
+ *   options string ("#options: ..." as in text stats), NUL terminated
+ *   one record per frame in coded order, back to back
+ *   index: uint64 offset of every record, in coded order
+ *   trailer: uint64 index offset, uint32 number of frames, magic
+ * A record is:
+ *   uint8  type (I, i, P, B or b as in text stats), direct mode, number of refs, flags
+ *   int32  frame number, in display order
+ *   float  qp_rc, qp_aq
+ *   int32  tex, mv and misc bits, I, P and skip mb counts
+ *   int64  duration, cpb duration
+ *   int32  refcount of each ref
+ *   int16  luma weight denom, scale and offset, with STATSFILE_WEIGHT_LUMA
+ *   int16  chroma weight denom, cb scale and offset, cr scale and offset, with STATSFILE_WEIGHT_CHROMA
+ *   uint16 big-endian fix8 qp offsets as in .mbtree files, with STATSFILE_MBTREE
+ * The coded frame number is the record's place in the index.  Everything is written in one
+ * pass, so the output needn't be seekable. */
+
+#define X264_STATSFILE_MAGIC      "x264stat"
+#define X264_STATSFILE_VERSION    2
+#define X264_STATSFILE_BYTE_ORDER 0x01020304
+
+#define STATSFILE_MBTREE        0x01
+#define STATSFILE_WEIGHT_LUMA   0x02
+#define STATSFILE_WEIGHT_CHROMA 0x04
+
+/* A record as it is written and as it is decoded. */
+typedef struct
+{
+    int      i_frame;         /* display order */
+    int      i_frame_out;     /* coded order; not stored, it's the record's place in the file */
+    int64_t  i_duration;
+    int64_t  i_cpb_duration;
+    float    f_qp_rc;
+    float    f_qp_aq;
+    int      i_tex_bits;
+    int      i_mv_bits;
+    int      i_misc_bits;
+    int      i_mb_count_i;
+    int      i_mb_count_p;
+    int      i_mb_count_skip;
+    char     c_type;
+    char     c_direct;
+    int      i_refs;
+    int      i_refcount[16];
+    int16_t  i_weight_denom[2]; /* -1 without luma/chroma weights */
+    int16_t  i_weight[3][2];    /* scale, offset per plane */
+    const uint8_t *mbtree;    /* i_mbtree_mbs big-endian fix8 values, unaligned; NULL if none */
+} x264_statsfile_record_t;
+
+typedef struct
+{
+    FILE     *fh;
+    int64_t  i_pos;           /* bytes written so far */
+    int      i_mbtree_mbs;
+    int      i_frames;
+    int      i_index_size;    /* allocated entries of index */
+    uint64_t *index;
+} x264_statsfile_writer_t;
+
+typedef struct
+{
+    uint8_t  *data;
+    int64_t  i_size;
+    int      b_mapped;
+    const char *options;
+    const uint8_t *index;     /* unaligned uint64_t offsets */
+    uint64_t i_index_offset;
+    int      i_frames;
+    int      i_mbtree_mbs;
+} x264_statsfile_t;
+
+/* Whether filename starts like a binary stats file; text stats and missing files give 0. */
+int  x264_statsfile_probe( const char *filename );
+
+/* Maps the file and checks that the header and index are consistent; the records themselves
+ * are only decoded when asked for.  Returns -1 if the file can't be read and -2 if it is damaged. */
+int  x264_statsfile_open( x264_statsfile_t **p_stats, const char *filename );
+void x264_statsfile_close( x264_statsfile_t *stats );
+
+/* Decodes the record of coded frame i_frame_out; only the index is read until then.
+ * Returns -1 if the record is damaged. */
+int  x264_statsfile_read( x264_statsfile_t *stats, int i_frame_out, x264_statsfile_record_t *rec );
+
+/* The writer takes over fh only for writing; the caller still closes it, after x264_statsfile_finish. */
+int  x264_statsfile_writer_open( x264_statsfile_writer_t **p_writer, FILE *fh, const char *options, int i_mbtree_mbs );
+int  x264_statsfile_write( x264_statsfile_writer_t *writer, const x264_statsfile_record_t *rec );
+int  x264_statsfile_finish( x264_statsfile_writer_t *writer );
+void x264_statsfile_writer_close( x264_statsfile_writer_t *writer );
+
+#endif
@@ -0,0 +1,483 @@
+/*****************************************************************************
+ * checkenc.c: encoder-level checks of the public API
+ *****************************************************************************
+ * Copyright (C) 2022 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+/* checkasm compares functions; this compares whole encodes.  Each check encodes the same
+ * synthetic clip two ways that should give the same result, e.g. on a shared thread pool and
+ * on private threads, and compares the slice NAL units (SEI holds the option string, which
+ * legitimately differs).  Everything goes through x264.h, as an application would. */
+
+#include <stdint.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <x264.h>
+
+#define FRAMES  60      /* unless param.i_frame_total says otherwise */
+#define MAX_FRAMES 250
+#define WIDTH   320
+#define HEIGHT  192
+
+typedef struct
+{
+    uint8_t *data;      /* slice NAL units only */
+    int     i_size;
+    int     i_alloc;
+    int     i_input;    /* frames fed to the encoder */
+    int     i_frames;
+    int     type[MAX_FRAMES];   /* frame types in display order */
+    double  f_psnr;     /* sum of the frames' luma PSNR */
+} stream_t;
+
+static int verbose = 0;
+
+/* A moving, textured pattern with a cut every 25 frames, the same at every resolution. */
+static int source_pixel( int p, int x, int y, int w, int h, int i_frame )
+{
+    int scene = i_frame / 25;
+    /* coordinates in a 1024x1024 space, so that every resolution sees the same picture */
+    int u = x * 1024 / w + i_frame * 6 * (scene & 1 ? -1 : 1);
+    int v = y * 1024 / h + i_frame * 3;
+    int val = ((u >> 4) * (3 + scene) ^ (v >> 5) * 7) & 0xff;
+    if( abs( u % 1024 - 512 ) < 100 + 40 * scene && abs( y * 1024 / h - 512 ) < 150 )
+        val = 255 - val / 2 - p * 40;
+    uint32_t noise = (x * 73856093u ^ y * 19349663u ^ i_frame * 83492791u ^ p) * 2654435761u;
+    val += (int)(noise >> 29) - 4;
+    return val < 0 ? 0 : val > 255 ? 255 : val;
+}
+
+static void fill_frame( x264_picture_t *pic, int width, int height, int i_frame )
+{
+    for( int p = 0; p < 3; p++ )
+    {
+        int w = p ? width / 2 : width;
+        int h = p ? height / 2 : height;
+        for( int y = 0; y < h; y++ )
+            for( int x = 0; x < w; x++ )
+                pic->img.plane[p][y * pic->img.i_stride[p] + x] = source_pixel( p, x, y, w, h, i_frame );
+    }
+}
+
+/* Luma PSNR of the reconstructed frame that comes with pic_out. */
+static double luma_psnr( x264_picture_t *pic_out, int width, int height )
+{
+    int64_t ssd = 0;
+    for( int y = 0; y < height; y++ )
+        for( int x = 0; x < width; x++ )
+        {
+            int d = pic_out->img.plane[0][y * pic_out->img.i_stride[0] + x] -
+                    source_pixel( 0, x, y, width, height, pic_out->i_pts );
+            ssd += d * d;
+        }
+    return ssd ? 10 * log10( 255. * 255 * width * height / ssd ) : 100;
+}
+
+static int stream_add( stream_t *s, x264_nal_t *nal, int i_nal, x264_picture_t *pic_out, x264_param_t *param )
+{
+    for( int i = 0; i < i_nal; i++ )
+    {
+        if( nal[i].i_type == NAL_SEI )
+            continue;
+        if( s->i_size + nal[i].i_payload > s->i_alloc )
+        {
+            s->i_alloc = 2 * (s->i_size + nal[i].i_payload);
+            uint8_t *data = realloc( s->data, s->i_alloc );
+            if( !data )
+                return -1;
+            s->data = data;
+        }
+        memcpy( s->data + s->i_size, nal[i].p_payload, nal[i].i_payload );
+        s->i_size += nal[i].i_payload;
+    }
+    if( pic_out->i_pts >= 0 && pic_out->i_pts < MAX_FRAMES )
+    {
+        s->type[pic_out->i_pts] = pic_out->i_type;
+        s->f_psnr += luma_psnr( pic_out, param->i_width, param->i_height );
+    }
+    s->i_frames++;
+    return 0;
+}
+
+/* Encodes the clip with i_enc encoders at once, feeding each frame to them in order as a
+ * single application thread would.  With force_type, the frame types are taken from it. */
+static int encode( x264_param_t *param, int i_enc, stream_t *out, const int *force_type )
+{
+    x264_t *h[4] = {0};
+    x264_picture_t pic[4];
+    x264_picture_t pic_out;
+    x264_nal_t *nal;
+    int i_nal;
+    int i_pics = 0;
+    int ret = -1;
+
+    int i_frames = param[0].i_frame_total ? param[0].i_frame_total : FRAMES;
+
+    memset( out, 0, i_enc * sizeof(stream_t) );
+    for( ; i_pics < i_enc; i_pics++ )
+        if( x264_picture_alloc( &pic[i_pics], param[i_pics].i_csp, param[i_pics].i_width, param[i_pics].i_height ) < 0 )
+            goto fail;
+    for( int e = 0; e < i_enc; e++ )
+    {
+        h[e] = x264_encoder_open( &param[e] );
+        if( !h[e] )
+            goto fail;
+    }
+
+    for( int i = 0; i <= i_frames; i++ )
+        for( int e = 0; e < i_enc; e++ )
+        {
+            x264_picture_t *in = NULL;
+            if( i < i_frames )
+            {
+                out[e].i_input++;
+                fill_frame( &pic[e], param[e].i_width, param[e].i_height, i );
+                pic[e].i_pts = i;
+                pic[e].i_type = force_type ? force_type[i] : X264_TYPE_AUTO;
+                in = &pic[e];
+            }
+            do
+            {
+                int i_frame_size = x264_encoder_encode( h[e], &nal, &i_nal, in, &pic_out );
+                if( i_frame_size < 0 )
+                    goto fail;
+                if( i_frame_size && stream_add( &out[e], nal, i_nal, &pic_out, &param[e] ) < 0 )
+                    goto fail;
+            } while( !in && x264_encoder_delayed_frames( h[e] ) );
+        }
+    ret = 0;
+
+fail:
+    for( int e = 0; e < i_enc; e++ )
+        if( h[e] )
+            x264_encoder_close( h[e] );
+    for( int i = 0; i < i_pics; i++ )
+        x264_picture_clean( &pic[i] );
+    return ret;
+}
+
+static void stream_free( stream_t *s, int i_streams )
+{
+    for( int i = 0; i < i_streams; i++ )
+        free( s[i].data );
+}
+
+static int same_stream( const char *name, stream_t *a, stream_t *b )
+{
+    int ok = a->i_frames == a->i_input && b->i_frames == b->i_input && a->i_frames &&
+             a->i_size == b->i_size && !memcmp( a->data, b->data, a->i_size );
+    if( !ok || verbose )
+        fprintf( stderr, "%s: %d frames, %d bytes vs %d frames, %d bytes%s\n", name,
+                 a->i_frames, a->i_size, b->i_frames, b->i_size, ok ? "" : " [FAILED]" );
+    return ok;
+}
+
+static int default_param( x264_param_t *param, int width, int height )
+{
+    if( x264_param_default_preset( param, "medium", NULL ) < 0 )
+        return -1;
+    param->i_width = width;
+    param->i_height = height;
+    param->i_csp = X264_CSP_I420;
+    param->i_bitdepth = 8;
+    param->b_vfr_input = 0;
+    param->i_fps_num = 25;
+    param->i_fps_den = 1;
+    param->i_log_level = verbose ? X264_LOG_WARNING : X264_LOG_ERROR;
+    return 0;
+}
+
+#define report( name ) { \
+    fprintf( stderr, " - %-21s [%s]\n", name, ok ? "OK" : "FAILED" ); \
+    if( !ok ) ret = -1; \
+}
+
+/* Two encoders attached to one pool must give what they give on private threads of the
+ * same count: sharing only changes when jobs run, not what they compute. */
+static int check_threadpool( void )
+{
+    int ret = 0, ok = 1;
+    x264_param_t param[2];
+    stream_t shared[2] = {{0}}, separate[2] = {{0}};
+    x264_threadpool_t *pool = x264_threadpool_open( 3 );
+    if( !pool )
+        return 0; /* built without threads */
+
+    for( int e = 0; e < 2; e++ )
+    {
+        if( default_param( &param[e], WIDTH >> e, HEIGHT >> e ) < 0 )
+        {
+            x264_threadpool_close( pool );
+            return -1;
+        }
+        param[e].i_threads = 3 - e;
+        param[e].rc.f_rf_constant = 20 + 6 * e;
+    }
+    if( encode( param, 1, &separate[0], NULL ) < 0 || encode( param + 1, 1, &separate[1], NULL ) < 0 )
+        ok = 0;
+    param[0].threadpool = param[1].threadpool = pool;
+    if( ok && encode( param, 2, shared, NULL ) < 0 )
+        ok = 0;
+    x264_threadpool_close( pool );
+    ok = ok && same_stream( "threadpool encoder 0", &shared[0], &separate[0] );
+    ok = ok && same_stream( "threadpool encoder 1", &shared[1], &separate[1] );
+    stream_free( shared, 2 );
+    stream_free( separate, 2 );
+    report( "shared threadpool :" );
+    return ret;
+}
+
+/* The ladder's leader runs its lookahead as a standalone encoder would, so its output must
+ * not change.  The followers take the leader's frame types and rescaled MB-tree offsets,
+ * so they can't match a standalone encode exactly; with the same frame types forced, their
+ * size must stay within 10% and their luma PSNR within 0.5 dB of it.  Both rungs here come
+ * out about 5% larger and 0.2 dB better. */
+static int check_ladder( void )
+{
+    int ret = 0, ok = 1;
+    x264_param_t param[3];
+    static const int size[3][2] = { { WIDTH, HEIGHT }, { WIDTH * 4 / 5, HEIGHT * 3 / 4 }, { WIDTH / 2, HEIGHT / 2 } };
+    stream_t ladder[3] = {{0}}, alone[3] = {{0}};
+    x264_ladder_t *lad = x264_ladder_open();
+    if( !lad )
+        return -1;
+
+    for( int e = 0; e < 3; e++ )
+    {
+        if( default_param( &param[e], size[e][0], size[e][1] ) < 0 )
+        {
+            x264_ladder_close( lad );
+            return -1;
+        }
+        param[e].i_threads = 1;
+    }
+    if( encode( param, 1, &alone[0], NULL ) < 0 )
+        ok = 0;
+    for( int e = 0; e < 3; e++ )
+        param[e].ladder = lad;
+    param[0].b_ladder_leader = 1;
+    if( ok && encode( param, 3, ladder, NULL ) < 0 )
+        ok = 0;
+    x264_ladder_close( lad );
+    for( int e = 1; e < 3; e++ )
+    {
+        param[e].ladder = NULL;
+        if( ok && encode( param + e, 1, &alone[e], ladder[e].type ) < 0 )
+            ok = 0;
+    }
+    ok = ok && same_stream( "ladder leader", &ladder[0], &alone[0] );
+    for( int e = 1; ok && e < 3; e++ )
+    {
+        double bytes = (double)ladder[e].i_size / alone[e].i_size;
+        double psnr = (ladder[e].f_psnr - alone[e].f_psnr) / FRAMES;
+        int same_types = !memcmp( ladder[e].type, ladder[0].type, sizeof(ladder[0].type) ) &&
+                         !memcmp( ladder[e].type, alone[e].type, sizeof(ladder[0].type) );
+        ok = same_types && ladder[e].i_frames == FRAMES && bytes > 0.9 && bytes < 1.1 && fabs( psnr ) < 0.5;
+        if( !ok || verbose )
+            fprintf( stderr, "ladder follower %dx%d: frame types %s, size %.3fx, PSNR %.3f dB (%+.3f)%s\n",
+                     param[e].i_width, param[e].i_height, same_types ? "match" : "differ", bytes,
+                     ladder[e].f_psnr / FRAMES, psnr, ok ? "" : " [FAILED]" );
+    }
+    stream_free( ladder, 3 );
+    stream_free( alone, 3 );
+    report( "ladder :" );
+    return ret;
+}
+
+/* --threads 1xN, a single frame thread encoding with N sliced threads, must give exactly
+ * what --threads N --sliced-threads gives.  With more than one frame thread the output is
+ * expected to differ: mv_range_thread and the reference row waits then limit the motion
+ * vectors as with plain frame threads. */
+static int check_hybrid_threads( void )
+{
+    int ret = 0, ok = 1;
+    for( int n = 2; n <= 3 && ok; n++ ) /* 12 mb rows allow 3 sliced threads */
+    {
+        x264_param_t param[2];
+        stream_t out[2] = {{0}};
+        char threads[16];
+        char name[32];
+        for( int i = 0; i < 2; i++ )
+            if( default_param( &param[i], WIDTH, HEIGHT ) < 0 )
+                return -1;
+        sprintf( threads, "1x%d", n );
+        if( x264_param_parse( &param[0], "threads", threads ) < 0 )
+            ok = 0;
+        param[1].i_threads = n;
+        param[1].b_sliced_threads = 1;
+        if( ok && (encode( &param[0], 1, &out[0], NULL ) < 0 || encode( &param[1], 1, &out[1], NULL ) < 0) )
+            ok = 0;
+        sprintf( name, "threads %s", threads );
+        ok = ok && same_stream( name, &out[0], &out[1] );
+        stream_free( out, 2 );
+    }
+    report( "hybrid threads :" );
+    return ret;
+}
+
+/* --lookahead-batch splits its rows into bands that depend on the frame size only, so the
+ * output must not depend on the number of lookahead threads, nor change between runs with
+ * frame threads.  Without a lookahead thread every frame thread runs the search in turn. */
+static int check_lookahead_batch( void )
+{
+    int ret = 0, ok = 1;
+    static const int threads[4][3] = /* threads, lookahead threads, sync lookahead */
+    {
+        { 1, 1, 0 }, { 1, 3, 0 }, { 3, 3, -1 }, { 3, 2, 0 },
+    };
+    stream_t out[4][2] = {{{0}}};
+    for( int i = 0; i < 4 && ok; i++ )
+        for( int run = 0; run < 2 && ok; run++ )
+        {
+            x264_param_t param;
+            if( default_param( &param, WIDTH, HEIGHT ) < 0 )
+                return -1;
+            param.b_lookahead_batch = 1;
+            param.i_threads = threads[i][0];
+            param.i_lookahead_threads = threads[i][1];
+            if( threads[i][2] >= 0 )
+                param.i_sync_lookahead = threads[i][2];
+            if( encode( &param, 1, &out[i][run], NULL ) < 0 )
+                ok = 0;
+        }
+    ok = ok && same_stream( "lookahead-batch lookahead threads", &out[0][0], &out[1][0] );
+    for( int i = 1; ok && i < 4; i++ )
+    {
+        char name[64];
+        sprintf( name, "lookahead-batch threads %d/%d/%d", threads[i][0], threads[i][1], threads[i][2] );
+        ok = same_stream( name, &out[i][0], &out[i][1] );
+    }
+    for( int i = 0; i < 4; i++ )
+        stream_free( out[i], 2 );
+    report( "lookahead batch :" );
+    return ret;
+}
+
+/* --stats-window plans blocks of the 2nd pass from the lookahead as the frame threads encode,
+ * from the stats alone, so the output must not change between runs. */
+static int check_stats_window( void )
+{
+    int ret = 0, ok = 1;
+    static const char *stats = "checkenc.stats";
+    x264_param_t param;
+    stream_t pass1 = {0}, out[3] = {{0}};
+    if( default_param( &param, WIDTH, HEIGHT ) < 0 )
+        return -1;
+    param.i_frame_total = 200;
+    param.rc.i_rc_method = X264_RC_ABR;
+    param.rc.i_bitrate = 300;
+    param.rc.b_stat_binary = 1;
+    param.rc.b_stat_write = 1;
+    param.rc.psz_stat_out = (char*)stats;
+    param.i_threads = 1;
+    if( encode( &param, 1, &pass1, NULL ) < 0 )
+        ok = 0;
+    stream_free( &pass1, 1 );
+    param.rc.b_stat_write = 0;
+    param.rc.b_stat_read = 1;
+    param.rc.psz_stat_in = (char*)stats;
+    param.rc.i_stats_window = 64;
+    param.i_threads = 4;
+    for( int run = 0; run < 3 && ok; run++ )
+        if( encode( &param, 1, &out[run], NULL ) < 0 )
+            ok = 0;
+    for( int run = 1; ok && run < 3; run++ )
+        ok = same_stream( "stats window threads 4", &out[0], &out[run] );
+    stream_free( out, 3 );
+    remove( stats );
+    report( "stats window :" );
+    return ret;
+}
+
+/* Binary stats must steer the 2nd pass exactly as text stats do: frame types, MB-tree data,
+ * reference counts, direct modes and weights.  Text rounds the frame qps to two decimals, so
+ * the 1st pass keeps them whole.  An Nth pass that reads binary stats writes them back binary. */
+static int check_stats_binary( void )
+{
+    int ret = 0, ok = 1;
+    static const char *stats[2] = { "checkenc.stats", "checkenc.txt.stats" };
+    x264_param_t param;
+    stream_t pass1[2] = {{0}}, pass2[2] = {{0}};
+    for( int b_text = 0; b_text < 2 && ok; b_text++ )
+    {
+        if( default_param( &param, WIDTH, HEIGHT ) < 0 )
+            return -1;
+        param.i_frame_total = 100;
+        param.analyse.i_direct_mv_pred = X264_DIRECT_PRED_AUTO;
+        param.rc.i_rc_method = X264_RC_ABR;
+        param.rc.i_bitrate = 300;
+        int qp_min = param.rc.i_qp_min, qp_max = param.rc.i_qp_max;
+        param.rc.i_qp_min = param.rc.i_qp_max = 26;
+        param.rc.b_stat_binary = !b_text;
+        param.rc.b_stat_write = 1;
+        param.rc.psz_stat_out = (char*)stats[b_text];
+        param.i_threads = 1;
+        if( encode( &param, 1, &pass1[b_text], NULL ) < 0 )
+            ok = 0;
+        param.rc.i_qp_min = qp_min;
+        param.rc.i_qp_max = qp_max;
+        param.rc.b_stat_binary = 0;
+        param.rc.b_stat_read = 1;
+        param.rc.psz_stat_in = (char*)stats[b_text];
+        if( ok && encode( &param, 1, &pass2[b_text], NULL ) < 0 )
+            ok = 0;
+    }
+    ok = ok && same_stream( "stats binary pass 1", &pass1[0], &pass1[1] );
+    ok = ok && same_stream( "stats binary pass 2", &pass2[0], &pass2[1] );
+    FILE *fh = fopen( stats[0], "rb" );
+    char magic[8] = {0};
+    if( !fh || fread( magic, 1, 8, fh ) != 8 || memcmp( magic, "x264stat", 8 ) )
+    {
+        fprintf( stderr, "stats binary: pass 3 didn't keep the stats binary [FAILED]\n" );
+        ok = 0;
+    }
+    if( fh )
+        fclose( fh );
+    stream_free( pass1, 2 );
+    stream_free( pass2, 2 );
+    remove( stats[0] );
+    remove( stats[1] );
+    remove( "checkenc.txt.stats.mbtree" );
+    report( "stats binary :" );
+    return ret;
+}
+
+int main( int argc, char **argv )
+{
+    int ret = 0;
+    if( argc > 1 && !strncmp( argv[1], "--verbose", 9 ) )
+        verbose = 1;
+
+    fprintf( stderr, "x264: checking encodes of %d frames at %dx%d\n", FRAMES, WIDTH, HEIGHT );
+    ret |= check_threadpool();
+    ret |= check_ladder();
+    ret |= check_hybrid_threads();
+    ret |= check_lookahead_batch();
+    ret |= check_stats_window();
+    ret |= check_stats_binary();
+
+    if( !ret )
+        fprintf( stderr, "x264: All tests passed Yeah :)\n" );
+    else
+        fprintf( stderr, "x264: at least one test has failed. Go and fix that Right Now!\n" );
+    return ret;
+}
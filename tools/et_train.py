@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+
+# Train the --et-model tables (encoder/analyse_et.h) from --dump-et statistics.
+#
+#   x264 --dump-et a.et ... ; x264 --dump-et b.et ...
+#   tools/et_train.py a.et b.et > encoder/analyse_et.h
+#
+# Each cell of the dumps counts the P-mbs that went through the full analysis,
+# how many of them ended up with a sub-16x16 partition and how many as intra.
+# Cells with few samples borrow the statistics of coarser cells: first without
+# the lowres bin, then without the neighbour bin, then without the qp bin.
+# The thresholds are the largest that skip at most the given fraction of the
+# wins in the training set.
+
+import argparse
+import sys
+import textwrap
+
+LICENSE = """\
+/*****************************************************************************
+ * analyse_et.h: early termination model tables
+ *****************************************************************************
+ * Copyright (C) 2003-2022 x264 project
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111, USA.
+ *
+ * This program is also available under a commercial proprietary license.
+ * For more information, contact us at licensing@x264.com.
+ *****************************************************************************/
+
+"""
+
+FEATURES = ("qp", "cost", "nb", "lowres")
+CLASSES = ("sub", "intra")
+
+def read_dump(path, stats):
+    with open(path) as f:
+        header = f.readline().split()
+        if not header or header[0] != "#x264-et":
+            sys.exit("%s: not a --dump-et file" % path)
+        dims = tuple(int(kv.split("=")[1]) for kv in header[1:])
+        for line in f:
+            cell, total, sub, intra = (int(x) for x in line.split())
+            n = stats.setdefault(cell, [0, 0, 0])
+            n[0] += total
+            n[1] += sub
+            n[2] += intra
+    return dims
+
+def split_cell(cell, dims):
+    coords = []
+    for d in reversed(dims):
+        coords.append(cell % d)
+        cell //= d
+    return tuple(reversed(coords))
+
+def main():
+    parser = argparse.ArgumentParser(description="Train the --et-model tables from --dump-et statistics.")
+    parser.add_argument("dumps", nargs="+")
+    parser.add_argument("--min-count", type=int, default=64,
+                        help="samples a cell needs before it stops borrowing from coarser cells [%(default)s]")
+    parser.add_argument("--sub-miss", type=float, default=0.03,
+                        help="fraction of the sub-16x16 partition wins the model may skip [%(default)s]")
+    parser.add_argument("--intra-miss", type=float, default=0.03,
+                        help="fraction of the intra wins the model may skip [%(default)s]")
+    parser.add_argument("--corpus",
+                        help="description of the clips and settings the dumps came from [the dump file names]")
+    args = parser.parse_args()
+
+    stats = {}
+    dims = None
+    for path in args.dumps:
+        d = read_dump(path, stats)
+        if dims and d != dims:
+            sys.exit("%s: feature bins differ from the other dumps" % path)
+        dims = d
+    cells = 1
+    for d in dims:
+        cells *= d
+
+    # Marginal counts for each back-off level; a level keeps the features whose mask bit is set.
+    levels = (0b1111, 0b1110, 0b1100, 0b0100)
+    marginal = [{} for _ in levels]
+    for cell, n in stats.items():
+        coords = split_cell(cell, dims)
+        for l, mask in enumerate(levels):
+            key = tuple(c for i, c in enumerate(coords) if mask & (8 >> i))
+            m = marginal[l].setdefault(key, [0, 0, 0])
+            for j in range(3):
+                m[j] += n[j]
+    everything = [sum(n[j] for n in stats.values()) for j in range(3)]
+    if not everything[0]:
+        sys.exit("no samples")
+
+    prob = [[0] * cells for _ in CLASSES]
+    for cell in range(cells):
+        coords = split_cell(cell, dims)
+        n = everything
+        for l, mask in enumerate(levels):
+            key = tuple(c for i, c in enumerate(coords) if mask & (8 >> i))
+            m = marginal[l].get(key)
+            if m and m[0] >= args.min_count:
+                n = m
+                break
+        for c in range(len(CLASSES)):
+            prob[c][cell] = min(255, int(255 * (n[c+1] + 0.5) / (n[0] + 1) + 0.5))
+
+    thresh = []
+    for c, miss in enumerate((args.sub_miss, args.intra_miss)):
+        wins = everything[c+1]
+        best = 0
+        for t in range(1, 256):
+            lost = sum(n[c+1] for cell, n in stats.items() if prob[c][cell] < t)
+            if lost > miss * wins:
+                break
+            best = t
+        skipped = sum(n[0] for cell, n in stats.items() if prob[c][cell] < best)
+        lost = sum(n[c+1] for cell, n in stats.items() if prob[c][cell] < best)
+        sys.stderr.write("%-5s: threshold %3d skips %5.1f%% of the mbs and %4.1f%% of the %d wins\n" %
+                         (CLASSES[c], best, 100. * skipped / everything[0], 100. * lost / max(wins, 1), wins))
+        thresh.append(best)
+
+    out = sys.stdout
+    out.write(LICENSE)
+    banner = "Generated by tools/et_train.py --sub-miss %g --intra-miss %g from %s (%d P-mbs), do not edit." % \
+             (args.sub_miss, args.intra_miss, args.corpus or " ".join(args.dumps), everything[0])
+    out.write("/* %s */\n\n" % "\n * ".join(textwrap.wrap(banner, 90)))
+    out.write("#if %s\n" % " || ".join("ET_%s_BINS != %d" % (f.upper(), d) for f, d in zip(FEATURES, dims)))
+    out.write("#error \"analyse_et.h was trained with different feature bins\"\n#endif\n\n")
+    out.write("#define ET_SUB_THRESH   %d\n" % thresh[0])
+    out.write("#define ET_INTRA_THRESH %d\n\n" % thresh[1])
+    out.write("/* [sub-16x16 partition, intra][cell]: chance of winning, out of 255 */\n")
+    out.write("static const uint8_t et_prob[2][ET_CELLS] =\n{\n")
+    for c in range(len(CLASSES)):
+        out.write("    {\n")
+        for i in range(0, cells, 16):
+            out.write("        " + " ".join("%3d," % p for p in prob[c][i:i+16]) + "\n")
+        out.write("    },\n")
+    out.write("};\n")
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,135 @@
+#!/usr/bin/env python3
+
+# Merge the first-pass stats of chunk encodes into one stats file for --pass 2.
+#
+#   x264 --pass 1 --seek 0    --frames 1000 --stats c0.log ...
+#   x264 --pass 1 --seek 1000 --frames 1000 --stats c1.log ...
+#   tools/stats_merge.py -o all.log c0.log c1.log
+#   x264 --pass 2 --stats all.log --stats-range 1000,1999 --seek 1000 ...
+#
+# The chunks are given in display order and each one continues where the
+# previous one ended, so their frame numbers are offset by the frame counts of
+# the chunks before them.  Every chunk must start with an IDR frame, which any
+# chunk encode does.  Text stats are merged together with their .mbtree files;
+# binary stats (--stats-binary) carry the MB-tree data in the file itself.
+# All chunks must be in the same format and the output keeps it.
+
+import argparse
+import re
+import struct
+import sys
+
+MAGIC = b"x264stat"
+VERSION = 2
+BYTE_ORDER = 0x01020304
+HEADER = struct.Struct("=8s4I")
+TRAILER = struct.Struct("=QI8s")
+RECORD_TYPE = 0
+RECORD_FRAME = struct.Struct("=i")
+RECORD_FRAME_POS = 4
+
+# Options that may differ between machines without changing the stats.
+VOLATILE_OPTIONS = re.compile(r" (lookahead_)?threads=\S+")
+
+def same_options(a, b):
+    return VOLATILE_OPTIONS.sub("", a) == VOLATILE_OPTIONS.sub("", b)
+
+def read_text(path):
+    with open(path) as f:
+        options = f.readline().rstrip("\n")
+        if not options.startswith("#options:"):
+            sys.exit("%s: not a stats file" % path)
+        entries = [e.lstrip() for e in f.read().split(";") if e.strip()]
+    return options, entries
+
+def merge_text(args):
+    options = None
+    lines = []
+    offset = 0
+    mbtree = None
+    for path in args.chunks:
+        chunk_options, entries = read_text(path)
+        if options is None:
+            options = chunk_options
+            if " mbtree=1" in options:
+                mbtree = open(args.output + ".mbtree", "wb")
+        elif not same_options(options, chunk_options):
+            sys.exit("%s: options differ from the first chunk" % path)
+        for e in entries:
+            m = re.match(r"in:(\d+) out:(\d+) type:(.)", e)
+            if not m:
+                sys.exit("%s: damaged entry: %s" % (path, e[:40]))
+            if int(m.group(2)) == 0 and m.group(3) != "I":
+                sys.exit("%s: chunk doesn't start with an IDR frame" % path)
+            lines.append("in:%d out:%d%s" % (int(m.group(1)) + offset, int(m.group(2)) + offset, e[m.end(2):]))
+        offset += len(entries)
+        if mbtree:
+            try:
+                with open(path + ".mbtree", "rb") as f:
+                    mbtree.write(f.read())
+            except OSError as err:
+                sys.exit("%s: %s" % (path, err))
+    if mbtree:
+        mbtree.close()
+    with open(args.output, "w") as f:
+        f.write(options + "\n")
+        for line in lines:
+            f.write(line + ";\n")
+    return offset
+
+def read_binary(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    magic, version, byte_order, options_size, mbs = HEADER.unpack_from(data)
+    if magic != MAGIC or version != VERSION or byte_order != BYTE_ORDER:
+        sys.exit("%s: not a binary stats file of this version" % path)
+    index_offset, frames, magic = TRAILER.unpack_from(data, len(data) - TRAILER.size)
+    if magic != MAGIC:
+        sys.exit("%s: damaged stats file" % path)
+    options = data[HEADER.size:HEADER.size + options_size].split(b"\0")[0].decode()
+    # The records are back to back, so each one ends where the next starts.
+    index = struct.unpack_from("=%dQ" % frames, data, index_offset) + (index_offset,)
+    records = [data[index[i]:index[i + 1]] for i in range(frames)]
+    return options, mbs, records
+
+def merge_binary(args):
+    chunks = [read_binary(path) for path in args.chunks]
+    options, mbs, _ = chunks[0]
+    out = open(args.output, "wb")
+    options_bytes = options.encode() + b"\0"
+    out.write(HEADER.pack(MAGIC, VERSION, BYTE_ORDER, len(options_bytes), mbs))
+    out.write(options_bytes)
+    pos = HEADER.size + len(options_bytes)
+    index = []
+    offset = 0
+    for path, (chunk_options, chunk_mbs, records) in zip(args.chunks, chunks):
+        if not same_options(options, chunk_options) or chunk_mbs != mbs:
+            sys.exit("%s: options differ from the first chunk" % path)
+        for frame_out, rec in enumerate(records):
+            rec = bytearray(rec)
+            if frame_out == 0 and rec[RECORD_TYPE] != ord("I"):
+                sys.exit("%s: chunk doesn't start with an IDR frame" % path)
+            frame, = RECORD_FRAME.unpack_from(rec, RECORD_FRAME_POS)
+            RECORD_FRAME.pack_into(rec, RECORD_FRAME_POS, frame + offset)
+            index.append(pos)
+            out.write(rec)
+            pos += len(rec)
+        offset += len(records)
+    out.write(struct.pack("=%dQ" % len(index), *index))
+    out.write(TRAILER.pack(pos, len(index), MAGIC))
+    out.close()
+    return offset
+
+def main():
+    parser = argparse.ArgumentParser(description="Merge the first-pass stats of chunk encodes.")
+    parser.add_argument("-o", "--output", required=True, help="merged stats file")
+    parser.add_argument("chunks", nargs="+", help="stats files of the chunks, in display order")
+    args = parser.parse_args()
+
+    with open(args.chunks[0], "rb") as f:
+        binary = f.read(len(MAGIC)) == MAGIC
+    frames = merge_binary(args) if binary else merge_text(args)
+    sys.stderr.write("merged %d chunks, %d frames\n" % (len(args.chunks), frames))
+
+if __name__ == "__main__":
+    main()
@@ -43,6 +43,7 @@
 #include "input/input.h"
 #include "output/output.h"
 #include "filters/filters.h"
+#include "filters/video/internal.h"
 
 #define QP_MAX_SPEC (51+6*2)
 #define QP_MAX (QP_MAX_SPEC+18)
@@ -122,8 +123,14 @@ static void sigint_handler( int a )
     b_ctrl_c = 1;
 }
 
+/* --estimate cuts the input into chunks of ESTIMATE_CHUNK frames and by default also encodes the
+ * first ESTIMATE_SAMPLE frames of each chunk for real. */
+#define ESTIMATE_CHUNK  250
+#define ESTIMATE_SAMPLE 25
+
 typedef struct {
     int b_progress;
+    int b_stage_timing;
     int i_seek;
     hnd_t hin;
     hnd_t hout;
@@ -131,6 +138,9 @@ typedef struct {
     FILE *tcfile_out;
     double timebase_convert_multiplier;
     int i_pulldown;
+    int i_estimate_crfs;
+    float estimate_crf[16];
+    int i_estimate_sample;
 } cli_opt_t;
 
 /* file i/o operation structs */
@@ -265,6 +275,7 @@ static const float pulldown_frame_duration[10] = { 0.0, 1, 0.5, 0.5, 1, 1, 1.5,
 static void help( x264_param_t *defaults, int longhelp );
 static int  parse( int argc, char **argv, x264_param_t *param, cli_opt_t *opt );
 static int  encode( x264_param_t *param, cli_opt_t *opt );
+static int  estimate( x264_param_t *param, cli_opt_t *opt );
 
 /* logging and printing for within the cli system */
 static char *psz_log_file       = NULL;
@@ -455,7 +466,7 @@ REALIGN_STACK int main( int argc, char **argv )
     signal( SIGINT, sigint_handler );
 
     if( !ret )
-        ret = encode( &param, &opt );
+        ret = opt.i_estimate_crfs ? estimate( &param, &opt ) : encode( &param, &opt );
 
     /* clean up handles */
     if( filter.free )
@@ -804,6 +815,12 @@ static void help( x264_param_t *defaults, int longhelp )
     H1( "  -q, --qp <integer>          Force constant QP (0-%d, 0=lossless)\n", QP_MAX );
     H0( "  -B, --bitrate <integer>     Set bitrate (kbit/s)\n" );
     H0( "      --crf <float>           Quality-based VBR (%d-51) [%.1f]\n", 51 - QP_MAX_SPEC, defaults->rc.f_rf_constant );
+    H1( "      --estimate <crf list>   Don't encode: run the lookahead on all cores and\n"
+        "                                  print the predicted bitrate at each CRF\n"
+        "                                  e.g. --estimate 18,21,24 (up to 16 values)\n" );
+    H2( "      --estimate-sample <integer> Frames out of every %d that --estimate also\n"
+        "                                  encodes at each CRF to calibrate itself [%d]\n"
+        "                                  0 = lookahead only, which is far less accurate\n", ESTIMATE_CHUNK, ESTIMATE_SAMPLE );
     H1( "      --rc-lookahead <integer> Number of frames for frametype lookahead [%d]\n", defaults->rc.i_lookahead );
     H0( "      --vbv-maxrate <integer> Max local bitrate (kbit/s) [%d]\n", defaults->rc.i_vbv_max_bitrate );
     H0( "      --vbv-bufsize <integer> Set size of the VBV buffer (kbit) [%d]\n", defaults->rc.i_vbv_buffer_size );
@@ -832,6 +849,17 @@ static void help( x264_param_t *defaults, int longhelp )
         "                                  - 2: Last pass, does not overwrite stats file\n" );
     H2( "                                  - 3: Nth pass, overwrites stats file\n" );
     H1( "      --stats <string>        Filename for 2 pass stats [\"%s\"]\n", defaults->rc.psz_stat_out );
+    H2( "      --stats-binary          Write the stats as an indexed binary file that\n"
+        "                                  includes the MB-tree data (implied when\n"
+        "                                  --pass 3 reads binary stats)\n" );
+    H2( "      --stats-range <start>,<end> Encode only these frames of the 2nd pass,\n"
+        "                                  planned against the whole stats file\n"
+        "                                  The input must begin at <start>, e.g. with\n"
+        "                                  --seek, and <start> must be an IDR frame.\n"
+        "                                  Output chunks can be concatenated.\n" );
+    H2( "      --stats-window <integer> Plan the 2nd pass this many frames at a time,\n"
+        "                                  keeping only part of the stats in memory.\n"
+        "                                  Needs binary stats.\n" );
     H2( "      --no-mbtree             Disable mb-tree ratecontrol.\n");
     H2( "      --qcomp <float>         QP curve compression [%.2f]\n", defaults->rc.f_qcompress );
     H2( "      --cplxblur <float>      Reduce fluctuations in QP (before curve compression) [%.1f]\n", defaults->rc.f_complexity_blur );
@@ -867,7 +895,8 @@ static void help( x264_param_t *defaults, int longhelp )
         "                                  - hex: hexagonal search, radius 2\n"
         "                                  - umh: uneven multi-hexagon search\n"
         "                                  - esa: exhaustive search\n"
-        "                                  - tesa: hadamard exhaustive search (slow)\n" );
+        "                                  - tesa: hadamard exhaustive search (slow)\n"
+        "                                  - pyr: pyramid search from half and quarter size\n" );
     else H1( "                                  - dia, hex, umh\n" );
     H2( "      --merange <integer>     Maximum motion vector search range [%d]\n", defaults->analyse.i_me_range );
     H2( "      --mvrange <integer>     Maximum motion vector length [-1 (auto)]\n" );
@@ -898,6 +927,8 @@ static void help( x264_param_t *defaults, int longhelp )
         "                                  - 1: enabled only on the final encode of a MB\n"
         "                                  - 2: enabled on all mode decisions\n", defaults->analyse.i_trellis );
     H2( "      --no-fast-pskip         Disables early SKIP detection on P-frames\n" );
+    H2( "      --et-model              Skip P-frame partitions and intra modes that a\n"
+        "                                  trained model predicts won't be chosen\n" );
     H2( "      --no-dct-decimate       Disables coefficient thresholding on P-frames\n" );
     H1( "      --nr <integer>          Noise reduction [%d]\n", defaults->analyse.i_noise_reduction );
     H2( "\n" );
@@ -1017,9 +1048,20 @@ static void help( x264_param_t *defaults, int longhelp )
                                        stringify_names( buf, x264_log_level_names ) );
     H1( "      --psnr                  Enable PSNR computation\n" );
     H1( "      --ssim                  Enable SSIM computation\n" );
-    H1( "      --threads <integer>     Force a specific number of threads\n" );
+    H1( "      --threads <integer>     Force a specific number of threads\n"
+        "                                  or <frames>x<slices>: frame threads that\n"
+        "                                  each encode with sliced threads\n" );
     H2( "      --lookahead-threads <integer> Force a specific number of lookahead threads\n" );
     H2( "      --sliced-threads        Low-latency but lower-efficiency threading\n" );
+    H2( "      --slice-threads <integer> Sliced threads per frame, frame threads for the rest\n" );
+    H2( "      --wavefront             Low-latency threading: analyse the rows of each frame\n"
+        "                                  in parallel without splitting it into slices\n" );
+    H2( "      --numa                  Pin frame threads to NUMA nodes and keep their\n"
+        "                                  reconstructed frames in local memory\n" );
+    H2( "      --frame-arena           Allocate and page in all frame buffers up front\n" );
+    H2( "      --low-memory            Reduce the memory held per frame, without changing the output\n" );
+    H2( "      --lazy-hpel             Only interpolate the parts of reference frames that\n"
+        "                                  motion search reaches, without changing the output\n" );
     H2( "      --thread-input          Run Avisynth in its own thread\n" );
     H2( "      --sync-lookahead <integer> Number of buffer frames for threaded lookahead\n" );
     H2( "      --non-deterministic     Slightly improve quality of SMP, at the cost of repeatability\n" );
@@ -1030,7 +1072,13 @@ static void help( x264_param_t *defaults, int longhelp )
     H2( "      --opencl                Enable use of OpenCL\n" );
     H2( "      --opencl-clbin <string> Specify path of compiled OpenCL kernel cache\n" );
     H2( "      --opencl-device <integer> Specify OpenCL device ordinal\n" );
+    H2( "      --lookahead-batch       Lowres motion search of a whole frame at a time, coarse\n"
+        "                                  to fine, like the OpenCL lookahead but on the cpu\n" );
     H2( "      --dump-yuv <string>     Save reconstructed frames\n" );
+    H2( "      --dump-et <string>      Save P-frame mode decision statistics for\n"
+        "                                  retraining --et-model (tools/et_train.py)\n" );
+    H2( "      --stage-timing          Report the time spent in each encoder stage\n"
+        "                                  (needs a libx264 configured with --enable-stage-timing)\n" );
     H2( "      --sps-id <integer>      Set SPS and PPS id numbers [%d]\n", defaults->i_sps_id );
     H2( "      --aud                   Use access unit delimiters\n" );
     H2( "      --force-cfr             Force constant framerate timestamp generation\n" );
@@ -1095,7 +1143,10 @@ typedef enum
     OPT_OUTPUT_CSP,
     OPT_INPUT_RANGE,
     OPT_RANGE,
-    OPT_FRAMESERVER_LIB
+    OPT_FRAMESERVER_LIB,
+    OPT_STAGE_TIMING,
+    OPT_ESTIMATE,
+    OPT_ESTIMATE_SAMPLE
 } OptionsOPT;
 
 static char short_options[] = "8A:B:b:f:hI:i:m:o:p:q:r:t:Vvw";
@@ -1147,6 +1198,8 @@ static struct option long_options[] =
     { "opencl",               no_argument,       NULL, 1 },
     { "opencl-clbin",         required_argument, NULL, 0 },
     { "opencl-device",        required_argument, NULL, 0 },
+    { "lookahead-batch",      no_argument,       NULL, 0 },
+    { "no-lookahead-batch",   no_argument,       NULL, 0 },
     { "sar",                  required_argument, NULL, 0 },
     { "fps",                  required_argument, NULL, OPT_FPS },
     { "frames",               required_argument, NULL, OPT_FRAMES },
@@ -1179,6 +1232,7 @@ static struct option long_options[] =
     { "trellis",              required_argument, NULL, 't' },
     { "fast-pskip",           no_argument,       NULL, 0 },
     { "no-fast-pskip",        no_argument,       NULL, 0 },
+    { "et-model",             no_argument,       NULL, 0 },
     { "no-dct-decimate",      no_argument,       NULL, 0 },
     { "aq-strength",          required_argument, NULL, 0 },
     { "aq-mode",              required_argument, NULL, 0 },
@@ -1191,11 +1245,16 @@ static struct option long_options[] =
     { "vbv-bufsize",          required_argument, NULL, 0 },
     { "vbv-init",             required_argument, NULL, 0 },
     { "crf-max",              required_argument, NULL, 0 },
+    { "estimate",             required_argument, NULL, OPT_ESTIMATE },
+    { "estimate-sample",      required_argument, NULL, OPT_ESTIMATE_SAMPLE },
     { "ipratio",              required_argument, NULL, 0 },
     { "pbratio",              required_argument, NULL, 0 },
     { "chroma-qp-offset",     required_argument, NULL, 0 },
     { "pass",                 required_argument, NULL, 'p' },
     { "stats",                required_argument, NULL, 0 },
+    { "stats-binary",         no_argument,       NULL, 0 },
+    { "stats-range",          required_argument, NULL, 0 },
+    { "stats-window",         required_argument, NULL, 0 },
     { "qcomp",                required_argument, NULL, 0 },
     { "mbtree",               no_argument,       NULL, 0 },
     { "no-mbtree",            no_argument,       NULL, 0 },
@@ -1207,6 +1266,17 @@ static struct option long_options[] =
     { "lookahead-threads",    required_argument, NULL, 0 },
     { "sliced-threads",       no_argument,       NULL, 0 },
     { "no-sliced-threads",    no_argument,       NULL, 0 },
+    { "slice-threads",        required_argument, NULL, 0 },
+    { "wavefront",            no_argument,       NULL, 0 },
+    { "no-wavefront",         no_argument,       NULL, 0 },
+    { "numa",                 no_argument,       NULL, 0 },
+    { "no-numa",              no_argument,       NULL, 0 },
+    { "frame-arena",          no_argument,       NULL, 0 },
+    { "no-frame-arena",       no_argument,       NULL, 0 },
+    { "low-memory",           no_argument,       NULL, 0 },
+    { "no-low-memory",        no_argument,       NULL, 0 },
+    { "lazy-hpel",            no_argument,       NULL, 0 },
+    { "no-lazy-hpel",         no_argument,       NULL, 0 },
     { "slice-max-size",       required_argument, NULL, 0 },
     { "slice-max-mbs",        required_argument, NULL, 0 },
     { "slice-min-mbs",        required_argument, NULL, 0 },
@@ -1226,6 +1296,8 @@ static struct option long_options[] =
     { "no-progress",          no_argument,       NULL, OPT_NOPROGRESS },
     { "no-progress-header",   no_argument,       NULL, OPT_NOPROGRESSHEAD },
     { "dump-yuv",             required_argument, NULL, 0 },
+    { "dump-et",              required_argument, NULL, 0 },
+    { "stage-timing",         no_argument,       NULL, OPT_STAGE_TIMING },
     { "sps-id",               required_argument, NULL, 0 },
     { "aud",                  no_argument,       NULL, 0 },
     { "opts",                 required_argument, NULL, 0 },
@@ -1548,6 +1620,7 @@ static int parse( int argc, char **argv, x264_param_t *param, cli_opt_t *opt )
     input_opt.input_range = input_opt.output_range = param->vui.b_fullrange = RANGE_AUTO;
     int output_csp = defaults.i_csp;
     opt->b_progress = 1;
+    opt->i_estimate_sample = ESTIMATE_SAMPLE;
 
     /* Parse command line options */
     for( optind = 0;; )
@@ -1635,6 +1708,27 @@ static int parse( int argc, char **argv, x264_param_t *param, cli_opt_t *opt )
             case OPT_NOPROGRESSHEAD:
                 print_progress_header = 0;
                 break;
+            case OPT_STAGE_TIMING:
+                opt->b_stage_timing = 1;
+                break;
+            case OPT_ESTIMATE:
+            {
+                char *p = optarg, *end;
+                opt->i_estimate_crfs = 0;
+                do
+                {
+                    FAIL_IF_ERROR( opt->i_estimate_crfs == ARRAY_ELEMS(opt->estimate_crf), "too many CRFs to estimate\n" );
+                    opt->estimate_crf[opt->i_estimate_crfs++] = strtod( p, &end );
+                    FAIL_IF_ERROR( end == p, "invalid CRF list `%s'\n", optarg );
+                    p = end + 1;
+                } while( *end == ',' );
+                FAIL_IF_ERROR( *end, "invalid CRF list `%s'\n", optarg );
+                param->rc.b_estimate = 1;
+                break;
+            }
+            case OPT_ESTIMATE_SAMPLE:
+                opt->i_estimate_sample = x264_clip3( atoi( optarg ), 0, ESTIMATE_CHUNK );
+                break;
             case OPT_TUNE:
             case OPT_PRESET:
                 break;
@@ -1748,12 +1842,16 @@ generic_option:
         return -1;
 
     /* Get the file name */
-    FAIL_IF_ERROR( optind > argc - 1 || !output_filename, "No %s file. Run x264 --help for a list of options.\n",
+    FAIL_IF_ERROR( optind > argc - 1 || (!output_filename && !opt->i_estimate_crfs), "No %s file. Run x264 --help for a list of options.\n",
                    optind > argc - 1 ? "input" : "output" );
 
-    if( select_output( muxer, output_filename, param ) )
-        return -1;
-    FAIL_IF_ERROR( cli_output.open_file( output_filename, &opt->hout, &output_opt ), "could not open output file `%s'\n", output_filename );
+    /* An estimate writes nothing. */
+    if( !opt->i_estimate_crfs )
+    {
+        if( select_output( muxer, output_filename, param ) )
+            return -1;
+        FAIL_IF_ERROR( cli_output.open_file( output_filename, &opt->hout, &output_opt ), "could not open output file `%s'\n", output_filename );
+    }
 
     x264_cli_log( "x264", X264_LOG_INFO, "core:%d%s (DJATOM's mod)\n", X264_BUILD, X264_VERSION );
 
@@ -1881,6 +1979,8 @@ generic_option:
     param->vui.i_sar_height = info.sar_height;
 
     info.num_frames = X264_MAX( info.num_frames - opt->i_seek, 0 );
+    if( param->rc.i_stats_range_frames && (!param->i_frame_total || param->i_frame_total > param->rc.i_stats_range_frames) )
+        param->i_frame_total = param->rc.i_stats_range_frames;
     if( (!info.num_frames || param->i_frame_total < info.num_frames)
         && param->i_frame_total > 0 )
         info.num_frames = param->i_frame_total;
@@ -2053,6 +2153,33 @@ do\
     }\
 } while( 0 )
 
+/* --stage-timing: totals over the output frames, [I, P, B] */
+static int64_t stage_time[3][X264_STAGE_MAX];
+static int stage_frames[3];
+
+static void stage_timing_add( x264_t *h, int i_type, const int64_t *time, void *opaque )
+{
+    int t = IS_X264_TYPE_I( i_type ) ? 0 : i_type == X264_TYPE_P ? 1 : 2;
+    stage_frames[t]++;
+    for( int i = 0; i < X264_STAGE_MAX; i++ )
+        stage_time[t][i] += time[i];
+}
+
+static void print_stage_timing( void )
+{
+    if( !stage_frames[0] && !stage_frames[1] && !stage_frames[2] )
+        return;
+    x264_cli_log( "x264", X264_LOG_INFO, "stage timing      ms/I    ms/P    ms/B   total s\n" );
+    for( int i = 0; i < X264_STAGE_MAX; i++ )
+    {
+        double ms[3];
+        for( int t = 0; t < 3; t++ )
+            ms[t] = stage_frames[t] ? stage_time[t][i] / (1000. * stage_frames[t]) : 0;
+        x264_cli_log( "x264", X264_LOG_INFO, "  %-12s %7.2f %7.2f %7.2f %9.2f\n", x264_stage_names[i], ms[0], ms[1], ms[2],
+                      (stage_time[0][i] + stage_time[1][i] + stage_time[2][i]) / 1e6 );
+    }
+}
+
 static int encode( x264_param_t *param, cli_opt_t *opt )
 {
     x264_t *h = NULL;
@@ -2091,6 +2218,9 @@ static int encode( x264_param_t *param, cli_opt_t *opt )
         param->i_timebase_den = param->i_fps_num * pulldown->fps_factor;
     }
 
+    if( opt->b_stage_timing )
+        param->stage_timing = stage_timing_add;
+
     h = x264_encoder_open( param );
     FAIL_IF_ERROR2( !h, "x264_encoder_open failed\n" );
 
@@ -2238,6 +2368,301 @@ fail:
                  (double) i_file * 8 / ( 1000 * duration ),
                  secs/3600, (secs/60)%60, secs%60, (int)((i_end - i_start)%1000000/10000) );
     }
+    print_stage_timing();
+
+    return retval;
+}
+
+/* --estimate: the input is cut into chunks that each start with an IDR frame, and the chunks
+ * are dealt in turn to one lookahead-only encoder per worker thread.  The sizes these predict
+ * come from untrained models, so the first frames of every chunk also go to a real CRF encoder
+ * per CRF and to one more lookahead-only encoder, and each frame type of the estimate is scaled
+ * by how the real encodes of that sample compare with its estimate.  Each worker queues up to a
+ * whole chunk, so that the others keep busy while the input is read into one of them, and each
+ * sampler up to a sample. */
+#define ESTIMATE_QUEUE_SIZE ((int64_t)2 << 30) /* bytes of queued pictures over all workers */
+
+typedef struct
+{
+    cli_pic_t cli;
+    int64_t i_pts;
+    int i_type;
+} estimate_pic_t;
+
+typedef struct
+{
+    x264_t *h;
+    x264_pthread_t thread;
+    x264_pthread_mutex_t mutex;
+    x264_pthread_cond_t cv;
+    estimate_pic_t *queue;
+    int i_queue_size;
+    int i_head;
+    int i_count;
+    int b_thread;
+    int b_eof;
+    int b_error;
+    double bits[3];     /* output of a real encoder: sizes of its I-, P- and B-frames */
+    /* used by the reader only */
+    int i_frames;
+    int64_t pts_offset;
+    int64_t last_pts;
+} estimate_worker_t;
+
+static int estimate_frame( estimate_worker_t *w, estimate_pic_t *p )
+{
+    x264_nal_t *nal;
+    int i_nal;
+    x264_picture_t pic, pic_out;
+    int ret;
+    if( p )
+    {
+        x264_picture_init( &pic );
+        convert_cli_to_lib_pic( &pic, &p->cli );
+        pic.i_pts = p->i_pts;
+        pic.i_type = p->i_type;
+    }
+    ret = x264_encoder_encode( w->h, &nal, &i_nal, p ? &pic : NULL, &pic_out );
+    if( ret > 0 )
+        w->bits[IS_X264_TYPE_I( pic_out.i_type ) ? 0 : IS_X264_TYPE_B( pic_out.i_type ) ? 2 : 1] += ret * 8.0;
+    return ret;
+}
+
+static void *estimate_worker( estimate_worker_t *w )
+{
+    x264_pthread_mutex_lock( &w->mutex );
+    while( 1 )
+    {
+        while( !w->i_count && !w->b_eof )
+            x264_pthread_cond_wait( &w->cv, &w->mutex );
+        if( !w->i_count )
+            break;
+        x264_pthread_mutex_unlock( &w->mutex );
+        int ret = estimate_frame( w, &w->queue[w->i_head] );
+        x264_pthread_mutex_lock( &w->mutex );
+        w->b_error |= ret < 0;
+        w->i_head = (w->i_head + 1) % w->i_queue_size;
+        w->i_count--;
+        x264_pthread_cond_signal( &w->cv );
+    }
+    x264_pthread_mutex_unlock( &w->mutex );
+    while( !w->b_error && x264_encoder_delayed_frames( w->h ) )
+        w->b_error |= estimate_frame( w, NULL ) < 0;
+    return NULL;
+}
+
+/* Hands a picture to a worker: a copy into its queue, or straight to its encoder without
+ * worker threads.  Each worker sees its chunks back to back, so their pts are made continuous. */
+static int estimate_push( estimate_worker_t *w, cli_pic_t *cli_pic, int64_t pts, int b_chunk_start, int64_t ticks_per_frame )
+{
+    estimate_pic_t direct = { *cli_pic }, *p = &direct;
+    int b_error;
+    if( w->b_thread )
+    {
+        /* The worker moves i_head and i_count together, so the free slot is found under the
+         * lock; it stays ours until i_count is raised. */
+        x264_pthread_mutex_lock( &w->mutex );
+        while( w->i_count == w->i_queue_size )
+            x264_pthread_cond_wait( &w->cv, &w->mutex );
+        p = &w->queue[(w->i_head + w->i_count) % w->i_queue_size];
+        x264_pthread_mutex_unlock( &w->mutex );
+        if( !p->cli.img.plane[0] &&
+            x264_cli_pic_alloc( &p->cli, cli_pic->img.csp, cli_pic->img.width, cli_pic->img.height ) )
+        {
+            x264_cli_log( "x264", X264_LOG_ERROR, "malloc failed\n" );
+            return -1;
+        }
+        if( x264_cli_pic_copy( &p->cli, cli_pic ) )
+            return -1;
+    }
+
+    if( b_chunk_start )
+        w->pts_offset = (w->i_frames ? w->last_pts + ticks_per_frame : 0) - pts;
+    p->i_pts = w->last_pts = X264_MAX( pts + w->pts_offset, w->i_frames ? w->last_pts + 1 : 0 );
+    p->i_type = b_chunk_start ? X264_TYPE_IDR : X264_TYPE_AUTO;
+    w->i_frames++;
+
+    if( w->b_thread )
+    {
+        x264_pthread_mutex_lock( &w->mutex );
+        w->i_count++;
+        x264_pthread_cond_signal( &w->cv );
+        b_error = w->b_error;
+        x264_pthread_mutex_unlock( &w->mutex );
+    }
+    else
+        b_error = w->b_error |= estimate_frame( w, p ) < 0;
+    return b_error ? -1 : 0;
+}
+
+static int estimate( x264_param_t *param, cli_opt_t *opt )
+{
+    estimate_worker_t *workers = NULL;
+    cli_pic_t cli_pic;
+    int i_workers = param->i_threads > 0 ? param->i_threads : x264_cpu_num_processors();
+    /* the sample's lookahead-only encoder, then its real encoder at each CRF */
+    int i_samplers = opt->i_estimate_sample ? opt->i_estimate_crfs + 1 : 0;
+    int i_frame = 0;
+    int64_t i_start = 0;
+    int retval = 0;
+
+    /* Queueing the chunks of many workers takes a lot of memory at high resolutions: the samplers'
+     * queues come first, then as many workers' as fit. */
+    int64_t pic_size = x264_cli_pic_size( param->i_csp, param->i_width, param->i_height );
+    int64_t sampler_queues = (int64_t)i_samplers * opt->i_estimate_sample * pic_size;
+    i_workers = x264_clip3( X264_MIN( i_workers, (ESTIMATE_QUEUE_SIZE - sampler_queues) / (ESTIMATE_CHUNK * pic_size) ), 1, X264_THREAD_MAX );
+#if !HAVE_THREAD
+    i_workers = 1;
+#endif
+    int i_total = i_workers + i_samplers;
+    int b_threads = HAVE_THREAD && i_total > 1;
+    /* The workers already keep every core busy, so each encoder only gets its share. */
+    int i_encoder_threads = X264_MAX( 1, x264_cpu_num_processors() / i_total );
+
+    workers = calloc( i_total, sizeof(estimate_worker_t) );
+    FAIL_IF_ERROR2( !workers, "malloc failed\n" );
+    for( int i = 0; i < i_total; i++ )
+    {
+        estimate_worker_t *w = &workers[i];
+        x264_param_t worker_param = *param;
+        if( i )
+            worker_param.i_log_level = X264_MIN( worker_param.i_log_level, X264_LOG_WARNING );
+        worker_param.i_threads = i_encoder_threads;
+        worker_param.i_lookahead_threads = i_encoder_threads;
+        worker_param.b_sliced_threads = 0;
+        if( i > i_workers )
+        {
+            worker_param.rc.b_estimate = 0;
+            worker_param.rc.f_rf_constant = opt->estimate_crf[i - i_workers - 1];
+            worker_param.rc.b_stat_write = 0;
+        }
+        if( b_threads )
+        {
+            w->i_queue_size = i < i_workers ? ESTIMATE_CHUNK : opt->i_estimate_sample;
+            w->queue = calloc( w->i_queue_size, sizeof(estimate_pic_t) );
+            FAIL_IF_ERROR2( !w->queue, "malloc failed\n" );
+            x264_pthread_mutex_init( &w->mutex, NULL );
+            x264_pthread_cond_init( &w->cv, NULL );
+        }
+        w->h = x264_encoder_open( &worker_param );
+        FAIL_IF_ERROR2( !w->h, "x264_encoder_open failed\n" );
+        if( b_threads )
+        {
+            FAIL_IF_ERROR2( x264_pthread_create( &w->thread, NULL, (void*)estimate_worker, w ), "failed to create thread\n" );
+            w->b_thread = 1;
+        }
+    }
+    x264_encoder_parameters( workers[0].h, param );
+
+    int64_t ticks_per_frame = (int64_t)param->i_timebase_den * param->i_fps_den / param->i_timebase_num / param->i_fps_num;
+    ticks_per_frame = X264_MAX( ticks_per_frame, 1 );
+    i_start = x264_mdate();
+
+    for( ; !b_ctrl_c && (i_frame < param->i_frame_total || !param->i_frame_total); i_frame++ )
+    {
+        if( filter.get_frame( opt->hin, &cli_pic, i_frame + opt->i_seek ) )
+            break;
+        int64_t pts = param->b_vfr_input ? cli_pic.pts : i_frame;
+        if( param->b_vfr_input && opt->timebase_convert_multiplier )
+            pts = (int64_t)( pts * opt->timebase_convert_multiplier + 0.5 );
+        int b_chunk_start = i_frame % ESTIMATE_CHUNK == 0;
+
+        int ret = estimate_push( &workers[i_frame / ESTIMATE_CHUNK % i_workers], &cli_pic, pts, b_chunk_start, ticks_per_frame );
+        if( i_frame % ESTIMATE_CHUNK < opt->i_estimate_sample )
+            for( int i = i_workers; i < i_total && !ret; i++ )
+                ret = estimate_push( &workers[i], &cli_pic, pts, b_chunk_start, ticks_per_frame );
+
+        if( filter.release_frame( opt->hin, &cli_pic, i_frame + opt->i_seek ) || ret < 0 )
+        {
+            retval = -1;
+            break;
+        }
+    }
+
+fail:
+    for( int i = 0; workers && i < i_total; i++ )
+    {
+        estimate_worker_t *w = &workers[i];
+        if( w->b_thread )
+        {
+            x264_pthread_mutex_lock( &w->mutex );
+            w->b_eof = 1;
+            x264_pthread_cond_signal( &w->cv );
+            x264_pthread_mutex_unlock( &w->mutex );
+            x264_pthread_join( w->thread, NULL );
+        }
+        else if( w->h )
+            while( !w->b_error && x264_encoder_delayed_frames( w->h ) )
+                w->b_error |= estimate_frame( w, NULL ) < 0;
+        if( w->b_error )
+            retval = -1;
+    }
+
+    double bits[ARRAY_ELEMS(opt->estimate_crf)][3] = {{0}};
+    double sample_bits[ARRAY_ELEMS(opt->estimate_crf)][3] = {{0}};
+    double worker_bits[ARRAY_ELEMS(opt->estimate_crf)][3];
+    double seconds = 0, worker_seconds;
+    int i_frames = 0, i_sample_frames = 0;
+    for( int i = 0; workers && i < i_total; i++ )
+    {
+        estimate_worker_t *w = &workers[i];
+        if( w->h && i <= i_workers )
+        {
+            int ret = x264_encoder_estimate( w->h, opt->estimate_crf, opt->i_estimate_crfs, worker_bits[0], &worker_seconds );
+            for( int j = 0; ret > 0 && j < opt->i_estimate_crfs; j++ )
+                for( int t = 0; t < 3; t++ )
+                    (i < i_workers ? bits : sample_bits)[j][t] += worker_bits[j][t];
+            if( ret > 0 && i < i_workers )
+            {
+                seconds += worker_seconds;
+                i_frames += ret;
+            }
+            else if( ret > 0 )
+                i_sample_frames = ret;
+        }
+        if( w->h )
+            x264_encoder_close( w->h );
+        if( w->queue )
+        {
+            for( int j = 0; j < w->i_queue_size; j++ )
+                if( w->queue[j].cli.img.plane[0] )
+                    x264_cli_pic_clean( &w->queue[j].cli );
+            free( w->queue );
+            x264_pthread_mutex_destroy( &w->mutex );
+            x264_pthread_cond_destroy( &w->cv );
+        }
+    }
+
+    if( b_ctrl_c )
+        x264_cli_printf( X264_LOG_INFO, "aborted at input frame %d\n", opt->i_seek + i_frame );
+    if( !retval && i_frames > 0 && seconds > 0 )
+    {
+        int64_t i_elapsed = x264_mdate() - i_start;
+        x264_cli_printf( X264_LOG_INFO, "estimated %d frames in %d chunks on %d threads, %.2f fps\n", i_frames,
+                         (i_frame + ESTIMATE_CHUNK - 1) / ESTIMATE_CHUNK, i_total, i_frames * 1e6 / X264_MAX( i_elapsed, 1 ) );
+        if( i_sample_frames )
+            x264_cli_printf( X264_LOG_INFO, "calibrated on %d frames encoded at each CRF\n", i_sample_frames );
+        else
+            x264_cli_printf( X264_LOG_WARNING, "not calibrated, the bitrates are only rough\n" );
+        for( int j = 0; j < opt->i_estimate_crfs; j++ )
+        {
+            /* Scale each frame type by how the real encode of the sample compares with its
+             * estimate, and types the sample lacks by the sample as a whole. */
+            double *real = i_sample_frames ? workers[i_workers + 1 + j].bits : NULL;
+            double real_sum = 0, sample_sum = 0, scale = 1, total = 0;
+            for( int t = 0; real && t < 3; t++ )
+            {
+                real_sum += real[t];
+                sample_sum += sample_bits[j][t];
+            }
+            if( real_sum > 0 && sample_sum > 0 )
+                scale = real_sum / sample_sum;
+            for( int t = 0; t < 3; t++ )
+                total += bits[j][t] * (real && real[t] > 0 && sample_bits[j][t] > 0 ? real[t] / sample_bits[j][t] : scale);
+            x264_cli_printf( X264_LOG_INFO, "crf %5.2f: %.2f kb/s\n", opt->estimate_crf[j], total / (1000 * seconds) );
+        }
+    }
+    free( workers );
 
     return retval;
 }
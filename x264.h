@@ -45,7 +45,7 @@ extern "C" {
 
 #include "x264_config.h"
 
-#define X264_BUILD 164
+#define X264_BUILD 181
 
 #ifdef _WIN32
 #   define X264_DLL_IMPORT __declspec(dllimport)
@@ -79,6 +79,14 @@ extern "C" {
  *      opaque handler for encoder */
 typedef struct x264_t x264_t;
 
+/* x264_threadpool_t:
+ *      opaque handler for a pool of worker threads, see x264_threadpool_open */
+typedef struct x264_threadpool_t x264_threadpool_t;
+
+/* x264_ladder_t:
+ *      opaque handler for lookahead decisions shared between encoders, see x264_ladder_open */
+typedef struct x264_ladder_t x264_ladder_t;
+
 /****************************************************************************
  * NAL structure and functions
  ****************************************************************************/
@@ -197,6 +205,7 @@ typedef struct x264_nal_t
 #define X264_ME_UMH                  2
 #define X264_ME_ESA                  3
 #define X264_ME_TESA                 4
+#define X264_ME_PYR                  5
 #define X264_CQM_FLAT                0
 #define X264_CQM_JVT                 1
 #define X264_CQM_CUSTOM              2
@@ -225,7 +234,7 @@ typedef struct x264_nal_t
 #define X264_AVCINTRA_FLAVOR_SONY      1
 
 static const char * const x264_direct_pred_names[] = { "none", "spatial", "temporal", "auto", 0 };
-static const char * const x264_motion_est_names[] = { "dia", "hex", "umh", "esa", "tesa", 0 };
+static const char * const x264_motion_est_names[] = { "dia", "hex", "umh", "esa", "tesa", "pyr", 0 };
 static const char * const x264_b_pyramid_names[] = { "none", "strict", "normal", 0 };
 static const char * const x264_overscan_names[] = { "undef", "show", "crop", 0 };
 static const char * const x264_vidformat_names[] = { "component", "pal", "ntsc", "secam", "mac", "undef", 0 };
@@ -284,6 +293,17 @@ static const char * const x264_avcintra_flavor_names[] = { "panasonic", "sony",
 #define X264_THREADS_AUTO 0 /* Automatically select optimal number of threads */
 #define X264_SYNC_LOOKAHEAD_AUTO (-1) /* Automatically select optimal lookahead thread buffer size */
 
+/* Encoder stages timed for x264_param_t.stage_timing */
+#define X264_STAGE_SLICETYPE    0   /* lookahead slicetype decision of the frame's minigop */
+#define X264_STAGE_ANALYSE      1   /* macroblock mode decision */
+#define X264_STAGE_ENCODE       2   /* macroblock transform, quantization and reconstruction */
+#define X264_STAGE_FILTER       3   /* deblocking, hpel interpolation and quality metrics of finished rows */
+#define X264_STAGE_RATECONTROL  4   /* macroblock-level ratecontrol and VBV row prediction */
+#define X264_STAGE_FRAME_END    5   /* output of the finished frame */
+#define X264_STAGE_WAIT         6   /* waiting on reference frame rows, also counted in the stage that waited */
+#define X264_STAGE_MAX          7
+static const char * const x264_stage_names[] = { "slicetype", "analyse", "encode", "filter", "ratecontrol", "frame_end", "wait", 0 };
+
 /* HRD */
 #define X264_NAL_HRD_NONE            0
 #define X264_NAL_HRD_VBR             1
@@ -321,9 +341,25 @@ typedef struct x264_param_t
     int         i_threads;           /* encode multiple frames in parallel */
     int         i_lookahead_threads; /* multiple threads for lookahead analysis */
     int         b_sliced_threads;  /* Whether to use slice-based threading. */
+    int         i_slice_threads;   /* With sliced threads: number of slice threads per frame. If less than
+                                    * i_threads, i_threads/i_slice_threads frames are encoded in parallel,
+                                    * each one split across i_slice_threads threads. 0 = i_threads */
+    int         b_wavefront;       /* Analyse the macroblock rows of a frame in parallel, each one lagging two
+                                    * macroblocks behind the row above, while a single slice is written in order. */
+    int         b_numa;            /* Spread the frame threads over the NUMA nodes, and keep their reconstructed
+                                    * frames on their own node. */
+    int         b_frame_arena;     /* Allocate the buffers of every frame the encoder will need as one block
+                                    * at x264_encoder_open, and fault it in there rather than while encoding. */
+    int         b_low_memory;      /* Keep less data per frame: lowres planes only while a frame is in the lookahead,
+                                    * hpel planes only for frames that will be referenced.  Doesn't change the output. */
+    int         b_lazy_hpel;       /* Filter the hpel planes of a reference frame a 16x16 tile at a time, the first time
+                                    * motion search or compensation reads the tile.  Doesn't change the output. */
     int         b_deterministic; /* whether to allow non-deterministic optimizations when threaded */
     int         b_cpu_independent; /* force canonical behavior rather than cpu-dependent optimal algorithms */
     int         i_sync_lookahead; /* threaded lookahead buffer */
+    x264_threadpool_t *threadpool; /* run threaded jobs on this shared pool instead of private threads */
+    x264_ladder_t *ladder;     /* share frame types and MB-tree with the other encoders of this ladder */
+    int         b_ladder_leader; /* this encoder runs the lookahead for the whole ladder */
 
     /* Video Properties */
     int         i_width;
@@ -405,6 +441,8 @@ typedef struct x264_param_t
     char        *psz_log_file;  /* filename (in UTF-8) of log-file */
     int         b_full_recon;   /* fully reconstruct frames, even when not necessary for encoding.  Implied by psz_dump_yuv */
     char        *psz_dump_yuv;  /* filename (in UTF-8) for reconstructed frames */
+    char        *psz_dump_et;   /* filename (in UTF-8) for the P-mb mode decision statistics that
+                                 * tools/et_train.py trains analyse.b_et_model from */
 
     /* Encoder analyser parameters */
     struct
@@ -435,6 +473,8 @@ typedef struct x264_param_t
 
         int          b_mb_info;            /* Use input mb_info data in x264_picture_t */
         int          b_mb_info_update; /* Update the values in mb_info according to the results of encoding. */
+        int          b_et_model; /* P-frames: skip the sub-16x16 partitions and intra modes a trained model
+                                  * predicts won't win, from what is known after the 16x16 search */
 
         /* the deadzone size that will be used in luma quantization */
         int          i_luma_deadzone[2]; /* {inter, intra} */
@@ -456,6 +496,9 @@ typedef struct x264_param_t
         int         i_bitrate;
         float       f_rf_constant;  /* 1pass VBR, nominal QP */
         float       f_rf_constant_max;  /* In CRF mode, maximum CRF as caused by VBV */
+        /* Only run the lookahead and predict the size of the 1-pass CRF encode instead of encoding,
+         * see x264_encoder_estimate.  Requires CRF without VBV. */
+        int         b_estimate;
         float       f_rate_tolerance;
         int         i_vbv_max_bitrate;
         int         i_vbv_buffer_size;
@@ -478,6 +521,17 @@ typedef struct x264_param_t
         char        *psz_stat_out;  /* output filename (in UTF-8) of the 2pass stats file */
         int         b_stat_read;    /* Read stat from psz_stat_in and use it */
         char        *psz_stat_in;   /* input filename (in UTF-8) of the 2pass stats file */
+        int         b_stat_binary;  /* Write the stats as one indexed binary file that includes the MB-tree
+                                     * data, instead of text plus a .mbtree file.  Both are read either way;
+                                     * rewriting binary stats (b_stat_read and b_stat_write) implies it. */
+        /* Encode only i_stats_range_frames frames, starting at frame i_stats_range_start of the 1st pass,
+         * with the bits planned over the whole stats file.  The input must start at that frame, which must
+         * be an IDR frame.  0 frames disables.  Implies b_stitchable. */
+        int         i_stats_range_start;
+        int         i_stats_range_frames;
+        /* Plan the 2nd pass i_stats_window frames at a time (at least 64) as they are encoded, keeping
+         * only a window of the stats in memory instead of all of them.  Needs binary stats.  0 disables. */
+        int         i_stats_window;
 
         /* 2pass params (same as ffmpeg ones) */
         float       f_qcompress;    /* 0.0 => cbr, 1.0 => constant qp */
@@ -576,6 +630,8 @@ typedef struct x264_param_t
     int i_opencl_device;     /* specify count of GPU devices to skip, for CLI users */
     void *opencl_device_id;  /* pass explicit cl_device_id as void*, for API users */
     char *psz_clbin_file;    /* filename (in UTF-8) of the compiled OpenCL kernel cache file */
+    int b_lookahead_batch;   /* The OpenCL lowres motion search on the cpu: coarse to fine over a downscaled pyramid,
+                              * a whole frame per pass, instead of one full search per macroblock. */
 
     /* Slicing parameters */
     int i_slice_max_size;    /* Max size per slice in bytes; includes estimated NAL overhead. */
@@ -627,6 +683,14 @@ typedef struct x264_param_t
      */
     void (*nalu_process)( x264_t *h, x264_nal_t *nal, void *opaque );
 
+    /* Optional callback for per-frame stage timing, only honoured by builds configured with
+     * --enable-stage-timing.  Called from x264_encoder_encode for each output frame with its
+     * X264_TYPE_* and stage_time[X264_STAGE_MAX]: the wall time in microseconds spent in each
+     * stage, summed over all threads that worked on the frame.
+     *
+     * The opaque pointer is the opaque pointer from the input frame, as with nalu_process. */
+    void (*stage_timing)( x264_t *h, int i_type, const int64_t *stage_time, void *opaque );
+
     /* For internal use only */
     void *opaque;
 } x264_param_t;
@@ -992,6 +1056,12 @@ X264_API int x264_encoder_delayed_frames( x264_t * );
  *      return the maximum number of delayed (buffered) frames that can occur with the current
  *      parameters. */
 X264_API int x264_encoder_maximum_delayed_frames( x264_t * );
+/* x264_encoder_resident_memory:
+ *      return the number of bytes of frame memory (input pictures, reconstructed references and
+ *      lookahead planes) the encoder holds.  frame memory is pooled rather than freed, so this
+ *      is also the peak so far.  with b_frame_arena, all of it is allocated and paged in by
+ *      x264_encoder_open unless the arena turned out too small. */
+X264_API int64_t x264_encoder_resident_memory( x264_t * );
 /* x264_encoder_intra_refresh:
  *      If an intra refresh is not in progress, begin one with the next P-frame.
  *      If an intra refresh is in progress, begin one as soon as the current one finishes.
@@ -1029,6 +1099,61 @@ X264_API void x264_encoder_intra_refresh( x264_t * );
  *
  *      Returns 0 on success, negative on failure. */
 X264_API int x264_encoder_invalidate_reference( x264_t *, int64_t pts );
+/* x264_encoder_estimate:
+ *      with rc.b_estimate set, x264_encoder_encode runs only the lookahead (slicetype decision,
+ *      AQ and MB-tree) and never outputs NAL units, so it runs at lookahead speed.  each frame
+ *      is planned as 1-pass CRF would plan it, using ratecontrol's untrained size predictors.
+ *      for each of the i_crf values in f_crf, p_bits[3*i], p_bits[3*i+1] and p_bits[3*i+2]
+ *      receive the predicted sizes in bits of the I-, P- and B-frames analysed so far at that
+ *      CRF, and *p_seconds their duration.  the predictors are untrained, so the sizes can be
+ *      off by a factor of 2 or more; scale each frame type by how a real encode of a sample
+ *      compares with its estimate, as x264cli's --estimate does, to get usable bitrates.
+ *      call it after flushing the delayed frames to cover the whole input.
+ *      returns the number of frames analysed, negative on failure. */
+X264_API int x264_encoder_estimate( x264_t *, const float *f_crf, int i_crf, double *p_bits, double *p_seconds );
+
+/****************************************************************************
+ * Thread pool functions
+ ****************************************************************************/
+
+/* x264_threadpool_open:
+ *      create a pool of i_threads worker threads (X264_THREADS_AUTO for one per cpu).
+ *      encoders that have x264_param_t.threadpool pointing to the pool run all of their
+ *      frame, slice and lookahead jobs on it instead of creating threads of their own,
+ *      so several encoders in one process (e.g. the rungs of an ABR ladder) can share
+ *      a fixed number of cores.  when the pool is busy, jobs are admitted in favour of
+ *      the encoder with the fewest jobs in flight.  with i_threads == X264_THREADS_AUTO,
+ *      attached encoders size their own thread count from the pool rather than the cpu.
+ *      returns NULL on failure, or if x264 was built without thread support. */
+X264_API x264_threadpool_t *x264_threadpool_open( int i_threads );
+/* x264_threadpool_close:
+ *      release the pool.  the worker threads exit once every encoder attached to the
+ *      pool has been closed as well. */
+X264_API void x264_threadpool_close( x264_threadpool_t * );
+
+/****************************************************************************
+ * ABR ladder functions
+ ****************************************************************************/
+
+/* x264_ladder_open:
+ *      create a ladder through which encoders of the same source at different resolutions
+ *      share a single lookahead.  exactly one encoder, opened with x264_param_t.ladder set
+ *      and b_ladder_leader = 1, runs slicetype decision, scenecut detection and MB-tree;
+ *      every other encoder opened with the same ladder afterwards reuses its frame types
+ *      and its MB-tree qp offsets, rescaled to its own resolution, instead of running that
+ *      analysis itself.  this saves most of the lookahead cost of the other rungs and keeps
+ *      all of their GOPs aligned.
+ *      all rungs must be fed the same frames in the same order; the followers' frame delay
+ *      is raised to at least the leader's, so one thread can drive the whole ladder as long
+ *      as it passes each frame to the leader first.  followers must match the leader's
+ *      GOP structure (keyint, bframes, b-pyramid, open-gop, intra-refresh, interlacing)
+ *      and have to be opened before the leader encodes its first frame.  a follower whose
+ *      leader stopped early falls back to its own lookahead for the remaining frames.
+ *      returns NULL on failure. */
+X264_API x264_ladder_t *x264_ladder_open( void );
+/* x264_ladder_close:
+ *      release the ladder.  must not be called before every encoder using it is closed. */
+X264_API void x264_ladder_close( x264_ladder_t * );
 
 #ifdef __cplusplus
 }